@@ -0,0 +1,312 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+
+#define ACCESSLOG_METHOD_MAX 16
+#define ACCESSLOG_PATH_MAX 216
+#define ACCESSLOG_BATCH_SIZE (256 * 1024)
+#define ACCESSLOG_LINE_MAX (4 * (ACCESSLOG_METHOD_MAX + ACCESSLOG_PATH_MAX) + 128)
+
+/* What a serving thread records of a request; formatting waits for the
+ * writer. */
+struct accesslog_entry {
+  time_t time;
+  uint64_t bytes;
+  struct in_addr address;
+  uint16_t status;
+  uint8_t http_1_0;
+  uint8_t method_size;
+  uint16_t path_size;
+  char method[ACCESSLOG_METHOD_MAX];
+  char path[ACCESSLOG_PATH_MAX];
+};
+
+/*
+ * A thread's ring. Only the owner writes head, sequence and dropped; only
+ * the writer writes tail. Each side's cursor has its own cache line.
+ */
+struct accesslog_ring {
+  unsigned long head __attribute__((aligned(64)));
+  unsigned long sequence;      // Requests seen, for sampling.
+  unsigned long dropped;       // Entries lost to a full ring.
+  unsigned long tail __attribute__((aligned(64)));
+  struct accesslog_ring *next;
+  struct accesslog_entry entries[ACCESSLOG_RING_ENTRIES];
+};
+
+int accesslog_enabled;
+
+static const char *log_path;
+static int log_fd = -1;
+static int log_sample = 1;
+static size_t log_max_bytes;
+static size_t log_size;
+static int log_wakeups;        // Futex the writer sleeps on.
+static unsigned long log_dropped_reported;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct accesslog_ring *rings;
+static __thread struct accesslog_ring *own_ring;
+
+static struct accesslog_ring *ring_register() {
+  struct accesslog_ring *ring;
+  if (posix_memalign((void **) &ring, 64, sizeof(*ring)) != 0) {
+    perror("Failed to allocate an access log ring");
+    exit(ENOMEM);
+  }
+  ring->head = ring->tail = ring->sequence = ring->dropped = 0;
+  pthread_mutex_lock(&rings_lock);
+  ring->next = rings;
+  __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&rings_lock);
+  own_ring = ring;
+  return ring;
+}
+
+/*
+ * Returns the calling thread's next free entry, or NULL when this request
+ * isn't sampled or the ring is full.
+ */
+static struct accesslog_entry *entry_begin(struct accesslog_ring **ring_out) {
+  struct accesslog_ring *ring = own_ring ? own_ring : ring_register();
+  if (log_sample > 1 && ring->sequence++ % log_sample != 0) return NULL;
+  unsigned long head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+      ACCESSLOG_RING_ENTRIES) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  *ring_out = ring;
+  return &ring->entries[head % ACCESSLOG_RING_ENTRIES];
+}
+
+/* Publishes the entry begun last, waking the writer at half full. */
+static void entry_commit(struct accesslog_ring *ring) {
+  unsigned long head = ring->head + 1;
+  __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) ==
+      ACCESSLOG_RING_ENTRIES / 2) {
+    __atomic_fetch_add(&log_wakeups, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &log_wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+static void entry_fill(struct accesslog_entry *entry,
+    const struct sockaddr_in *peer, const char *method, size_t method_size,
+    const char *path, size_t path_size, int http_1_0, int status,
+    size_t bytes) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  entry->time = now.tv_sec;
+  entry->bytes = bytes;
+  entry->address = peer->sin_family == AF_INET ? peer->sin_addr :
+    (struct in_addr) { 0 };
+  entry->status = status;
+  entry->http_1_0 = http_1_0;
+  if (!method) method_size = path_size = 0;
+  entry->method_size = method_size < ACCESSLOG_METHOD_MAX ? method_size :
+    ACCESSLOG_METHOD_MAX;
+  memcpy(entry->method, method, entry->method_size);
+  entry->path_size = path && path_size < ACCESSLOG_PATH_MAX ? path_size :
+    path ? ACCESSLOG_PATH_MAX : 0;
+  memcpy(entry->path, path, entry->path_size);
+}
+
+void accesslog_request(struct http_connection *connection) {
+  if (!accesslog_enabled || !connection->request_parsed) return;
+  struct accesslog_ring *ring;
+  struct accesslog_entry *entry = entry_begin(&ring);
+  if (!entry) return;
+
+  /* A malformed head leaves the request fields as they were. */
+  const struct http_request *request = &connection->request;
+  int parsed = !connection->head_error && request->method;
+  entry_fill(entry, http_connection_peer(connection),
+      parsed ? request->method : NULL, parsed ? strlen(request->method) : 0,
+      parsed ? request->path : NULL, parsed ? strlen(request->path) : 0,
+      connection->http_1_0,
+      connection->response_status, connection->response_bytes);
+  entry_commit(ring);
+}
+
+void accesslog_entry(int fd, const char *method, size_t method_size,
+    const char *path, size_t path_size, int http_1_0, int status,
+    size_t bytes) {
+  if (!accesslog_enabled) return;
+  struct accesslog_ring *ring;
+  struct accesslog_entry *entry = entry_begin(&ring);
+  if (!entry) return;
+
+  entry_fill(entry, http_peer_address(fd), method, method_size, path,
+      path_size, http_1_0, status, bytes);
+  entry_commit(ring);
+}
+
+/* Appends SIZE bytes of DATA to OUT, escaping quotes and non-printables. */
+static size_t append_escaped(char *out, const char *data, size_t size) {
+  static const char hex[] = "0123456789abcdef";
+  char *p = out;
+  for (size_t i = 0; i < size; i++) {
+    unsigned char c = data[i];
+    if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\') {
+      *p++ = c;
+    } else {
+      *p++ = '\\';
+      *p++ = 'x';
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 15];
+    }
+  }
+  return p - out;
+}
+
+/* Formats ENTRY as a Common Log Format line into OUT; returns its length. */
+static size_t format_entry(char *out, const struct accesslog_entry *entry) {
+  static time_t date_time = -1;
+  static char date[32];
+  if (entry->time != date_time) {
+    struct tm tm;
+    gmtime_r(&entry->time, &tm);
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+    date_time = entry->time;
+  }
+
+  char address[INET_ADDRSTRLEN] = "-";
+  if (entry->address.s_addr)
+    inet_ntop(AF_INET, &entry->address, address, sizeof(address));
+  size_t size = sprintf(out, "%s - - [%s] \"", address, date);
+  if (entry->method_size == 0) {
+    out[size++] = '-';
+  } else {
+    size += append_escaped(out + size, entry->method, entry->method_size);
+    out[size++] = ' ';
+    size += append_escaped(out + size, entry->path, entry->path_size);
+    size += sprintf(out + size, " HTTP/1.%d", entry->http_1_0 ? 0 : 1);
+  }
+  if (entry->status)
+    size += sprintf(out + size, "\" %d %lu\n", entry->status,
+        (unsigned long) entry->bytes);
+  else
+    size += sprintf(out + size, "\" - %lu\n", (unsigned long) entry->bytes);
+  return size;
+}
+
+/* Starts a new log once the current one reaches the size limit, keeping
+ * the old one as PATH.1. */
+static void rotate() {
+  char rotated[PATH_MAX];
+  snprintf(rotated, sizeof(rotated), "%s.1", log_path);
+  if (rename(log_path, rotated) < 0) {
+    perror("Failed to rotate the access log");
+    return;
+  }
+  int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror("Failed to reopen the access log");
+    return;
+  }
+  close(log_fd);
+  log_fd = fd;
+  log_size = 0;
+}
+
+static void write_batch(const char *data, size_t size) {
+  if (log_max_bytes > 0 && log_size > 0 && log_size + size > log_max_bytes)
+    rotate();
+  log_size += size;
+  while (size > 0) {
+    ssize_t written = write(log_fd, data, size);
+    if (written < 0 && errno == EINTR) continue;
+    if (written < 0) {
+      perror("Failed to write the access log");
+      return;
+    }
+    data += written;
+    size -= written;
+  }
+}
+
+void accesslog_flush() {
+  static char batch[ACCESSLOG_BATCH_SIZE];
+  if (!accesslog_enabled) return;
+
+  pthread_mutex_lock(&drain_lock);
+  size_t size = 0;
+  unsigned long dropped = 0;
+  for (struct accesslog_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+      ring; ring = ring->next) {
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = ring->tail;
+    for (; tail != head; tail++) {
+      if (sizeof(batch) - size < ACCESSLOG_LINE_MAX) {
+        write_batch(batch, size);
+        size = 0;
+      }
+      size += format_entry(batch + size,
+          &ring->entries[tail % ACCESSLOG_RING_ENTRIES]);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  }
+  if (size > 0) write_batch(batch, size);
+
+  if (dropped > log_dropped_reported) {
+    fprintf(stderr, "Access log dropped %lu entries\n",
+        dropped - log_dropped_reported);
+    log_dropped_reported = dropped;
+  }
+  pthread_mutex_unlock(&drain_lock);
+}
+
+static void *writer_main(void *arg) {
+  struct timespec timeout = { 0, ACCESSLOG_FLUSH_MS * 1000000L };
+  while (1) {
+    int wakeups = __atomic_load_n(&log_wakeups, __ATOMIC_ACQUIRE);
+    accesslog_flush();
+    syscall(SYS_futex, &log_wakeups, FUTEX_WAIT_PRIVATE, wakeups, &timeout,
+        NULL, 0);
+  }
+  return NULL;
+}
+
+void accesslog_init(const char *path, int sample, size_t max_bytes) {
+  if (strcmp(path, "-") == 0) {
+    log_fd = STDOUT_FILENO;
+    max_bytes = 0;
+  } else if ((log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+          0644)) < 0) {
+    perror("Failed to open the access log");
+    exit(errno);
+  }
+  struct stat stat;
+  if (fstat(log_fd, &stat) == 0 && S_ISREG(stat.st_mode))
+    log_size = stat.st_size;
+  log_path = path;
+  log_sample = sample > 0 ? sample : 1;
+  log_max_bytes = max_bytes;
+  accesslog_enabled = 1;
+
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, writer_main, NULL);
+  if (err != 0) {
+    fprintf(stderr, "Failed to create the access log writer: %s\n",
+        strerror(err));
+    exit(err);
+  }
+  pthread_detach(thread);
+}
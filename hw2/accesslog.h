@@ -0,0 +1,54 @@
+#ifndef __ACCESSLOG__
+#define __ACCESSLOG__
+
+#include <stddef.h>
+
+#include "libhttp.h"
+
+/*
+ * ACCESSLOG writes one Common Log Format line per request without
+ * slowing down the threads serving requests.
+ *
+ * A serving thread only copies the request's raw details into a ring of
+ * fixed-size entries. Each thread has its own single-producer,
+ * single-consumer ring, so the copy needs no lock. A background writer
+ * drains the rings every ACCESSLOG_FLUSH_MS, or sooner when a ring is half
+ * full. It formats the entries (dates, addresses, escaping) and writes
+ * them out in large batches.
+ *
+ * If a ring is full, the entry is dropped rather than blocking the serving
+ * thread, and the writer reports how many were lost. With sampling, only
+ * every Nth request of each thread is logged. With a size limit, the log
+ * is renamed to FILE.1 once it would grow past the limit, and a new one is
+ * started.
+ */
+
+#define ACCESSLOG_FLUSH_MS 100
+#define ACCESSLOG_RING_ENTRIES 2048
+
+extern int accesslog_enabled;
+
+/*
+ * Starts logging to PATH ("-" for stdout), keeping 1 in SAMPLE requests
+ * and rotating at MAX_BYTES (0 never rotates).
+ */
+void accesslog_init(const char *path, int sample, size_t max_bytes);
+
+/*
+ * Logs the request CONNECTION just answered, if http_request_parse read
+ * one. Call it after the handler and before http_connection_finish.
+ */
+void accesslog_request(struct http_connection *connection);
+
+/*
+ * Logs a request that a handler parsed and answered itself, as the proxy
+ * does. METHOD and PATH may be NULL if unknown, and so may STATUS (0).
+ */
+void accesslog_entry(int fd, const char *method, size_t method_size,
+    const char *path, size_t path_size, int http_1_0, int status,
+    size_t bytes);
+
+/* Writes out everything logged so far; for shutdown. */
+void accesslog_flush();
+
+#endif
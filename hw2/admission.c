@@ -0,0 +1,116 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "stats.h"
+
+#define ADMISSION_SHARD_SIZE (ADMISSION_CLIENTS / ADMISSION_SHARDS)
+
+/* Tokens are kept in thousandths of a request. */
+struct admission_bucket {
+  in_addr_t address;      // 0 marks a free slot.
+  uint32_t updated_ms;    // Wraps; only differences are used.
+  uint32_t tokens;
+};
+
+struct admission_shard {
+  pthread_mutex_t lock;
+  struct admission_bucket buckets[ADMISSION_SHARD_SIZE];
+} __attribute__((aligned(64)));
+
+int admission_rate_limited;
+
+static int max_connections;
+static int open_connections __attribute__((aligned(64)));
+static uint32_t refill_per_ms, capacity;
+static struct admission_shard *shards;
+
+static const char overloaded[] =
+  "HTTP/1.1 503 Service Unavailable\r\n"
+  "Content-Length: 0\r\n"
+  "Retry-After: 1\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+void admission_init(int connections, int rate, int burst) {
+  max_connections = connections;
+  if (rate <= 0) return;
+
+  if (posix_memalign((void **) &shards, 64,
+        ADMISSION_SHARDS * sizeof(*shards)) != 0) {
+    perror("Failed to allocate rate limit buckets");
+    exit(ENOMEM);
+  }
+  for (int i = 0; i < ADMISSION_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+    for (int j = 0; j < ADMISSION_SHARD_SIZE; j++)
+      shards[i].buckets[j].address = 0;
+  }
+  refill_per_ms = rate;
+  capacity = (uint32_t) (burst > 0 ? burst : rate) * 1000;
+  admission_rate_limited = 1;
+}
+
+int admission_admit(int fd) {
+  if (max_connections <= 0) return 1;
+  if (__atomic_add_fetch(&open_connections, 1, __ATOMIC_RELAXED) <=
+      max_connections)
+    return 1;
+  __atomic_sub_fetch(&open_connections, 1, __ATOMIC_RELAXED);
+  STATS_COUNT(STATS_CONNECTIONS_SHED);
+  send(fd, overloaded, sizeof(overloaded) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(fd);
+  return 0;
+}
+
+void admission_release() {
+  if (max_connections > 0)
+    __atomic_sub_fetch(&open_connections, 1, __ATOMIC_RELAXED);
+}
+
+static uint32_t admission_now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int admission_allow(in_addr_t address) {
+  if (!admission_rate_limited || address == 0) return 1;
+  uint32_t hash = address * 2654435761u;  // Fibonacci hashing.
+  struct admission_shard *shard = &shards[hash >> 26];
+  uint32_t now = admission_now_ms();
+
+  pthread_mutex_lock(&shard->lock);
+  struct admission_bucket *bucket = NULL, *victim = NULL;
+  for (int i = 0; i < ADMISSION_PROBE; i++) {
+    struct admission_bucket *slot =
+      &shard->buckets[((hash >> 16) + i) & (ADMISSION_SHARD_SIZE - 1)];
+    if (slot->address == address) {
+      bucket = slot;
+      break;
+    }
+    if (!victim || (victim->address != 0 && (slot->address == 0 ||
+            now - slot->updated_ms > now - victim->updated_ms)))
+      victim = slot;
+  }
+  if (!bucket) {
+    bucket = victim;
+    bucket->address = address;
+    bucket->tokens = capacity;
+  } else {
+    uint64_t tokens = bucket->tokens +
+      (uint64_t) (now - bucket->updated_ms) * refill_per_ms;
+    bucket->tokens = tokens < capacity ? tokens : capacity;
+  }
+  bucket->updated_ms = now;
+  int allowed = bucket->tokens >= 1000;
+  if (allowed) bucket->tokens -= 1000;
+  pthread_mutex_unlock(&shard->lock);
+  return allowed;
+}
@@ -0,0 +1,39 @@
+#ifndef __ADMISSION__
+#define __ADMISSION__
+
+#include <netinet/in.h>
+
+/*
+ * ADMISSION decides which clients the server takes on, so that a flood
+ * from a few of them can't hold every worker and starve the rest.
+ *
+ * With a connection limit, admission_admit counts open connections and
+ * answers any past the limit with a canned 503 straight from the accepting
+ * thread, before it costs a queue slot or a buffer. Engines call
+ * admission_release when they close an admitted connection.
+ *
+ * With a rate limit, admission_allow charges a request to its client
+ * address's token bucket, which refills at RATE requests a second up to
+ * BURST. Buckets live in a fixed-size open addressing table split into
+ * shards, each under its own lock; a bucket that can't be placed near its
+ * hash replaces the least recently used one there, which only forgets a
+ * client that has been quiet the longest.
+ */
+
+#define ADMISSION_CLIENTS 65536   // Client addresses tracked at once.
+#define ADMISSION_SHARDS 64
+#define ADMISSION_PROBE 8         // Slots searched for an address.
+
+extern int admission_rate_limited;
+
+/* 0 leaves either limit off. */
+void admission_init(int max_connections, int rate, int burst);
+
+/* Returns 1 if FD may be served; otherwise it has been answered and closed. */
+int admission_admit(int fd);
+void admission_release();
+
+/* Returns 1 if a request from ADDRESS (network order) is within its rate. */
+int admission_allow(in_addr_t address);
+
+#endif
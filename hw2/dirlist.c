@@ -0,0 +1,453 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "dirlist.h"
+#include "libhttp.h"
+
+#define DIRLIST_BATCH_SIZE (64 * 1024)  // Bytes of dirents per getdents64.
+#define DIRLIST_CHUNK_SIZE (16 * 1024)  // Rendered bytes per chunk sent.
+#define DIRLIST_BUCKETS 256
+
+struct dirlist_entry {
+  char *path;
+  ino_t inode;
+  struct timespec mtime;
+  char *body;
+  size_t size;
+  int refcount;
+  int cached;
+  struct dirlist_entry *next;  // Hash chain.
+  struct dirlist_entry *lru_prev, *lru_next;
+};
+
+static pthread_mutex_t dirlist_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dirlist_entry *buckets[DIRLIST_BUCKETS];
+static struct dirlist_entry *lru_head, *lru_tail;  // Head is newest.
+static size_t cache_capacity, cache_bytes;
+static int sort_listings;
+
+void dirlist_init(size_t cache_bytes_limit, int sorted) {
+  cache_capacity = cache_bytes_limit;
+  sort_listings = sorted;
+}
+
+static unsigned int dirlist_hash(const char *path) {
+  unsigned int hash = 2166136261u; // FNV-1a
+  while (*path) {
+    hash ^= (unsigned char) *path++;
+    hash *= 16777619u;
+  }
+  return hash % DIRLIST_BUCKETS;
+}
+
+static size_t entry_cost(struct dirlist_entry *entry) {
+  return entry->size + sizeof(*entry);
+}
+
+static void entry_destroy(struct dirlist_entry *entry) {
+  free(entry->path);
+  free(entry->body);
+  free(entry);
+}
+
+/* Takes ENTRY out of the table and LRU list. Caller holds dirlist_lock. */
+static void entry_unlink(struct dirlist_entry *entry) {
+  struct dirlist_entry **link = &buckets[dirlist_hash(entry->path)];
+  while (*link != entry) link = &(*link)->next;
+  *link = entry->next;
+
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else lru_head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else lru_tail = entry->lru_prev;
+
+  cache_bytes -= entry_cost(entry);
+  entry->cached = 0;
+  if (--entry->refcount == 0) entry_destroy(entry);
+}
+
+/*
+ * Returns the cached listing of PATH if it was rendered from the directory
+ * STAT describes now, dropping it if the directory has changed since.
+ */
+static struct dirlist_entry *dirlist_acquire(const char *path,
+    const struct stat *stat) {
+  pthread_mutex_lock(&dirlist_lock);
+  struct dirlist_entry *entry = buckets[dirlist_hash(path)];
+  while (entry && strcmp(entry->path, path) != 0) entry = entry->next;
+  if (entry && (entry->inode != stat->st_ino ||
+        entry->mtime.tv_sec != stat->st_mtim.tv_sec ||
+        entry->mtime.tv_nsec != stat->st_mtim.tv_nsec)) {
+    entry_unlink(entry);
+    entry = NULL;
+  }
+  if (entry) {
+    entry->refcount++;
+    if (entry != lru_head) {
+      entry->lru_prev->lru_next = entry->lru_next;
+      if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+      else lru_tail = entry->lru_prev;
+      entry->lru_prev = NULL;
+      entry->lru_next = lru_head;
+      lru_head->lru_prev = entry;
+      lru_head = entry;
+    }
+  }
+  pthread_mutex_unlock(&dirlist_lock);
+  return entry;
+}
+
+static void dirlist_release(struct dirlist_entry *entry) {
+  pthread_mutex_lock(&dirlist_lock);
+  if (--entry->refcount == 0) entry_destroy(entry);
+  pthread_mutex_unlock(&dirlist_lock);
+}
+
+/* Caches BODY (taking ownership) as the listing of PATH as of STAT. */
+static void dirlist_insert(const char *path, const struct stat *stat,
+    char *body, size_t size) {
+  struct dirlist_entry *entry = calloc(1, sizeof(*entry));
+  if (!entry || !(entry->path = strdup(path))) {
+    free(entry);
+    free(body);
+    return;
+  }
+  entry->inode = stat->st_ino;
+  entry->mtime = stat->st_mtim;
+  entry->body = body;
+  entry->size = size;
+  entry->refcount = 1;
+  entry->cached = 1;
+
+  pthread_mutex_lock(&dirlist_lock);
+  unsigned int bucket = dirlist_hash(path);
+  struct dirlist_entry *existing = buckets[bucket];
+  while (existing && strcmp(existing->path, path) != 0) existing = existing->next;
+  if (existing) entry_unlink(existing);
+  while (lru_tail && cache_bytes + entry_cost(entry) > cache_capacity)
+    entry_unlink(lru_tail);
+
+  entry->next = buckets[bucket];
+  buckets[bucket] = entry;
+  entry->lru_next = lru_head;
+  if (lru_head) lru_head->lru_prev = entry;
+  else lru_tail = entry;
+  lru_head = entry;
+  cache_bytes += entry_cost(entry);
+  pthread_mutex_unlock(&dirlist_lock);
+}
+
+/*
+ * Rendered output on its way to the client: collected into chunks and,
+ * while the listing may still fit in the cache, copied for it.
+ */
+struct dirlist_output {
+  int fd;
+  size_t chunk_size;
+  char *copy;
+  size_t copy_size, copy_capacity;
+  int copying;
+  int failed;       // A send failed; nothing more goes out.
+  char chunk[DIRLIST_CHUNK_SIZE];
+};
+
+/* Sends the pending chunk. Returns -1 once a send has failed. */
+static int output_flush(struct dirlist_output *output) {
+  if (output->failed) return -1;
+  if (output->chunk_size == 0) return 0;
+  if (http_send_data(output->fd, output->chunk, output->chunk_size) < 0) {
+    output->failed = 1;
+    output->copying = 0;
+    return -1;
+  }
+
+  if (output->copying) {
+    size_t needed = output->copy_size + output->chunk_size;
+    if (needed > cache_capacity / 2) {
+      output->copying = 0;
+    } else if (needed > output->copy_capacity) {
+      size_t capacity = output->copy_capacity ? output->copy_capacity : 4096;
+      while (capacity < needed) capacity *= 2;
+      char *copy = realloc(output->copy, capacity);
+      if (copy) {
+        output->copy = copy;
+        output->copy_capacity = capacity;
+      } else {
+        output->copying = 0;
+      }
+    }
+    if (output->copying) {
+      memcpy(output->copy + output->copy_size, output->chunk, output->chunk_size);
+      output->copy_size = needed;
+    }
+  }
+  output->chunk_size = 0;
+  return 0;
+}
+
+static void output_append(struct dirlist_output *output, const char *data,
+    size_t size) {
+  if (size > sizeof(output->chunk) - output->chunk_size &&
+      output_flush(output) < 0)
+    return;
+  memcpy(output->chunk + output->chunk_size, data, size);
+  output->chunk_size += size;
+}
+
+/* Appends NAME escaped for use inside an HTML attribute and element body. */
+static void output_escaped(struct dirlist_output *output, const char *name) {
+  const char *start = name;
+  for (; *name; name++) {
+    const char *escape = NULL;
+    switch (*name) {
+      case '&': escape = "&amp;"; break;
+      case '<': escape = "&lt;"; break;
+      case '>': escape = "&gt;"; break;
+      case '"': escape = "&quot;"; break;
+      case '\'': escape = "&#39;"; break;
+    }
+    if (!escape) continue;
+    output_append(output, start, name - start);
+    output_append(output, escape, strlen(escape));
+    start = name + 1;
+  }
+  output_append(output, start, name - start);
+}
+
+/*
+ * Percent-encodes NAME as a single path segment into TARGET, which holds
+ * 3 * NAME_MAX + 1 bytes, so a name with '?', '#', '%' or ':' still links
+ * to itself.
+ */
+static void encode_segment(char *target, const char *name) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (; *name; name++) {
+    unsigned char c = *name;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' || c == '~') {
+      *target++ = c;
+    } else {
+      *target++ = '%';
+      *target++ = hex[c >> 4];
+      *target++ = hex[c & 15];
+    }
+  }
+  *target = '\0';
+}
+
+static void output_link(struct dirlist_output *output, const char *name,
+    int is_directory) {
+  const char *suffix = is_directory ? "/" : "";
+  char target[3 * NAME_MAX + 1];
+  encode_segment(target, name);
+  output_append(output, "<a href=\"", 9);
+  output_escaped(output, target);
+  output_append(output, suffix, strlen(suffix));
+  output_append(output, "\">", 2);
+  output_escaped(output, name);
+  output_append(output, suffix, strlen(suffix));
+  output_append(output, "</a><br>\n", 9);
+}
+
+/* Names gathered for a sorted listing, packed into one growing buffer. */
+struct dirlist_names {
+  char *data;
+  size_t size, capacity;
+  size_t *offsets;  // Start of each name; its first byte is the type flag.
+  size_t count, offsets_capacity;
+};
+
+/* Returns -1 with errno set if NAME can't be added. */
+static int names_add(struct dirlist_names *names, const char *name,
+    int is_directory) {
+  size_t length = strlen(name) + 2;
+  if (names->size + length > names->capacity) {
+    size_t capacity = names->capacity ? names->capacity * 2 : 64 * 1024;
+    while (capacity < names->size + length) capacity *= 2;
+    char *data = realloc(names->data, capacity);
+    if (!data) return -1;
+    names->data = data;
+    names->capacity = capacity;
+  }
+  if (names->count == names->offsets_capacity) {
+    size_t capacity = names->offsets_capacity ? names->offsets_capacity * 2 : 1024;
+    size_t *offsets = realloc(names->offsets, capacity * sizeof(*offsets));
+    if (!offsets) return -1;
+    names->offsets = offsets;
+    names->offsets_capacity = capacity;
+  }
+  names->offsets[names->count++] = names->size;
+  names->data[names->size] = is_directory ? 'd' : '-';
+  memcpy(names->data + names->size + 1, name, length - 1);
+  names->size += length;
+  return 0;
+}
+
+static int names_compare(const void *a, const void *b, void *data) {
+  return strcmp((const char *) data + *(const size_t *) a + 1,
+      (const char *) data + *(const size_t *) b + 1);
+}
+
+/*
+ * Handles one entry of DIRECTORY: rendered straight away, or kept to sort.
+ * File systems that don't fill in d_type get an fstatat. Returns -1 if the
+ * listing can't go on.
+ */
+static int visit(int directory, struct dirlist_output *output,
+    struct dirlist_names *names, const char *name, unsigned char type) {
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+  if (type == DT_UNKNOWN) {
+    struct stat stat;
+    if (fstatat(directory, name, &stat, AT_SYMLINK_NOFOLLOW) == 0 &&
+        S_ISDIR(stat.st_mode))
+      type = DT_DIR;
+  }
+  if (names) return names_add(names, name, type == DT_DIR);
+  output_link(output, name, type == DT_DIR);
+  return output->failed ? -1 : 0;
+}
+
+#ifdef SYS_getdents64
+struct dirlist_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* Reads DIRECTORY in large getdents64 batches, one chunk sent per batch. */
+static int dirlist_walk(int directory, struct dirlist_output *output,
+    struct dirlist_names *names) {
+  char *batch = malloc(DIRLIST_BATCH_SIZE);
+  if (!batch) return -1;
+
+  ssize_t size;
+  while ((size = syscall(SYS_getdents64, directory, batch, DIRLIST_BATCH_SIZE)) > 0) {
+    for (ssize_t offset = 0; offset < size && size > 0; ) {
+      struct dirlist_dirent64 *dirent = (struct dirlist_dirent64 *) (batch + offset);
+      if (visit(directory, output, names, dirent->d_name, dirent->d_type) < 0)
+        size = -1;
+      offset += dirent->d_reclen;
+    }
+    if (size < 0 || (!names && output_flush(output) < 0)) break;
+  }
+  free(batch);
+  return size < 0 ? -1 : 0;
+}
+#else
+static int dirlist_walk(int directory, struct dirlist_output *output,
+    struct dirlist_names *names) {
+  DIR *stream = fdopendir(dup(directory));
+  if (!stream) return -1;
+  struct dirent *dirent;
+  int result = 0;
+  while (result == 0 && (dirent = readdir(stream)) != NULL)
+    result = visit(directory, output, names, dirent->d_name, dirent->d_type);
+  closedir(stream);
+  return result;
+}
+#endif
+
+/* Sends a cached listing with a Content-Length, head and body together. */
+static void dirlist_send_cached(int fd, struct dirlist_entry *entry) {
+  char content_length[24];
+  snprintf(content_length, sizeof(content_length), "%zu", entry->size);
+  http_start_response(fd, 200);
+  http_send_header(fd, "Content-Type", "text/html");
+  http_send_header(fd, "Content-Length", content_length);
+  http_end_headers(fd);
+  http_send_data(fd, entry->body, entry->size);
+}
+
+int dirlist_send(int fd, const char *directory_path, int directory_fd) {
+  struct stat stat;
+  if (fstat(directory_fd, &stat) < 0) return -1;
+
+  if (cache_capacity > 0) {
+    struct dirlist_entry *entry = dirlist_acquire(directory_path, &stat);
+    if (entry) {
+      dirlist_send_cached(fd, entry);
+      dirlist_release(entry);
+      return 0;
+    }
+  }
+
+  /* A description of its own, as the cached fd's offset is shared, but of
+   * the same directory, which its path may no longer name. */
+  int directory = openat(directory_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory < 0) return -1;
+
+  struct dirlist_output *output = malloc(sizeof(*output));
+  if (!output) {
+    close(directory);
+    return -1;
+  }
+  output->fd = fd;
+  output->chunk_size = 0;
+  output->copy = NULL;
+  output->copy_size = output->copy_capacity = 0;
+  output->copying = cache_capacity > 0;
+  output->failed = 0;
+
+  /* Sorted names are all gathered before anything is sent, so a listing
+   * that can't be read can still be answered with an error. */
+  struct dirlist_names names = { 0 };
+  int result = sort_listings ? dirlist_walk(directory, output, &names) : 0;
+  if (result < 0) {
+    int saved_errno = errno;
+    close(directory);
+    free(names.data);
+    free(names.offsets);
+    free(output);
+    errno = saved_errno;
+    return -1;
+  }
+
+  /* No length up front: the body goes out chunked as it is rendered. */
+  http_start_response(fd, 200);
+  http_send_header(fd, "Content-Type", "text/html");
+  http_end_headers(fd);
+  const char *header = "<html><body><a href=\"../\">Parent directory</a><br>\n";
+  output_append(output, header, strlen(header));
+
+  if (sort_listings) {
+    qsort_r(names.offsets, names.count, sizeof(*names.offsets), names_compare,
+        names.data);
+    for (size_t i = 0; i < names.count && !output->failed; i++) {
+      const char *name = names.data + names.offsets[i];
+      output_link(output, name + 1, name[0] == 'd');
+    }
+    free(names.data);
+    free(names.offsets);
+  } else {
+    result = dirlist_walk(directory, output, NULL);
+  }
+  close(directory);
+  output_append(output, "</body></html>\n", 15);
+  if (output_flush(output) < 0 || result < 0) {
+    /* Don't let a partial listing pass for a whole one. */
+    http_abort_response(fd);
+    result = -1;
+  }
+
+  /* Only a listing read to the end is worth keeping. */
+  if (output->copying && result == 0)
+    dirlist_insert(directory_path, &stat, output->copy, output->copy_size);
+  else
+    free(output->copy);
+  free(output);
+  return 0;
+}
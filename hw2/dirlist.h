@@ -0,0 +1,29 @@
+#ifndef __DIRLIST__
+#define __DIRLIST__
+
+/*
+ * DIRLIST renders HTML directory listings.
+ *
+ * A listing is streamed as the directory is read: entries come in large
+ * getdents64 batches (readdir where that syscall is missing) and each
+ * batch goes out as its own chunk, so the first byte leaves after the
+ * first batch however big the directory is. With sorting on, names are
+ * gathered and sorted first and the output is streamed the same way.
+ *
+ * Rendered listings are kept in a byte-bounded LRU cache keyed by path and
+ * checked against the directory's current inode and mtime, so a cached
+ * listing costs one fstat and one write, and any change to the directory
+ * makes the next request render it afresh.
+ */
+
+void dirlist_init(size_t cache_bytes, int sorted);
+
+/*
+ * Sends the listing of DIRECTORY_PATH, open as DIRECTORY_FD, as a 200.
+ * Returns -1 with errno set, having sent nothing, if the directory can't
+ * be read (or, sorted, its names can't be held). A listing that fails
+ * once under way is cut short and its connection closed.
+ */
+int dirlist_send(int fd, const char *directory_path, int directory_fd);
+
+#endif
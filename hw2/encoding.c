@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+
+#include <brotli/encode.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "encoding.h"
+#include "libhttp.h"
+#include "stats.h"
+
+#define ENCODING_MIN_SIZE 256    // Smaller files gain too little.
+#define ENCODING_MAX_PENDING 64  // Jobs queued beyond this are dropped.
+
+static pthread_mutex_t encoding_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_ready = PTHREAD_COND_INITIALIZER;
+static struct encoding_entry **buckets;
+static unsigned int bucket_mask;
+static struct encoding_entry *lru_head, *lru_tail;
+static struct encoding_entry *jobs_head, *jobs_tail;
+static int jobs_pending;
+static size_t capacity, max_file_size, bytes;
+
+static unsigned int encoding_hash(const char *path, int encoding) {
+  unsigned int hash = 2166136261u; // FNV-1a
+  while (*path) {
+    hash ^= (unsigned char) *path++;
+    hash *= 16777619u;
+  }
+  return hash ^ encoding;
+}
+
+static size_t entry_cost(struct encoding_entry *entry) {
+  return entry->body_size + sizeof(*entry);
+}
+
+static void lru_unlink(struct encoding_entry *entry) {
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else lru_head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else lru_tail = entry->lru_prev;
+}
+
+static void lru_push_front(struct encoding_entry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = lru_head;
+  if (lru_head) lru_head->lru_prev = entry;
+  lru_head = entry;
+  if (!lru_tail) lru_tail = entry;
+}
+
+static void entry_destroy(struct encoding_entry *entry) {
+  free(entry->path);
+  free(entry->body);
+  free(entry);
+}
+
+/* Removes ENTRY from the table. Called with encoding_lock held. */
+static void entry_remove(struct encoding_entry *entry) {
+  struct encoding_entry **link =
+      &buckets[encoding_hash(entry->path, entry->encoding) & bucket_mask];
+  while (*link != entry) link = &(*link)->next;
+  *link = entry->next;
+  lru_unlink(entry);
+  entry->cached = 0;
+  bytes -= entry_cost(entry);
+  if (entry->refcount == 0) entry_destroy(entry);
+}
+
+/*
+ * Finds the variant of PATH tagged ETAG. Variants of an older version of
+ * the file are dropped on the way. Called with encoding_lock held.
+ */
+static struct encoding_entry *entry_lookup(const char *path, const char *etag,
+    int encoding) {
+  struct encoding_entry *entry =
+      buckets[encoding_hash(path, encoding) & bucket_mask];
+  while (entry) {
+    struct encoding_entry *next = entry->next;
+    if (entry->encoding == encoding && strcmp(entry->path, path) == 0) {
+      if (strcmp(entry->etag, etag) == 0) return entry;
+      entry_remove(entry);
+    }
+    entry = next;
+  }
+  return NULL;
+}
+
+/* Evicts until NEEDED more bytes fit. Called with encoding_lock held. */
+static void make_room(size_t needed) {
+  while (lru_tail && bytes + needed > capacity) entry_remove(lru_tail);
+}
+
+static int compress_gzip(const char *data, size_t size, char **out,
+    size_t *out_size) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+      Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+  size_t bound = deflateBound(&stream, size);
+  *out = malloc(bound);
+  if (!*out) {
+    deflateEnd(&stream);
+    return -1;
+  }
+  stream.next_in = (Bytef *) data;
+  stream.avail_in = size;
+  stream.next_out = (Bytef *) *out;
+  stream.avail_out = bound;
+  int result = deflate(&stream, Z_FINISH);
+  *out_size = stream.total_out;
+  deflateEnd(&stream);
+  if (result != Z_STREAM_END) {
+    free(*out);
+    return -1;
+  }
+  return 0;
+}
+
+static int compress_brotli(const char *data, size_t size, char **out,
+    size_t *out_size) {
+  size_t bound = BrotliEncoderMaxCompressedSize(size);
+  if (bound == 0 || !(*out = malloc(bound))) return -1;
+  *out_size = bound;
+  if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+      BROTLI_MODE_TEXT, size, (const uint8_t *) data, out_size,
+      (uint8_t *) *out)) {
+    free(*out);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Reads ENTRY's file and compresses it, provided it is still the version
+ * the entry is tagged with. Returns -1 if the file changed or can't be read.
+ */
+static int encoding_run(struct encoding_entry *entry, char **out,
+    size_t *out_size) {
+  int fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+
+  struct stat stat;
+  char etag[64];
+  if (fstat(fd, &stat) < 0) {
+    close(fd);
+    return -1;
+  }
+  http_format_etag(etag, sizeof(etag), &stat);
+  char *data = malloc(stat.st_size ? stat.st_size : 1);
+  if (strcmp(etag, entry->etag) != 0 || !data) {
+    free(data);
+    close(fd);
+    return -1;
+  }
+
+  size_t size = stat.st_size, offset = 0;
+  while (offset < size) {
+    ssize_t bytes_read = pread(fd, data + offset, size - offset, offset);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) {
+      free(data);
+      close(fd);
+      return -1;
+    }
+    offset += bytes_read;
+  }
+  close(fd);
+
+  int result = entry->encoding == ENCODING_BR ?
+      compress_brotli(data, size, out, out_size) :
+      compress_gzip(data, size, out, out_size);
+  if (result == 0 && *out_size >= size) {
+    /* Not worth it; remember that instead. */
+    free(*out);
+    *out = NULL;
+    *out_size = 0;
+  }
+  free(data);
+  return result;
+}
+
+/*
+ * Compression threads run under SCHED_IDLE, so they only get CPU time the
+ * workers leave unused and never delay a response.
+ */
+static void *encoding_worker(void *arg) {
+  struct sched_param param = { 0 };
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+  for (;;) {
+    pthread_mutex_lock(&encoding_lock);
+    while (!jobs_head) pthread_cond_wait(&jobs_ready, &encoding_lock);
+    struct encoding_entry *entry = jobs_head;
+    if (!(jobs_head = entry->next_job)) jobs_tail = NULL;
+    jobs_pending--;
+    int cached = entry->cached;
+    pthread_mutex_unlock(&encoding_lock);
+
+    char *body = NULL;
+    size_t body_size = 0;
+    int result = cached ? encoding_run(entry, &body, &body_size) : -1;
+
+    pthread_mutex_lock(&encoding_lock);
+    if (entry->cached) {
+      /* Take it out while making room so it can't evict itself. */
+      lru_unlink(entry);
+      make_room(body_size);
+      lru_push_front(entry);
+    }
+    if (result < 0 || !entry->cached) {
+      free(body);
+      if (entry->cached) entry_remove(entry);
+    } else {
+      entry->body = body;
+      entry->body_size = body_size;
+      entry->ready = 1;
+      bytes += body_size;
+    }
+    int destroy = --entry->refcount == 0 && !entry->cached;
+    pthread_mutex_unlock(&encoding_lock);
+    if (destroy) entry_destroy(entry);
+  }
+  return NULL;
+}
+
+/*
+ * Initializes a cache holding up to CACHE_BYTES of compressed variants, and
+ * NUM_THREADS threads to compress them. No file larger than an eighth of
+ * the cache is compressed. Either being zero disables compression.
+ */
+void encoding_init(size_t cache_bytes, int num_threads) {
+  if (cache_bytes == 0 || num_threads <= 0) return;
+  capacity = cache_bytes;
+  max_file_size = capacity / 8;
+
+  unsigned int size = 64;
+  while (size < capacity / 4096 && size < (1u << 20)) size <<= 1;
+  buckets = calloc(size, sizeof(*buckets));
+  if (!buckets) {
+    fprintf(stderr, "Failed to allocate compression cache\n");
+    exit(ENOMEM);
+  }
+  bucket_mask = size - 1;
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, encoding_worker, NULL) != 0) {
+      perror("Failed to create compression thread");
+      exit(errno);
+    }
+    pthread_detach(thread);
+  }
+}
+
+/* Whether the q parameter in [P, END) is zero ("0", "0.0", "0.000"...). */
+static int quality_is_zero(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  if (end - p < 2 || strncasecmp(p, "q=", 2) != 0) return 0;
+  p += 2;
+  if (p == end || *p != '0') return 0;
+  for (p++; p < end && (*p == '.' || *p == '0'); p++);
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  return p == end;
+}
+
+int encoding_accepted(const struct http_slice *accept_encoding) {
+  if (!accept_encoding) return 0;
+  int accepted = 0, listed = 0, any = 0;
+  const char *p = accept_encoding->data;
+  const char *end = p + accept_encoding->size;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    const char *name = p;
+    while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+    size_t length = p - name;
+    int zero = 0;
+    while (p < end && *p != ',') {
+      const char *param = ++p;
+      while (p < end && *p != ',' && *p != ';') p++;
+      if (quality_is_zero(param, p)) zero = 1;
+    }
+
+    int encoding = 0;
+    if (length == 4 && strncasecmp(name, "gzip", 4) == 0) encoding = ENCODING_GZIP;
+    else if (length == 2 && strncasecmp(name, "br", 2) == 0) encoding = ENCODING_BR;
+    else if (length == 1 && *name == '*') any = zero ? -1 : 1;
+    listed |= encoding;
+    if (!zero) accepted |= encoding;
+  }
+  if (any > 0) accepted |= (ENCODING_GZIP | ENCODING_BR) & ~listed;
+  return accepted;
+}
+
+int encoding_compressible(const char *content_type) {
+  static const char *types[] = {
+    "application/javascript", "application/json", "application/xml",
+    "application/xhtml+xml", "application/rss+xml", "application/atom+xml",
+    "application/wasm", "image/svg+xml", "image/x-icon",
+  };
+  size_t length = strcspn(content_type, ";");
+  if (strncasecmp(content_type, "text/", 5) == 0) return 1;
+  if (length > 5 && (strncasecmp(content_type + length - 5, "+json", 5) == 0 ||
+      strncasecmp(content_type + length - 4, "+xml", 4) == 0))
+    return 1;
+  for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    if (strlen(types[i]) == length && strncasecmp(content_type, types[i], length) == 0)
+      return 1;
+  return 0;
+}
+
+const char *encoding_name(int encoding) {
+  return encoding == ENCODING_BR ? "br" : "gzip";
+}
+
+const char *encoding_suffix(int encoding) {
+  return encoding == ENCODING_BR ? ".br" : ".gz";
+}
+
+void encoding_format_etag(char *buffer, size_t size, const char *etag,
+    int encoding) {
+  size_t length = strlen(etag);
+  if (length > 0 && etag[length - 1] == '"') length--;
+  snprintf(buffer, size, "%.*s-%s\"", (int) length, etag,
+      encoding_name(encoding));
+}
+
+struct encoding_entry *encoding_acquire(const char *path, const char *etag,
+    int encoding, off_t size) {
+  if (capacity == 0 || size < ENCODING_MIN_SIZE || (size_t) size > max_file_size)
+    return NULL;
+
+  pthread_mutex_lock(&encoding_lock);
+  struct encoding_entry *entry = entry_lookup(path, etag, encoding);
+  if (entry) {
+    lru_unlink(entry);
+    lru_push_front(entry);
+    int ready = entry->ready;
+    if (ready && entry->body) entry->refcount++;
+    else entry = NULL;
+    pthread_mutex_unlock(&encoding_lock);
+    STATS_COUNT(ready ? STATS_ENCODING_HITS : STATS_ENCODING_MISSES);
+    return entry;
+  }
+  STATS_COUNT(STATS_ENCODING_MISSES);
+
+  /* Not seen yet: leave a placeholder and queue it for compression. */
+  if (jobs_pending < ENCODING_MAX_PENDING &&
+      (entry = calloc(1, sizeof(*entry))) && (entry->path = strdup(path))) {
+    snprintf(entry->etag, sizeof(entry->etag), "%s", etag);
+    entry->encoding = encoding;
+    entry->refcount = 1;  // Held by the job.
+    entry->cached = 1;
+    make_room(entry_cost(entry));
+    unsigned int bucket = encoding_hash(path, encoding) & bucket_mask;
+    entry->next = buckets[bucket];
+    buckets[bucket] = entry;
+    lru_push_front(entry);
+    bytes += entry_cost(entry);
+
+    if (jobs_tail) jobs_tail->next_job = entry;
+    else jobs_head = entry;
+    jobs_tail = entry;
+    jobs_pending++;
+    pthread_cond_signal(&jobs_ready);
+  } else if (entry) {
+    free(entry);
+  }
+  pthread_mutex_unlock(&encoding_lock);
+  return NULL;
+}
+
+void encoding_release(struct encoding_entry *entry) {
+  pthread_mutex_lock(&encoding_lock);
+  int destroy = --entry->refcount == 0 && !entry->cached;
+  pthread_mutex_unlock(&encoding_lock);
+  if (destroy) entry_destroy(entry);
+}
@@ -0,0 +1,63 @@
+#ifndef __ENCODING__
+#define __ENCODING__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "parser.h"
+
+/*
+ * ENCODING negotiates Content-Encoding and keeps compressed variants of
+ * files.
+ *
+ * Variants are cached in a byte-bounded LRU keyed by path, ETag (which
+ * carries the file's inode, size and mtime) and encoding, so a changed file
+ * simply stops matching its old variants. A miss never compresses on the
+ * caller's thread: it queues the file for a small pool of SCHED_IDLE
+ * threads and returns NULL, and the caller sends the identity body until
+ * the variant is ready. Files that don't shrink are remembered as such and
+ * not compressed again.
+ */
+
+#define ENCODING_GZIP 1
+#define ENCODING_BR 2
+
+struct encoding_entry {
+  char *path;
+  char etag[64];      // ETag of the identity file.
+  int encoding;
+  int ready;          // Compressed (or found incompressible).
+  char *body;         // NULL if the file didn't shrink.
+  size_t body_size;
+  int refcount;
+  int cached;         // Still reachable from the table.
+  struct encoding_entry *next;  // Hash chain.
+  struct encoding_entry *lru_prev, *lru_next;
+  struct encoding_entry *next_job;
+};
+
+void encoding_init(size_t cache_bytes, int num_threads);
+
+/* Returns the ENCODING_* bits ACCEPT_ENCODING allows (q=0 excludes). */
+int encoding_accepted(const struct http_slice *accept_encoding);
+
+/* Whether CONTENT_TYPE is worth compressing (text and text-like types). */
+int encoding_compressible(const char *content_type);
+
+/* The Content-Encoding token and sibling file suffix of ENCODING. */
+const char *encoding_name(int encoding);
+const char *encoding_suffix(int encoding);
+
+/* Writes the ETag of the ENCODING variant of an entity tagged ETAG. */
+void encoding_format_etag(char *buffer, size_t size, const char *etag,
+    int encoding);
+
+/*
+ * Returns a referenced, compressed variant of the file at PATH, or NULL,
+ * scheduling compression of files of SIZE bytes that aren't cached yet.
+ */
+struct encoding_entry *encoding_acquire(const char *path, const char *etag,
+    int encoding, off_t size);
+void encoding_release(struct encoding_entry *entry);
+
+#endif
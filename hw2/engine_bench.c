@@ -0,0 +1,404 @@
+/*
+ * Benchmark for the server's I/O engines.
+ *
+ * Serves a small file from a scratch directory with ./httpserver in each
+ * engine (worker pool, epoll event loop, io_uring) and drives it with
+ * keep-alive clients from one epoll thread. Reports requests per second
+ * over a timed run, then system calls per request over a shorter run with
+ * every server thread traced by ptrace (which slows the server, so it is
+ * kept apart from the timed run). Where the kernel lacks io_uring the
+ * server says so on stderr and its io_uring row measures the event loop.
+ *
+ * Usage: ./engine_bench [seconds] [connections] [port] [-- server options]
+ *
+ * Server options default to "--cache-mb 16", so the file is answered from
+ * the content cache as a hot small response would be.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_CONNECTIONS 1024
+#define BENCH_MAX_ARGS 32
+
+static const char request[] =
+  "GET /engine_bench.txt HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+struct engine {
+  const char *name;
+  const char *options[4];
+};
+
+static const struct engine engines[] = {
+  { "pool", { "--num-threads", "4" } },
+  { "epoll", { "--event-loop", "--num-threads", "1" } },
+  { "io_uring", { "--io-uring", "--num-threads", "1" } },
+};
+
+struct client {
+  int fd;
+  char buffer[4096];
+  size_t size;
+};
+
+static int port = 8999;
+static const char *server_options[BENCH_MAX_ARGS] = { "--cache-mb", "16" };
+static int num_server_options = 2;
+
+/* What bench_cleanup undoes when the bench exits, on any path. */
+static pid_t server_pid;
+static char directory[] = "/tmp/engine_bench.XXXXXX";
+static int directory_made;
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server() {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+  int enabled = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+  return fd;
+}
+
+/*
+ * Waits until nothing listens on the port any more. A killed io_uring
+ * server's listener outlives the process until the kernel has torn its
+ * ring down, and the next server must not find the port taken.
+ */
+static void wait_port_released() {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  for (int tries = 0; tries < 500; tries++) {
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int enabled = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+    int bound = bind(fd, (struct sockaddr *) &address, sizeof(address)) == 0;
+    close(fd);
+    if (bound) return;
+    usleep(10000);
+  }
+  fprintf(stderr, "Port %d is still in use\n", port);
+  exit(1);
+}
+
+/* Starts ./httpserver on DIRECTORY with ENGINE and waits until it accepts. */
+static pid_t start_server(const struct engine *engine) {
+  char port_string[16];
+  snprintf(port_string, sizeof(port_string), "%d", port);
+  const char *argv[BENCH_MAX_ARGS * 2] = { "./httpserver", "--files", directory,
+    "--port", port_string };
+  int argc = 5;
+  for (int i = 0; i < 4 && engine->options[i]; i++) argv[argc++] = engine->options[i];
+  for (int i = 0; i < num_server_options; i++) argv[argc++] = server_options[i];
+  argv[argc] = NULL;
+
+  wait_port_released();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("Failed to fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    execv(argv[0], (char **) argv);
+    perror("Failed to start ./httpserver");
+    _exit(1);
+  }
+  server_pid = pid;
+  for (int tries = 0; tries < 200; tries++) {
+    if (waitpid(pid, NULL, WNOHANG) == pid) {
+      server_pid = 0;
+      fprintf(stderr, "httpserver exited before listening on port %d\n", port);
+      exit(1);
+    }
+    int fd = connect_server();
+    if (fd >= 0) {
+      close(fd);
+      return pid;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "httpserver didn't start listening on port %d\n", port);
+  exit(1);
+}
+
+/* Kills the server, reaping any threads still traced. */
+static void stop_server(pid_t pid) {
+  kill(pid, SIGKILL);
+  pid_t reaped;
+  do {
+    reaped = waitpid(-1, NULL, __WALL);
+  } while (reaped > 0 && reaped != pid);
+  server_pid = 0;
+}
+
+/* Stops a server still running and removes the bench directory. */
+static void bench_cleanup() {
+  if (server_pid > 0) stop_server(server_pid);
+  if (directory_made) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/engine_bench.txt", directory);
+    unlink(path);
+    rmdir(directory);
+  }
+}
+
+/*
+ * Consumes whole responses from CLIENT's buffer, returning how many. The
+ * bench file is small enough that every response fits the buffer.
+ */
+static long take_responses(struct client *client) {
+  long responses = 0;
+  while (1) {
+    char *head_end = memmem(client->buffer, client->size, "\r\n\r\n", 4);
+    if (!head_end) return responses;
+    char *length = memmem(client->buffer, head_end - client->buffer,
+        "Content-Length: ", 16);
+    size_t response_size = head_end + 4 - client->buffer +
+      (length ? strtoul(length + 16, NULL, 10) : 0);
+    if (client->size < response_size) return responses;
+    memmove(client->buffer, client->buffer + response_size,
+        client->size - response_size);
+    client->size -= response_size;
+    responses++;
+  }
+}
+
+/* Connects CLIENT, adds it to EPOLL_FD and sends its first request. */
+static void open_client(int epoll_fd, struct client *client) {
+  client->fd = connect_server();
+  client->size = 0;
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+  if (client->fd < 0 ||
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event) < 0 ||
+      write(client->fd, request, sizeof(request) - 1) < 0) {
+    perror("Failed to connect a client");
+    exit(1);
+  }
+}
+
+/*
+ * Runs CONNECTIONS keep-alive clients, each with one request outstanding
+ * (reconnecting when the server closes),
+ * until SECONDS pass or MAX_REQUESTS responses arrive. Returns responses.
+ */
+static long run_clients(int connections, double seconds, long max_requests) {
+  static struct client clients[BENCH_MAX_CONNECTIONS];
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  for (int i = 0; i < connections; i++) open_client(epoll_fd, &clients[i]);
+
+  long responses = 0;
+  double deadline = now_seconds() + seconds;
+  struct epoll_event events[64];
+  while (responses < max_requests && now_seconds() < deadline) {
+    int ready = epoll_wait(epoll_fd, events, 64, 100);
+    for (int i = 0; i < ready; i++) {
+      struct client *client = events[i].data.ptr;
+      ssize_t bytes = read(client->fd, client->buffer + client->size,
+          sizeof(client->buffer) - client->size);
+      if (bytes <= 0) {
+        /* The server ends keep-alive after its per-connection limit. */
+        close(client->fd);
+        open_client(epoll_fd, client);
+        continue;
+      }
+      client->size += bytes;
+      long taken = take_responses(client);
+      responses += taken;
+      if (taken > 0 && write(client->fd, request, sizeof(request) - 1) < 0) {
+        perror("Failed to send a request");
+        exit(1);
+      }
+    }
+  }
+  for (int i = 0; i < connections; i++) close(clients[i].fd);
+  close(epoll_fd);
+  return responses;
+}
+
+struct traced_run {
+  int connections;
+  long requests;
+  long responses;
+  volatile int done;
+};
+
+static void *traced_clients(void *arg) {
+  struct traced_run *run = arg;
+  run->responses = run_clients(run->connections, 60, run->requests);
+  run->done = 1;
+  return NULL;
+}
+
+/* Seizes every thread of PID and starts it tracing system calls. */
+static int trace_threads(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/task", pid);
+  DIR *tasks = opendir(path);
+  if (!tasks) return -1;
+  struct dirent *task;
+  int count = 0;
+  while ((task = readdir(tasks))) {
+    pid_t tid = atoi(task->d_name);
+    if (tid <= 0) continue;
+    if (ptrace(PTRACE_SEIZE, tid, NULL,
+        (void *) (PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE)) < 0) {
+      closedir(tasks);
+      return -1;
+    }
+    ptrace(PTRACE_INTERRUPT, tid, NULL, NULL);
+    count++;
+  }
+  closedir(tasks);
+  return count;
+}
+
+/*
+ * Counts the server's system calls while REQUESTS requests are served.
+ * Returns calls per request, or -1 if the server can't be traced.
+ */
+static double syscalls_per_request(pid_t pid, int connections, long requests) {
+  if (trace_threads(pid) < 0) return -1;
+
+  struct traced_run run = { .connections = connections, .requests = requests };
+  pthread_t client;
+  pthread_create(&client, NULL, traced_clients, &run);
+
+  long stops = 0;
+  while (1) {
+    int status;
+    pid_t tid = waitpid(-1, &status, __WALL | WNOHANG);
+    if (tid == 0) {
+      if (run.done) break;
+      usleep(100);
+      continue;
+    }
+    if (tid < 0) break;
+    if (!WIFSTOPPED(status)) continue;
+    int signal = WSTOPSIG(status);
+    if (signal == (SIGTRAP | 0x80)) {
+      stops++;
+      signal = 0;
+    } else if (signal == SIGTRAP || (status >> 16) != 0) {
+      signal = 0;  // Clone or interrupt stop.
+    }
+    ptrace(PTRACE_SYSCALL, tid, NULL, (void *) (long) signal);
+  }
+  pthread_join(client, NULL);
+  /* Each call stops once on entry and once on exit. */
+  return run.responses > 0 ? stops / 2.0 / run.responses : -1;
+}
+
+static int make_directory() {
+  if (!mkdtemp(directory)) return -1;
+  directory_made = 1;
+  char path[256];
+  snprintf(path, sizeof(path), "%s/engine_bench.txt", directory);
+  FILE *file = fopen(path, "w");
+  if (!file) return -1;
+  for (int i = 0; i < 16; i++)
+    fprintf(file, "A small response body, as most are on a busy site.\n");
+  fclose(file);
+  return 0;
+}
+
+char *USAGE =
+  "Usage: ./engine_bench [seconds] [connections] [port] [-- server options]\n"
+  "\n"
+  "  seconds       timed run per engine (default 5)\n"
+  "  connections   keep-alive clients, 1 to %d (default 32)\n"
+  "  port          port the servers listen on (default 8999)\n"
+  "  -- options    ./httpserver options for every engine, replacing the\n"
+  "                default --cache-mb 16\n";
+
+static void exit_with_usage() {
+  fprintf(stderr, USAGE, BENCH_MAX_CONNECTIONS);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  double seconds = 5;
+  int connections = 32;
+  int positional = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--") == 0) {
+      num_server_options = 0;
+      while (++i < argc && num_server_options < BENCH_MAX_ARGS)
+        server_options[num_server_options++] = argv[i];
+      break;
+    }
+    if (argv[i][0] == '-') exit_with_usage();  // --help, or a typo.
+    switch (positional++) {
+      case 0: seconds = atof(argv[i]); break;
+      case 1: connections = atoi(argv[i]); break;
+      case 2: port = atoi(argv[i]); break;
+      default: exit_with_usage();
+    }
+  }
+  if (seconds <= 0 || port <= 0 || port > 65535 ||
+      connections < 1 || connections > BENCH_MAX_CONNECTIONS)
+    exit_with_usage();
+
+  atexit(bench_cleanup);
+  if (make_directory() < 0) {
+    perror("Failed to create the bench directory");
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("%d connections, %.0f s per engine\n", connections, seconds);
+  printf("%-10s %14s %18s\n", "engine", "requests/s", "syscalls/request");
+  for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+    pid_t pid = start_server(&engines[i]);
+    run_clients(connections, 0.5, 1L << 40);  // Warm the caches.
+    double start = now_seconds();
+    long responses = run_clients(connections, seconds, 1L << 40);
+    double elapsed = now_seconds() - start;
+    stop_server(pid);
+
+    pid = start_server(&engines[i]);
+    run_clients(connections, 0.2, 1L << 40);
+    double syscalls = syscalls_per_request(pid, connections, 2000);
+    stop_server(pid);
+
+    printf("%-10s %14.0f ", engines[i].name, responses / elapsed);
+    if (syscalls < 0) printf("%18s\n", "(can't trace)");
+    else printf("%18.2f\n", syscalls);
+    fflush(stdout);
+  }
+  return 0;
+}
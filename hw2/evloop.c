@@ -0,0 +1,624 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "admission.h"
+#include "evloop.h"
+#include "libhttp.h"
+#include "listener.h"
+#include "stats.h"
+#include "timerwheel.h"
+
+#define EVLOOP_MAX_EVENTS 256
+#define EVLOOP_WATCH 1  // Tags epoll data of a descriptor a handler awaits.
+
+/* Response output the socket couldn't take yet: bytes, or part of a file. */
+struct evloop_output {
+  struct evloop_output *next;
+  int file_fd;      // -1 for the bytes in data.
+  off_t offset;     // Into the file, or into data.
+  size_t size;      // Bytes left to send.
+  char data[];
+};
+
+/*
+ * Per-connection state, hung off the epoll event's data pointer. Each
+ * connection has one deadline on its reactor's timer wheel, in seconds.
+ */
+struct evloop_connection {
+  struct timerwheel_timer timer;  // First, so a timer is its connection.
+  struct evloop_reactor *reactor;
+  int head_pending;               // The deadline is for a head under way.
+  uint32_t events;                // What the socket is registered for.
+  struct evloop_output *output;   // Queued output, oldest first.
+  struct evloop_output **output_tail;
+  int output_failed;              // The socket failed while sending.
+  int close_after_output;
+  int eof;                        // The client has sent all it will.
+  int closed;                     // Freed once the current events are done.
+  struct evloop_connection *next_closed;
+  /* While the request handler waits in evloop_await: */
+  int suspended;
+  short await_events;
+  int watch_fd;
+  void (*resume)(int fd, void *context, int ready);
+  void *resume_context;
+  struct stats_request stats;
+  struct http_connection http;
+};
+
+struct evloop_reactor {
+  int index;
+  int pin_cpu;
+  int listen_fd;
+  int epoll_fd;
+  int keep_alive_timeout;
+  int header_timeout;
+  struct timerwheel wheel;
+  void (*request_handler)(int);
+  struct evloop_connection *closed;  // Waiting to be freed.
+};
+
+/* Tags the listening socket in epoll data so it can't be mistaken for a
+ * connection. */
+static struct evloop_connection listen_marker;
+
+/* The connection whose handler the calling reactor is running. */
+static __thread struct evloop_connection *evloop_current;
+
+/*
+ * Re-arms CONNECTION's deadline after a read that served SERVED requests.
+ * A head has header_timeout from its first byte, or from the end of the
+ * last response while that request's unread body is still being skipped,
+ * and a connection that finished a request has keep_alive_timeout to start
+ * the next. Bytes that trickle in without completing a head never push a
+ * deadline back.
+ */
+static void evloop_rearm(struct evloop_reactor *reactor,
+    struct evloop_connection *connection, int served, time_t now) {
+  struct http_connection *http = &connection->http;
+  int partial = http_connection_in_request(http);
+  if (served) connection->head_pending = 0;
+  if (partial && !connection->head_pending) {
+    connection->head_pending = 1;
+    timerwheel_schedule(&reactor->wheel, &connection->timer,
+        now + reactor->header_timeout);
+  } else if (served && !partial) {
+    timerwheel_schedule(&reactor->wheel, &connection->timer,
+        now + reactor->keep_alive_timeout);
+  }
+}
+
+/*
+ * Registers CONNECTION's socket for what it waits on now: while its
+ * handler awaits, the events awaited; otherwise writability while output
+ * is queued (reads wait until it's sent) and reads when there is none.
+ */
+static void evloop_watch(struct evloop_reactor *reactor,
+    struct evloop_connection *connection) {
+  uint32_t events;
+  if (connection->suspended)
+    events = (connection->await_events & POLLIN ? EPOLLIN : 0) |
+      (connection->output || connection->await_events & POLLOUT ? EPOLLOUT : 0);
+  else
+    events = connection->output ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+  if (events == connection->events) return;
+  struct epoll_event event = { .events = events, .data.ptr = connection };
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, connection->http.fd, &event);
+  connection->events = events;
+}
+
+static void evloop_close(struct evloop_reactor *reactor,
+    struct evloop_connection *connection) {
+  timerwheel_cancel(&connection->timer);
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, connection->http.fd, NULL);
+  close(connection->http.fd);
+  while (connection->output) {
+    struct evloop_output *output = connection->output;
+    connection->output = output->next;
+    if (output->file_fd >= 0) close(output->file_fd);
+    free(output);
+  }
+  /* Events already fetched may still name it. */
+  connection->closed = 1;
+  connection->next_closed = reactor->closed;
+  reactor->closed = connection;
+  admission_release();
+}
+
+/* Closes CONNECTION once the output queued for it is sent. */
+static void evloop_close_after_output(struct evloop_reactor *reactor,
+    struct evloop_connection *connection) {
+  if (!connection->output || connection->output_failed) {
+    evloop_close(reactor, connection);
+    return;
+  }
+  connection->close_after_output = 1;
+  evloop_watch(reactor, connection);
+  timerwheel_schedule(&reactor->wheel, &connection->timer,
+      time(NULL) + reactor->header_timeout);
+}
+
+/* Queues SIZE bytes of IOV, past the first SKIP, behind CONNECTION's
+ * output. */
+static int evloop_queue_iov(struct evloop_connection *connection,
+    const struct iovec *iov, int iovcnt, size_t skip, size_t size) {
+  struct evloop_output *output = malloc(sizeof(*output) + size);
+  if (!output) return -1;
+  size_t copied = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    size_t length = iov[i].iov_len;
+    if (skip >= length) {
+      skip -= length;
+      continue;
+    }
+    memcpy(output->data + copied, (char *) iov[i].iov_base + skip,
+        length - skip);
+    copied += length - skip;
+    skip = 0;
+  }
+  output->next = NULL;
+  output->file_fd = -1;
+  output->offset = 0;
+  output->size = size;
+  *connection->output_tail = output;
+  connection->output_tail = &output->next;
+  return 0;
+}
+
+/*
+ * The libhttp sink for reactor connections: output goes straight to the
+ * socket while nothing is queued ahead of it, and whatever the socket
+ * can't take is queued (files by a duplicate of their descriptor) and sent
+ * as it drains, so a slow reader never holds up the reactor.
+ */
+static int evloop_sink_write(void *context, const struct iovec *iov,
+    int iovcnt) {
+  struct evloop_connection *connection = context;
+  if (connection->output_failed) return -1;
+  size_t size = 0, sent = 0;
+  for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+  if (!connection->output) {
+    ssize_t bytes;
+    do {
+      bytes = writev(connection->http.fd, iov, iovcnt);
+    } while (bytes < 0 && errno == EINTR);
+    if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      connection->output_failed = 1;
+      return -1;
+    }
+    if (bytes > 0) sent = bytes;
+    if (sent == size) return 0;
+  }
+  if (evloop_queue_iov(connection, iov, iovcnt, sent, size - sent) < 0) {
+    connection->output_failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+static int evloop_sink_send_file(void *context, int file_fd, off_t offset,
+    size_t size) {
+  struct evloop_connection *connection = context;
+  if (connection->output_failed) return -1;
+  while (!connection->output && size > 0) {
+    ssize_t bytes = sendfile(connection->http.fd, file_fd, &offset, size);
+    if (bytes > 0) {
+      size -= bytes;
+      continue;
+    }
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    /* Failed, or the file shrank underneath us: the body can't be whole. */
+    connection->output_failed = 1;
+    return -1;
+  }
+  if (size == 0) return 0;
+
+  struct evloop_output *output = malloc(sizeof(*output));
+  if (!output || (output->file_fd = dup(file_fd)) < 0) {
+    free(output);
+    connection->output_failed = 1;
+    return -1;
+  }
+  output->next = NULL;
+  output->offset = offset;
+  output->size = size;
+  *connection->output_tail = output;
+  connection->output_tail = &output->next;
+  return 0;
+}
+
+static int evloop_sink_pending(void *context) {
+  struct evloop_connection *connection = context;
+  if (connection->output_failed) return -1;
+  return connection->output != NULL;
+}
+
+static const struct http_sink evloop_sink = {
+  .write = evloop_sink_write,
+  .send_file = evloop_sink_send_file,
+  .pending = evloop_sink_pending,
+};
+
+/* Sends what the socket takes of CONNECTION's queued output. Returns 1 once
+ * it's all sent, 0 while the socket is full and -1 if it failed. */
+static int evloop_send_output(struct evloop_connection *connection) {
+  int fd = connection->http.fd;
+  while (connection->output) {
+    struct evloop_output *output = connection->output;
+    ssize_t bytes = output->file_fd >= 0 ?
+      sendfile(fd, output->file_fd, &output->offset, output->size) :
+      write(fd, output->data + output->offset, output->size);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (bytes <= 0) {
+      connection->output_failed = 1;
+      return -1;
+    }
+    if (output->file_fd < 0) output->offset += bytes;
+    output->size -= bytes;
+    if (output->size > 0) continue;
+    connection->output = output->next;
+    if (output->file_fd >= 0) close(output->file_fd);
+    free(output);
+  }
+  connection->output_tail = &connection->output;
+  return 1;
+}
+
+/* Accepts every pending connection and registers it for reads. */
+static void evloop_accept(struct evloop_reactor *reactor) {
+  while (1) {
+    int fd = accept4(reactor->listen_fd, NULL, NULL,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Error accepting socket");
+      return;
+    }
+    if (!admission_admit(fd)) continue;
+
+    struct evloop_connection *connection = malloc(sizeof(*connection));
+    if (!connection) {
+      close(fd);
+      admission_release();
+      continue;
+    }
+    http_connection_init(&connection->http, fd);
+    http_connection_set_sink(&connection->http, &evloop_sink, connection);
+    STATS_COUNT(STATS_CONNECTIONS);
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP,
+      .data.ptr = connection };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      close(fd);
+      free(connection);
+      admission_release();
+      continue;
+    }
+    connection->reactor = reactor;
+    connection->events = event.events;
+    connection->output = NULL;
+    connection->output_tail = &connection->output;
+    connection->output_failed = connection->close_after_output = 0;
+    connection->eof = connection->closed = connection->suspended = 0;
+    connection->watch_fd = -1;
+    /* A new connection gets header_timeout to start its first request. */
+    connection->timer.prev = connection->timer.next = NULL;
+    connection->head_pending = 0;
+    timerwheel_schedule(&reactor->wheel, &connection->timer,
+        time(NULL) + reactor->header_timeout);
+  }
+}
+
+int evloop_await(int fd, short events, int watch_fd, short watch_events,
+    int timeout, void (*resume)(int fd, void *context, int ready),
+    void *context) {
+  struct evloop_connection *connection = evloop_current;
+  if (!connection || connection->http.fd != fd) return -1;
+  struct evloop_reactor *reactor = connection->reactor;
+  if (watch_fd >= 0) {
+    struct epoll_event event = {
+      .events = (watch_events & POLLIN ? EPOLLIN : 0) |
+        (watch_events & POLLOUT ? EPOLLOUT : 0),
+      .data.ptr = (void *) ((uintptr_t) connection | EVLOOP_WATCH),
+    };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, watch_fd, &event) < 0)
+      return -1;
+  }
+  connection->suspended = 1;
+  connection->await_events = events;
+  connection->watch_fd = watch_fd;
+  connection->resume = resume;
+  connection->resume_context = context;
+  timerwheel_schedule(&reactor->wheel, &connection->timer, time(NULL) + timeout);
+  return 0;
+}
+
+/* Runs the handler's next step for CONNECTION's current request: the
+ * handler itself, or the resume callback of its wait. */
+static void evloop_enter(struct evloop_connection *connection) {
+  http_connection_bind(&connection->http);
+  evloop_current = connection;
+}
+
+/*
+ * After the handler (or a resume callback) returns, sets the request aside
+ * if it awaits something, or ends it. Returns 1 if the connection can go on
+ * to its next request; otherwise it waits, or is closing.
+ */
+static int evloop_leave(struct evloop_reactor *reactor,
+    struct evloop_connection *connection) {
+  struct http_connection *http = &connection->http;
+  evloop_current = NULL;
+  if (connection->suspended) {
+    STATS_REQUEST_SUSPEND(&connection->stats);
+    http_connection_bind(NULL);
+    evloop_watch(reactor, connection);
+    return 0;
+  }
+  accesslog_request(http);
+  int keep_alive = http_connection_finish(http);
+  STATS_REQUEST_END(http->response_status);
+  http_connection_bind(NULL);
+  if (!keep_alive || connection->output_failed) {
+    evloop_close_after_output(reactor, connection);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Runs the handler for every complete request head buffered, in order, with
+ * the connection bound so http_request_parse takes each from the buffer
+ * instead of calling read(). Stops while a handler waits or output is
+ * queued, and re-arms the connection's deadline once it has to wait for the
+ * client. SERVED counts requests the client has been answered for since.
+ */
+static void evloop_serve(struct evloop_reactor *reactor,
+    struct evloop_connection *connection, int served) {
+  struct http_connection *http = &connection->http;
+  while (!connection->output && http_connection_has_request(http)) {
+    served++;
+    evloop_enter(connection);
+    STATS_REQUEST_BEGIN();
+    reactor->request_handler(http->fd);
+    if (!evloop_leave(reactor, connection)) return;
+  }
+
+  /* Without keep-alive here, skipping the last request's body failed. */
+  if (!http->keep_alive) {
+    evloop_close_after_output(reactor, connection);
+    return;
+  }
+  time_t now = time(NULL);
+  if (connection->output) {
+    evloop_watch(reactor, connection);
+    timerwheel_schedule(&reactor->wheel, &connection->timer,
+        now + reactor->header_timeout);
+  } else if (connection->eof) {
+    evloop_close(reactor, connection);
+  } else {
+    evloop_watch(reactor, connection);
+    evloop_rearm(reactor, connection, served, now);
+  }
+}
+
+/* Ends CONNECTION's wait and hands its request back to the handler; READY
+ * is 0 if the wait timed out or the client hung up. */
+static void evloop_resume(struct evloop_reactor *reactor,
+    struct evloop_connection *connection, int ready) {
+  if (connection->watch_fd >= 0) {
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, connection->watch_fd, NULL);
+    connection->watch_fd = -1;
+  }
+  connection->suspended = 0;
+  evloop_enter(connection);
+  STATS_REQUEST_RESUME(&connection->stats);
+  connection->resume(connection->http.fd, connection->resume_context, ready);
+  if (evloop_leave(reactor, connection)) evloop_serve(reactor, connection, 1);
+}
+
+/* Handles a deadline that passed: a waiting handler is told, and any other
+ * connection closes. */
+static void evloop_expired(struct timerwheel_timer *timer, void *context) {
+  struct evloop_connection *connection = (struct evloop_connection *) timer;
+  if (connection->suspended) {
+    evloop_resume(context, connection, 0);
+    return;
+  }
+  if (connection->head_pending) STATS_COUNT(STATS_HEADER_TIMEOUTS);
+  evloop_close(context, connection);
+}
+
+/*
+ * Drains whatever the socket has and serves the complete request heads
+ * buffered. The connection stays registered between requests while
+ * keep-alive holds, and closes once the client has closed its side and
+ * every request it sent before is answered.
+ */
+static void evloop_read(struct evloop_reactor *reactor,
+    struct evloop_connection *connection) {
+  struct http_connection *http = &connection->http;
+  while (1) {
+    ssize_t bytes_read = http_connection_fill(http);
+    if (bytes_read > 0) continue;
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    /* A full buffer is served before reading more; if it holds no whole
+     * head, the handler's parser rejects it as it would an oversized
+     * read(), and the connection closes. */
+    if (bytes_read < 0 && errno == ENOBUFS) {
+      if (http_connection_has_request(http)) break;
+      /* Skipping a body frees the buffer for the rest of it. */
+      if (http->start > 0 && http->keep_alive) continue;
+    }
+    connection->eof = 1;
+    break;
+  }
+  /* A body too big to skip gets no answer: the connection gave up on it. */
+  if (connection->eof && !http_connection_has_request(http) &&
+      http->keep_alive && http->size == sizeof(http->buffer)) {
+    evloop_enter(connection);
+    reactor->request_handler(http->fd);
+    evloop_current = NULL;
+    accesslog_request(http);
+    http_connection_finish(http);
+    http_connection_bind(NULL);
+    evloop_close_after_output(reactor, connection);
+    return;
+  }
+  evloop_serve(reactor, connection, 0);
+}
+
+/* Handles EVENTS on CONNECTION's socket. */
+static void evloop_event(struct evloop_reactor *reactor,
+    struct evloop_connection *connection, uint32_t events) {
+  int sent = 1;
+  if (connection->output && events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+    sent = evloop_send_output(connection);
+    if (sent < 0 && !connection->suspended) {
+      evloop_close(reactor, connection);
+      return;
+    }
+  }
+
+  if (connection->suspended) {
+    int ready = (events & EPOLLIN && connection->await_events & POLLIN) ||
+      (sent > 0 && events & EPOLLOUT && connection->await_events & POLLOUT);
+    if (ready || sent < 0 || events & (EPOLLERR | EPOLLHUP))
+      evloop_resume(reactor, connection, ready);
+    else
+      evloop_watch(reactor, connection);
+    return;
+  }
+
+  if (connection->output) {
+    /* Still sending: a client that keeps taking it keeps its time. */
+    timerwheel_schedule(&reactor->wheel, &connection->timer,
+        time(NULL) + reactor->header_timeout);
+  } else if (connection->close_after_output) {
+    evloop_close(reactor, connection);
+  } else if (events & EPOLLOUT) {
+    evloop_serve(reactor, connection, 1);
+  } else {
+    evloop_read(reactor, connection);
+  }
+}
+
+static void *evloop_reactor_main(void *arg) {
+  struct evloop_reactor *reactor = arg;
+  struct epoll_event events[EVLOOP_MAX_EVENTS];
+  if (reactor->pin_cpu) listener_pin_thread(reactor->index);
+
+  while (1) {
+    int ready = epoll_wait(reactor->epoll_fd, events, EVLOOP_MAX_EVENTS, 1000);
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait failed");
+      exit(errno);
+    }
+
+    for (int i = 0; i < ready; i++) {
+      uintptr_t data = (uintptr_t) events[i].data.ptr;
+      struct evloop_connection *connection =
+        (struct evloop_connection *) (data & ~(uintptr_t) EVLOOP_WATCH);
+      if (connection == &listen_marker) {
+        evloop_accept(reactor);
+      } else if (connection->closed) {
+        continue;
+      } else if (data & EVLOOP_WATCH) {
+        /* The wait may have ended on another event since. */
+        if (connection->suspended && connection->watch_fd >= 0)
+          evloop_resume(reactor, connection, 1);
+      } else {
+        evloop_event(reactor, connection, events[i].events);
+      }
+    }
+    /* Only once the events are handled: a connection that expires here
+     * may be one of them. */
+    timerwheel_advance(&reactor->wheel, time(NULL), evloop_expired, reactor);
+    while (reactor->closed) {
+      struct evloop_connection *connection = reactor->closed;
+      reactor->closed = connection->next_closed;
+      free(connection);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Starts NUM_REACTORS reactor threads listening on PORT, as LISTEN_OPTIONS
+ * say, and serves on the calling thread as the last of them. Connections
+ * idle for KEEP_ALIVE_TIMEOUT seconds after a request, or taking more than
+ * HEADER_TIMEOUT seconds over a request head, are closed. Never returns.
+ */
+void evloop_serve_forever(int port, int num_reactors,
+    const struct listener_options *listen_options, int keep_alive_timeout,
+    int header_timeout, void (*request_handler)(int)) {
+  if (num_reactors < 1) num_reactors = 1;
+
+  struct evloop_reactor *reactors = calloc(num_reactors, sizeof(*reactors));
+  int *listen_fds = calloc(num_reactors, sizeof(*listen_fds));
+  if (!reactors || !listen_fds) {
+    fprintf(stderr, "Failed to allocate reactors\n");
+    exit(ENOMEM);
+  }
+
+  struct listener_options options = *listen_options;
+  options.nonblocking = 1;
+  listener_open_group(port, num_reactors, &options, listen_fds);
+
+  for (int i = 0; i < num_reactors; i++) {
+    struct evloop_reactor *reactor = &reactors[i];
+    reactor->index = i;
+    reactor->pin_cpu = options.pin_cpus;
+    reactor->keep_alive_timeout = keep_alive_timeout;
+    reactor->header_timeout = header_timeout;
+    timerwheel_init(&reactor->wheel, time(NULL));
+    reactor->request_handler = request_handler;
+    reactor->listen_fd = listen_fds[i];
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd == -1) {
+      perror("Failed to create epoll set");
+      exit(errno);
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &listen_marker };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd,
+          &event) == -1) {
+      perror("Failed to watch listening socket");
+      exit(errno);
+    }
+  }
+
+  printf("Listening on port %d with %d reactor thread(s)...\n", port,
+      num_reactors);
+
+  for (int i = 0; i < num_reactors - 1; i++) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, evloop_reactor_main, &reactors[i]);
+    if (err != 0) {
+      fprintf(stderr, "Failed to create reactor thread: %s\n", strerror(err));
+      exit(err);
+    }
+    pthread_detach(thread);
+  }
+  evloop_reactor_main(&reactors[num_reactors - 1]);
+}
@@ -0,0 +1,49 @@
+#ifndef __EVLOOP__
+#define __EVLOOP__
+
+/*
+ * EVLOOP is the event-driven alternative to the thread-per-request pool.
+ * Each reactor thread owns an epoll set and its own SO_REUSEPORT listening
+ * socket on the same port, so the kernel spreads new connections across
+ * reactors without a shared accept lock. Client sockets are non-blocking;
+ * request bytes are accumulated as they arrive and the request handler only
+ * runs once a complete request head is buffered. Keep-alive connections stay
+ * in the epoll set between requests, and pipelined requests are served back
+ * to back from the buffer. Nothing blocks a reactor: response output the
+ * socket can't take yet is queued on its connection and sent as the socket
+ * drains, with the connection's next request waiting until it is all out.
+ *
+ * With pin_cpus set in the listener options each reactor is pinned to its
+ * own core, and with steer_by_cpu each connection goes to the reactor on
+ * the core that received it.
+ *
+ * Deadlines live on a per-reactor timer wheel: a connection has to finish
+ * each request head, along with skipping whatever body the request before
+ * it left unread, within the header timeout of starting it, so trickled
+ * bytes can't keep it open, and to start a new request within the
+ * keep-alive timeout of the last. A client taking a response has the header
+ * timeout to take more of it.
+ */
+
+#include "listener.h"
+
+void evloop_serve_forever(int port, int num_reactors,
+    const struct listener_options *listen_options, int keep_alive_timeout,
+    int header_timeout, void (*request_handler)(int));
+
+/*
+ * Lets a request handler wait without holding up its reactor, as the proxy
+ * waits on its upstream. evloop_await sets the request on FD aside until FD
+ * is ready for EVENTS (POLLIN, POLLOUT), WATCH_FD (unless -1) is ready for
+ * WATCH_EVENTS, or TIMEOUT seconds pass, and returns 0; the handler returns
+ * straight away, and RESUME is later called on the reactor with CONTEXT,
+ * and READY 0 if the time ran out or the client hung up. POLLOUT on FD
+ * waits for the response output queued so far to be sent. The request ends
+ * once the handler, or a RESUME, returns without awaiting again. Off a
+ * reactor evloop_await returns -1, and the caller has to wait itself.
+ */
+int evloop_await(int fd, short events, int watch_fd, short watch_events,
+    int timeout, void (*resume)(int fd, void *context, int ready),
+    void *context);
+
+#endif
@@ -0,0 +1,397 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+#include "mime.h"
+#include "stats.h"
+
+#define FDCACHE_WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+    IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | \
+    IN_MOVE_SELF)
+
+static pthread_mutex_t fdcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fdcache_entry **buckets;
+static unsigned int bucket_mask;
+static int capacity, count;
+static struct fdcache_entry *lru_head, *lru_tail; // Head is most recent.
+static unsigned long generation;  // Bumped by every inotify event.
+
+/* Directory watched by each inotify descriptor, indexed by wd. */
+static int inotify_fd = -1;
+static char **watched_directories;
+static int watched_directories_size;
+static char root[PATH_MAX];       // Highest directory watched.
+static size_t root_length;
+static void (*change_hook)(const char *path, int tree);
+static void (*close_hook)(int fd);
+
+void fdcache_set_change_hook(void (*hook)(const char *path, int tree)) {
+  change_hook = hook;
+}
+
+void fdcache_set_close_hook(void (*hook)(int fd)) {
+  close_hook = hook;
+}
+
+static unsigned int fdcache_hash(const char *path) {
+  unsigned int hash = 2166136261u; // FNV-1a
+  while (*path) {
+    hash ^= (unsigned char) *path++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void lru_unlink(struct fdcache_entry *entry) {
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else lru_head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else lru_tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct fdcache_entry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = lru_head;
+  if (lru_head) lru_head->lru_prev = entry;
+  lru_head = entry;
+  if (!lru_tail) lru_tail = entry;
+}
+
+static void entry_destroy(struct fdcache_entry *entry) {
+  if (entry->fd >= 0) {
+    if (close_hook) close_hook(entry->fd);
+    close(entry->fd);
+  }
+  free(entry->path);
+  free(entry);
+}
+
+/* Removes ENTRY from the table. Called with fdcache_lock held. */
+static void entry_remove(struct fdcache_entry *entry) {
+  struct fdcache_entry **link = &buckets[fdcache_hash(entry->path) & bucket_mask];
+  while (*link != entry) link = &(*link)->next;
+  *link = entry->next;
+  lru_unlink(entry);
+  entry->cached = 0;
+  count--;
+  if (entry->refcount == 0) entry_destroy(entry);
+}
+
+static struct fdcache_entry *entry_lookup(const char *path) {
+  struct fdcache_entry *entry = buckets[fdcache_hash(path) & bucket_mask];
+  while (entry && strcmp(entry->path, path) != 0) entry = entry->next;
+  return entry;
+}
+
+/* Returns whether PATH is DIRECTORY or lies under it. */
+static int path_in_tree(const char *path, const char *directory) {
+  size_t length = strlen(directory);
+  return strncmp(path, directory, length) == 0 &&
+    (path[length] == '\0' || path[length] == '/' ||
+     (length > 0 && directory[length - 1] == '/'));
+}
+
+/* Watches DIRECTORY, returning -1 if it can't. Called with fdcache_lock
+ * held. */
+static int watch_directory(const char *directory) {
+  int wd = inotify_add_watch(inotify_fd, directory, FDCACHE_WATCH_MASK);
+  if (wd < 0) return -1;
+  if (wd >= watched_directories_size) {
+    int size = watched_directories_size ? watched_directories_size : 64;
+    while (size <= wd) size *= 2;
+    char **grown = realloc(watched_directories, size * sizeof(char *));
+    if (!grown) {
+      inotify_rm_watch(inotify_fd, wd);
+      return -1;
+    }
+    memset(grown + watched_directories_size, 0,
+        (size - watched_directories_size) * sizeof(char *));
+    watched_directories = grown;
+    watched_directories_size = size;
+  }
+  if (!watched_directories[wd] &&
+      !(watched_directories[wd] = strdup(directory))) {
+    inotify_rm_watch(inotify_fd, wd);
+    return -1;
+  }
+  return 0;
+}
+
+/* Watches PATH's parent directory and those above it up to the root, so
+ * renaming any of them is seen. Returns -1 if the parent itself can't be
+ * watched. Called with fdcache_lock held. */
+static int watch_parent(const char *path) {
+  if (inotify_fd < 0) return -1;
+
+  char directory[PATH_MAX];
+  if (strlen(path) >= sizeof(directory)) return -1;
+  strcpy(directory, path);
+  int in_root = root_length > 0 && path_in_tree(path, root);
+  int result = 1;
+  while (1) {
+    char *slash = strrchr(directory, '/');
+    if (!slash) {
+      strcpy(directory, ".");
+    } else if (slash == directory) {
+      strcpy(directory, "/");
+    } else {
+      *slash = '\0';
+    }
+    int watched = watch_directory(directory);
+    if (result > 0) result = watched;
+    if (!in_root || strlen(directory) <= root_length || !slash ||
+        slash == directory)
+      return result;
+  }
+}
+
+/* Adds ENTRY to the table, evicting the least recently used entry if it's
+ * full. Called with fdcache_lock held. */
+static void entry_insert(struct fdcache_entry *entry) {
+  if (count >= capacity) entry_remove(lru_tail);
+
+  unsigned int bucket = fdcache_hash(entry->path) & bucket_mask;
+  entry->next = buckets[bucket];
+  buckets[bucket] = entry;
+  lru_push_front(entry);
+  entry->cached = 1;
+  count++;
+}
+
+/* Drops every entry at or under DIRECTORY, and the watches on it and the
+ * directories below it, which follow their inodes wherever they went.
+ * Called with fdcache_lock held. */
+static void drop_tree(const char *directory) {
+  generation++;
+  struct fdcache_entry *entry = lru_head;
+  while (entry) {
+    struct fdcache_entry *next = entry->lru_next;
+    if (path_in_tree(entry->path, directory)) entry_remove(entry);
+    entry = next;
+  }
+  for (int wd = 0; wd < watched_directories_size; wd++) {
+    if (watched_directories[wd] &&
+        path_in_tree(watched_directories[wd], directory)) {
+      inotify_rm_watch(inotify_fd, wd);
+      free(watched_directories[wd]);
+      watched_directories[wd] = NULL;
+    }
+  }
+}
+
+/* Drains inotify events forever, dropping entries for files that changed. */
+static void *fdcache_watcher(void *arg) {
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char path[PATH_MAX];
+
+  while (1) {
+    ssize_t size = read(inotify_fd, events, sizeof(events));
+    if (size < 0) {
+      if (errno == EINTR) continue;
+      perror("Failed to read inotify events");
+      return NULL;
+    }
+
+    for (char *cursor = events; cursor < events + size;
+        cursor += sizeof(struct inotify_event) + ((struct inotify_event *) cursor)->len) {
+      struct inotify_event *event = (struct inotify_event *) cursor;
+      int changed = 0, tree = 0;
+      pthread_mutex_lock(&fdcache_lock);
+      char *directory = event->wd < watched_directories_size ?
+        watched_directories[event->wd] : NULL;
+      if (event->mask & IN_IGNORED) {
+        free(directory);
+        if (event->wd < watched_directories_size)
+          watched_directories[event->wd] = NULL;
+      } else if (directory && (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF))) {
+        /* The directory itself was renamed or deleted. */
+        snprintf(path, sizeof(path), "%s", directory);
+        drop_tree(path);
+        changed = tree = 1;
+      } else if (directory && event->len > 0) {
+        generation++;
+        snprintf(path, sizeof(path), "%s%s%s", directory,
+            strcmp(directory, "/") == 0 ? "" : "/", event->name);
+        if (event->mask & IN_ISDIR) {
+          /* A subdirectory came, went or was replaced: nothing cached
+           * under its name still holds. */
+          drop_tree(path);
+          tree = 1;
+        } else {
+          struct fdcache_entry *entry = entry_lookup(path);
+          if (entry) entry_remove(entry);
+        }
+        changed = 1;
+      }
+      pthread_mutex_unlock(&fdcache_lock);
+      if (changed && change_hook) change_hook(path, tree);
+    }
+  }
+  return NULL;
+}
+
+/* Initializes a cache holding at most MAX_ENTRIES open files from under
+ * ROOT (NULL watches just each file's parent). */
+void fdcache_init(int max_entries, const char *root_directory) {
+  unsigned int size = 16;
+  while (size < (unsigned int) max_entries * 2) size <<= 1;
+  buckets = calloc(size, sizeof(*buckets));
+  if (!buckets) {
+    fprintf(stderr, "Failed to allocate file cache\n");
+    exit(ENOMEM);
+  }
+  bucket_mask = size - 1;
+  if (root_directory && strlen(root_directory) < sizeof(root)) {
+    strcpy(root, root_directory);
+    root_length = strlen(root);
+    while (root_length > 1 && root[root_length - 1] == '/')
+      root[--root_length] = '\0';
+  }
+
+  inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    perror("inotify unavailable, file cache disabled");
+    return;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, fdcache_watcher, NULL) != 0) {
+    fprintf(stderr, "Failed to start file cache watcher, cache disabled\n");
+    close(inotify_fd);
+    inotify_fd = -1;
+    return;
+  }
+  pthread_detach(thread);
+  capacity = max_entries;
+}
+
+/* Remembers that PATH doesn't exist, unless something changed since
+ * START_GENERATION. */
+static void cache_missing(const char *path, unsigned long start_generation) {
+  struct fdcache_entry *entry = calloc(1, sizeof(*entry));
+  if (!entry || !(entry->path = strdup(path))) {
+    free(entry);
+    return;
+  }
+  entry->fd = -1;
+  pthread_mutex_lock(&fdcache_lock);
+  if (generation != start_generation || entry_lookup(path)) {
+    pthread_mutex_unlock(&fdcache_lock);
+    entry_destroy(entry);
+    return;
+  }
+  entry_insert(entry);
+  pthread_mutex_unlock(&fdcache_lock);
+}
+
+/*
+ * Returns a referenced entry for PATH, opening and caching it on a miss, or
+ * NULL with errno set if it can't be opened or is neither a regular file
+ * nor a directory. Release it with fdcache_release.
+ */
+struct fdcache_entry *fdcache_acquire(const char *path) {
+  pthread_mutex_lock(&fdcache_lock);
+  struct fdcache_entry *entry = capacity > 0 ? entry_lookup(path) : NULL;
+  if (entry) {
+    lru_unlink(entry);
+    lru_push_front(entry);
+    int missing = entry->fd < 0;
+    if (!missing) entry->refcount++;
+    pthread_mutex_unlock(&fdcache_lock);
+    STATS_COUNT(STATS_FDCACHE_HITS);
+    if (!missing) return entry;
+    errno = ENOENT;
+    return NULL;
+  }
+  /* Watch before opening, so any change after the open shows up as a new
+   * generation by the time the entry would be cached. */
+  int parent_watched = watch_parent(path) == 0;
+  unsigned long start_generation = generation;
+  pthread_mutex_unlock(&fdcache_lock);
+  STATS_COUNT(STATS_FDCACHE_MISSES);
+
+  /* O_NONBLOCK so a FIFO dropped in the tree can't hang the open. */
+  int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd < 0) {
+    /* Only a watched parent reports the file's creation. */
+    if (errno == ENOENT && parent_watched && capacity > 0) {
+      cache_missing(path, start_generation);
+      errno = ENOENT;
+    }
+    return NULL;
+  }
+
+  entry = calloc(1, sizeof(*entry));
+  if (!entry || fstat(fd, &entry->stat) < 0 || !(entry->path = strdup(path))) {
+    int saved_errno = errno;
+    close(fd);
+    free(entry);
+    errno = saved_errno;
+    return NULL;
+  }
+  entry->fd = fd;
+  entry->refcount = 1;
+  if (!S_ISREG(entry->stat.st_mode) && !S_ISDIR(entry->stat.st_mode)) {
+    entry_destroy(entry);
+    errno = EACCES;
+    return NULL;
+  }
+  if (capacity <= 0) return entry;
+
+  pthread_mutex_lock(&fdcache_lock);
+  struct fdcache_entry *existing = entry_lookup(path);
+  if (existing && existing->fd < 0) {
+    /* Cached as missing by a thread that looked before it was created. */
+    entry_remove(existing);
+    existing = NULL;
+  }
+  if (existing) {
+    /* Another thread cached it first; use theirs. */
+    existing->refcount++;
+    pthread_mutex_unlock(&fdcache_lock);
+    entry_destroy(entry);
+    return existing;
+  }
+  if (generation != start_generation) {
+    /* A file changed since the open, maybe this one, and its event has
+     * already been handled; serve ours without caching it. */
+    pthread_mutex_unlock(&fdcache_lock);
+    return entry;
+  }
+  entry_insert(entry);
+  pthread_mutex_unlock(&fdcache_lock);
+  return entry;
+}
+
+void fdcache_release(struct fdcache_entry *entry) {
+  pthread_mutex_lock(&fdcache_lock);
+  int destroy = --entry->refcount == 0 && !entry->cached;
+  pthread_mutex_unlock(&fdcache_lock);
+  if (destroy) entry_destroy(entry);
+}
+
+/* Drops PATH from the cache, if present. */
+void fdcache_invalidate(const char *path) {
+  pthread_mutex_lock(&fdcache_lock);
+  struct fdcache_entry *entry = capacity > 0 ? entry_lookup(path) : NULL;
+  if (entry) entry_remove(entry);
+  pthread_mutex_unlock(&fdcache_lock);
+}
+
+const char *fdcache_content_type(struct fdcache_entry *entry) {
+  const char *content_type = __atomic_load_n(&entry->content_type,
+      __ATOMIC_ACQUIRE);
+  if (!content_type) {
+    content_type = mime_lookup(entry->path);
+    __atomic_store_n(&entry->content_type, content_type, __ATOMIC_RELEASE);
+  }
+  return content_type;
+}
@@ -0,0 +1,54 @@
+#ifndef __FDCACHE__
+#define __FDCACHE__
+
+#include <sys/stat.h>
+
+/*
+ * FDCACHE keeps a bounded LRU table of open file descriptors and their stat
+ * results, keyed by path, so serving a hot file costs no open()/fstat().
+ * Entries are watched through inotify on every directory from the root
+ * given to fdcache_init down to their parent, and dropped as soon as the
+ * file is written, replaced, renamed or deleted, or a directory above it
+ * is renamed, replaced or deleted.
+ *
+ * Other caches built on top of it can register a change hook, which the
+ * watcher calls with the path of every file that changes under a watched
+ * directory, or with TREE set and the path of a directory whose whole
+ * subtree is to be dropped.
+ *
+ * Entries are reference counted: an entry evicted or invalidated while a
+ * worker is still sending from it keeps its fd open until released.
+ *
+ * A path that doesn't exist is cached too, as an entry with no fd, once
+ * its parent directory is watched: probing for it again (a .br or .gz
+ * sibling, say) costs no failed open() until something is created there.
+ */
+
+struct fdcache_entry {
+  char *path;
+  int fd;                      // -1 if the path doesn't exist.
+  struct stat stat;
+  const char *content_type;    // Memoized by fdcache_content_type.
+  int refcount;
+  int cached;                  // Still reachable from the table.
+  struct fdcache_entry *next;  // Hash chain.
+  struct fdcache_entry *lru_prev, *lru_next;
+};
+
+void fdcache_init(int capacity, const char *root);
+struct fdcache_entry *fdcache_acquire(const char *path);
+void fdcache_release(struct fdcache_entry *entry);
+void fdcache_invalidate(const char *path);
+void fdcache_set_change_hook(void (*hook)(const char *path, int tree));
+
+/*
+ * Sets a hook called with an entry's descriptor just before the fd cache
+ * closes it, from whichever thread drops the entry's last reference, so a
+ * cache of what a descriptor number stands for can drop it.
+ */
+void fdcache_set_close_hook(void (*hook)(int fd));
+
+/* Returns the MIME type of ENTRY's path, looked up once per entry. */
+const char *fdcache_content_type(struct fdcache_entry *entry);
+
+#endif
@@ -0,0 +1,328 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hotcache.h"
+#include "libhttp.h"
+
+#define HOTCACHE_QUEUE_IN 0     // A1in: FIFO of first-time entries.
+#define HOTCACHE_QUEUE_MAIN 1   // Am: LRU of entries seen again.
+#define HOTCACHE_GHOSTS 1024    // A1out: hashes of paths evicted from A1in.
+#define HOTCACHE_GHOST_SLOTS (2 * HOTCACHE_GHOSTS)
+
+struct hotcache_queue {
+  struct hotcache_entry *head, *tail; // Head is newest.
+  size_t bytes;
+};
+
+static pthread_mutex_t hotcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hotcache_entry **buckets;
+static unsigned int bucket_mask;
+static size_t capacity, in_capacity, max_entry_size;
+static struct hotcache_queue queues[2];
+static unsigned int ghosts[HOTCACHE_GHOSTS];
+static int ghost_next;
+/* Open-addressed set of the hashes in ghosts, with how often each occurs,
+ * so a lookup doesn't scan the whole ring. */
+static struct {
+  unsigned int hash;
+  int count;
+} ghost_set[HOTCACHE_GHOST_SLOTS];
+static unsigned long generation;  // Bumped by every invalidation.
+static struct hotcache_stats stats;
+
+static unsigned int hotcache_hash(const char *path) {
+  unsigned int hash = 2166136261u; // FNV-1a
+  while (*path) {
+    hash ^= (unsigned char) *path++;
+    hash *= 16777619u;
+  }
+  return hash | 1; // Zero marks an empty ghost slot.
+}
+
+static size_t entry_cost(struct hotcache_entry *entry) {
+  return entry->head_size + entry->body_size + sizeof(*entry);
+}
+
+static void queue_unlink(struct hotcache_entry *entry) {
+  struct hotcache_queue *queue = &queues[entry->queue];
+  if (entry->prev_in_queue) entry->prev_in_queue->next_in_queue = entry->next_in_queue;
+  else queue->head = entry->next_in_queue;
+  if (entry->next_in_queue) entry->next_in_queue->prev_in_queue = entry->prev_in_queue;
+  else queue->tail = entry->prev_in_queue;
+  queue->bytes -= entry_cost(entry);
+}
+
+static void queue_push_front(int which, struct hotcache_entry *entry) {
+  struct hotcache_queue *queue = &queues[which];
+  entry->queue = which;
+  entry->prev_in_queue = NULL;
+  entry->next_in_queue = queue->head;
+  if (queue->head) queue->head->prev_in_queue = entry;
+  queue->head = entry;
+  if (!queue->tail) queue->tail = entry;
+  queue->bytes += entry_cost(entry);
+}
+
+static void entry_destroy(struct hotcache_entry *entry) {
+  free(entry->path);
+  free(entry->head);
+  free(entry->body);
+  free(entry);
+}
+
+static struct hotcache_entry *entry_lookup(const char *path) {
+  struct hotcache_entry *entry = buckets[hotcache_hash(path) & bucket_mask];
+  while (entry && strcmp(entry->path, path) != 0) entry = entry->next;
+  return entry;
+}
+
+/* Removes ENTRY from the table. Called with hotcache_lock held. */
+static void entry_remove(struct hotcache_entry *entry) {
+  struct hotcache_entry **link = &buckets[hotcache_hash(entry->path) & bucket_mask];
+  while (*link != entry) link = &(*link)->next;
+  *link = entry->next;
+  queue_unlink(entry);
+  entry->cached = 0;
+  stats.bytes -= entry_cost(entry);
+  if (entry->refcount == 0) entry_destroy(entry);
+}
+
+/* Returns HASH's slot in ghost_set, or the empty slot it would take. */
+static unsigned int ghost_slot(unsigned int hash) {
+  unsigned int slot = hash & (HOTCACHE_GHOST_SLOTS - 1);
+  while (ghost_set[slot].hash && ghost_set[slot].hash != hash)
+    slot = (slot + 1) & (HOTCACHE_GHOST_SLOTS - 1);
+  return slot;
+}
+
+static int ghost_contains(unsigned int hash) {
+  return ghost_set[ghost_slot(hash)].hash == hash;
+}
+
+/* Drops one occurrence of HASH from ghost_set, shifting back the entries
+ * that probed past its slot once the last one goes. */
+static void ghost_forget(unsigned int hash) {
+  unsigned int hole = ghost_slot(hash);
+  if (--ghost_set[hole].count > 0) return;
+  ghost_set[hole].hash = 0;
+  for (unsigned int slot = (hole + 1) & (HOTCACHE_GHOST_SLOTS - 1);
+      ghost_set[slot].hash; slot = (slot + 1) & (HOTCACHE_GHOST_SLOTS - 1)) {
+    unsigned int home = ghost_set[slot].hash & (HOTCACHE_GHOST_SLOTS - 1);
+    /* Leave it if its home lies cyclically in (hole, slot]. */
+    if (hole <= slot ? hole < home && home <= slot : hole < home || home <= slot)
+      continue;
+    ghost_set[hole] = ghost_set[slot];
+    ghost_set[slot].hash = 0;
+    ghost_set[slot].count = 0;
+    hole = slot;
+  }
+}
+
+/* Remembers HASH in the ghost ring, forgetting the oldest one. */
+static void ghost_remember(unsigned int hash) {
+  if (ghosts[ghost_next]) ghost_forget(ghosts[ghost_next]);
+  ghosts[ghost_next] = hash;
+  ghost_next = (ghost_next + 1) % HOTCACHE_GHOSTS;
+  unsigned int slot = ghost_slot(hash);
+  ghost_set[slot].hash = hash;
+  ghost_set[slot].count++;
+}
+
+/* Evicts until NEEDED more bytes fit. Called with hotcache_lock held. */
+static void make_room(size_t needed) {
+  while (stats.bytes + needed > capacity) {
+    struct hotcache_entry *victim;
+    if (queues[HOTCACHE_QUEUE_IN].tail &&
+        (queues[HOTCACHE_QUEUE_IN].bytes > in_capacity ||
+         !queues[HOTCACHE_QUEUE_MAIN].tail)) {
+      victim = queues[HOTCACHE_QUEUE_IN].tail;
+      ghost_remember(hotcache_hash(victim->path));
+    } else if (queues[HOTCACHE_QUEUE_MAIN].tail) {
+      victim = queues[HOTCACHE_QUEUE_MAIN].tail;
+    } else {
+      return;
+    }
+    entry_remove(victim);
+    stats.evictions++;
+  }
+}
+
+/*
+ * Initializes a cache holding up to CAPACITY_BYTES of file data and heads.
+ * A quarter goes to the first-time FIFO, and no single file may take more
+ * than an eighth, so a few big files can't evict everything else.
+ */
+void hotcache_init(size_t capacity_bytes) {
+  capacity = capacity_bytes;
+  in_capacity = capacity / 4;
+  max_entry_size = capacity / 8;
+
+  unsigned int size = 64;
+  while (size < capacity / 4096 && size < (1u << 20)) size <<= 1;
+  buckets = calloc(size, sizeof(*buckets));
+  if (!buckets) {
+    fprintf(stderr, "Failed to allocate content cache\n");
+    exit(ENOMEM);
+  }
+  bucket_mask = size - 1;
+}
+
+int hotcache_enabled() {
+  return capacity > 0;
+}
+
+/* Returns a referenced entry for PATH, or NULL on a miss. */
+struct hotcache_entry *hotcache_acquire(const char *path) {
+  if (capacity == 0) return NULL;
+
+  pthread_mutex_lock(&hotcache_lock);
+  struct hotcache_entry *entry = entry_lookup(path);
+  if (entry) {
+    entry->refcount++;
+    if (entry->queue == HOTCACHE_QUEUE_MAIN) {
+      queue_unlink(entry);
+      queue_push_front(HOTCACHE_QUEUE_MAIN, entry);
+    }
+    stats.hits++;
+  } else {
+    stats.misses++;
+  }
+  pthread_mutex_unlock(&hotcache_lock);
+  return entry;
+}
+
+/* Returns the invalidation count, to be taken before opening a file that
+ * may be passed to hotcache_insert. */
+unsigned long hotcache_generation() {
+  pthread_mutex_lock(&hotcache_lock);
+  unsigned long current = generation;
+  pthread_mutex_unlock(&hotcache_lock);
+  return current;
+}
+
+/*
+ * Reads FILE_FD, whose stat is STAT, into a new referenced entry for PATH
+ * and caches it. Returns NULL if the file is too large to cache or can't be
+ * read; the caller then serves it from disk. The entry is still returned,
+ * just not cached, if any path was invalidated after START_GENERATION, as
+ * returned by hotcache_generation before FILE_FD was opened or looked up:
+ * PATH may have changed since its stat was taken. VARY adds a
+ * Vary: Accept-Encoding header to the head.
+ */
+struct hotcache_entry *hotcache_insert(const char *path, int file_fd,
+    const struct stat *stat, const char *content_type, int vary,
+    unsigned long start_generation) {
+  if (capacity == 0 || stat->st_size < 0 || (size_t) stat->st_size > max_entry_size)
+    return NULL;
+
+  struct hotcache_entry *entry = calloc(1, sizeof(*entry));
+  if (!entry) return NULL;
+  entry->body_size = stat->st_size;
+  entry->body = malloc(entry->body_size ? entry->body_size : 1);
+  entry->path = strdup(path);
+  if (!entry->body || !entry->path) {
+    entry_destroy(entry);
+    return NULL;
+  }
+
+  size_t offset = 0;
+  while (offset < entry->body_size) {
+    ssize_t bytes_read = pread(file_fd, entry->body + offset,
+        entry->body_size - offset, offset);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) {
+      entry_destroy(entry);
+      return NULL;
+    }
+    offset += bytes_read;
+  }
+
+  char last_modified[64];
+  http_format_etag(entry->etag, sizeof(entry->etag), stat);
+  entry->mtime = stat->st_mtime;
+  entry->content_type = content_type;
+  http_format_date(last_modified, sizeof(last_modified), entry->mtime);
+  int head_size = snprintf(NULL, 0, "HTTP/1.1 200 OK\r\n"
+      "Content-Type: %s\r\nContent-Length: %zu\r\nETag: %s\r\n"
+      "Last-Modified: %s\r\nAccept-Ranges: bytes\r\n%s",
+      content_type, entry->body_size, entry->etag, last_modified,
+      vary ? "Vary: Accept-Encoding\r\n" : "");
+  entry->head = malloc(head_size + 1);
+  if (!entry->head) {
+    entry_destroy(entry);
+    return NULL;
+  }
+  snprintf(entry->head, head_size + 1, "HTTP/1.1 200 OK\r\n"
+      "Content-Type: %s\r\nContent-Length: %zu\r\nETag: %s\r\n"
+      "Last-Modified: %s\r\nAccept-Ranges: bytes\r\n%s",
+      content_type, entry->body_size, entry->etag, last_modified,
+      vary ? "Vary: Accept-Encoding\r\n" : "");
+  entry->head_size = head_size;
+  entry->refcount = 1;
+
+  pthread_mutex_lock(&hotcache_lock);
+  struct hotcache_entry *existing = entry_lookup(path);
+  if (existing || generation != start_generation) {
+    /* Someone cached it first or a file changed since it was looked up;
+     * serve ours without caching it. */
+    pthread_mutex_unlock(&hotcache_lock);
+    return entry;
+  }
+
+  unsigned int hash = hotcache_hash(path);
+  int queue = ghost_contains(hash) ? HOTCACHE_QUEUE_MAIN : HOTCACHE_QUEUE_IN;
+  make_room(entry_cost(entry));
+  entry->next = buckets[hash & bucket_mask];
+  buckets[hash & bucket_mask] = entry;
+  queue_push_front(queue, entry);
+  entry->cached = 1;
+  stats.bytes += entry_cost(entry);
+  stats.insertions++;
+  pthread_mutex_unlock(&hotcache_lock);
+  return entry;
+}
+
+void hotcache_release(struct hotcache_entry *entry) {
+  pthread_mutex_lock(&hotcache_lock);
+  int destroy = --entry->refcount == 0 && !entry->cached;
+  pthread_mutex_unlock(&hotcache_lock);
+  if (destroy) entry_destroy(entry);
+}
+
+/* Drops PATH from the cache and, with TREE, every path under it. Suitable
+ * as an fdcache change hook. */
+void hotcache_invalidate(const char *path, int tree) {
+  if (capacity == 0) return;
+
+  pthread_mutex_lock(&hotcache_lock);
+  generation++;
+  struct hotcache_entry *entry = entry_lookup(path);
+  if (entry) {
+    entry_remove(entry);
+    stats.invalidations++;
+  }
+  size_t length = strlen(path);
+  for (int which = 0; tree && which < 2; which++) {
+    entry = queues[which].head;
+    while (entry) {
+      struct hotcache_entry *next = entry->next_in_queue;
+      if (strncmp(entry->path, path, length) == 0 &&
+          (entry->path[length] == '/' || (length > 0 && path[length - 1] == '/'))) {
+        entry_remove(entry);
+        stats.invalidations++;
+      }
+      entry = next;
+    }
+  }
+  pthread_mutex_unlock(&hotcache_lock);
+}
+
+void hotcache_get_stats(struct hotcache_stats *out) {
+  pthread_mutex_lock(&hotcache_lock);
+  *out = stats;
+  pthread_mutex_unlock(&hotcache_lock);
+}
@@ -0,0 +1,58 @@
+#ifndef __HOTCACHE__
+#define __HOTCACHE__
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * HOTCACHE keeps the bytes of small, frequently requested files in memory
+ * next to a pre-rendered response head (status line, Content-Type,
+ * Content-Length, ETag, Last-Modified, Accept-Ranges and Vary for types
+ * that may be sent compressed), so a hit is answered with a single
+ * writev(). The validators are kept alongside for conditional and range
+ * requests.
+ *
+ * Admission and eviction follow 2Q, weighted by entry size: new files enter
+ * a small FIFO, and only files requested again after falling out of it (as
+ * remembered by a ghost list of recently evicted paths) are promoted into
+ * the main LRU. One-off requests for large files can't flush the hot set.
+ */
+
+struct hotcache_entry {
+  char *path;
+  char *head;          // Pre-rendered status line and headers, unterminated.
+  size_t head_size;
+  char *body;
+  size_t body_size;
+  const char *content_type;
+  char etag[64];
+  time_t mtime;
+  int refcount;
+  int cached;          // Still reachable from the table.
+  int queue;           // Which 2Q queue holds it.
+  struct hotcache_entry *next;  // Hash chain.
+  struct hotcache_entry *prev_in_queue, *next_in_queue;
+};
+
+struct hotcache_stats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long insertions;
+  unsigned long evictions;
+  unsigned long invalidations;
+  size_t bytes;
+};
+
+void hotcache_init(size_t capacity_bytes);
+int hotcache_enabled();
+struct hotcache_entry *hotcache_acquire(const char *path);
+unsigned long hotcache_generation();
+struct hotcache_entry *hotcache_insert(const char *path, int file_fd,
+    const struct stat *stat, const char *content_type, int vary,
+    unsigned long start_generation);
+void hotcache_release(struct hotcache_entry *entry);
+void hotcache_invalidate(const char *path, int tree);
+void hotcache_get_stats(struct hotcache_stats *stats);
+
+#endif
@@ -0,0 +1,997 @@
+/*
+ * Load generator and latency benchmark for httpserver.
+ *
+ * Each client thread drives its share of the connections from its own
+ * epoll loop and records response latencies in HDR-style histograms
+ * (log-linear buckets, three significant digits), one per request kind.
+ * Requests are drawn from a weighted mix of a small file, a large file, a
+ * directory listing and a missing path. Responses are framed by
+ * Content-Length, chunked encoding or the close of the connection. A
+ * connection stops pipelining at a response carrying Connection: close;
+ * one the server closes or resets is reopened and its unanswered requests
+ * are sent again, as a client retries idempotent requests. That only
+ * counts as a connection error if the server never answered on it, since
+ * a server ending keep-alive (after --max-requests, say) resets the
+ * requests pipelined past its last response.
+ *
+ * By default the load is closed-loop: each connection keeps --pipeline
+ * requests outstanding and sends the next one as soon as a response
+ * arrives. With --rate the load is open-loop: requests are due at a fixed
+ * rate whether or not the server keeps up, and latency is measured from
+ * when each was due rather than when it was sent, so a stalled server is
+ * charged for the requests it held back (coordinated omission).
+ *
+ * --stalled N first opens N connections that pipeline requests for
+ * /large.bin and never read a byte of the responses, as a client that
+ * stops reading would. The server fills their socket buffers and has to
+ * give up on them (--header-timeout bounds the blocking engines' writes);
+ * a worker they pin shows up as latency or unfinished requests in the run.
+ *
+ * The requested paths are /small.txt, /large.bin, /dir/ and /missing.
+ * --serve files starts ./httpserver on a scratch copy of that tree;
+ * --serve proxy also starts a stand-in upstream serving the same paths
+ * from memory and points ./httpserver --proxy at it. --upstream runs just
+ * the stand-in, and --tree writes the tree, for driving a server by hand.
+ *
+ * Usage: ./httpbench [--port 8000] [--threads 1] [--connections 16]
+ *                    [--duration 5] [--pipeline 1] [--no-keep-alive]
+ *                    [--rate N] [--mix small=N,large=N,dir=N,missing=N]
+ *                    [--stalled N]
+ *                    [--serve files|proxy] [-- httpserver options]
+ *        ./httpbench --upstream PORT
+ *        ./httpbench --tree DIRECTORY
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_MAX_CONNECTIONS 10000
+#define BENCH_MAX_STALLED 64
+#define BENCH_MAX_PIPELINE 64
+#define BENCH_MAX_ARGS 32
+#define BENCH_INPUT_SIZE (16 * 1024)
+#define BENCH_REQUEST_MAX 128
+
+#define SMALL_SIZE 512
+#define LARGE_SIZE (1024 * 1024)
+#define DIR_ENTRIES 64
+
+/*
+ * Histogram values are microseconds. Values below 2^HDR_SUB_BITS get a
+ * bucket each; above, each power of two is split into 2^(HDR_SUB_BITS - 1)
+ * buckets, which keeps every bucket within 0.1% of the values it holds.
+ */
+#define HDR_SUB_BITS 11
+#define HDR_HALF (1 << (HDR_SUB_BITS - 1))
+#define HDR_MAX_BITS 36  // About 19 hours.
+#define HDR_BUCKETS ((HDR_MAX_BITS - HDR_SUB_BITS + 2) * HDR_HALF)
+
+enum kind { KIND_SMALL, KIND_LARGE, KIND_DIR, KIND_MISSING, NUM_KINDS };
+
+static const char *kind_names[NUM_KINDS] = { "small", "large", "dir", "missing" };
+static const char *kind_paths[NUM_KINDS] = {
+  "/small.txt", "/large.bin", "/dir/", "/missing"
+};
+
+struct histogram {
+  uint64_t counts[HDR_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+struct pending {
+  uint64_t start;  // When the request was due (open loop) or sent.
+  int kind;
+};
+
+enum response_state {
+  STATE_HEAD, STATE_BODY, STATE_CHUNK_SIZE, STATE_CHUNK_DATA, STATE_CHUNK_END,
+  STATE_TRAILER
+};
+
+struct connection {
+  int fd;
+  int want_write;              // EPOLLOUT registered.
+  char input[BENCH_INPUT_SIZE];
+  size_t input_start, input_end;
+  enum response_state state;
+  uint64_t remaining;          // Body or chunk bytes still to come.
+  int until_close;             // Body runs until the server closes.
+  int close_after;             // Server said Connection: close.
+  int answered;                // Responses on this socket.
+  int status;
+  char output[BENCH_MAX_PIPELINE * BENCH_REQUEST_MAX];
+  size_t output_start, output_end;
+  struct pending inflight[BENCH_MAX_PIPELINE];
+  int inflight_head, inflight_count;
+};
+
+struct client_thread {
+  pthread_t thread;
+  int index;
+  int num_connections;
+  struct connection *connections;
+  double rate;                 // Requests per second; 0 is closed loop.
+  uint64_t random;
+  int epoll_fd;
+  int cursor;                  // Where the next open-loop dispatch looks.
+  struct histogram *histograms[NUM_KINDS];
+  uint64_t statuses[6];        // By status class; [0] counts others.
+  uint64_t errors;
+  uint64_t body_bytes;
+  uint64_t unfinished;
+};
+
+static struct sockaddr_in server_address;
+static int num_threads = 1;
+static int num_connections = 16;
+static double duration = 5;
+static int pipeline = 1;
+static int keep_alive = 1;
+static double rate;
+static int mix[NUM_KINDS] = { 1, 0, 0, 0 };
+static int mix_total = 1;
+static int num_stalled;
+static char requests[NUM_KINDS][BENCH_REQUEST_MAX];
+static size_t request_sizes[NUM_KINDS];
+static uint64_t run_start, run_end;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void hdr_record(struct histogram *histogram, uint64_t value) {
+  if (value >> HDR_MAX_BITS) value = (1ULL << HDR_MAX_BITS) - 1;
+  int index = value;
+  if (value >= (1 << HDR_SUB_BITS)) {
+    int shift = 63 - __builtin_clzll(value) - (HDR_SUB_BITS - 1);
+    index = shift * HDR_HALF + (int) (value >> shift);
+  }
+  histogram->counts[index]++;
+  histogram->total++;
+  if (value > histogram->max) histogram->max = value;
+}
+
+/* The highest value that lands in bucket INDEX. */
+static uint64_t hdr_value(int index) {
+  if (index < (1 << HDR_SUB_BITS)) return index;
+  int shift = index / HDR_HALF - 1;
+  uint64_t sub = index - shift * HDR_HALF;
+  return ((sub + 1) << shift) - 1;
+}
+
+static uint64_t hdr_percentile(const struct histogram *histogram, double percentile) {
+  if (histogram->total == 0) return 0;
+  uint64_t target = (uint64_t) (percentile / 100 * histogram->total + 0.5);
+  if (target < 1) target = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HDR_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= target)
+      return hdr_value(i) < histogram->max ? hdr_value(i) : histogram->max;
+  }
+  return histogram->max;
+}
+
+static void hdr_add(struct histogram *into, const struct histogram *from) {
+  for (int i = 0; i < HDR_BUCKETS; i++) into->counts[i] += from->counts[i];
+  into->total += from->total;
+  if (from->max > into->max) into->max = from->max;
+}
+
+static uint64_t next_random(struct client_thread *thread) {
+  thread->random ^= thread->random << 13;
+  thread->random ^= thread->random >> 7;
+  thread->random ^= thread->random << 17;
+  return thread->random;
+}
+
+static int pick_kind(struct client_thread *thread) {
+  int pick = next_random(thread) % mix_total;
+  for (int kind = 0; kind < NUM_KINDS; kind++) {
+    if (pick < mix[kind]) return kind;
+    pick -= mix[kind];
+  }
+  return KIND_SMALL;
+}
+
+static void watch(struct client_thread *thread, struct connection *connection,
+    int op) {
+  struct epoll_event event = {
+    .events = EPOLLIN | (connection->want_write ? EPOLLOUT : 0),
+    .data.ptr = connection
+  };
+  if (epoll_ctl(thread->epoll_fd, op, connection->fd, &event) < 0) {
+    perror("Failed to watch a connection");
+    exit(errno);
+  }
+}
+
+/* Writes what it can of CONNECTION's queued requests. */
+static int connection_flush(struct client_thread *thread,
+    struct connection *connection) {
+  while (connection->output_start < connection->output_end) {
+    ssize_t bytes = write(connection->fd,
+        connection->output + connection->output_start,
+        connection->output_end - connection->output_start);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes < 0 && errno == EAGAIN) break;
+    if (bytes < 0) return -1;
+    connection->output_start += bytes;
+  }
+  if (connection->output_start == connection->output_end)
+    connection->output_start = connection->output_end = 0;
+  int want_write = connection->output_end > 0;
+  if (want_write != connection->want_write) {
+    connection->want_write = want_write;
+    watch(thread, connection, EPOLL_CTL_MOD);
+  }
+  return 0;
+}
+
+static void queue_request(struct connection *connection, int kind) {
+  if (connection->output_start > 0) {
+    memmove(connection->output, connection->output + connection->output_start,
+        connection->output_end - connection->output_start);
+    connection->output_end -= connection->output_start;
+    connection->output_start = 0;
+  }
+  memcpy(connection->output + connection->output_end, requests[kind],
+      request_sizes[kind]);
+  connection->output_end += request_sizes[kind];
+}
+
+/*
+ * (Re)connects CONNECTION and queues every request still waiting for a
+ * response on it.
+ */
+static void connection_open(struct client_thread *thread,
+    struct connection *connection) {
+  connection->fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (connection->fd < 0 || connect(connection->fd,
+        (struct sockaddr *) &server_address, sizeof(server_address)) < 0) {
+    perror("Failed to connect to the server");
+    exit(errno);
+  }
+  int enabled = 1;
+  setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+  fcntl(connection->fd, F_SETFL, O_NONBLOCK);
+
+  connection->input_start = connection->input_end = 0;
+  connection->state = STATE_HEAD;
+  connection->close_after = 0;
+  connection->answered = 0;
+  connection->output_start = connection->output_end = 0;
+  for (int i = 0; i < connection->inflight_count; i++)
+    queue_request(connection, connection->inflight[
+        (connection->inflight_head + i) % BENCH_MAX_PIPELINE].kind);
+  connection->want_write = 0;
+  watch(thread, connection, EPOLL_CTL_ADD);
+  if (connection_flush(thread, connection) < 0) {
+    perror("Failed to send requests");
+    exit(errno);
+  }
+}
+
+static void connection_reopen(struct client_thread *thread,
+    struct connection *connection) {
+  close(connection->fd);
+  connection_open(thread, connection);
+}
+
+static void send_request(struct client_thread *thread,
+    struct connection *connection, uint64_t start) {
+  int kind = pick_kind(thread);
+  int slot = (connection->inflight_head + connection->inflight_count) %
+    BENCH_MAX_PIPELINE;
+  connection->inflight[slot].start = start;
+  connection->inflight[slot].kind = kind;
+  connection->inflight_count++;
+  queue_request(connection, kind);
+  if (connection_flush(thread, connection) < 0) connection_reopen(thread, connection);
+}
+
+/* Returns the value of header NAME in HEAD, or NULL. */
+static const char *find_header(const char *head, size_t size, const char *name) {
+  size_t name_size = strlen(name);
+  const char *line = memchr(head, '\n', size);
+  while (line && (size_t) (line + 1 - head) < size) {
+    line++;
+    if ((size_t) (head + size - line) > name_size &&
+        strncasecmp(line, name, name_size) == 0 && line[name_size] == ':') {
+      line += name_size + 1;
+      while (*line == ' ') line++;
+      return line;
+    }
+    line = memchr(line, '\n', head + size - line);
+  }
+  return NULL;
+}
+
+static void finish_response(struct client_thread *thread,
+    struct connection *connection) {
+  struct pending *pending = &connection->inflight[connection->inflight_head];
+  uint64_t now = now_ns();
+  if (pending->start >= run_start && now <= run_end) {
+    hdr_record(thread->histograms[pending->kind], (now - pending->start) / 1000);
+    int class = connection->status / 100;
+    thread->statuses[class >= 1 && class <= 5 ? class : 0]++;
+  }
+  connection->inflight_head = (connection->inflight_head + 1) % BENCH_MAX_PIPELINE;
+  connection->inflight_count--;
+  connection->answered++;
+  connection->state = STATE_HEAD;
+}
+
+/*
+ * Whether CONNECTION failing now counts as an error: not once the server
+ * has answered on it, or said it would close, since the server then ended
+ * keep-alive and its unanswered requests are simply sent again.
+ */
+static int connection_failed(struct connection *connection) {
+  return connection->inflight_count > 0 && !connection->close_after &&
+    connection->answered == 0;
+}
+
+/*
+ * Parses the responses in CONNECTION's input. Returns the number finished,
+ * or -1 if the server sent something unparseable.
+ */
+static int parse_responses(struct client_thread *thread,
+    struct connection *connection) {
+  int finished = 0;
+  while (1) {
+    char *data = connection->input + connection->input_start;
+    size_t size = connection->input_end - connection->input_start;
+    char *end;
+    switch (connection->state) {
+      case STATE_HEAD: {
+        if (size == 0) return finished;
+        end = memmem(data, size, "\r\n\r\n", 4);
+        if (!end) return size == sizeof(connection->input) ? -1 : finished;
+        if (connection->inflight_count == 0 || strncmp(data, "HTTP/1.", 7) != 0)
+          return -1;
+        size_t head_size = end + 4 - data;
+        connection->status = atoi(data + 9);
+        const char *value = find_header(data, head_size, "Connection");
+        connection->close_after = !keep_alive ||
+          (value && strncasecmp(value, "close", 5) == 0);
+        connection->until_close = 0;
+        value = find_header(data, head_size, "Transfer-Encoding");
+        if (value && strncasecmp(value, "chunked", 7) == 0) {
+          connection->state = STATE_CHUNK_SIZE;
+        } else if ((value = find_header(data, head_size, "Content-Length"))) {
+          connection->remaining = strtoull(value, NULL, 10);
+          connection->state = STATE_BODY;
+        } else if (connection->status == 204 || connection->status == 304) {
+          connection->remaining = 0;
+          connection->state = STATE_BODY;
+        } else {
+          connection->remaining = UINT64_MAX;
+          connection->until_close = 1;
+          connection->state = STATE_BODY;
+        }
+        connection->input_start += head_size;
+        break;
+      }
+      case STATE_BODY:
+      case STATE_CHUNK_DATA: {
+        size_t taken = size < connection->remaining ? size : connection->remaining;
+        connection->input_start += taken;
+        connection->remaining -= taken;
+        thread->body_bytes += taken;
+        if (connection->remaining > 0) return finished;
+        if (connection->state == STATE_CHUNK_DATA) {
+          connection->state = STATE_CHUNK_END;
+          break;
+        }
+        finish_response(thread, connection);
+        finished++;
+        if (connection->close_after) return finished;
+        break;
+      }
+      case STATE_CHUNK_SIZE:
+      case STATE_CHUNK_END:
+      case STATE_TRAILER: {
+        end = memmem(data, size, "\r\n", 2);
+        if (!end) return size == sizeof(connection->input) ? -1 : finished;
+        connection->input_start += end + 2 - data;
+        if (connection->state == STATE_CHUNK_END) {
+          connection->state = STATE_CHUNK_SIZE;
+        } else if (connection->state == STATE_CHUNK_SIZE) {
+          connection->remaining = strtoull(data, NULL, 16);
+          connection->state = connection->remaining > 0 ? STATE_CHUNK_DATA :
+            STATE_TRAILER;
+        } else if (end == data) {
+          finish_response(thread, connection);
+          finished++;
+          if (connection->close_after) return finished;
+        }
+        break;
+      }
+    }
+  }
+}
+
+static int connection_read(struct client_thread *thread,
+    struct connection *connection) {
+  while (1) {
+    if (connection->input_start == connection->input_end) {
+      connection->input_start = connection->input_end = 0;
+    } else if (connection->input_end == sizeof(connection->input)) {
+      memmove(connection->input, connection->input + connection->input_start,
+          connection->input_end - connection->input_start);
+      connection->input_end -= connection->input_start;
+      connection->input_start = 0;
+    }
+    ssize_t bytes = read(connection->fd, connection->input + connection->input_end,
+        sizeof(connection->input) - connection->input_end);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes < 0 && errno == EAGAIN) return 0;
+    if (bytes <= 0) {
+      if (connection->state == STATE_BODY && connection->until_close)
+        finish_response(thread, connection);
+      else if (connection_failed(connection))
+        thread->errors++;
+      return -1;
+    }
+    connection->input_end += bytes;
+    int finished = parse_responses(thread, connection);
+    if (finished < 0) {
+      thread->errors++;
+      return -1;
+    }
+    if (connection->close_after && connection->state == STATE_HEAD &&
+        finished > 0) return -1;
+    if (finished > 0) return finished;
+  }
+}
+
+static uint64_t due_time(struct client_thread *thread, uint64_t sequence) {
+  return run_start + (uint64_t) (sequence * 1e9 / thread->rate);
+}
+
+static void *client_main(void *arg) {
+  struct client_thread *thread = arg;
+  thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  for (int kind = 0; kind < NUM_KINDS; kind++)
+    if (!(thread->histograms[kind] = calloc(1, sizeof(struct histogram)))) {
+      perror("Failed to allocate histograms");
+      exit(errno);
+    }
+  for (int i = 0; i < thread->num_connections; i++)
+    connection_open(thread, &thread->connections[i]);
+
+  /* Closed loop fills every pipeline at once; open loop follows the clock. */
+  uint64_t sequence = 0;
+  if (thread->rate == 0)
+    for (int i = 0; i < thread->num_connections; i++)
+      for (int j = 0; j < pipeline; j++)
+        send_request(thread, &thread->connections[i], now_ns());
+
+  struct epoll_event events[64];
+  int have_pwait2 = 1;
+  while (1) {
+    uint64_t now = now_ns();
+    if (now >= run_end) break;
+    uint64_t wake = run_end;
+    if (thread->rate > 0) {
+      while (due_time(thread, sequence) <= now) {
+        struct connection *connection = NULL;
+        for (int i = 0; i < thread->num_connections; i++) {
+          struct connection *candidate = &thread->connections[thread->cursor];
+          thread->cursor = (thread->cursor + 1) % thread->num_connections;
+          if (candidate->inflight_count < pipeline && !candidate->close_after) {
+            connection = candidate;
+            break;
+          }
+        }
+        if (!connection) break;  // Every pipeline is full; wait for I/O.
+        send_request(thread, connection, due_time(thread, sequence++));
+      }
+      if (due_time(thread, sequence) > now && due_time(thread, sequence) < wake)
+        wake = due_time(thread, sequence);
+    }
+
+    int ready;
+    if (have_pwait2) {
+      struct timespec timeout = { (wake - now) / 1000000000,
+        (wake - now) % 1000000000 };
+      ready = epoll_pwait2(thread->epoll_fd, events, 64, &timeout, NULL);
+      if (ready < 0 && errno == ENOSYS) {
+        have_pwait2 = 0;
+        continue;
+      }
+    } else {
+      ready = epoll_wait(thread->epoll_fd, events, 64,
+          (int) ((wake - now + 999999) / 1000000));
+    }
+    for (int i = 0; i < ready; i++) {
+      struct connection *connection = events[i].data.ptr;
+      if ((events[i].events & EPOLLOUT) && connection_flush(thread, connection) < 0) {
+        if (connection_failed(connection)) thread->errors++;
+        connection_reopen(thread, connection);
+        continue;
+      }
+      if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+      if (connection_read(thread, connection) < 0)
+        connection_reopen(thread, connection);
+      /* Nothing more goes to a server that said it will close. */
+      if (thread->rate == 0)
+        while (connection->inflight_count < pipeline && !connection->close_after)
+          send_request(thread, connection, now_ns());
+    }
+  }
+
+  for (int i = 0; i < thread->num_connections; i++) {
+    thread->unfinished += thread->connections[i].inflight_count;
+    close(thread->connections[i].fd);
+  }
+  /* Requests that fell due but found every pipeline full. */
+  if (thread->rate > 0)
+    while (due_time(thread, sequence) < run_end) {
+      thread->unfinished++;
+      sequence++;
+    }
+  close(thread->epoll_fd);
+  return NULL;
+}
+
+static char body_small[SMALL_SIZE], body_large[LARGE_SIZE];
+static char body_dir[DIR_ENTRIES * 64];
+static size_t body_dir_size;
+
+static void make_bodies() {
+  for (size_t i = 0; i < sizeof(body_small); i++) body_small[i] = 'a' + i % 26;
+  for (size_t i = 0; i < sizeof(body_large); i++) body_large[i] = i * 7;
+  for (int i = 0; i < DIR_ENTRIES; i++)
+    body_dir_size += sprintf(body_dir + body_dir_size,
+        "<a href=\"entry%02d.txt\">entry%02d.txt</a><br>\n", i, i);
+}
+
+static void write_file(const char *path, const char *data, size_t size) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || write(fd, data, size) != (ssize_t) size) {
+    perror(path);
+    exit(errno);
+  }
+  close(fd);
+}
+
+/* Writes the paths the bench requests into DIRECTORY. */
+static void make_tree(const char *directory) {
+  char path[4096];
+  mkdir(directory, 0755);
+  snprintf(path, sizeof(path), "%s/small.txt", directory);
+  write_file(path, body_small, sizeof(body_small));
+  snprintf(path, sizeof(path), "%s/large.bin", directory);
+  write_file(path, body_large, sizeof(body_large));
+  snprintf(path, sizeof(path), "%s/dir", directory);
+  mkdir(path, 0755);
+  for (int i = 0; i < DIR_ENTRIES; i++) {
+    snprintf(path, sizeof(path), "%s/dir/entry%02d.txt", directory, i);
+    write_file(path, body_small, 16);
+  }
+}
+
+static void remove_tree(const char *directory) {
+  char path[4096];
+  for (int i = 0; i < DIR_ENTRIES; i++) {
+    snprintf(path, sizeof(path), "%s/dir/entry%02d.txt", directory, i);
+    unlink(path);
+  }
+  snprintf(path, sizeof(path), "%s/dir", directory);
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/small.txt", directory);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/large.bin", directory);
+  unlink(path);
+  rmdir(directory);
+}
+
+/*
+ * The stand-in upstream: one epoll thread answering GETs for the bench's
+ * paths from memory, keeping connections alive and answering pipelined
+ * requests in order.
+ */
+struct upstream_connection {
+  int fd;
+  char input[8192];
+  size_t input_size;
+  char head[256];
+  struct iovec output[2];
+};
+
+static int upstream_pump(struct upstream_connection *connection) {
+  while (1) {
+    if (connection->output[0].iov_len + connection->output[1].iov_len > 0) {
+      ssize_t bytes = writev(connection->fd, connection->output, 2);
+      if (bytes < 0 && errno == EAGAIN) return 0;
+      if (bytes < 0 && errno == EINTR) continue;
+      if (bytes < 0) return -1;
+      for (int i = 0; i < 2; i++) {
+        size_t taken = (size_t) bytes < connection->output[i].iov_len ? bytes :
+          connection->output[i].iov_len;
+        connection->output[i].iov_base = (char *) connection->output[i].iov_base + taken;
+        connection->output[i].iov_len -= taken;
+        bytes -= taken;
+      }
+      continue;
+    }
+
+    char *end = memmem(connection->input, connection->input_size, "\r\n\r\n", 4);
+    if (end) {
+      const char *body = "Not Found\n";
+      size_t body_size = 10;
+      int status = 404;
+      const char *type = "text/plain";
+      char *path = memchr(connection->input, ' ', end - connection->input);
+      size_t path_size = path ? strcspn(++path, " \r\n") : 0;
+      if (path_size == 10 && memcmp(path, "/small.txt", 10) == 0) {
+        body = body_small, body_size = sizeof(body_small), status = 200;
+      } else if (path_size == 10 && memcmp(path, "/large.bin", 10) == 0) {
+        body = body_large, body_size = sizeof(body_large), status = 200;
+        type = "application/octet-stream";
+      } else if (path_size == 5 && memcmp(path, "/dir/", 5) == 0) {
+        body = body_dir, body_size = body_dir_size, status = 200;
+        type = "text/html";
+      }
+      connection->output[0].iov_base = connection->head;
+      connection->output[0].iov_len = snprintf(connection->head,
+          sizeof(connection->head), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n"
+          "Content-Length: %zu\r\n\r\n", status, status == 200 ? "OK" :
+          "Not Found", type, body_size);
+      connection->output[1].iov_base = (void *) body;
+      connection->output[1].iov_len = body_size;
+      size_t request_size = end + 4 - connection->input;
+      memmove(connection->input, end + 4, connection->input_size - request_size);
+      connection->input_size -= request_size;
+      continue;
+    }
+    if (connection->input_size == sizeof(connection->input)) return -1;
+
+    ssize_t bytes = read(connection->fd, connection->input + connection->input_size,
+        sizeof(connection->input) - connection->input_size);
+    if (bytes < 0 && errno == EAGAIN) return 0;
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) return -1;
+    connection->input_size += bytes;
+  }
+}
+
+static void *upstream_main(void *arg) {
+  int listener = (int) (intptr_t) arg;
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &event);
+  struct epoll_event events[64];
+  while (1) {
+    int ready = epoll_wait(epoll_fd, events, 64, -1);
+    for (int i = 0; i < ready; i++) {
+      struct upstream_connection *connection = events[i].data.ptr;
+      if (!connection) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        if (!(connection = calloc(1, sizeof(*connection)))) {
+          close(fd);
+          continue;
+        }
+        connection->fd = fd;
+        struct epoll_event client_event = {
+          .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = connection
+        };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &client_event);
+      }
+      if (upstream_pump(connection) < 0) {
+        close(connection->fd);
+        free(connection);
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Starts the stand-in upstream on PORT (0 picks one) and returns its port. */
+static int start_upstream(int port) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  socklen_t length = sizeof(address);
+  int enabled = 1;
+  int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) < 0 ||
+      bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+      listen(fd, 1024) < 0 ||
+      getsockname(fd, (struct sockaddr *) &address, &length) < 0) {
+    perror("Failed to set up the upstream listener");
+    exit(errno);
+  }
+  pthread_t thread;
+  pthread_create(&thread, NULL, upstream_main, (void *) (intptr_t) fd);
+  pthread_detach(thread);
+  return ntohs(address.sin_port);
+}
+
+/* Starts ./httpserver with ARGV and waits until it accepts connections. */
+static pid_t start_server(const char **argv) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    execv(argv[0], (char **) argv);
+    perror("Failed to start ./httpserver");
+    _exit(1);
+  }
+  for (int tries = 0; tries < 200; tries++) {
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(fd, (struct sockaddr *) &server_address, sizeof(server_address)) == 0) {
+      close(fd);
+      return pid;
+    }
+    close(fd);
+    usleep(10000);
+  }
+  fprintf(stderr, "httpserver didn't start listening\n");
+  kill(pid, SIGKILL);
+  exit(1);
+}
+
+/* Opens the --stalled connections into FDS: each asks for /large.bin many
+ * times over, with a small receive buffer, and is never read. */
+static void open_stalled(int *fds) {
+  char request[BENCH_REQUEST_MAX];
+  int size = snprintf(request, sizeof(request),
+      "GET /large.bin HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n",
+      ntohs(server_address.sin_port));
+  int receive_buffer = 4096;
+  for (int i = 0; i < num_stalled; i++) {
+    fds[i] = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fds[i] < 0 || setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF,
+          &receive_buffer, sizeof(receive_buffer)) < 0 ||
+        connect(fds[i], (struct sockaddr *) &server_address,
+          sizeof(server_address)) < 0) {
+      perror("Failed to open a stalled connection");
+      exit(errno);
+    }
+    for (int j = 0; j < BENCH_MAX_PIPELINE; j++)
+      if (write(fds[i], request, size) != size) break;
+  }
+}
+
+static int parse_mix(char *spec) {
+  memset(mix, 0, sizeof(mix));
+  mix_total = 0;
+  for (char *item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+    char *weight = strchr(item, '=');
+    int kind;
+    for (kind = 0; kind < NUM_KINDS; kind++)
+      if (weight && strncmp(item, kind_names[kind], weight - item) == 0 &&
+          kind_names[kind][weight - item] == '\0') break;
+    if (kind == NUM_KINDS || atoi(weight + 1) < 0) return -1;
+    mix[kind] = atoi(weight + 1);
+    mix_total += mix[kind];
+  }
+  return mix_total > 0 ? 0 : -1;
+}
+
+static void print_latencies(const char *name, const struct histogram *histogram) {
+  printf("%-8s %10lu %9.3f %9.3f %9.3f %9.3f %9.3f\n", name,
+      (unsigned long) histogram->total,
+      hdr_percentile(histogram, 50) / 1e3, hdr_percentile(histogram, 90) / 1e3,
+      hdr_percentile(histogram, 99) / 1e3, hdr_percentile(histogram, 99.9) / 1e3,
+      histogram->max / 1e3);
+}
+
+char *USAGE =
+  "Usage: ./httpbench [options] [-- httpserver options]\n"
+  "       ./httpbench --upstream PORT\n"
+  "       ./httpbench --tree DIRECTORY\n"
+  "\n"
+  "Options:\n"
+  "  --port N          the server's port on 127.0.0.1 (default 8000)\n"
+  "  --threads N       client threads (default 1)\n"
+  "  --connections N   connections, shared among the threads (default 16)\n"
+  "  --duration S      seconds to run (default 5)\n"
+  "  --pipeline N      requests outstanding per connection (default 1)\n"
+  "  --no-keep-alive   open a connection per request\n"
+  "  --rate N          open loop: N requests per second in all, with latency\n"
+  "                    measured from when each was due (default closed loop)\n"
+  "  --mix small=N,large=N,dir=N,missing=N\n"
+  "                    weights of /small.txt, /large.bin, /dir/ and /missing\n"
+  "                    (default small=1)\n"
+  "  --stalled N       also hold N connections that request /large.bin and\n"
+  "                    never read the responses (default 0)\n"
+  "  --serve files|proxy\n"
+  "                    start ./httpserver on --port over a scratch tree, or as\n"
+  "                    a proxy to a stand-in upstream, for the run\n"
+  "  --upstream PORT   only run the stand-in upstream on PORT\n"
+  "  --tree DIRECTORY  only write the requested files into DIRECTORY\n";
+
+static void exit_with_usage() {
+  fprintf(stderr, "%s", USAGE);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+  int port = 8000;
+  const char *serve = NULL;
+  const char *server_options[BENCH_MAX_ARGS];
+  int num_server_options = 0;
+
+  for (int i = 1; i < argc; i++) {
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp("--", argv[i]) == 0) {
+      while (++i < argc && num_server_options < BENCH_MAX_ARGS - 8)
+        server_options[num_server_options++] = argv[i];
+    } else if (strcmp("--port", argv[i]) == 0 && value) {
+      port = atoi(argv[++i]);
+    } else if (strcmp("--threads", argv[i]) == 0 && value) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp("--connections", argv[i]) == 0 && value) {
+      num_connections = atoi(argv[++i]);
+    } else if (strcmp("--duration", argv[i]) == 0 && value) {
+      duration = atof(argv[++i]);
+    } else if (strcmp("--pipeline", argv[i]) == 0 && value) {
+      pipeline = atoi(argv[++i]);
+    } else if (strcmp("--no-keep-alive", argv[i]) == 0) {
+      keep_alive = 0;
+    } else if (strcmp("--rate", argv[i]) == 0 && value) {
+      rate = atof(argv[++i]);
+    } else if (strcmp("--mix", argv[i]) == 0 && value) {
+      if (parse_mix(argv[++i]) < 0) exit_with_usage();
+    } else if (strcmp("--stalled", argv[i]) == 0 && value) {
+      num_stalled = atoi(argv[++i]);
+    } else if (strcmp("--serve", argv[i]) == 0 && value) {
+      serve = argv[++i];
+      if (strcmp(serve, "files") != 0 && strcmp(serve, "proxy") != 0)
+        exit_with_usage();
+    } else if (strcmp("--upstream", argv[i]) == 0 && value) {
+      make_bodies();
+      printf("Stand-in upstream on port %d\n", start_upstream(atoi(argv[++i])));
+      fflush(stdout);
+      pause();
+    } else if (strcmp("--tree", argv[i]) == 0 && value) {
+      make_bodies();
+      make_tree(argv[++i]);
+      return 0;
+    } else {
+      exit_with_usage();
+    }
+  }
+  if (num_threads < 1 || num_threads > BENCH_MAX_THREADS ||
+      num_connections < num_threads || num_connections > BENCH_MAX_CONNECTIONS ||
+      pipeline < 1 || pipeline > BENCH_MAX_PIPELINE || duration <= 0 ||
+      rate < 0 || (!keep_alive && pipeline > 1) ||
+      num_stalled < 0 || num_stalled > BENCH_MAX_STALLED)
+    exit_with_usage();
+
+  memset(&server_address, 0, sizeof(server_address));
+  server_address.sin_family = AF_INET;
+  server_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server_address.sin_port = htons(port);
+  for (int kind = 0; kind < NUM_KINDS; kind++)
+    request_sizes[kind] = snprintf(requests[kind], BENCH_REQUEST_MAX,
+        "GET %s HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n%s\r\n", kind_paths[kind],
+        port, keep_alive ? "" : "Connection: close\r\n");
+
+  char directory[] = "/tmp/httpbench.XXXXXX";
+  pid_t server = 0;
+  if (serve) {
+    make_bodies();
+    char port_string[16], target[64];
+    snprintf(port_string, sizeof(port_string), "%d", port);
+    const char *server_argv[BENCH_MAX_ARGS] = { "./httpserver", "--port", port_string };
+    int server_argc = 3;
+    if (strcmp(serve, "files") == 0) {
+      if (!mkdtemp(directory)) {
+        perror("Failed to create the scratch tree");
+        return 1;
+      }
+      make_tree(directory);
+      server_argv[server_argc++] = "--files";
+      server_argv[server_argc++] = directory;
+    } else {
+      snprintf(target, sizeof(target), "127.0.0.1:%d", start_upstream(0));
+      server_argv[server_argc++] = "--proxy";
+      server_argv[server_argc++] = target;
+    }
+    for (int i = 0; i < num_server_options; i++)
+      server_argv[server_argc++] = server_options[i];
+    server_argv[server_argc] = NULL;
+    server = start_server(server_argv);
+  }
+
+  int stalled_fds[BENCH_MAX_STALLED];
+  open_stalled(stalled_fds);
+
+  struct client_thread threads[BENCH_MAX_THREADS];
+  memset(threads, 0, sizeof(threads));
+  run_start = now_ns();
+  run_end = run_start + (uint64_t) (duration * 1e9);
+  for (int i = 0; i < num_threads; i++) {
+    struct client_thread *thread = &threads[i];
+    thread->index = i;
+    thread->num_connections = num_connections / num_threads +
+      (i < num_connections % num_threads);
+    thread->rate = rate * thread->num_connections / num_connections;
+    thread->random = 0x9e3779b97f4a7c15ULL * (i + 1);
+    if (!(thread->connections = calloc(thread->num_connections,
+            sizeof(struct connection)))) {
+      perror("Failed to allocate connections");
+      return 1;
+    }
+    pthread_create(&thread->thread, NULL, client_main, thread);
+  }
+
+  struct histogram *totals[NUM_KINDS + 1];
+  uint64_t statuses[6] = { 0 }, errors = 0, body_bytes = 0, unfinished = 0;
+  for (int kind = 0; kind <= NUM_KINDS; kind++)
+    totals[kind] = calloc(1, sizeof(struct histogram));
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    for (int kind = 0; kind < NUM_KINDS; kind++) {
+      hdr_add(totals[kind], threads[i].histograms[kind]);
+      hdr_add(totals[NUM_KINDS], threads[i].histograms[kind]);
+      free(threads[i].histograms[kind]);
+    }
+    for (int j = 0; j < 6; j++) statuses[j] += threads[i].statuses[j];
+    errors += threads[i].errors;
+    body_bytes += threads[i].body_bytes;
+    unfinished += threads[i].unfinished;
+    free(threads[i].connections);
+  }
+  double elapsed = (run_end - run_start) / 1e9;
+  for (int i = 0; i < num_stalled; i++) close(stalled_fds[i]);
+
+  if (server) {
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    if (strcmp(serve, "files") == 0) remove_tree(directory);
+  }
+
+  printf("%d threads, %d connections, pipeline %d%s, %.0f s, ", num_threads,
+      num_connections, pipeline, keep_alive ? "" : ", no keep-alive", duration);
+  if (num_stalled) printf("%d stalled, ", num_stalled);
+  if (rate > 0) printf("open loop at %.0f requests/s\n", rate);
+  else printf("closed loop\n");
+  printf("%lu responses, %.0f requests/s, %.1f MB/s of bodies\n",
+      (unsigned long) totals[NUM_KINDS]->total,
+      totals[NUM_KINDS]->total / elapsed, body_bytes / elapsed / 1e6);
+  printf("2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, other %lu, connection errors %lu, "
+      "unfinished %lu\n", (unsigned long) statuses[2], (unsigned long) statuses[3],
+      (unsigned long) statuses[4], (unsigned long) statuses[5],
+      (unsigned long) statuses[0], (unsigned long) errors,
+      (unsigned long) unfinished);
+  printf("\n%-8s %10s %9s %9s %9s %9s %9s\n", "latency", "count", "p50 ms",
+      "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+  for (int kind = 0; kind < NUM_KINDS; kind++)
+    if (mix[kind]) print_latencies(kind_names[kind], totals[kind]);
+  print_latencies("all", totals[NUM_KINDS]);
+  return 0;
+}
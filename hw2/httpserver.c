@@ -1,37 +1,467 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <unistd.h>
 
+#include "accesslog.h"
+#include "admission.h"
+#include "dirlist.h"
+#include "encoding.h"
+#include "evloop.h"
+#include "fdcache.h"
+#include "hotcache.h"
 #include "libhttp.h"
+#include "listener.h"
+#include "mime.h"
+#include "relay.h"
+#include "stats.h"
+#include "upstream.h"
+#include "uring.h"
 #include "wq.h"
 
 /*
- * Global configuration variables.
- * You need to use these in your implementation of handle_files_request and
- * handle_proxy_request. Their values are set up in main() using the
- * command line arguments (already implemented for you).
+ * Global configuration, set up in main() from the command line arguments
+ * and read by the request handlers and serving engines.
  */
 wq_t work_queue;
 int num_threads;
+int work_queue_capacity;
+int work_queue_lock_free;
+int use_event_loop;
+int use_io_uring;
+int fd_cache_size = 256;
+int content_cache_mb;
+int proxy_pool_size = 8;
+int proxy_idle_timeout = 30;
+int proxy_timeout = 30;
+int proxy_dns_ttl = 60;
+int keep_alive_timeout = 5;
+int header_timeout = 10;
+int max_connections;
+int rate_limit;
+int rate_burst;
+int max_requests_per_connection = 100;
+char *mime_types_path;
+int listing_cache_mb = 8;
+int sorted_listings;
+int compress_cache_mb = 16;
+int compress_threads = 1;
+int sharded;
+char *access_log_path;
+int access_log_sample = 1;
+int access_log_max_mb;
+int serve_stats;
+struct listener_options listen_options;
 int server_port;
 char *server_files_directory;
 char *server_proxy_hostname;
 int server_proxy_port;
 
 
+/* Sends a minimal HTML error page for STATUS_CODE. */
+static void send_error(int fd, int status_code) {
+  char body[128];
+  snprintf(body, sizeof(body), "<center><h1>%d %s</h1><hr></center>",
+      status_code, http_get_response_message(status_code));
+  http_start_response(fd, status_code);
+  http_send_header(fd, "Content-Type", "text/html");
+  http_end_headers(fd);
+  http_send_string(fd, body);
+}
+
+#ifdef HTTP_STATS
+#define STATS_PATH "/__stats"
+
+/*
+ * Answers a request for STATS_PATH with every metric in Prometheus text
+ * format: the stats module's, plus the work queue and content cache
+ * figures kept here.
+ */
+static void send_stats(int fd) {
+  char *body = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&body, &size);
+  if (!out) {
+    send_error(fd, 500);
+    return;
+  }
+  stats_write(out);
+  if (!use_event_loop && !use_io_uring && !sharded && num_threads > 0)
+    fprintf(out, "# HELP httpserver_work_queue_depth Accepted connections "
+        "waiting for a worker.\n# TYPE httpserver_work_queue_depth gauge\n"
+        "httpserver_work_queue_depth %d\n"
+        "# HELP httpserver_work_queue_capacity Connections the work queue "
+        "holds.\n# TYPE httpserver_work_queue_capacity gauge\n"
+        "httpserver_work_queue_capacity %d\n", wq_size(&work_queue),
+        work_queue.capacity);
+  if (hotcache_enabled()) {
+    struct hotcache_stats stats;
+    hotcache_get_stats(&stats);
+    fprintf(out, "# HELP httpserver_content_cache_lookups_total Content cache "
+        "lookups.\n# TYPE httpserver_content_cache_lookups_total counter\n"
+        "httpserver_content_cache_lookups_total{result=\"hit\"} %lu\n"
+        "httpserver_content_cache_lookups_total{result=\"miss\"} %lu\n"
+        "# HELP httpserver_content_cache_bytes Bytes held by the content "
+        "cache.\n# TYPE httpserver_content_cache_bytes gauge\n"
+        "httpserver_content_cache_bytes %zu\n", stats.hits, stats.misses,
+        stats.bytes);
+  }
+  fclose(out);
+
+  char length[24];
+  snprintf(length, sizeof(length), "%zu", size);
+  http_start_response(fd, 200);
+  http_send_header(fd, "Content-Type", "text/plain; version=0.0.4");
+  http_send_header(fd, "Content-Length", length);
+  http_send_header(fd, "Cache-Control", "no-store");
+  http_end_headers(fd);
+  http_send_data(fd, body, size);
+  free(body);
+}
+#endif
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/*
+ * Maps REQUEST_PATH onto server_files_directory, writing the result to
+ * RESOLVED. The query string is dropped, %XX escapes are decoded and "."
+ * and ".." segments are folded lexically, so the result never climbs out
+ * of the served directory. Returns 0 if the path is malformed or too long.
+ */
+static int resolve_request_path(const char *request_path, char *resolved,
+    size_t size) {
+  size_t root_length = strlen(server_files_directory);
+  while (root_length > 1 && server_files_directory[root_length - 1] == '/')
+    root_length--;
+  if (root_length + 1 >= size) return 0;
+  memcpy(resolved, server_files_directory, root_length);
+  size_t length = root_length;
+
+  const char *cursor = request_path;
+  while (*cursor && *cursor != '?' && *cursor != '#') {
+    while (*cursor == '/') cursor++;
+
+    /* Decode one segment after a '/' placeholder. */
+    size_t segment_start = length;
+    if (length + 1 >= size) return 0;
+    resolved[length++] = '/';
+    while (*cursor && *cursor != '/' && *cursor != '?' && *cursor != '#') {
+      char c = *cursor++;
+      if (c == '%') {
+        int high = hex_value(cursor[0]), low = high < 0 ? -1 : hex_value(cursor[1]);
+        if (low < 0) return 0;
+        c = high * 16 + low;
+        cursor += 2;
+        if (c == '\0' || c == '/') return 0;
+      }
+      if (length + 1 >= size) return 0;
+      resolved[length++] = c;
+    }
+
+    size_t segment_length = length - segment_start - 1;
+    const char *segment = resolved + segment_start + 1;
+    if (segment_length == 0 || (segment_length == 1 && segment[0] == '.')) {
+      length = segment_start;
+    } else if (segment_length == 2 && segment[0] == '.' && segment[1] == '.') {
+      length = segment_start;
+      while (length > root_length && resolved[length - 1] != '/') length--;
+      if (length > root_length) length--;
+    }
+  }
+  resolved[length] = '\0';
+  return 1;
+}
+
+#define MAX_RANGES 16
+
+/*
+ * Describes a file being answered: its validators, and its bytes either in
+ * memory (BODY) or in FILE_FD for sendfile.
+ */
+struct file_response {
+  const char *content_type;
+  const char *content_encoding;  // NULL for the identity body.
+  int vary;                      // Whether the encoding was negotiated.
+  const char *etag;
+  time_t mtime;
+  off_t size;
+  int file_fd;
+  const char *body;
+};
+
+static void send_file_bytes(int fd, const struct file_response *file,
+    off_t offset, off_t length) {
+  if (file->body)
+    http_send_data(fd, (char *) file->body + offset, length);
+  else
+    http_send_file(fd, file->file_fd, offset, length);
+}
+
+/*
+ * Writes a fresh 128-bit random multipart boundary to BOUNDARY, which holds
+ * 33 bytes. A body in memory is checked not to contain it; a file body
+ * can't be checked without reading it, and is trusted to the odds. Returns
+ * 0 if no random bytes could be had.
+ */
+static int make_boundary(char *boundary, const struct file_response *file,
+    const struct http_range *ranges, int num_ranges) {
+  for (int attempt = 0; attempt < 4; attempt++) {
+    unsigned char bytes[16];
+    if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)) return 0;
+    for (int i = 0; i < 16; i++)
+      sprintf(boundary + 2 * i, "%02x", bytes[i]);
+    int found = 0;
+    for (int i = 0; file->body && i < num_ranges && !found; i++)
+      found = memmem(file->body + ranges[i].offset, ranges[i].length,
+          boundary, 32) != NULL;
+    if (!found) return 1;
+  }
+  return 0;
+}
+
+/* Renders the head of one multipart/byteranges part; returns its length. */
+static int format_part_head(char *buffer, size_t size, const char *boundary,
+    const struct file_response *file, const struct http_range *range) {
+  return snprintf(buffer, size, "\r\n--%s\r\nContent-Type: %s\r\n"
+      "Content-Range: bytes %lld-%lld/%lld\r\n\r\n", boundary,
+      file->content_type, (long long) range->offset,
+      (long long) (range->offset + range->length - 1), (long long) file->size);
+}
+
+/*
+ * Answers a conditional or range request for FILE with a 304, 206 or 416.
+ * Returns 0, having sent nothing, if a plain 200 is called for instead.
+ * Range bodies go out with sendfile, each part of a multi-range response
+ * separately, so nothing is copied whatever the ranges are. Overlapping
+ * ranges are merged, so no byte goes out twice.
+ */
+static int send_partial_file(int fd, struct http_request *request,
+    const struct file_response *file) {
+  char last_modified[64], header[96];
+  http_format_date(last_modified, sizeof(last_modified), file->mtime);
+
+  if (http_not_modified(request, file->etag, file->mtime)) {
+    http_start_response(fd, 304);
+    http_send_header(fd, "ETag", (char *) file->etag);
+    http_send_header(fd, "Last-Modified", last_modified);
+    if (file->vary) http_send_header(fd, "Vary", "Accept-Encoding");
+    http_end_headers(fd);
+    return 1;
+  }
+
+  struct http_range ranges[MAX_RANGES];
+  int num_ranges = http_request_ranges(request, file->etag, file->mtime,
+      file->size, ranges, MAX_RANGES);
+  char boundary[33];
+  if (num_ranges == 0 ||
+      (num_ranges > 1 && !make_boundary(boundary, file, ranges, num_ranges)))
+    return 0;
+  if (num_ranges < 0) {
+    snprintf(header, sizeof(header), "bytes */%lld", (long long) file->size);
+    http_start_response(fd, 416);
+    http_send_header(fd, "Content-Range", header);
+    http_send_header(fd, "Content-Length", "0");
+    http_end_headers(fd);
+    return 1;
+  }
+
+  http_start_response(fd, 206);
+  http_send_header(fd, "ETag", (char *) file->etag);
+  http_send_header(fd, "Last-Modified", last_modified);
+  http_send_header(fd, "Accept-Ranges", "bytes");
+  if (file->content_encoding)
+    http_send_header(fd, "Content-Encoding", (char *) file->content_encoding);
+  if (file->vary) http_send_header(fd, "Vary", "Accept-Encoding");
+  if (num_ranges == 1) {
+    http_send_header(fd, "Content-Type", (char *) file->content_type);
+    snprintf(header, sizeof(header), "bytes %lld-%lld/%lld",
+        (long long) ranges[0].offset,
+        (long long) (ranges[0].offset + ranges[0].length - 1),
+        (long long) file->size);
+    http_send_header(fd, "Content-Range", header);
+    snprintf(header, sizeof(header), "%lld", (long long) ranges[0].length);
+    http_send_header(fd, "Content-Length", header);
+    http_end_headers(fd);
+    send_file_bytes(fd, file, ranges[0].offset, ranges[0].length);
+    return 1;
+  }
+
+  char part_head[PATH_MAX];
+  long long content_length = sizeof("\r\n----\r\n") - 1 + strlen(boundary);
+  for (int i = 0; i < num_ranges; i++)
+    content_length += format_part_head(part_head, sizeof(part_head), boundary,
+        file, &ranges[i]) + ranges[i].length;
+
+  snprintf(header, sizeof(header), "multipart/byteranges; boundary=%s",
+      boundary);
+  http_send_header(fd, "Content-Type", header);
+  snprintf(header, sizeof(header), "%lld", content_length);
+  http_send_header(fd, "Content-Length", header);
+  http_end_headers(fd);
+  for (int i = 0; i < num_ranges; i++) {
+    int size = format_part_head(part_head, sizeof(part_head), boundary, file,
+        &ranges[i]);
+    http_send_data(fd, part_head, size);
+    send_file_bytes(fd, file, ranges[i].offset, ranges[i].length);
+  }
+  snprintf(part_head, sizeof(part_head), "\r\n--%s--\r\n", boundary);
+  http_send_string(fd, part_head);
+  return 1;
+}
+
+/* Sends FILE whole as a 200, or as the 304, 206 or 416 the request asks. */
+static void send_file_response(int fd, struct http_request *request,
+    const struct file_response *file) {
+  if (send_partial_file(fd, request, file)) return;
+
+  char content_length[24], last_modified[64];
+  snprintf(content_length, sizeof(content_length), "%lld",
+      (long long) file->size);
+  http_format_date(last_modified, sizeof(last_modified), file->mtime);
+  http_start_response(fd, 200);
+  http_send_header(fd, "Content-Type", (char *) file->content_type);
+  http_send_header(fd, "Content-Length", content_length);
+  http_send_header(fd, "ETag", (char *) file->etag);
+  http_send_header(fd, "Last-Modified", last_modified);
+  http_send_header(fd, "Accept-Ranges", "bytes");
+  if (file->content_encoding)
+    http_send_header(fd, "Content-Encoding", (char *) file->content_encoding);
+  if (file->vary) http_send_header(fd, "Vary", "Accept-Encoding");
+  http_end_headers(fd);
+  send_file_bytes(fd, file, 0, file->size);
+}
+
+/*
+ * Sends a compressed variant of the file at PATH if the client accepts
+ * one: a .br or .gz sibling file when there is one, else a variant from
+ * the compression cache. Returns 0, having sent nothing, if there is no
+ * variant to send (yet); the caller then sends the identity body.
+ */
+static int send_encoded_file(int fd, struct http_request *request,
+    const char *path, const struct file_response *identity) {
+  int accepted = encoding_accepted(http_request_header(request,
+      "Accept-Encoding"));
+  if (!accepted) return 0;
+
+  static const int preferred[] = { ENCODING_BR, ENCODING_GZIP };
+  char sibling_path[PATH_MAX], etag[64];
+  struct file_response file = *identity;
+  for (int i = 0; i < 2; i++) {
+    int encoding = preferred[i];
+    if (!(accepted & encoding) || snprintf(sibling_path, sizeof(sibling_path),
+        "%s%s", path, encoding_suffix(encoding)) >= sizeof(sibling_path))
+      continue;
+    struct fdcache_entry *sibling = fdcache_acquire(sibling_path);
+    if (!sibling) continue;
+    if (!S_ISREG(sibling->stat.st_mode)) {
+      fdcache_release(sibling);
+      continue;
+    }
+    http_format_etag(etag, sizeof(etag), &sibling->stat);
+    file.content_encoding = encoding_name(encoding);
+    file.etag = etag;
+    file.mtime = sibling->stat.st_mtime;
+    file.size = sibling->stat.st_size;
+    file.file_fd = sibling->fd;
+    file.body = NULL;
+    send_file_response(fd, request, &file);
+    fdcache_release(sibling);
+    return 1;
+  }
+
+  int encoding = accepted & ENCODING_BR ? ENCODING_BR : ENCODING_GZIP;
+  struct encoding_entry *variant = encoding_acquire(path, identity->etag,
+      encoding, identity->size);
+  if (!variant) return 0;
+  encoding_format_etag(etag, sizeof(etag), identity->etag, encoding);
+  file.content_encoding = encoding_name(encoding);
+  file.etag = etag;
+  file.size = variant->body_size;
+  file.file_fd = -1;
+  file.body = variant->body;
+  send_file_response(fd, request, &file);
+  encoding_release(variant);
+  return 1;
+}
+
+/*
+ * Sends a cached head and body with a single writev, unless the request
+ * is conditional, asks for ranges or gets a compressed variant.
+ */
+static void send_cached_file(int fd, struct http_request *request,
+    struct hotcache_entry *cached) {
+  struct file_response file = {
+    .content_type = cached->content_type,
+    .content_encoding = NULL,
+    .vary = encoding_compressible(cached->content_type),
+    .etag = cached->etag,
+    .mtime = cached->mtime,
+    .size = cached->body_size,
+    .file_fd = -1,
+    .body = cached->body,
+  };
+  if (!(file.vary && send_encoded_file(fd, request, cached->path, &file)) &&
+      !send_partial_file(fd, request, &file))
+    http_send_prerendered(fd, cached->head, cached->head_size, cached->body,
+        cached->body_size);
+  hotcache_release(cached);
+}
+
+/*
+ * Sends ENTRY, an open regular file, as a 200 response (or a 304, 206 or
+ * 416 as the request asks, compressed if negotiated). Small files are
+ * pulled into the content cache on the way, big ones go out with sendfile;
+ * GENERATION is the content cache's, from before ENTRY was acquired.
+ */
+static void send_file(int fd, struct http_request *request,
+    struct fdcache_entry *entry, unsigned long generation) {
+  const char *content_type = fdcache_content_type(entry);
+  int vary = encoding_compressible(content_type);
+  struct hotcache_entry *cached = hotcache_insert(entry->path, entry->fd,
+      &entry->stat, content_type, vary, generation);
+  if (cached) {
+    send_cached_file(fd, request, cached);
+    return;
+  }
+
+  char etag[64];
+  http_format_etag(etag, sizeof(etag), &entry->stat);
+  struct file_response file = {
+    .content_type = content_type,
+    .content_encoding = NULL,
+    .vary = vary,
+    .etag = etag,
+    .mtime = entry->stat.st_mtime,
+    .size = entry->stat.st_size,
+    .file_fd = entry->fd,
+    .body = NULL,
+  };
+  if (!(vary && send_encoded_file(fd, request, entry->path, &file)))
+    send_file_response(fd, request, &file);
+}
+
 /*
  * Reads an HTTP request from stream (fd), and writes an HTTP response
  * containing:
@@ -42,175 +472,1006 @@ int server_proxy_port;
  *   3) If user requested a directory and index.html doesn't exist, send a list
  *      of files in the directory with links to each.
  *   4) Send a 404 Not Found response.
+ *
+ * Open files and their stat results come from the fd cache, and file bodies
+ * go out with sendfile, so a hot file costs no open(), fstat() or copy.
+ * Small hot files are answered straight from the content cache. Files
+ * honour If-None-Match / If-Modified-Since and single or multiple byte
+ * ranges, and text files are sent gzip or brotli encoded when the client
+ * accepts it.
  */
 void handle_files_request(int fd) {
+  struct http_request *request = http_request_parse(fd);
+  if (!request) {
+    send_error(fd, 400);
+    return;
+  }
+  if (strcmp(request->method, "GET") != 0 &&
+      strcmp(request->method, "HEAD") != 0) {
+    send_error(fd, 405);
+    http_request_free(request);
+    return;
+  }
+#ifdef HTTP_STATS
+  if (serve_stats && strcmp(request->path, STATS_PATH) == 0) {
+    send_stats(fd);
+    http_request_free(request);
+    return;
+  }
+#endif
 
-  /*
-   * TODO: Your solution for Task 1 goes here! Feel free to delete/modify *
-   * any existing code.
-   */
+  char path[PATH_MAX];
+  if (!resolve_request_path(request->path, path, sizeof(path) - sizeof("/index.html"))) {
+    send_error(fd, 404);
+    http_request_free(request);
+    return;
+  }
 
-  struct http_request *request = http_request_parse(fd);
+  /* Taken before the fd cache lookup, so a change made after the entry
+   * was opened keeps its contents out of the content cache. */
+  unsigned long generation = hotcache_generation();
+  struct hotcache_entry *cached = hotcache_acquire(path);
+  if (cached) {
+    send_cached_file(fd, request, cached);
+    http_request_free(request);
+    return;
+  }
 
-  http_start_response(fd, 200);
-  http_send_header(fd, "Content-Type", "text/html");
-  http_end_headers(fd);
-  http_send_string(fd,
-      "<center>"
-      "<h1>Welcome to httpserver!</h1>"
-      "<hr>"
-      "<p>Nothing's here yet.</p>"
-      "</center>");
+  struct fdcache_entry *entry = fdcache_acquire(path);
+  if (!entry) {
+    send_error(fd, 404);
+  } else if (S_ISREG(entry->stat.st_mode)) {
+    send_file(fd, request, entry, generation);
+  } else if (S_ISDIR(entry->stat.st_mode)) {
+    size_t request_path_length = strcspn(request->path, "?#");
+    if (request_path_length == 0 || request->path[request_path_length - 1] != '/') {
+      /* Relative links only resolve against a path ending in '/'. */
+      char location[PATH_MAX];
+      snprintf(location, sizeof(location), "%.*s/", (int) request_path_length,
+          request->path);
+      http_start_response(fd, 301);
+      http_send_header(fd, "Location", location);
+      http_send_header(fd, "Content-Length", "0");
+      http_end_headers(fd);
+    } else {
+      size_t length = strlen(path);
+      strcpy(path + length, "/index.html");
+      struct fdcache_entry *index = NULL;
+      if ((cached = hotcache_acquire(path)) != NULL) {
+        send_cached_file(fd, request, cached);
+      } else if ((index = fdcache_acquire(path)) && S_ISREG(index->stat.st_mode)) {
+        send_file(fd, request, index, generation);
+      } else {
+        path[length] = '\0';
+        if (dirlist_send(fd, path, entry->fd) < 0)
+          send_error(fd, errno == ENOMEM ? 500 : 404);
+      }
+      if (index) fdcache_release(index);
+    }
+  } else {
+    send_error(fd, 404);
+  }
+
+  if (entry) fdcache_release(entry);
+  http_request_free(request);
 }
 
 
+#define PROXY_HEAD_MAX 8192
+
+/* Where a proxied exchange has got to. */
+enum proxy_stage {
+  PROXY_READ_REQUEST,     // Reading the client's request head.
+  PROXY_CONNECT,          // Waiting for a new upstream connection.
+  PROXY_SEND_REQUEST,     // Sending the request upstream.
+  PROXY_READ_RESPONSE,    // Reading the response head.
+  PROXY_FORWARD_BODY,     // Splicing the response body to the client.
+  PROXY_FORWARD_CHUNKED,  // Copying a chunked body, following its framing.
+  PROXY_RELAY,            // Relaying both ways, opaquely.
+  PROXY_DONE
+};
+
 /*
- * Opens a connection to the proxy target (hostname=server_proxy_hostname and
- * port=server_proxy_port) and relays traffic to/from the stream fd and the
- * proxy target. HTTP requests from the client (fd) should be sent to the
- * proxy target, and HTTP responses from the proxy target should be sent to
- * the client (fd).
- *
- *   +--------+     +------------+     +--------------+
- *   | client | <-> | httpserver | <-> | proxy target |
- *   +--------+     +------------+     +--------------+
+ * One request on its way through the proxy. No step of it blocks: a step
+ * that has to wait says what for, so the same exchange runs on a reactor,
+ * set aside with evloop_await between steps, and on a worker thread, which
+ * polls.
  */
-void handle_proxy_request(int fd) {
+struct proxy_exchange {
+  int fd;                    // The client.
+  int upstream_fd;
+  enum proxy_stage stage;
+  int ready;                 // The last wait ended in time.
+  int opaque;                // The client's bytes go upstream as they are.
+  int reused;                // The upstream connection came from the pool.
+  int keep_alive;            // It may go back to the pool after the body.
+  int dechunk;               // The chunked body goes out unframed.
+  char method[16];
+  const char *outgoing;      // What goes upstream, and how much went.
+  size_t outgoing_size, sent;
+  size_t request_size, request_head, request_scanned;
+  size_t response_size, response_head, response_scanned;
+  char *chunk;               // Chunked body bytes read, not yet forwarded.
+  size_t chunk_size;
+  struct http_chunked_state chunked_state;
+  struct relay_channel body;
+  struct relay relay;
+  int body_open, relay_open;
+  char request[PROXY_HEAD_MAX];
+  char forwarded[PROXY_HEAD_MAX + 256];
+  char response[PROXY_HEAD_MAX];
+};
 
-  /*
-  * The code below does a DNS lookup of server_proxy_hostname and 
-  * opens a connection to it. Please do not modify.
-  */
+static int header_equals(const char *head, size_t size, const char *name,
+    const char *expected) {
+  const char *value;
+  size_t value_size;
+  return http_find_header(head, size, name, &value, &value_size) &&
+    value_size == strlen(expected) && strncasecmp(value, expected, value_size) == 0;
+}
 
-  struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
+/*
+ * Copies the head HEAD (of HEAD_SIZE bytes) to OUT, with FIRST_LINE in
+ * place of its start line, without hop-by-hop connection headers (nor
+ * Transfer-Encoding, if DECHUNK), and with EXTRA_HEADERS added. Returns the
+ * new head's length, or 0 if it doesn't fit in CAPACITY.
+ */
+static size_t proxy_rewrite_head(char *out, size_t capacity, const char *head,
+    size_t head_size, const char *first_line, const char *extra_headers,
+    int dechunk) {
+  const char *end = head + head_size;
+  const char *line = memchr(head, '\n', head_size) + 1;
+  size_t length = snprintf(out, capacity, "%s\r\n", first_line);
 
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
+  while (line < end) {
+    const char *line_end = memchr(line, '\n', end - line) + 1;
+    size_t line_size = line_end - line;
+    int blank = line_size <= 2 && (line[0] == '\r' || line[0] == '\n');
+    int hop_by_hop = strncasecmp(line, "Connection:", 11) == 0 ||
+      strncasecmp(line, "Keep-Alive:", 11) == 0 ||
+      strncasecmp(line, "Proxy-Connection:", 17) == 0 ||
+      (dechunk && strncasecmp(line, "Transfer-Encoding:", 18) == 0);
+    if (!blank && !hop_by_hop) {
+      if (length + line_size >= capacity) return 0;
+      memcpy(out + length, line, line_size);
+      length += line_size;
+    }
+    line = line_end;
+  }
 
-  int client_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (client_socket_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    exit(errno);
+  int extra = snprintf(out + length, capacity - length, "%s\r\n", extra_headers);
+  if (extra < 0 || length + extra >= capacity) return 0;
+  return length + extra;
+}
+
+/*
+ * Logs a proxied request from the raw head in REQUEST. Only the request
+ * line is needed, so a head that never completed is fine too.
+ */
+static void proxy_log(int fd, const char *request, size_t request_size,
+    int status_code, size_t bytes) {
+  if (!accesslog_enabled) return;
+  const char *line_end = memchr(request, '\n', request_size);
+  if (!line_end) line_end = request + request_size;
+  if (line_end > request && line_end[-1] == '\r') line_end--;
+  const char *path = memchr(request, ' ', line_end - request);
+  if (!path) {
+    accesslog_entry(fd, NULL, 0, NULL, 0, 0, status_code, bytes);
+    return;
   }
+  const char *path_end = memchr(path + 1, ' ', line_end - path - 1);
+  int http_1_0 = path_end && line_end - path_end == 9 &&
+    memcmp(path_end + 1, "HTTP/1.0", 8) == 0;
+  if (!path_end) path_end = line_end;
+  accesslog_entry(fd, request, path - request, path + 1, path_end - path - 1,
+      http_1_0, status_code, bytes);
+}
+
 
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    exit(ENXIO);
+/* Answers the client with STATUS_CODE from here and ends the exchange. */
+static void proxy_fail(struct proxy_exchange *exchange, int status_code) {
+  if (exchange->upstream_fd >= 0) close(exchange->upstream_fd);
+  exchange->upstream_fd = -1;
+  send_error(exchange->fd, status_code);
+  proxy_log(exchange->fd, exchange->request, exchange->request_head ?
+      exchange->request_head : exchange->request_size, status_code, 0);
+  exchange->stage = PROXY_DONE;
+}
+
+/* Ends the exchange, pooling the upstream connection if the whole body was
+ * DELIVERED and the target keeps the connection open. */
+static void proxy_release(struct proxy_exchange *exchange, int delivered) {
+  upstream_release(exchange->upstream_fd, delivered && exchange->keep_alive);
+  exchange->upstream_fd = -1;
+  exchange->stage = PROXY_DONE;
+}
+
+/* Takes a pooled upstream connection, or starts a new one. */
+static void proxy_connect(struct proxy_exchange *exchange) {
+  exchange->upstream_fd = upstream_acquire(&exchange->reused);
+  if (exchange->upstream_fd < 0) {
+    proxy_fail(exchange, 502);
+    return;
   }
+  exchange->sent = 0;
+  exchange->stage = exchange->reused ? PROXY_SEND_REQUEST : PROXY_CONNECT;
+}
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
+/*
+ * Gives up on an upstream connection that failed before the response head
+ * came, or stayed silent for proxy_timeout if TIMED_OUT. A pooled one may
+ * have been closed by the target since, so the request is retried on
+ * another; otherwise the client gets a 502, or a 504 for a target that
+ * didn't answer in time.
+ */
+static void proxy_upstream_failed(struct proxy_exchange *exchange,
+    int timed_out) {
+  close(exchange->upstream_fd);
+  exchange->upstream_fd = -1;
+  if (exchange->reused && !timed_out)
+    proxy_connect(exchange);
+  else
+    proxy_fail(exchange, timed_out ? 504 : 502);
+}
 
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(client_socket_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
+/* Sends what the client sent upstream as it is, to relay both ways. */
+static void proxy_go_opaque(struct proxy_exchange *exchange) {
+  if (exchange->request_size == 0) {
+    exchange->stage = PROXY_DONE;
+    return;
+  }
+  exchange->opaque = 1;
+  exchange->outgoing = exchange->request;
+  exchange->outgoing_size = exchange->request_size;
+  proxy_connect(exchange);
+}
 
-  if (connection_status < 0) {
-    /* Dummy request parsing, just to be compliant. */
-    http_request_parse(fd);
+/*
+ * Decides what becomes of a complete request head. Requests without a body
+ * go out as HTTP/1.1 keep-alive requests over a pooled upstream connection;
+ * anything else (request bodies, upgrades, other methods) is relayed
+ * opaquely.
+ */
+static void proxy_route(struct proxy_exchange *exchange) {
+  char *request = exchange->request;
+  size_t request_head = exchange->request_head;
+#ifdef HTTP_STATS
+  if (serve_stats &&
+      strncmp(request, "GET " STATS_PATH " ", sizeof("GET " STATS_PATH)) == 0) {
+    send_stats(exchange->fd);
+    proxy_log(exchange->fd, request, request_head, 200, 0);
+    exchange->stage = PROXY_DONE;
+    return;
+  }
+#endif
 
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
+  const char *value;
+  size_t value_size, length;
+  int method_length = strcspn(request, " \r\n");
+  snprintf(exchange->method, sizeof(exchange->method), "%.*s", method_length,
+      request);
+  int has_length = http_find_content_length(request, request_head, &length);
+  if (has_length < 0) {
+    proxy_fail(exchange, 400);
+    return;
+  }
+  int has_body = http_find_header(request, request_head, "Transfer-Encoding",
+      &value, &value_size) || (has_length && length > 0);
+  if (has_body || exchange->request_size != request_head ||
+      http_find_header(request, request_head, "Upgrade", &value, &value_size) ||
+      (strcmp(exchange->method, "GET") != 0 &&
+       strcmp(exchange->method, "HEAD") != 0)) {
+    proxy_go_opaque(exchange);
+    return;
+  }
+
+  /* Re-issue the request line as HTTP/1.1 and ask to keep the connection. */
+  char first_line[PROXY_HEAD_MAX], extra_headers[PATH_MAX];
+  int target_length = strcspn(request + method_length + 1, " \r\n");
+  snprintf(first_line, sizeof(first_line), "%s %.*s HTTP/1.1",
+      exchange->method, target_length, request + method_length + 1);
+  if (http_find_header(request, request_head, "Host", &value, &value_size))
+    snprintf(extra_headers, sizeof(extra_headers), "Connection: keep-alive\r\n");
+  else
+    snprintf(extra_headers, sizeof(extra_headers),
+        "Host: %s:%d\r\nConnection: keep-alive\r\n", server_proxy_hostname,
+        server_proxy_port);
+  exchange->outgoing = exchange->forwarded;
+  exchange->outgoing_size = proxy_rewrite_head(exchange->forwarded,
+      sizeof(exchange->forwarded), request, request_head, first_line,
+      extra_headers, 0);
+  if (exchange->outgoing_size == 0) {
+    proxy_fail(exchange, 400);
     return;
+  }
+  proxy_connect(exchange);
+}
 
+/*
+ * Passes a complete response head on to the client and sets up forwarding
+ * the body by its framing: a Content-Length body is spliced, a chunked one
+ * copied so its end can be seen (and stripped of its framing for HTTP/1.0
+ * clients, which can't read it) and an unframed one spliced until the
+ * target closes.
+ */
+static void proxy_respond(struct proxy_exchange *exchange) {
+  int fd = exchange->fd;
+  char *request = exchange->request, *response = exchange->response;
+  size_t request_head = exchange->request_head;
+  size_t response_head = exchange->response_head;
+  int status_code = atoi(response + strcspn(response, " "));
+  exchange->keep_alive = strncmp(response, "HTTP/1.1", 8) == 0 ?
+    !header_equals(response, response_head, "Connection", "close") :
+    header_equals(response, response_head, "Connection", "keep-alive");
+  int chunked = header_equals(response, response_head, "Transfer-Encoding",
+      "chunked");
+  size_t body_size = 0;
+  int framed = 1;
+  if (strcmp(exchange->method, "HEAD") == 0 || status_code / 100 == 1 ||
+      status_code == 204 || status_code == 304) {
+    chunked = 0;
+  } else if (!chunked) {
+    int has_length = http_find_content_length(response, response_head,
+        &body_size);
+    if (has_length < 0) {
+      /* No telling where the body ends, for us or the client. */
+      proxy_fail(exchange, 502);
+      return;
+    }
+    framed = has_length;
   }
 
-  /* 
-  * TODO: Your solution for task 3 belongs here! 
-  */
+  /* HTTP/1.0 clients can't read chunked framing: they get the body
+   * unframed, delimited by the close. */
+  const char *line_end = request + strcspn(request, "\r\n");
+  exchange->dechunk = chunked && line_end - request >= 9 &&
+    memcmp(line_end - 9, " HTTP/1.0", 9) == 0;
+  char status_line[256];
+  snprintf(status_line, sizeof(status_line), "%.*s",
+      (int) strcspn(response, "\r\n"), response);
+  char client_head[PROXY_HEAD_MAX + 256];
+  size_t client_head_size = proxy_rewrite_head(client_head, sizeof(client_head),
+      response, response_head, status_line, "Connection: close\r\n",
+      exchange->dechunk);
+  if (client_head_size == 0 ||
+      http_send_data(fd, client_head, client_head_size) < 0) {
+    proxy_log(fd, request, request_head, status_code, 0);
+    proxy_release(exchange, 0);
+    return;
+  }
+  /* Chunked and close-delimited bodies aren't counted. */
+  proxy_log(fd, request, request_head, status_code,
+      client_head_size + body_size);
+
+  char *body = response + response_head;
+  size_t buffered = exchange->response_size - response_head;
+  if (chunked) {
+    memset(&exchange->chunked_state, 0, sizeof(exchange->chunked_state));
+    exchange->chunk = body;
+    exchange->chunk_size = buffered;
+    exchange->stage = PROXY_FORWARD_CHUNKED;
+    return;
+  }
+  if (!framed) {
+    exchange->keep_alive = 0;
+  } else if (buffered > body_size) {
+    /* The target sent past the body: the connection is out of step. */
+    buffered = body_size;
+    exchange->keep_alive = 0;
+  }
+  if (buffered > 0 && http_send_data(fd, body, buffered) < 0) {
+    proxy_release(exchange, 0);
+    return;
+  }
+  size_t remaining = framed ? body_size - buffered : RELAY_UNTIL_CLOSE;
+  if (remaining == 0) {
+    proxy_release(exchange, 1);
+  } else if (relay_channel_open(&exchange->body, exchange->upstream_fd, fd,
+        remaining) < 0) {
+    proxy_release(exchange, 0);
+  } else {
+    exchange->body_open = 1;
+    exchange->stage = PROXY_FORWARD_BODY;
+  }
 }
 
+/* The stages below return 1 with the events they wait for set, or 0 once
+ * they have moved the exchange on. EXPIRED says the last wait timed out. */
 
-void init_thread_pool(int num_threads, void (*request_handler)(int)) {
-  /*
-   * TODO: Part of your solution for Task 2 goes here!
-   */
+static int proxy_read_request(struct proxy_exchange *exchange, int expired,
+    short *client_events) {
+  STATS_START(parse_start);
+  while (1) {
+    exchange->request_head = http_request_head_end(exchange->request,
+        exchange->request_size, &exchange->request_scanned);
+    if (exchange->request_head > 0) {
+      STATS_PARSED(parse_start);
+      proxy_route(exchange);
+      return 0;
+    }
+    if (expired || exchange->request_size == sizeof(exchange->request)) break;
+    ssize_t bytes_read = read(exchange->fd,
+        exchange->request + exchange->request_size,
+        sizeof(exchange->request) - exchange->request_size);
+    if (bytes_read > 0) {
+      exchange->request_size += bytes_read;
+    } else if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+          errno == EINTR)) {
+      *client_events = POLLIN;
+      return 1;
+    } else {
+      break;
+    }
+  }
+  /* Closed, silent or too big: what did come goes through as it is. */
+  proxy_go_opaque(exchange);
+  return 0;
+}
+
+static int proxy_await_connect(struct proxy_exchange *exchange, int expired,
+    short *upstream_events) {
+  int connected = upstream_connected(exchange->upstream_fd, expired);
+  if (connected == 0) {
+    *upstream_events = POLLOUT;
+    return 1;
+  }
+  if (connected < 0)
+    proxy_upstream_failed(exchange, expired);
+  else
+    exchange->stage = PROXY_SEND_REQUEST;
+  return 0;
+}
+
+static int proxy_send_request(struct proxy_exchange *exchange, int expired,
+    short *upstream_events) {
+  while (!expired && exchange->sent < exchange->outgoing_size) {
+    ssize_t bytes_sent = send(exchange->upstream_fd,
+        exchange->outgoing + exchange->sent,
+        exchange->outgoing_size - exchange->sent, MSG_NOSIGNAL);
+    if (bytes_sent > 0) {
+      exchange->sent += bytes_sent;
+    } else if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+          errno == EINTR)) {
+      *upstream_events = POLLOUT;
+      return 1;
+    } else {
+      break;
+    }
+  }
+  if (exchange->sent < exchange->outgoing_size) {
+    proxy_upstream_failed(exchange, expired);
+  } else if (!exchange->opaque) {
+    exchange->response_size = exchange->response_scanned = 0;
+    exchange->stage = PROXY_READ_RESPONSE;
+  } else if (relay_open(&exchange->relay, exchange->fd,
+        exchange->upstream_fd) < 0) {
+    proxy_fail(exchange, 502);
+  } else {
+    proxy_log(exchange->fd, exchange->request, exchange->request_size, 0, 0);
+    exchange->relay_open = 1;
+    exchange->stage = PROXY_RELAY;
+  }
+  return 0;
+}
+
+static int proxy_read_response(struct proxy_exchange *exchange, int expired,
+    short *upstream_events) {
+  while (!expired && exchange->response_size < sizeof(exchange->response)) {
+    ssize_t bytes_read = read(exchange->upstream_fd,
+        exchange->response + exchange->response_size,
+        sizeof(exchange->response) - exchange->response_size);
+    if (bytes_read > 0) {
+      exchange->response_size += bytes_read;
+      exchange->response_head = http_request_head_end(exchange->response,
+          exchange->response_size, &exchange->response_scanned);
+      if (exchange->response_head > 0) {
+        proxy_respond(exchange);
+        return 0;
+      }
+    } else if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+          errno == EINTR)) {
+      *upstream_events = POLLIN;
+      return 1;
+    } else {
+      break;
+    }
+  }
+  /* Closed, silent or a head too big to forward. */
+  proxy_upstream_failed(exchange, expired);
+  return 0;
+}
+
+/* Output buffered for the client goes out before the body is spliced
+ * after it; for a chunked body, before more is read. */
+static int proxy_forward_body(struct proxy_exchange *exchange, int expired,
+    short *client_events, short *upstream_events) {
+  int status = expired ? -1 : http_flush(exchange->fd);
+  if (status > 0) {
+    *client_events = POLLOUT;
+    return 1;
+  }
+  if (status == 0) {
+    status = relay_channel_run(&exchange->body, upstream_events, client_events);
+    if (status == 0) return 1;
+  }
+  proxy_release(exchange, status > 0);
+  return 0;
+}
+
+static int proxy_forward_chunked(struct proxy_exchange *exchange, int expired,
+    short *client_events, short *upstream_events) {
+  while (!expired) {
+    int flushed = http_flush(exchange->fd);
+    if (flushed < 0) break;
+    if (flushed > 0) {
+      *client_events = POLLOUT;
+      return 1;
+    }
+
+    if (exchange->chunk_size > 0) {
+      size_t deliver;
+      ssize_t body_end = exchange->dechunk ?
+        http_chunked_decode(&exchange->chunked_state, exchange->chunk,
+            exchange->chunk_size, &deliver) :
+        http_chunked_scan(&exchange->chunked_state, exchange->chunk,
+            exchange->chunk_size);
+      if (body_end < 0) break;
+      if (!exchange->dechunk)
+        deliver = body_end > 0 ? (size_t) body_end : exchange->chunk_size;
+      if (deliver > 0 &&
+          http_send_data(exchange->fd, exchange->chunk, deliver) < 0)
+        break;
+      if (body_end > 0) {
+        /* Bytes past the body put the connection out of step. */
+        proxy_release(exchange, (size_t) body_end == exchange->chunk_size);
+        return 0;
+      }
+      exchange->chunk_size = 0;
+      continue;
+    }
+
+    ssize_t bytes_read = read(exchange->upstream_fd, exchange->response,
+        sizeof(exchange->response));
+    if (bytes_read > 0) {
+      exchange->chunk = exchange->response;
+      exchange->chunk_size = bytes_read;
+    } else if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+          errno == EINTR)) {
+      *upstream_events = POLLIN;
+      return 1;
+    } else {
+      break;
+    }
+  }
+  proxy_release(exchange, 0);
+  return 0;
+}
+
+static int proxy_relay(struct proxy_exchange *exchange, int expired,
+    short *client_events, short *upstream_events) {
+  int status = expired ? -1 :
+    relay_run(&exchange->relay, client_events, upstream_events);
+  if (status == 0) return 1;
+  proxy_release(exchange, 0);
+  return 0;
 }
 
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Takes EXCHANGE as far as it goes without blocking. Returns 1 if it has
+ * to wait for *CLIENT_EVENTS on the client or *UPSTREAM_EVENTS on the
+ * upstream connection, for up to *TIMEOUT seconds, or 0 once it is over.
  */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+static int proxy_step(struct proxy_exchange *exchange, short *client_events,
+    short *upstream_events, int *timeout) {
+  int expired = !exchange->ready;
+  exchange->ready = 1;
+  *client_events = *upstream_events = 0;
+  while (1) {
+    int waiting = 0;
+    switch (exchange->stage) {
+      case PROXY_READ_REQUEST:
+        waiting = proxy_read_request(exchange, expired, client_events);
+        break;
+      case PROXY_CONNECT:
+        waiting = proxy_await_connect(exchange, expired, upstream_events);
+        break;
+      case PROXY_SEND_REQUEST:
+        waiting = proxy_send_request(exchange, expired, upstream_events);
+        break;
+      case PROXY_READ_RESPONSE:
+        waiting = proxy_read_response(exchange, expired, upstream_events);
+        break;
+      case PROXY_FORWARD_BODY:
+        waiting = proxy_forward_body(exchange, expired, client_events,
+            upstream_events);
+        break;
+      case PROXY_FORWARD_CHUNKED:
+        waiting = proxy_forward_chunked(exchange, expired, client_events,
+            upstream_events);
+        break;
+      case PROXY_RELAY:
+        waiting = proxy_relay(exchange, expired, client_events,
+            upstream_events);
+        break;
+      case PROXY_DONE:
+        return 0;
+    }
+    if (waiting) {
+      *timeout = exchange->stage == PROXY_READ_REQUEST ? header_timeout :
+        proxy_timeout;
+      return 1;
+    }
+    /* The stage that waited has dealt with the timeout. */
+    expired = 0;
+  }
+}
 
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
+static void proxy_resume(int fd, void *context, int ready);
 
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-  if (*socket_number == -1) {
-    perror("Failed to create a new socket");
-    exit(errno);
+/*
+ * Runs EXCHANGE until it is over. On a reactor it is set aside whenever it
+ * has to wait, and proxy_resume takes it up again; elsewhere the calling
+ * thread polls.
+ */
+static void proxy_run(struct proxy_exchange *exchange) {
+  short client_events, upstream_events;
+  int timeout;
+  while (proxy_step(exchange, &client_events, &upstream_events, &timeout)) {
+    int watch_fd = upstream_events ? exchange->upstream_fd : -1;
+    if (evloop_await(exchange->fd, client_events, watch_fd, upstream_events,
+          timeout, proxy_resume, exchange) == 0)
+      return;
+
+    struct pollfd pollfds[2] = {
+      { .fd = exchange->fd, .events = client_events },
+      { .fd = watch_fd, .events = upstream_events },
+    };
+    int ready;
+    do {
+      ready = poll(pollfds, 2, timeout * 1000);
+    } while (ready < 0 && errno == EINTR);
+    /* A client that hangs up ends the wait as a timeout would. */
+    exchange->ready = ready > 0 && !(pollfds[0].revents & (POLLHUP | POLLERR) &&
+        !(pollfds[0].revents & client_events));
   }
 
-  int socket_option = 1;
-  if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
-        sizeof(socket_option)) == -1) {
-    perror("Failed to set socket options");
-    exit(errno);
+  if (exchange->body_open) relay_channel_close(&exchange->body);
+  if (exchange->relay_open) relay_close(&exchange->relay);
+  if (exchange->upstream_fd >= 0) close(exchange->upstream_fd);
+  free(exchange);
+}
+
+static void proxy_resume(int fd, void *context, int ready) {
+  struct proxy_exchange *exchange = context;
+  exchange->ready = ready;
+  proxy_run(exchange);
+}
+
+/*
+ * Relays one request from the stream fd to the proxy target
+ * (hostname=server_proxy_hostname and port=server_proxy_port) and its
+ * response back to the client (fd).
+ *
+ *   +--------+     +------------+     +--------------+
+ *   | client | <-> | httpserver | <-> | proxy target |
+ *   +--------+     +------------+     +--------------+
+ *
+ * Requests without a body go out as HTTP/1.1 keep-alive requests over a
+ * pooled upstream connection, and the response is forwarded by its framing
+ * (Content-Length through splice, chunked by scanning), so the connection
+ * can go back to the pool. A warm pool saves the DNS lookup and the TCP
+ * handshake. Anything else (request bodies, upgrades, unframed responses)
+ * is relayed opaquely over a connection of its own. The exchange never
+ * blocks, so on the event loop a slow target or client holds up no one
+ * else.
+ */
+void handle_proxy_request(int fd) {
+  struct proxy_exchange *exchange = malloc(sizeof(*exchange));
+  if (!exchange) {
+    send_error(fd, 500);
+    return;
   }
+  char *pending = NULL;
+  size_t size = http_take_pending_input(fd, &pending);
+  if (size > sizeof(exchange->request)) size = sizeof(exchange->request);
+  if (size > 0) memcpy(exchange->request, pending, size);
+  exchange->fd = fd;
+  exchange->upstream_fd = -1;
+  exchange->stage = PROXY_READ_REQUEST;
+  exchange->ready = 1;
+  exchange->opaque = exchange->body_open = exchange->relay_open = 0;
+  exchange->request_size = size;
+  exchange->request_head = exchange->request_scanned = 0;
+  proxy_run(exchange);
+}
 
-  memset(&server_address, 0, sizeof(server_address));
-  server_address.sin_family = AF_INET;
-  server_address.sin_addr.s_addr = INADDR_ANY;
-  server_address.sin_port = htons(server_port);
+/* The handler that requests within their client's rate go on to. */
+static void (*rate_limited_handler)(int);
 
-  if (bind(*socket_number, (struct sockaddr *) &server_address,
-        sizeof(server_address)) == -1) {
-    perror("Failed to bind on socket");
-    exit(errno);
+/*
+ * Stands in front of the request handler when --rate-limit is set. A
+ * request over its client's rate is parsed and answered with 429 here.
+ */
+static void handle_rate_limited_request(int fd) {
+  if (admission_allow(http_peer_address(fd)->sin_addr.s_addr)) {
+    rate_limited_handler(fd);
+    return;
   }
+  STATS_COUNT(STATS_REQUESTS_LIMITED);
+  struct http_request *request = http_request_parse(fd);
+  http_start_response(fd, 429);
+  http_send_header(fd, "Retry-After", "1");
+  http_send_header(fd, "Content-Length", "0");
+  http_end_headers(fd);
+  if (request) http_request_free(request);
+}
 
-  if (listen(*socket_number, 1024) == -1) {
-    perror("Failed to listen on socket");
+/*
+ * Serves requests on FD until the client or keep-alive limits end the
+ * connection, it idles past keep_alive_timeout (header_timeout before its
+ * first request) or it takes longer than header_timeout over a head, then
+ * closes it. Handlers only run once a whole head is buffered, so a slow
+ * client can't hold the worker inside a read.
+ */
+static void serve_connection(int fd, void (*request_handler)(int)) {
+  static __thread struct http_connection *connection;
+  if (!connection && !(connection = malloc(sizeof(*connection)))) {
+    perror("Failed to allocate connection");
     exit(errno);
   }
 
+  http_connection_init(connection, fd);
+  http_connection_bind(connection);
+  STATS_COUNT(STATS_CONNECTIONS);
+  int idle_timeout = header_timeout;
+  while (http_connection_wait(connection, idle_timeout * 1000,
+        header_timeout * 1000)) {
+    STATS_REQUEST_BEGIN();
+    request_handler(fd);
+    accesslog_request(connection);
+    int keep_alive = http_connection_finish(connection);
+    STATS_REQUEST_END(connection->response_status);
+    if (!keep_alive) break;
+    idle_timeout = keep_alive_timeout;
+  }
+  http_connection_bind(NULL);
+  close(fd);
+  admission_release();
+}
+
+/*
+ * Body of every pool thread: pops accepted sockets off work_queue and serves
+ * them, forever.
+ */
+static void *thread_pool_worker(void *arg) {
+  void (*request_handler)(int) = *(void (**)(int)) arg;
+
+  while (1) {
+    int client_socket_number = wq_pop(&work_queue);
+    STATS_DEQUEUED(client_socket_number);
+    serve_connection(client_socket_number, request_handler);
+  }
+  return NULL;
+}
+
+/*
+ * Starts NUM_THREADS detached workers that serve the sockets serve_forever
+ * pushes onto work_queue. With no workers, serve_forever keeps serving
+ * inline on the accept thread.
+ */
+void init_thread_pool(int num_threads, void (*request_handler)(int)) {
+  static void (*pool_request_handler)(int);
+  pool_request_handler = request_handler;
+
+  if (work_queue_lock_free)
+    wq_init_ring(&work_queue, work_queue_capacity);
+  else
+    wq_init(&work_queue, work_queue_capacity);
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, thread_pool_worker,
+        &pool_request_handler);
+    if (err != 0) {
+      fprintf(stderr, "Failed to create worker thread: %s\n", strerror(err));
+      exit(err);
+    }
+    pthread_detach(thread);
+  }
+}
+
+/*
+ * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
+ * the fd number of the server socket in *socket_number. For each accepted
+ * connection, calls request_handler with the accepted fd number.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+
+  /* io_uring serves --files only: the proxy reads and writes client
+   * sockets itself, so proxy mode falls back to the event loop. */
+  if (use_io_uring && server_proxy_hostname) {
+    fprintf(stderr, "--io-uring serves --files only; using the event loop\n");
+    use_event_loop = 1;
+  } else if (use_io_uring) {
+    uring_serve_forever(server_port, num_threads, &listen_options,
+        keep_alive_timeout, header_timeout, request_handler);
+    perror("io_uring is unavailable; using the event loop");
+    use_event_loop = 1;
+  }
+
+  /* Shards are reactors: each accepts on its own listener, on its own
+   * core, and an idle keep-alive connection doesn't hold up the rest. */
+  if (use_event_loop || sharded) {
+    use_event_loop = 1;
+    evloop_serve_forever(server_port, num_threads, &listen_options,
+        keep_alive_timeout, header_timeout, request_handler);
+    return;
+  }
+
+  int client_socket_number;
+
+  *socket_number = listener_open(server_port, &listen_options);
+
   printf("Listening on port %d...\n", server_port);
 
   init_thread_pool(num_threads, request_handler);
 
   while (1) {
-    client_socket_number = accept(*socket_number,
-        (struct sockaddr *) &client_address,
-        (socklen_t *) &client_address_length);
+    client_socket_number = accept4(*socket_number, NULL, NULL,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (client_socket_number < 0) {
       perror("Error accepting socket");
       continue;
     }
+    STATS_START(accepted);
+    if (!admission_admit(client_socket_number)) continue;
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
-
-    // TODO: Change me?
-    request_handler(client_socket_number);
-    close(client_socket_number);
-
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+    /* Blocks while the queue is full, so a saturated pool stops us from
+     * accepting and the kernel's listen backlog absorbs the burst. */
+    if (num_threads > 0) {
+      STATS_RECORD(STATS_ACCEPT, accepted);
+      STATS_ENQUEUED(client_socket_number);
+      if (wq_push(&work_queue, client_socket_number) < 0) {
+        perror("Failed to queue socket");
+        close(client_socket_number);
+        admission_release();
+      }
+    } else {
+      serve_connection(client_socket_number, request_handler);
+    }
   }
 
   shutdown(*socket_number, SHUT_RDWR);
   close(*socket_number);
 }
 
-int server_fd;
-void signal_callback_handler(int signum) {
+int server_fd = -1;  // The pool's listener; the engines keep their own.
+
+/*
+ * Waits for SIGINT, which every other thread keeps blocked, and shuts the
+ * server down as ordinary code rather than in a signal handler: printf,
+ * the content cache's lock and the access log's flush would deadlock
+ * there against a thread the signal interrupted while holding them.
+ */
+static void *signal_thread(void *arg) {
+  sigset_t *signals = arg;
+  int signum;
+  while (sigwait(signals, &signum) != 0)
+    ;
   printf("Caught signal %d: %s\n", signum, strsignal(signum));
-  printf("Closing socket %d\n", server_fd);
-  if (close(server_fd) < 0) perror("Failed to close server_fd (ignoring)\n");
+  if (hotcache_enabled()) {
+    struct hotcache_stats stats;
+    hotcache_get_stats(&stats);
+    printf("Content cache: %lu hits, %lu misses, %lu evictions, "
+        "%lu invalidations, %zu bytes\n", stats.hits, stats.misses,
+        stats.evictions, stats.invalidations, stats.bytes);
+  }
+  accesslog_flush();
+  if (server_fd >= 0) {
+    printf("Closing socket %d\n", server_fd);
+    if (close(server_fd) < 0) perror("Failed to close server_fd (ignoring)\n");
+  }
   exit(0);
 }
 
+/* Blocks SIGINT, for the threads started from here on too, and starts
+ * signal_thread to take it. */
+static void start_signal_thread() {
+  static sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, signal_thread, &signals);
+  if (err != 0) {
+    fprintf(stderr, "Failed to create signal thread: %s\n", strerror(err));
+    exit(err);
+  }
+  pthread_detach(thread);
+}
+
 char *USAGE =
   "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n"
+  "\n"
+  "Options:\n"
+  "  --num-threads N   serve connections from a pool of N worker threads\n"
+  "  --queue-size N    accepted connections that may wait for a worker\n"
+  "                    before accept() stops (default 1024)\n"
+  "  --queue-backend list|ring\n"
+  "                    back the work queue with a locked list (default) or\n"
+  "                    a lock-free ring\n"
+  "  --event-loop      serve from epoll reactor threads (one per\n"
+  "                    --num-threads) instead of a worker pool\n"
+  "  --io-uring        serve --files from io_uring threads (one per\n"
+  "                    --num-threads); falls back to --event-loop where the\n"
+  "                    kernel lacks io_uring\n"
+  "  --sharded         serve from --num-threads reactors (or io_uring\n"
+  "                    threads), each pinned to its own core with its own\n"
+  "                    SO_REUSEPORT listener\n"
+  "  --steer-by-cpu    with --sharded or --event-loop, hand each connection\n"
+  "                    to the listener on the core that received it\n"
+  "                    (SO_ATTACH_REUSEPORT_CBPF)\n"
+  "  --defer-accept S  don't accept a connection until its first bytes\n"
+  "                    arrive or S seconds pass (TCP_DEFER_ACCEPT)\n"
+  "  --fd-cache-size N open files (and their stat) kept cached in --files\n"
+  "                    mode; 0 disables (default 256)\n"
+  "  --cache-mb N      keep up to N MB of small hot files in memory with\n"
+  "                    pre-rendered headers (default 0, disabled)\n"
+  "  --proxy-pool-size N\n"
+  "                    idle upstream connections kept per worker in --proxy\n"
+  "                    mode; 0 disables pooling (default 8)\n"
+  "  --proxy-idle-timeout S\n"
+  "                    close pooled connections idle for S seconds (default 30)\n"
+  "  --dns-ttl S       re-resolve the proxy target every S seconds (default 60)\n"
+  "  --proxy-timeout S give up on a proxy target that stays silent for S\n"
+  "                    seconds, with a 504 if it hasn't answered yet\n"
+  "                    (default 30)\n"
+  "  --header-timeout S\n"
+  "                    close connections that take more than S seconds to\n"
+  "                    send a request head, or to start their first one,\n"
+  "                    or that take none of a response for S seconds\n"
+  "                    (default 10)\n"
+  "  --max-connections N\n"
+  "                    answer connections past N open ones with an\n"
+  "                    immediate 503 (default 0, unlimited)\n"
+  "  --rate-limit N    answer requests from a client address past N a\n"
+  "                    second with 429 (default 0, unlimited)\n"
+  "  --rate-burst N    requests a client may make at once under\n"
+  "                    --rate-limit (default N of --rate-limit)\n"
+  "  --keep-alive-timeout S\n"
+  "                    close keep-alive connections idle for S seconds\n"
+  "                    (default 5)\n"
+  "  --max-requests N  requests served per connection before it is closed;\n"
+  "                    1 disables keep-alive (default 100)\n"
+  "  --mime-types FILE add Content-Types from a mime.types style FILE to the\n"
+  "                    built-in table\n"
+  "  --listing-cache-mb N\n"
+  "                    keep up to N MB of rendered directory listings\n"
+  "                    (default 8, 0 disables)\n"
+  "  --sorted-listings sort directory listings by name; the first byte of an\n"
+  "                    uncached listing then waits for the whole directory\n"
+  "  --compress-cache-mb N\n"
+  "                    keep up to N MB of gzip/brotli variants of text files\n"
+  "                    without a .gz/.br sibling (default 16, 0 disables)\n"
+  "  --compress-threads N\n"
+  "                    idle-priority threads compressing those variants\n"
+  "                    (default 1)\n"
+  "  --access-log FILE log each request to FILE (- for stdout) in Common Log\n"
+  "                    Format, written in batches by a background thread\n"
+  "  --access-log-sample N\n"
+  "                    log only every Nth request of each thread (default 1)\n"
+  "  --access-log-max-mb N\n"
+  "                    rename the log to FILE.1 and start a new one when it\n"
+  "                    would pass N MB (default 0, never)\n"
+#ifdef HTTP_STATS
+  "  --stats           answer GET /__stats with the server's counters and\n"
+  "                    per-stage latency histograms in Prometheus text\n"
+  "                    format; any client may ask, and a file or upstream\n"
+  "                    path of that name is hidden (default off)\n"
+#endif
+  ;
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
@@ -218,7 +1479,9 @@ void exit_with_usage() {
 }
 
 int main(int argc, char **argv) {
-  signal(SIGINT, signal_callback_handler);
+  start_signal_thread();
+  /* A client hanging up mid-response must not take the whole server down. */
+  signal(SIGPIPE, SIG_IGN);
 
   /* Default settings */
   server_port = 8000;
@@ -265,6 +1528,162 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--queue-size", argv[i]) == 0) {
+      char *queue_size_str = argv[++i];
+      if (!queue_size_str || (work_queue_capacity = atoi(queue_size_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --queue-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-backend", argv[i]) == 0) {
+      char *backend = argv[++i];
+      if (backend && strcmp(backend, "ring") == 0) {
+        work_queue_lock_free = 1;
+      } else if (backend && strcmp(backend, "list") == 0) {
+        work_queue_lock_free = 0;
+      } else {
+        fprintf(stderr, "Expected \"list\" or \"ring\" after --queue-backend\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--event-loop", argv[i]) == 0) {
+      use_event_loop = 1;
+    } else if (strcmp("--io-uring", argv[i]) == 0) {
+      use_io_uring = 1;
+    } else if (strcmp("--fd-cache-size", argv[i]) == 0) {
+      char *fd_cache_size_str = argv[++i];
+      if (!fd_cache_size_str || (fd_cache_size = atoi(fd_cache_size_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --fd-cache-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-mb", argv[i]) == 0) {
+      char *cache_mb_str = argv[++i];
+      if (!cache_mb_str || (content_cache_mb = atoi(cache_mb_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --cache-mb\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-pool-size", argv[i]) == 0) {
+      char *pool_size_str = argv[++i];
+      if (!pool_size_str || (proxy_pool_size = atoi(pool_size_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --proxy-pool-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-idle-timeout", argv[i]) == 0) {
+      char *idle_timeout_str = argv[++i];
+      if (!idle_timeout_str || (proxy_idle_timeout = atoi(idle_timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --proxy-idle-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--dns-ttl", argv[i]) == 0) {
+      char *dns_ttl_str = argv[++i];
+      if (!dns_ttl_str || (proxy_dns_ttl = atoi(dns_ttl_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --dns-ttl\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-timeout", argv[i]) == 0) {
+      char *proxy_timeout_str = argv[++i];
+      if (!proxy_timeout_str || (proxy_timeout = atoi(proxy_timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --proxy-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--keep-alive-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (keep_alive_timeout = atoi(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --keep-alive-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--header-timeout", argv[i]) == 0) {
+      char *header_timeout_str = argv[++i];
+      if (!header_timeout_str || (header_timeout = atoi(header_timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --header-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-connections", argv[i]) == 0) {
+      char *max_connections_str = argv[++i];
+      if (!max_connections_str ||
+          (max_connections = atoi(max_connections_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --max-connections\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-limit", argv[i]) == 0) {
+      char *rate_limit_str = argv[++i];
+      if (!rate_limit_str || (rate_limit = atoi(rate_limit_str)) < 0 ||
+          rate_limit > 1000000) {
+        fprintf(stderr, "Expected integer from 0 to 1000000 after --rate-limit\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-burst", argv[i]) == 0) {
+      char *rate_burst_str = argv[++i];
+      if (!rate_burst_str || (rate_burst = atoi(rate_burst_str)) < 1 ||
+          rate_burst > 1000000) {
+        fprintf(stderr, "Expected integer from 1 to 1000000 after --rate-burst\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-requests", argv[i]) == 0) {
+      char *max_requests_str = argv[++i];
+      if (!max_requests_str ||
+          (max_requests_per_connection = atoi(max_requests_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-requests\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--mime-types", argv[i]) == 0) {
+      mime_types_path = argv[++i];
+      if (!mime_types_path) {
+        fprintf(stderr, "Expected argument after --mime-types\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--listing-cache-mb", argv[i]) == 0) {
+      char *listing_cache_str = argv[++i];
+      if (!listing_cache_str || (listing_cache_mb = atoi(listing_cache_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --listing-cache-mb\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--sorted-listings", argv[i]) == 0) {
+      sorted_listings = 1;
+    } else if (strcmp("--sharded", argv[i]) == 0) {
+      sharded = 1;
+      listen_options.pin_cpus = 1;
+    } else if (strcmp("--steer-by-cpu", argv[i]) == 0) {
+      listen_options.steer_by_cpu = 1;
+    } else if (strcmp("--defer-accept", argv[i]) == 0) {
+      char *defer_accept_str = argv[++i];
+      if (!defer_accept_str ||
+          (listen_options.defer_accept = atoi(defer_accept_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --defer-accept\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--compress-cache-mb", argv[i]) == 0) {
+      char *compress_cache_str = argv[++i];
+      if (!compress_cache_str || (compress_cache_mb = atoi(compress_cache_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --compress-cache-mb\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--compress-threads", argv[i]) == 0) {
+      char *compress_threads_str = argv[++i];
+      if (!compress_threads_str || (compress_threads = atoi(compress_threads_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --compress-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log", argv[i]) == 0) {
+      access_log_path = argv[++i];
+      if (!access_log_path) {
+        fprintf(stderr, "Expected argument after --access-log\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log-sample", argv[i]) == 0) {
+      char *sample_str = argv[++i];
+      if (!sample_str || (access_log_sample = atoi(sample_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --access-log-sample\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log-max-mb", argv[i]) == 0) {
+      char *max_mb_str = argv[++i];
+      if (!max_mb_str || (access_log_max_mb = atoi(max_mb_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --access-log-max-mb\n");
+        exit_with_usage();
+      }
+#ifdef HTTP_STATS
+    } else if (strcmp("--stats", argv[i]) == 0) {
+      serve_stats = 1;
+#endif
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -279,6 +1698,33 @@ int main(int argc, char **argv) {
     exit_with_usage();
   }
 
+  http_set_max_requests(max_requests_per_connection);
+  http_set_send_timeout(header_timeout);
+  STATS_INIT();
+  admission_init(max_connections, rate_limit, rate_burst);
+  if (admission_rate_limited) {
+    rate_limited_handler = request_handler;
+    request_handler = handle_rate_limited_request;
+  }
+  if (access_log_path)
+    accesslog_init(access_log_path, access_log_sample,
+        (size_t) access_log_max_mb << 20);
+  if (mime_types_path && mime_load(mime_types_path) < 0) {
+    perror("Failed to load MIME types");
+    exit(errno);
+  }
+
+  if (server_files_directory != NULL) {
+    fdcache_init(fd_cache_size, server_files_directory);
+    hotcache_init((size_t) content_cache_mb << 20);
+    fdcache_set_change_hook(hotcache_invalidate);
+    dirlist_init((size_t) listing_cache_mb << 20, sorted_listings);
+    encoding_init((size_t) compress_cache_mb << 20, compress_threads);
+  }
+  if (server_proxy_hostname != NULL)
+    upstream_init(server_proxy_hostname, server_proxy_port, proxy_dns_ttl,
+        proxy_pool_size, proxy_idle_timeout);
+
   serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
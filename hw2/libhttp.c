@@ -1,70 +1,529 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
 #include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "libhttp.h"
-
-#define LIBHTTP_REQUEST_MAX_SIZE 8192
+#include "mime.h"
+#include "stats.h"
 
 void http_fatal_error(char *message) {
   fprintf(stderr, "%s\n", message);
   exit(ENOBUFS);
 }
 
-struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
+static int http_output_append(struct http_connection *connection,
+    const char *data, size_t size);
+
+
+size_t http_request_head_end(const char *buffer, size_t size, size_t *scanned) {
+  size_t i = *scanned;
+  for (; i < size; i++) {
+    if (buffer[i] != '\n') continue;
+    /* Accept both "\r\n\r\n" and bare "\n\n" terminators. */
+    if (i >= 1 && buffer[i - 1] == '\n') return i + 1;
+    if (i >= 2 && buffer[i - 1] == '\r' && buffer[i - 2] == '\n') return i + 1;
+  }
+  *scanned = i;
+  return 0;
+}
+
+int http_find_header(const char *head, size_t size, const char *name,
+    const char **value, size_t *value_size) {
+  size_t name_length = strlen(name);
+  const char *end = head + size;
+  const char *line = memchr(head, '\n', size); /* Skip the start line. */
+
+  while (line && ++line < end) {
+    const char *line_end = memchr(line, '\n', end - line);
+    if (!line_end) line_end = end;
+    if ((size_t) (line_end - line) > name_length && line[name_length] == ':' &&
+        strncasecmp(line, name, name_length) == 0) {
+      const char *start = line + name_length + 1, *stop = line_end;
+      while (start < stop && (*start == ' ' || *start == '\t')) start++;
+      while (stop > start && isspace((unsigned char) stop[-1])) stop--;
+      *value = start;
+      *value_size = stop - start;
+      return 1;
+    }
+    line = line_end < end ? line_end : NULL;
+  }
+  return 0;
+}
+
+enum {
+  CHUNKED_SIZE,
+  CHUNKED_EXTENSION,
+  CHUNKED_DATA,
+  CHUNKED_DATA_END,
+  CHUNKED_TRAILER,
+};
+
+/*
+ * Follows the chunked framing of the SIZE bytes at DATA, as
+ * http_chunked_scan does. With DECODED set, chunk data is also moved to the
+ * front of DATA, and *DECODED counts how much of it there is.
+ */
+static ssize_t http_chunked_step(struct http_chunked_state *state, char *data,
+    size_t size, size_t *decoded) {
+  size_t i = 0;
+  while (i < size) {
+    char c = data[i];
+    switch (state->state) {
+      case CHUNKED_SIZE:
+      case CHUNKED_EXTENSION:
+        if (c == '\n') {
+          state->state = state->remaining > 0 ? CHUNKED_DATA : CHUNKED_TRAILER;
+          state->line_empty = 1;
+        } else if (state->state == CHUNKED_SIZE && isxdigit((unsigned char) c)) {
+          if (state->remaining >> (sizeof(size_t) * 8 - 4)) return -1;
+          state->remaining = state->remaining * 16 +
+            (isdigit((unsigned char) c) ? c - '0' : tolower((unsigned char) c) - 'a' + 10);
+        } else if (c != '\r') {
+          state->state = CHUNKED_EXTENSION;
+        }
+        i++;
+        break;
+      case CHUNKED_DATA: {
+        size_t take = size - i < state->remaining ? size - i : state->remaining;
+        if (decoded) {
+          memmove(data + *decoded, data + i, take);
+          *decoded += take;
+        }
+        state->remaining -= take;
+        i += take;
+        if (state->remaining == 0) state->state = CHUNKED_DATA_END;
+        break;
+      }
+      case CHUNKED_DATA_END:
+        if (c == '\n') state->state = CHUNKED_SIZE;
+        else if (c != '\r') return -1;
+        i++;
+        break;
+      case CHUNKED_TRAILER:
+        i++;
+        if (c == '\n') {
+          if (state->line_empty) return i;
+          state->line_empty = 1;
+        } else if (c != '\r') {
+          state->line_empty = 0;
+        }
+        break;
+    }
+  }
+  return 0;
+}
 
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
-  if (!read_buffer) http_fatal_error("Malloc failed");
+ssize_t http_chunked_scan(struct http_chunked_state *state, const char *data,
+    size_t size) {
+  return http_chunked_step(state, (char *) data, size, NULL);
+}
 
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
+ssize_t http_chunked_decode(struct http_chunked_state *state, char *data,
+    size_t size, size_t *decoded) {
+  *decoded = 0;
+  return http_chunked_step(state, data, size, decoded);
+}
+
+/* Reads a Content-Length value: decimal digits only, and no overflow. */
+static int http_parse_length(const char *value, size_t size, size_t *length) {
+  if (size == 0) return -1;
+  size_t result = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (!isdigit((unsigned char) value[i]) || result > (SIZE_MAX - 9) / 10)
+      return -1;
+    result = result * 10 + (value[i] - '0');
+  }
+  *length = result;
+  return 0;
+}
 
-  char *read_start, *read_end;
-  size_t read_size;
+int http_find_content_length(const char *head, size_t size, size_t *length) {
+  const char *value;
+  size_t value_size;
+  int found = 0;
+  while (http_find_header(head, size, "Content-Length", &value, &value_size)) {
+    if (found++ || http_parse_length(value, value_size, length) < 0) return -1;
+    /* Search on from the line after; the rest of this one is skipped as
+     * http_find_header skips a start line. */
+    size -= value + value_size - head;
+    head = value + value_size;
+  }
+  return found;
+}
+
+static int http_max_requests = 100;
+static int http_send_timeout_ms = -1;
+
+/* The connection bound to the calling thread, if any. */
+static __thread struct http_connection *current_connection;
+
+void http_set_max_requests(int max_requests) {
+  http_max_requests = max_requests;
+}
 
+void http_set_send_timeout(int seconds) {
+  http_send_timeout_ms = seconds > 0 ? seconds * 1000 : -1;
+}
+
+void http_connection_init(struct http_connection *connection, int fd) {
+  memset(connection, 0, offsetof(struct http_connection, parser));
+  connection->fd = fd;
+  connection->keep_alive = 1;
+  parser_init(&connection->parser);
+
+  /* Responses leave in whole writes, so Nagle would only hold back the
+   * last segment of one. */
+  int enabled = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+}
+
+void http_connection_bind(struct http_connection *connection) {
+  current_connection = connection;
+}
+
+/* Returns the connection bound to this thread if it serves fd. */
+static struct http_connection *http_bound_connection(int fd) {
+  struct http_connection *connection = current_connection;
+  return connection && connection->fd == fd ? connection : NULL;
+}
+
+/* Readies CONNECTION to parse the next request head in its buffer. */
+static void http_connection_next_head(struct http_connection *connection) {
+  connection->head_length = 0;
+  connection->head_error = 0;
+  parser_init(&connection->parser);
+}
+
+/*
+ * Discards what is buffered of the body the last request left unread, so
+ * the next head starts at a message boundary. Returns 1 once the whole body
+ * is gone, 0 while more of it has to arrive. A malformed chunked body, or
+ * one running past HTTP_SKIP_MAX_SIZE, ends keep-alive instead.
+ */
+static int http_connection_skip_body(struct http_connection *connection) {
+  size_t buffered = connection->size - connection->start;
+  if (connection->body_chunked) {
+    ssize_t body_end = http_chunked_scan(&connection->body_state,
+        connection->buffer + connection->start, buffered);
+    if (body_end > 0) {
+      connection->start += body_end;
+      connection->body_chunked = 0;
+      return 1;
+    }
+    connection->start += buffered;
+    connection->body_skipped += buffered;
+    if (body_end < 0 || connection->body_skipped > HTTP_SKIP_MAX_SIZE)
+      connection->keep_alive = 0;
+    return 0;
+  }
+
+  size_t take = buffered < connection->body_remaining ?
+    buffered : connection->body_remaining;
+  connection->start += take;
+  connection->body_remaining -= take;
+  return connection->body_remaining == 0;
+}
+
+/*
+ * A malformed head counts as a request too, spanning everything buffered,
+ * so the handler runs and answers it with an error.
+ */
+int http_connection_has_request(struct http_connection *connection) {
+  if (connection->head_length == 0) {
+    if (!connection->keep_alive || !http_connection_skip_body(connection))
+      return 0;
+    ssize_t result = parser_execute(&connection->parser,
+        connection->buffer + connection->start,
+        connection->size - connection->start);
+    if (result == PARSER_ERROR) {
+      connection->head_error = 1;
+      connection->head_length = connection->size - connection->start;
+    } else {
+      connection->head_length = result;
+    }
+  }
+  return connection->head_length > 0;
+}
+
+int http_connection_in_request(struct http_connection *connection) {
+  return connection->size > connection->start ||
+    connection->body_remaining > 0 || connection->body_chunked;
+}
+
+ssize_t http_connection_fill(struct http_connection *connection) {
+  if (connection->start > 0 && connection->head_length == 0) {
+    /* Slide the unconsumed bytes down to make room; a parsed head points
+     * into the buffer, so it only moves between heads. */
+    memmove(connection->buffer, connection->buffer + connection->start,
+        connection->size - connection->start);
+    connection->size -= connection->start;
+    connection->start = 0;
+  }
+  if (connection->size == sizeof(connection->buffer)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  ssize_t bytes_read;
   do {
-    /* Read in the HTTP method: "[A-Z]*" */
-    read_start = read_end = read_buffer;
-    while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
-
-    /* Read in a space character. */
-    read_start = read_end;
-    if (*read_end != ' ') break;
-    read_end++;
-
-    /* Read in the path: "[^ \n]*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
-
-    /* Read in HTTP version and rest of request line: ".*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != '\n') read_end++;
-    if (*read_end != '\n') break;
-    read_end++;
-
-    free(read_buffer);
-    return request;
-  } while (0);
-
-  /* An error occurred. */
-  free(request);
-  free(read_buffer);
-  return NULL;
+    bytes_read = read(connection->fd, connection->buffer + connection->size,
+        sizeof(connection->buffer) - connection->size);
+  } while (bytes_read < 0 && errno == EINTR);
+  if (bytes_read > 0) connection->size += bytes_read;
+  return bytes_read;
+}
+
+int http_connection_wait(struct http_connection *connection, int idle_ms,
+    int header_ms) {
+  struct timespec deadline = { 0, 0 };
+  while (!http_connection_has_request(connection)) {
+    int timeout_ms = idle_ms;
+    if (http_connection_in_request(connection)) {
+      /* Part of a request is in: the rest of it, and of any body being
+       * skipped ahead of it, is due by a fixed deadline, however slowly it
+       * trickles in. */
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+      if (deadline.tv_sec == 0) {
+        deadline = now;
+        deadline.tv_sec += header_ms / 1000;
+        deadline.tv_nsec += header_ms % 1000 * 1000000L;
+      }
+      timeout_ms = (deadline.tv_sec - now.tv_sec) * 1000 +
+        (deadline.tv_nsec - now.tv_nsec) / 1000000;
+      if (timeout_ms <= 0) {
+        STATS_COUNT(STATS_HEADER_TIMEOUTS);
+        return 0;
+      }
+    }
+    struct pollfd pollfd = { .fd = connection->fd, .events = POLLIN };
+    if (poll(&pollfd, 1, timeout_ms) < 0) return 0;
+    if (!connection->keep_alive) return 0;
+    ssize_t bytes_read = http_connection_fill(connection);
+    if (bytes_read == 0) return 0;
+    /* A full buffer without a head goes to the handler to be rejected. */
+    if (bytes_read < 0 && errno == ENOBUFS) return 1;
+    if (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return 0;
+    if (bytes_read < 0 && connection->size == connection->start) return 0;
+  }
+  return 1;
+}
+
+const struct sockaddr_in *http_connection_peer(
+    struct http_connection *connection) {
+  if (!connection->peer_known) {
+    socklen_t length = sizeof(connection->peer);
+    if (getpeername(connection->fd, (struct sockaddr *) &connection->peer,
+          &length) < 0)
+      memset(&connection->peer, 0, sizeof(connection->peer));
+    connection->peer_known = 1;
+  }
+  return &connection->peer;
+}
+
+const struct sockaddr_in *http_peer_address(int fd) {
+  static __thread struct sockaddr_in unbound_peer;
+  struct http_connection *connection = http_bound_connection(fd);
+  if (connection) return http_connection_peer(connection);
+  socklen_t length = sizeof(unbound_peer);
+  if (getpeername(fd, (struct sockaddr *) &unbound_peer, &length) < 0)
+    memset(&unbound_peer, 0, sizeof(unbound_peer));
+  return &unbound_peer;
+}
+
+void http_connection_set_sink(struct http_connection *connection,
+    const struct http_sink *sink, void *context) {
+  connection->sink = sink;
+  connection->sink_context = context;
+}
+
+int http_flush(int fd) {
+  struct http_connection *connection = http_bound_connection(fd);
+  if (!connection) return 0;
+  if (http_response_flush(connection) < 0) return -1;
+  if (!connection->sink || !connection->sink->pending) return 0;
+  return connection->sink->pending(connection->sink_context);
+}
+
+size_t http_take_pending_input(int fd, char **data) {
+  struct http_connection *connection = http_bound_connection(fd);
+  if (!connection) return 0;
+  connection->keep_alive = 0;
+  *data = connection->buffer + connection->start;
+  size_t size = connection->size - connection->start;
+  connection->start = connection->size;
+  http_connection_next_head(connection);
+  return size;
+}
+
+/* Whether the comma separated list in VALUE holds TOKEN. */
+static int http_slice_has_token(const struct http_slice *value,
+    const char *token) {
+  size_t token_length = strlen(token);
+  const char *p = value->data, *end = value->data + value->size;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    const char *item = p;
+    while (p < end && *p != ',') p++;
+    const char *item_end = p;
+    while (item_end > item && (item_end[-1] == ' ' || item_end[-1] == '\t'))
+      item_end--;
+    if ((size_t) (item_end - item) == token_length &&
+        strncasecmp(item, token, token_length) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Sets up the keep-alive and body framing state for the request just
+ * parsed into CONNECTION's parser. */
+static void http_connection_begin_request(struct http_connection *connection) {
+  struct http_parser *parser = &connection->parser;
+
+  connection->requests++;
+  connection->response_started = 0;
+  connection->response_framed = 0;
+  connection->response_chunked = 0;
+  connection->response_in_body = 0;
+  connection->response_status = 0;
+  connection->response_bytes = 0;
+  connection->body_remaining = 0;
+  connection->body_chunked = 0;
+  memset(&connection->body_state, 0, sizeof(connection->body_state));
+  connection->body_skipped = 0;
+  if (connection->head_error) {
+    connection->http_1_0 = 0;
+    connection->head_request = 0;
+    connection->keep_alive = 0;
+    return;
+  }
+
+  int version_minor = -1;
+  if (parser->version.size == 8 &&
+      strncmp(parser->version.data, "HTTP/1.", 7) == 0)
+    version_minor = parser->version.data[7] - '0';
+  connection->http_1_0 = version_minor == 0;
+  connection->head_request = parser->method.size == 4 &&
+    strncmp(parser->method.data, "HEAD", 4) == 0;
+
+  const struct http_slice *value = parser_find_header(parser, "Connection");
+  int keep_alive_requested = version_minor == 0 ?
+    value && http_slice_has_token(value, "keep-alive") :
+    version_minor >= 1 && !(value && http_slice_has_token(value, "close"));
+  connection->keep_alive = connection->keep_alive && keep_alive_requested &&
+    connection->requests < http_max_requests;
+
+  /* A Content-Length that isn't a plain number, or comes twice, makes the
+   * body's end unknowable: the head is rejected as malformed. */
+  const struct http_slice *length = NULL;
+  for (int i = 0; i < parser->num_headers; i++) {
+    const struct http_slice *name = &parser->headers[i].name;
+    if (name->size != 14 || strncasecmp(name->data, "Content-Length", 14) != 0)
+      continue;
+    if (length || http_parse_length(parser->headers[i].value.data,
+          parser->headers[i].value.size, &connection->body_remaining) < 0) {
+      connection->head_error = 1;
+      connection->keep_alive = 0;
+      connection->body_remaining = 0;
+      return;
+    }
+    length = &parser->headers[i].value;
+  }
+  connection->body_chunked =
+    parser_find_header(parser, "Transfer-Encoding") != NULL;
+  if (connection->body_chunked) connection->body_remaining = 0;
+}
+
+/*
+ * Pipelined responses are coalesced: while the next request's head is
+ * already buffered, this response waits in the output buffer and leaves in
+ * one write with the next, flushed once the buffer fills or the last
+ * request buffered has been answered.
+ */
+int http_connection_finish(struct http_connection *connection) {
+  if (connection->response_chunked)
+    http_output_append(connection, "0\r\n\r\n", 5);
+  if (!connection->response_started) connection->keep_alive = 0;
 
+  http_connection_next_head(connection);
+  connection->request_parsed = 0;
+  if ((!connection->keep_alive || !http_connection_has_request(connection)) &&
+      http_response_flush(connection) < 0)
+    connection->keep_alive = 0;
+  return connection->keep_alive;
+}
+
+/*
+ * Reads a request from fd. With a bound connection the head comes from
+ * (and is consumed from) its buffer; otherwise it is read into a buffer the
+ * thread keeps for unbound callers.
+ */
+struct http_request *http_request_parse(int fd) {
+  static __thread struct http_connection *unbound_connection;
+  STATS_START(start);
+  struct http_connection *connection = http_bound_connection(fd);
+  if (!connection) {
+    if (!unbound_connection &&
+        !(unbound_connection = malloc(sizeof(*unbound_connection))))
+      http_fatal_error("Malloc failed");
+    connection = unbound_connection;
+    http_connection_init(connection, fd);
+  }
+
+  while (!http_connection_has_request(connection)) {
+    if (!connection->keep_alive) return NULL;
+    ssize_t bytes_read = http_connection_fill(connection);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+      poll(&pollfd, 1, -1);
+    } else if (bytes_read <= 0) {
+      connection->keep_alive = 0;
+      return NULL;
+    }
+  }
+
+  /* The parser keeps its results until http_connection_finish readies it
+   * for the next head. */
+  http_connection_begin_request(connection);
+  connection->start += connection->head_length;
+  connection->head_length = 0;
+  connection->request_parsed = 1;
+  STATS_PARSED(start);
+  if (connection->head_error) return NULL;
+
+  /* Terminate method and path in place; what follows each is a delimiter
+   * the parser has already consumed. */
+  struct http_parser *parser = &connection->parser;
+  struct http_request *request = &connection->request;
+  request->method = (char *) parser->method.data;
+  request->method[parser->method.size] = '\0';
+  request->path = (char *) parser->path.data;
+  request->path[parser->path.size] = '\0';
+  request->parser = parser;
+  return request;
+}
+
+const struct http_slice *http_request_header(struct http_request *request,
+    const char *name) {
+  return parser_find_header(request->parser, name);
+}
+
+/* Requests live in their connection's buffer; nothing to free. */
+void http_request_free(struct http_request *request) {
 }
 
 char* http_get_response_message(int status_code) {
@@ -77,6 +536,8 @@ char* http_get_response_message(int status_code) {
       return "Moved Permanently";
     case 302:
       return "Found";
+    case 206:
+      return "Partial Content";
     case 304:
       return "Not Modified";
     case 400:
@@ -89,58 +550,601 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 416:
+      return "Range Not Satisfiable";
+    case 429:
+      return "Too Many Requests";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
+    case 504:
+      return "Gateway Timeout";
     default:
       return "Internal Server Error";
   }
 }
 
+/* Blocks until fd can take more data; used when a non-blocking socket's
+ * send buffer is full. Returns -1 (errno ETIMEDOUT) if the client takes
+ * nothing for the send timeout, so a reader that stalls can't hold the
+ * thread. */
+static int http_wait_writable(int fd) {
+  struct pollfd pollfd = { .fd = fd, .events = POLLOUT };
+  int ready;
+  do {
+    ready = poll(&pollfd, 1, http_send_timeout_ms);
+  } while (ready < 0 && errno == EINTR);
+  if (ready == 0) errno = ETIMEDOUT;
+  return ready > 0 ? 0 : -1;
+}
+
+/*
+ * Writes SIZE bytes with send(2) FLAGS (MSG_MORE to hold them for what
+ * follows), or write(2) when FLAGS is 0. Returns 0 once all are written,
+ * -1 if the socket failed.
+ */
+static int http_send_data_raw(int fd, char *data, size_t size, int flags) {
+  ssize_t bytes_sent;
+  while (size > 0) {
+    bytes_sent = flags ? send(fd, data, size, flags) : write(fd, data, size);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+          http_wait_writable(fd) == 0)
+        continue;
+      return -1;
+    }
+    size -= bytes_sent;
+    data += bytes_sent;
+  }
+  return 0;
+}
+
+/*
+ * Sends every buffer in IOV with as few writev(2) calls as the socket
+ * allows, resuming mid-buffer after a short write. Returns 0 once all are
+ * written, -1 if the socket failed.
+ */
+static int http_send_iov_raw(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t bytes_sent = writev(fd, iov, iovcnt);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+          http_wait_writable(fd) == 0)
+        continue;
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t) bytes_sent >= iov->iov_len) {
+      bytes_sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + bytes_sent;
+      iov->iov_len -= bytes_sent;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Sends SIZE bytes of FILE_FD starting at OFFSET with sendfile(2), so the
+ * file's pages go from the page cache to the socket without passing
+ * through a userspace buffer. Falls back to read/write where sendfile isn't
+ * supported for the pair of descriptors. Returns 0 once all SIZE bytes are
+ * sent, or -1 if the socket failed or the file ended short of them.
+ */
+static int http_send_file_raw(int fd, int file_fd, off_t offset, size_t size) {
+  while (size > 0) {
+    ssize_t bytes_sent = sendfile(fd, file_fd, &offset, size);
+    if (bytes_sent > 0) {
+      size -= bytes_sent;
+      continue;
+    }
+    if (bytes_sent == 0) return -1; /* File shrank underneath us. */
+    if (errno == EINTR) continue;
+    if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+        http_wait_writable(fd) == 0)
+      continue;
+    if (errno != EINVAL && errno != ENOSYS) return -1;
+
+    char buffer[LIBHTTP_REQUEST_MAX_SIZE];
+    while (size > 0) {
+      ssize_t bytes_read = pread(file_fd, buffer,
+          size < sizeof(buffer) ? size : sizeof(buffer), offset);
+      if (bytes_read <= 0 ||
+          http_send_data_raw(fd, buffer, bytes_read, 0) < 0)
+        return -1;
+      offset += bytes_read;
+      size -= bytes_read;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Writes CONNECTION's pending output followed by IOV with one writev and
+ * empties the output buffer. Once a write has failed, the rest of the
+ * response is dropped and the connection closes after it.
+ */
+static int http_output_write(struct http_connection *connection,
+    struct iovec *iov, int iovcnt) {
+  struct iovec vectors[LIBHTTP_MAX_IOV];
+  int count = 0, result;
+  if (connection->output_failed) {
+    connection->output_size = 0;
+    return -1;
+  }
+  if (connection->output_size > 0) {
+    vectors[count].iov_base = connection->output;
+    vectors[count++].iov_len = connection->output_size;
+    connection->output_size = 0;
+  }
+  if (count + iovcnt == 0) return 0;
+  for (int i = 0; i < iovcnt; i++) connection->response_bytes += iov[i].iov_len;
+
+  STATS_START(start);
+  if (connection->sink) {
+    const struct http_sink *sink = connection->sink;
+    if (count + iovcnt > LIBHTTP_MAX_IOV) {
+      result = sink->write(connection->sink_context, vectors, count);
+      if (result >= 0 && iovcnt)
+        result = sink->write(connection->sink_context, iov, iovcnt);
+    } else {
+      memcpy(vectors + count, iov, iovcnt * sizeof(*iov));
+      result = sink->write(connection->sink_context, vectors, count + iovcnt);
+    }
+  } else if (count + iovcnt > LIBHTTP_MAX_IOV) {
+    result = http_send_iov_raw(connection->fd, vectors, count);
+    if (result >= 0) result = http_send_iov_raw(connection->fd, iov, iovcnt);
+  } else {
+    memcpy(vectors + count, iov, iovcnt * sizeof(*iov));
+    result = http_send_iov_raw(connection->fd, vectors, count + iovcnt);
+  }
+  STATS_SENT(start);
+  if (result < 0) {
+    connection->output_failed = 1;
+    connection->keep_alive = 0;
+  }
+  return result;
+}
+
+/* Adds SIZE bytes to CONNECTION's pending output, or writes them together
+ * with it when they don't fit. */
+static int http_output_append(struct http_connection *connection,
+    const char *data, size_t size) {
+  if (size > sizeof(connection->output) - connection->output_size) {
+    struct iovec iov = { .iov_base = (char *) data, .iov_len = size };
+    return http_output_write(connection, &iov, 1);
+  }
+  memcpy(connection->output + connection->output_size, data, size);
+  connection->output_size += size;
+  connection->response_bytes += size;
+  return 0;
+}
+
+void http_response_start(struct http_connection *connection, int status_code) {
+  connection->response_started = 1;
+  connection->response_status = status_code;
+
+  char line[64];
+  int length = snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", status_code,
+      http_get_response_message(status_code));
+  http_output_append(connection, line, length);
+}
+
+void http_response_header(struct http_connection *connection, const char *key,
+    const char *value) {
+  if (strcasecmp(key, "Content-Length") == 0 ||
+      strcasecmp(key, "Transfer-Encoding") == 0)
+    connection->response_framed = 1;
+
+  http_output_append(connection, key, strlen(key));
+  http_output_append(connection, ": ", 2);
+  http_output_append(connection, value, strlen(value));
+  http_output_append(connection, "\r\n", 2);
+}
+
+/*
+ * Returns the lines that end CONNECTION's response head: how an unframed
+ * body is delimited and whether the connection stays open.
+ */
+static const char *http_connection_trailer(struct http_connection *connection) {
+  int status = connection->response_status;
+  int has_body = !connection->head_request && status / 100 != 1 &&
+    status != 204 && status != 304;
+
+  /* A body left unread closes the connection unless it is nearly all
+   * here: skipping it would only hold the connection for bytes it
+   * doesn't want. */
+  if (!connection->body_chunked && connection->body_remaining >
+      connection->size - connection->start + HTTP_SKIP_MAX_SIZE)
+    connection->keep_alive = 0;
+
+  if (!connection->response_framed && has_body) {
+    /* No length: chunk the body, or delimit it by closing for HTTP/1.0. */
+    if (connection->http_1_0) connection->keep_alive = 0;
+    else if (connection->keep_alive) connection->response_chunked = 1;
+  }
+  connection->response_in_body = 1;
+
+  if (!connection->keep_alive) return "Connection: close\r\n\r\n";
+  if (connection->response_chunked) return "Transfer-Encoding: chunked\r\n\r\n";
+  if (connection->http_1_0) return "Connection: keep-alive\r\n\r\n";
+  return "\r\n";
+}
+
+void http_response_end_headers(struct http_connection *connection) {
+  const char *trailer = http_connection_trailer(connection);
+  http_output_append(connection, trailer, strlen(trailer));
+}
+
+/* Appends the size line of a SIZE byte chunk. */
+static void http_output_chunk_header(struct http_connection *connection,
+    size_t size) {
+  char chunk_header[24];
+  int length = snprintf(chunk_header, sizeof(chunk_header), "%zx\r\n", size);
+  http_output_append(connection, chunk_header, length);
+}
+
+int http_response_write(struct http_connection *connection, struct iovec *iov,
+    int iovcnt) {
+  if (connection->head_request) return 0;
+
+  size_t size = 0;
+  for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+  if (size == 0) return 0; /* An empty chunk would end a chunked body. */
+  if (connection->response_chunked) http_output_chunk_header(connection, size);
+
+  int result = 0;
+  if (size <= sizeof(connection->output) - connection->output_size) {
+    for (int i = 0; i < iovcnt; i++)
+      http_output_append(connection, iov[i].iov_base, iov[i].iov_len);
+  } else {
+    result = http_output_write(connection, iov, iovcnt);
+  }
+  if (connection->response_chunked) http_output_append(connection, "\r\n", 2);
+  return result;
+}
+
+void http_response_send_file(struct http_connection *connection, int file_fd,
+    off_t offset, size_t size) {
+  if (connection->head_request || size == 0) return;
+  if (connection->response_chunked) http_output_chunk_header(connection, size);
+  connection->response_bytes += size;
+
+  /* A body cut short by a failed socket or a file that shrank can't be
+   * followed by another response: the client would read that one as the
+   * rest of this body. */
+  if (connection->sink) {
+    int result = http_output_write(connection, NULL, 0);
+    STATS_START(start);
+    if (result == 0)
+      result = connection->sink->send_file(connection->sink_context, file_fd,
+          offset, size);
+    STATS_SENT(start);
+    if (result < 0) {
+      connection->output_failed = 1;
+      http_response_abort(connection);
+      return;
+    }
+    if (connection->response_chunked) http_output_append(connection, "\r\n", 2);
+    return;
+  }
+
+  /* MSG_MORE holds the head back so it shares segments with the file. */
+  if (connection->output_failed) return;
+  STATS_START(start);
+  int result = 0;
+  if (connection->output_size > 0) {
+    result = http_send_data_raw(connection->fd, connection->output,
+        connection->output_size, MSG_MORE);
+    connection->output_size = 0;
+  }
+  if (result == 0)
+    result = http_send_file_raw(connection->fd, file_fd, offset, size);
+  STATS_SENT(start);
+  if (result < 0) {
+    connection->output_failed = 1;
+    http_response_abort(connection);
+    return;
+  }
+  if (connection->response_chunked) http_output_append(connection, "\r\n", 2);
+}
+
+int http_response_flush(struct http_connection *connection) {
+  return http_output_write(connection, NULL, 0);
+}
+
+void http_response_abort(struct http_connection *connection) {
+  connection->output_size = 0;
+  connection->response_chunked = 0;
+  connection->keep_alive = 0;
+}
+
+/*
+ * The fd based response helpers below are thin wrappers: on a bound
+ * connection they go through its response builder, otherwise they write
+ * straight to the socket in HTTP/1.0.
+ */
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
+  struct http_connection *connection = http_bound_connection(fd);
+  if (connection) {
+    http_response_start(connection, status_code);
+    return;
+  }
+
+  char line[64];
+  int length = snprintf(line, sizeof(line), "HTTP/1.0 %d %s\r\n", status_code,
       http_get_response_message(status_code));
+  http_send_data_raw(fd, line, length, 0);
 }
 
 void http_send_header(int fd, char *key, char *value) {
-  dprintf(fd, "%s: %s\r\n", key, value);
+  struct http_connection *connection = http_bound_connection(fd);
+  if (connection) {
+    http_response_header(connection, key, value);
+    return;
+  }
+
+  struct iovec iov[4] = {
+    { .iov_base = key, .iov_len = strlen(key) },
+    { .iov_base = ": ", .iov_len = 2 },
+    { .iov_base = value, .iov_len = strlen(value) },
+    { .iov_base = "\r\n", .iov_len = 2 },
+  };
+  http_send_iov_raw(fd, iov, 4);
 }
 
 void http_end_headers(int fd) {
-  dprintf(fd, "\r\n");
+  struct http_connection *connection = http_bound_connection(fd);
+  if (connection)
+    http_response_end_headers(connection);
+  else
+    http_send_data_raw(fd, "\r\n", 2, 0);
 }
 
 void http_send_string(int fd, char *data) {
   http_send_data(fd, data, strlen(data));
 }
 
-void http_send_data(int fd, char *data, size_t size) {
-  ssize_t bytes_sent;
-  while (size > 0) {
-    bytes_sent = write(fd, data, size);
-    if (bytes_sent < 0)
-      return;
-    size -= bytes_sent;
-    data += bytes_sent;
+int http_send_data(int fd, char *data, size_t size) {
+  struct iovec iov = { .iov_base = data, .iov_len = size };
+  return http_send_iov(fd, &iov, 1);
+}
+
+int http_send_iov(int fd, struct iovec *iov, int iovcnt) {
+  struct http_connection *connection = http_bound_connection(fd);
+  if (!connection) return http_send_iov_raw(fd, iov, iovcnt);
+  if (connection->response_in_body)
+    return http_response_write(connection, iov, iovcnt);
+  return http_output_write(connection, iov, iovcnt);
+}
+
+void http_send_file(int fd, int file_fd, off_t offset, size_t size) {
+  struct http_connection *connection = http_bound_connection(fd);
+  if (connection && connection->response_in_body)
+    http_response_send_file(connection, file_fd, offset, size);
+  else if (http_send_file_raw(fd, file_fd, offset, size) < 0)
+    shutdown(fd, SHUT_RDWR);  /* Close-delimited: end the body short. */
+}
+
+/*
+ * Sends a response whose status line and headers were rendered ahead of
+ * time (without the blank line that ends them), and its body, in a single
+ * writev. The head must include a Content-Length.
+ */
+void http_send_prerendered(int fd, char *head, size_t head_size, char *body,
+    size_t body_size) {
+  struct http_connection *connection = http_bound_connection(fd);
+  const char *trailer = "Connection: close\r\n\r\n";
+  if (connection) {
+    connection->response_started = 1;
+    connection->response_framed = 1;
+    connection->response_status = 200;
+    trailer = http_connection_trailer(connection);
+    if (connection->head_request) body_size = 0;
   }
+
+  struct iovec iov[3] = {
+    { .iov_base = head, .iov_len = head_size },
+    { .iov_base = (char *) trailer, .iov_len = strlen(trailer) },
+    { .iov_base = body, .iov_len = body_size },
+  };
+  int iovcnt = body_size > 0 ? 3 : 2;
+  if (connection)
+    http_output_write(connection, iov, iovcnt);
+  else
+    http_send_iov_raw(fd, iov, iovcnt);
+}
+
+/* Without a bound connection the response is close-delimited already. */
+void http_abort_response(int fd) {
+  struct http_connection *connection = http_bound_connection(fd);
+  if (connection) http_response_abort(connection);
 }
 
 char *http_get_mime_type(char *file_name) {
-  char *file_extension = strrchr(file_name, '.');
-  if (file_extension == NULL) {
-    return "text/plain";
-  }
-
-  if (strcmp(file_extension, ".html") == 0 || strcmp(file_extension, ".htm") == 0) {
-    return "text/html";
-  } else if (strcmp(file_extension, ".jpg") == 0 || strcmp(file_extension, ".jpeg") == 0) {
-    return "image/jpeg";
-  } else if (strcmp(file_extension, ".png") == 0) {
-    return "image/png";
-  } else if (strcmp(file_extension, ".css") == 0) {
-    return "text/css";
-  } else if (strcmp(file_extension, ".js") == 0) {
-    return "application/javascript";
-  } else if (strcmp(file_extension, ".pdf") == 0) {
-    return "application/pdf";
-  } else {
-    return "text/plain";
+  return (char *) mime_lookup(file_name);
+}
+
+void http_format_etag(char *buffer, size_t size, const struct stat *stat) {
+  snprintf(buffer, size, "\"%lx-%llx-%llx.%lx\"", (unsigned long) stat->st_ino,
+      (unsigned long long) stat->st_size, (unsigned long long) stat->st_mtim.tv_sec,
+      (unsigned long) stat->st_mtim.tv_nsec);
+}
+
+void http_format_date(char *buffer, size_t size, time_t time) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* Parses an HTTP date in any of the three formats RFC 7231 accepts;
+ * returns -1 if VALUE is none of them. */
+static time_t http_parse_date(const struct http_slice *value) {
+  static const char *formats[] = {
+    "%a, %d %b %Y %H:%M:%S GMT",  // IMF-fixdate
+    "%A, %d-%b-%y %H:%M:%S GMT",  // RFC 850
+    "%a %b %e %H:%M:%S %Y",       // asctime
+  };
+  char date[64];
+  if (value->size >= sizeof(date)) return -1;
+  memcpy(date, value->data, value->size);
+  date[value->size] = '\0';
+
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char *end = strptime(date, formats[i], &tm);
+    if (end && *end == '\0') return timegm(&tm);
+  }
+  return -1;
+}
+
+/*
+ * Whether the entity tag at TAG (TAG_SIZE bytes) matches ETAG. Weak
+ * comparison ignores W/ prefixes; strong comparison never matches them.
+ */
+static int http_etag_equals(const char *tag, size_t tag_size, const char *etag,
+    int weak) {
+  if (tag_size >= 2 && strncmp(tag, "W/", 2) == 0) {
+    if (!weak) return 0;
+    tag += 2;
+    tag_size -= 2;
+  }
+  if (strncmp(etag, "W/", 2) == 0) {
+    if (!weak) return 0;
+    etag += 2;
+  }
+  return strlen(etag) == tag_size && memcmp(tag, etag, tag_size) == 0;
+}
+
+int http_not_modified(struct http_request *request, const char *etag,
+    time_t modified) {
+  const struct http_slice *value = http_request_header(request, "If-None-Match");
+  if (value) {
+    /* A comma separated list of tags, or "*" for any current entity. */
+    const char *p = value->data, *end = value->data + value->size;
+    while (p < end) {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+      const char *tag = p;
+      if (p < end && *p == '*') return 1;
+      if (end - p >= 2 && strncmp(p, "W/", 2) == 0) p += 2;
+      if (p < end && *p == '"') {
+        const char *close = memchr(p + 1, '"', end - p - 1);
+        if (!close) return 0;
+        p = close + 1;
+      } else {
+        while (p < end && *p != ',') p++;
+      }
+      if (http_etag_equals(tag, p - tag, etag, 1)) return 1;
+    }
+    return 0;
+  }
+
+  value = http_request_header(request, "If-Modified-Since");
+  if (!value) return 0;
+  time_t since = http_parse_date(value);
+  return since != -1 && modified <= since;
+}
+
+/* Reads the decimal number at *CURSOR, advancing it; -1 if there is none. */
+static off_t http_parse_offset(const char **cursor, const char *end) {
+  const char *p = *cursor;
+  off_t number = 0;
+  if (p == end || !isdigit((unsigned char) *p)) return -1;
+  for (; p < end && isdigit((unsigned char) *p); p++) {
+    if (number > (INT64_MAX - 9) / 10) return -1;
+    number = number * 10 + (*p - '0');
+  }
+  *cursor = p;
+  return number;
+}
+
+static int http_range_compare(const void *a, const void *b) {
+  off_t x = ((const struct http_range *) a)->offset;
+  off_t y = ((const struct http_range *) b)->offset;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Merges the COUNT RANGES that overlap or adjoin, so repeating a range
+ * can't multiply the bytes sent. They are left in the order asked for
+ * unless some merge, in which case they come out sorted by offset.
+ * Returns how many are left.
+ */
+static int http_coalesce_ranges(struct http_range *ranges, int count) {
+  int touching = 0;
+  for (int i = 0; i < count && !touching; i++)
+    for (int j = i + 1; j < count && !touching; j++)
+      touching = ranges[i].offset <= ranges[j].offset + ranges[j].length &&
+        ranges[j].offset <= ranges[i].offset + ranges[i].length;
+  if (!touching) return count;
+
+  qsort(ranges, count, sizeof(*ranges), http_range_compare);
+  int merged = 0;
+  for (int i = 1; i < count; i++) {
+    off_t end = ranges[merged].offset + ranges[merged].length;
+    if (ranges[i].offset <= end) {
+      off_t next_end = ranges[i].offset + ranges[i].length;
+      if (next_end > end) ranges[merged].length = next_end - ranges[merged].offset;
+    } else {
+      ranges[++merged] = ranges[i];
+    }
+  }
+  return merged + 1;
+}
+
+int http_request_ranges(struct http_request *request, const char *etag,
+    time_t modified, off_t size, struct http_range *ranges, int max_ranges) {
+  const struct http_slice *value = http_request_header(request, "Range");
+  if (!value) return 0;
+
+  /* If-Range asks for the whole entity unless it is still the one named. */
+  const struct http_slice *if_range = http_request_header(request, "If-Range");
+  if (if_range) {
+    int is_tag = if_range->size > 0 && (if_range->data[0] == '"' ||
+        (if_range->size > 2 && strncmp(if_range->data, "W/", 2) == 0));
+    if (is_tag ? !http_etag_equals(if_range->data, if_range->size, etag, 0) :
+        http_parse_date(if_range) != modified)
+      return 0;
+  }
+
+  const char *p = value->data, *end = value->data + value->size;
+  if (value->size < 6 || strncasecmp(p, "bytes=", 6) != 0) return 0;
+  p += 6;
+
+  int count = 0, satisfiable = 0;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    off_t first = -1, last = -1;
+    if (p < end && *p != '-' && (first = http_parse_offset(&p, end)) < 0) return 0;
+    if (p == end || *p++ != '-') return 0;
+    if (p < end && isdigit((unsigned char) *p)) last = http_parse_offset(&p, end);
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p < end && *p++ != ',') return 0;
+
+    off_t offset, length;
+    if (first < 0) {
+      /* "-N": the final N bytes. */
+      if (last < 0) return 0;
+      if (last == 0) continue;
+      offset = last < size ? size - last : 0;
+      length = size - offset;
+    } else {
+      if (last >= 0 && last < first) return 0;
+      if (first >= size) continue;
+      offset = first;
+      length = (last < 0 || last >= size ? size - 1 : last) - first + 1;
+    }
+    /* Too many ranges to be worth honouring; send the whole entity. */
+    if (count == max_ranges) return 0;
+    ranges[count].offset = offset;
+    ranges[count++].length = length;
+    satisfiable = 1;
   }
+  return satisfiable ? http_coalesce_ranges(ranges, count) : -1;
 }
@@ -20,28 +20,258 @@
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "parser.h"
+
+#define LIBHTTP_REQUEST_MAX_SIZE 8192
+#define LIBHTTP_OUTPUT_BUFFER_SIZE 4096
+#define LIBHTTP_MAX_IOV 16
+#define HTTP_SKIP_MAX_SIZE (16 * 1024)
+
 /*
  * Functions for parsing an HTTP request.
+ *
+ * The request is parsed in place in its connection's buffer, reading until
+ * the head is complete however it was split across reads, and lives until
+ * the next request on the connection; nothing is allocated per request.
+ * method and path are NUL-terminated in the buffer; the version and headers
+ * are (pointer, length) slices in parser. http_request_header finds a
+ * header by name (case insensitively) and returns NULL without one.
+ * http_request_free ends a handler's use of a request; it has nothing to
+ * release, the request belonging to its connection.
  */
 struct http_request {
   char *method;
   char *path;
+  struct http_parser *parser;
 };
 
 struct http_request *http_request_parse(int fd);
+const struct http_slice *http_request_header(struct http_request *request,
+    const char *name);
+void http_request_free(struct http_request *request);
+
+/*
+ * Functions for persistent (HTTP/1.1 keep-alive) connections.
+ *
+ * A server keeps one http_connection per client connection and binds it to
+ * the serving thread while a request handler runs. While bound:
+ *
+ *   - http_request_parse(fd) takes the request from the connection's
+ *     buffer, so pipelined requests read together cost no further read();
+ *     bytes past the head stay buffered for the next request.
+ *   - The response helpers answer in HTTP/1.1, say whether the connection
+ *     stays open, and frame a body sent without Content-Length as chunked
+ *     (or close the connection for HTTP/1.0 clients). Bodies of HEAD
+ *     responses are dropped.
+ *
+ * http_connection_has_request reports whether a whole request head is
+ * buffered, first discarding, as its bytes arrive, whatever the last
+ * request left of its body. http_connection_in_request reports whether part
+ * of a request, head or skipped body, has arrived without the head being
+ * complete yet. http_connection_fill reads once into the buffer (returning
+ * as read() does); http_connection_wait blocks for a whole head, waiting up
+ * to idle_ms for its first byte and then at most header_ms for the rest,
+ * skipped body included (1 once there is one or the buffer is full, 0 on
+ * timeout or close). http_connection_peer (or http_peer_address, for the
+ * connection serving fd) looks up the client's address once per connection.
+ * After the handler returns, http_connection_finish ends the response and
+ * returns whether the connection may carry another request; the response
+ * stays buffered to leave with the next one if that request is already in.
+ * A request body left unread that is still more than HTTP_SKIP_MAX_SIZE
+ * short when the response starts closes the connection instead of being
+ * skipped, as does a chunked one whose skipping runs past that many bytes
+ * (keep_alive then drops to 0). http_set_max_requests caps requests per
+ * connection (1 turns keep-alive off). http_set_send_timeout bounds how
+ * long a blocking write waits on a client that takes none of the response:
+ * the write then fails, the rest of the response is dropped and the
+ * connection closes.
+ *
+ * http_take_pending_input hands the caller whatever is buffered for fd and
+ * gives the raw stream over to it, e.g. for a proxy; the connection then
+ * closes after the current request.
+ *
+ * http_connection_set_sink hands a connection's output to an engine that
+ * sends it asynchronously: every write and file segment of a response goes
+ * to SINK (data is only valid during the call; file_fd is only open until
+ * the handler returns) instead of the socket. If the sink has a pending
+ * callback, it tells whether the sink still holds output (1), has sent it
+ * all (0) or can't send it (-1).
+ *
+ * http_flush sends whatever output is buffered for fd, for a caller about
+ * to write to the socket itself: it returns 0 once all of it is on the
+ * socket, 1 while a sink still holds some (wait for fd to turn writable and
+ * call it again) and -1 if the socket failed.
+ */
+
+/* Where http_chunked_scan (below) is in a chunked body. */
+struct http_chunked_state {
+  int state;
+  int line_empty;
+  size_t remaining;
+};
+
+struct http_sink {
+  int (*write)(void *context, const struct iovec *iov, int iovcnt);
+  int (*send_file)(void *context, int file_fd, off_t offset, size_t size);
+  int (*pending)(void *context);
+};
+struct http_connection {
+  int fd;
+  size_t start;           // First unconsumed byte of buffer.
+  size_t size;            // End of buffered bytes.
+  size_t head_length;     // Length of the buffered head, once complete.
+  int head_error;         // The buffered head is malformed.
+  int requests;           // Requests parsed so far.
+  int keep_alive;         // May carry another request after this one.
+  int http_1_0;           // Current request is HTTP/1.0.
+  int head_request;       // Current request is HEAD.
+  size_t body_remaining;  // Unread Content-Length bytes of the request.
+  int body_chunked;       // Request has a chunked body, not yet all read.
+  struct http_chunked_state body_state;  // Where skipping it has got to.
+  size_t body_skipped;    // Bytes of the chunked body skipped so far.
+  int response_started;
+  int response_framed;    // Handler sent Content-Length/Transfer-Encoding.
+  int response_chunked;   // libhttp is chunking the response body.
+  int response_in_body;
+  int response_status;
+  size_t response_bytes;  // Response bytes produced, head included.
+  int request_parsed;     // http_request_parse read the current head.
+  struct sockaddr_in peer;  // Client address, once someone looks it up.
+  int peer_known;
+  size_t output_size;     // Bytes waiting in output.
+  int output_failed;      // A write failed or timed out: send no more.
+  const struct http_sink *sink;  // Takes the output instead of fd, if set.
+  void *sink_context;
+  struct http_parser parser;
+  struct http_request request;
+  char buffer[LIBHTTP_REQUEST_MAX_SIZE];
+  char output[LIBHTTP_OUTPUT_BUFFER_SIZE];
+};
+
+void http_set_max_requests(int max_requests);
+void http_set_send_timeout(int seconds);
+void http_connection_init(struct http_connection *connection, int fd);
+void http_connection_bind(struct http_connection *connection);
+int http_connection_has_request(struct http_connection *connection);
+int http_connection_in_request(struct http_connection *connection);
+ssize_t http_connection_fill(struct http_connection *connection);
+int http_connection_wait(struct http_connection *connection, int idle_ms,
+    int header_ms);
+const struct sockaddr_in *http_connection_peer(
+    struct http_connection *connection);
+const struct sockaddr_in *http_peer_address(int fd);
+int http_connection_finish(struct http_connection *connection);
+size_t http_take_pending_input(int fd, char **data);
+void http_connection_set_sink(struct http_connection *connection,
+    const struct http_sink *sink, void *context);
+int http_flush(int fd);
 
 /*
- * Functions for sending an HTTP response.
+ * Functions for callers that look at raw heads themselves, as a proxy does.
+ * http_request_head_end scans for the blank line that ends a head, resuming
+ * where the last call stopped at *scanned; it returns the head length once
+ * complete and 0 until then. http_find_header finds the first header called
+ * name (matched case insensitively) among the size bytes of head and points
+ * *value at its trimmed value. http_find_content_length reads the
+ * Content-Length of head into *length: it returns 1 with one, 0 without and
+ * -1 if the value isn't a plain decimal number or the header appears more
+ * than once. http_chunked_scan follows the framing of a chunked body across
+ * calls; it returns how many of the size bytes belong to the body once its
+ * end has been seen, 0 while more is needed and -1 if malformed.
+ * http_chunked_decode does the same and also strips the framing, moving the
+ * chunk data among those bytes to the front of data, *decoded bytes of it.
  */
+size_t http_request_head_end(const char *buffer, size_t size, size_t *scanned);
+int http_find_header(const char *head, size_t size, const char *name,
+    const char **value, size_t *value_size);
+
+int http_find_content_length(const char *head, size_t size, size_t *length);
+ssize_t http_chunked_scan(struct http_chunked_state *state, const char *data,
+    size_t size);
+ssize_t http_chunked_decode(struct http_chunked_state *state, char *data,
+    size_t size, size_t *decoded);
+
+/*
+ * Response builder for a connection. The status line, headers and small
+ * body writes collect in the connection's output buffer and leave together
+ * with the next large body write in one writev; a file body is handed to
+ * sendfile right behind the buffered head (sent with MSG_MORE). Whatever is
+ * still buffered goes out in http_response_flush, which
+ * http_connection_finish calls, so a typical response costs one write.
+ */
+void http_response_start(struct http_connection *connection, int status_code);
+void http_response_header(struct http_connection *connection, const char *key,
+    const char *value);
+void http_response_end_headers(struct http_connection *connection);
+int http_response_write(struct http_connection *connection, struct iovec *iov,
+    int iovcnt);
+void http_response_send_file(struct http_connection *connection, int file_fd,
+    off_t offset, size_t size);
+int http_response_flush(struct http_connection *connection);
+
+/*
+ * Gives up on a response whose body can't be completed: nothing more is
+ * sent and the connection closes, so the client sees it cut short rather
+ * than a body that merely ends early.
+ */
+void http_response_abort(struct http_connection *connection);
+
+/*
+ * Functions for sending an HTTP response. On a bound connection these wrap
+ * the response builder above; otherwise each writes to fd directly.
+ */
+char *http_get_response_message(int status_code);
 void http_start_response(int fd, int status_code);
 void http_send_header(int fd, char *key, char *value);
 void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
-void http_send_data(int fd, char *data, size_t size);
+int http_send_data(int fd, char *data, size_t size);
+int http_send_iov(int fd, struct iovec *iov, int iovcnt);
+void http_send_file(int fd, int file_fd, off_t offset, size_t size);
+void http_send_prerendered(int fd, char *head, size_t head_size, char *body,
+    size_t body_size);
+void http_abort_response(int fd);
 
 /*
- * Helper function: gets the Content-Type based on a file name.
+ * Helper function: gets the Content-Type based on a file name, from the
+ * table in mime.h.
  */
 char *http_get_mime_type(char *file_name);
 
+/*
+ * Helper function: writes a strong ETag for a file (quoted, derived from
+ * its inode, size and modification time) into buffer.
+ */
+void http_format_etag(char *buffer, size_t size, const struct stat *stat);
+
+/*
+ * Helper functions for conditional and range requests.
+ *
+ * http_format_date writes TIME as an HTTP date (IMF-fixdate).
+ * http_not_modified reports whether the request's If-None-Match (or,
+ * without one, If-Modified-Since) shows the client already has the entity
+ * with ETAG, last modified at MODIFIED, so a 304 will do.
+ * http_request_ranges reads a "bytes" Range header for an entity of SIZE
+ * bytes into RANGES: it returns how many it stored, 0 if the whole entity
+ * should be sent (no usable Range, a stale If-Range, or more than
+ * MAX_RANGES ranges) and -1 if no range is satisfiable (a 416). Ranges
+ * that overlap or adjoin are merged into one.
+ */
+struct http_range {
+  off_t offset;
+  off_t length;
+};
+
+void http_format_date(char *buffer, size_t size, time_t time);
+int http_not_modified(struct http_request *request, const char *etag,
+    time_t modified);
+int http_request_ranges(struct http_request *request, const char *etag,
+    time_t modified, off_t size, struct http_range *ranges, int max_ranges);
+
 #endif
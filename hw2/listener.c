@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "listener.h"
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+/* The cores the process may run on, as they were before any thread was
+ * pinned, and how many there are. */
+static cpu_set_t listener_cpus;
+static int listener_cpu_count = -1;
+
+static int listener_allowed_cpus(void) {
+  if (listener_cpu_count < 0) {
+    if (sched_getaffinity(0, sizeof(listener_cpus), &listener_cpus) == -1)
+      CPU_ZERO(&listener_cpus);
+    listener_cpu_count = CPU_COUNT(&listener_cpus);
+  }
+  return listener_cpu_count;
+}
+
+static void listener_bind(int listen_fd, int port) {
+  struct sockaddr_in server_address;
+  memset(&server_address, 0, sizeof(server_address));
+  server_address.sin_family = AF_INET;
+  server_address.sin_addr.s_addr = INADDR_ANY;
+  server_address.sin_port = htons(port);
+
+  if (bind(listen_fd, (struct sockaddr *) &server_address,
+        sizeof(server_address)) == -1) {
+    perror("Failed to bind on socket");
+    exit(errno);
+  }
+}
+
+int listener_open(int port, const struct listener_options *options) {
+  int type = SOCK_STREAM | SOCK_CLOEXEC | (options->nonblocking ? SOCK_NONBLOCK : 0);
+  int listen_fd = socket(PF_INET, type, 0);
+  if (listen_fd == -1) {
+    perror("Failed to create a new socket");
+    exit(errno);
+  }
+
+  int socket_option = 1;
+  if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+        sizeof(socket_option)) == -1 ||
+      (options->reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT,
+        &socket_option, sizeof(socket_option)) == -1)) {
+    perror("Failed to set socket options");
+    exit(errno);
+  }
+  if (options->defer_accept > 0 && setsockopt(listen_fd, IPPROTO_TCP,
+        TCP_DEFER_ACCEPT, &options->defer_accept,
+        sizeof(options->defer_accept)) == -1)
+    perror("Failed to set TCP_DEFER_ACCEPT (ignoring)");
+
+  listener_bind(listen_fd, port);
+
+  if (listen(listen_fd, 1024) == -1) {
+    perror("Failed to listen on socket");
+    exit(errno);
+  }
+  return listen_fd;
+}
+
+/*
+ * Attaches a program to the SO_REUSEPORT group of LISTEN_FD that picks,
+ * for the CPU that received a connection, the listener whose thread
+ * listener_pin_thread puts on that CPU: the k-th allowed CPU goes to
+ * listener k modulo COUNT. A CPU the process may not run on falls back to
+ * its number modulo COUNT. The kernel uses the result as an index into the
+ * group, whose members are in the order they were opened.
+ */
+static int listener_steer_by_cpu(int listen_fd, int count) {
+  int allowed = listener_allowed_cpus();
+  struct sock_filter *code = calloc(2 * allowed + 3, sizeof(*code));
+  if (!code) return -1;
+
+  int length = 0;
+  code[length++] = (struct sock_filter)
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };
+  for (int cpu = 0, k = 0; k < allowed; cpu++) {
+    if (!CPU_ISSET(cpu, &listener_cpus)) continue;
+    code[length++] = (struct sock_filter)
+      { BPF_JMP | BPF_JEQ | BPF_K, 0, 1, cpu };
+    code[length++] = (struct sock_filter)
+      { BPF_RET | BPF_K, 0, 0, k++ % count };
+  }
+  code[length++] = (struct sock_filter)
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, count };
+  code[length++] = (struct sock_filter) { BPF_RET | BPF_A, 0, 0, 0 };
+
+  struct sock_fprog program = { .len = length, .filter = code };
+  int result = setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+      &program, sizeof(program));
+  free(code);
+  return result;
+}
+
+void listener_open_group(int port, int count,
+    const struct listener_options *options, int *fds) {
+  /* Sockets joining a group bind alongside each other, and alongside
+   * another server's group on the port too; a plain bind first makes sure
+   * the port is free, so a collision still fails. */
+  int probe_fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int socket_option = 1;
+  if (probe_fd == -1 || setsockopt(probe_fd, SOL_SOCKET, SO_REUSEADDR,
+        &socket_option, sizeof(socket_option)) == -1) {
+    perror("Failed to create a new socket");
+    exit(errno);
+  }
+  listener_bind(probe_fd, port);
+  close(probe_fd);
+
+  /* Snapshot the cores before any thread pins itself to one. */
+  listener_allowed_cpus();
+
+  struct listener_options group_options = *options;
+  group_options.reuse_port = 1;
+  for (int i = 0; i < count; i++)
+    fds[i] = listener_open(port, &group_options);
+
+  if (options->steer_by_cpu && listener_steer_by_cpu(fds[0], count) == -1)
+    perror("Failed to attach reuseport steering program (ignoring)");
+}
+
+int listener_pin_thread(int index) {
+  int count = listener_allowed_cpus();
+  if (count == 0) return -1;
+
+  int cpu = -1;
+  for (int seen = -1; seen < index % count; )
+    if (CPU_ISSET(++cpu, &listener_cpus)) seen++;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) return -1;
+  return cpu;
+}
@@ -0,0 +1,45 @@
+#ifndef __LISTENER__
+#define __LISTENER__
+
+/*
+ * LISTENER opens the server's listening sockets.
+ *
+ * A sharded server opens one SO_REUSEPORT listener per thread and pins
+ * each thread to its own core, so every connection is accepted and served
+ * on one core with no hand-off between threads. The kernel spreads
+ * connections over the listeners by a hash of their addresses; with
+ * steer_by_cpu a classic BPF program attached to the group
+ * (SO_ATTACH_REUSEPORT_CBPF) instead picks the listener of the core that
+ * took the connection's packets, so its cache lines stay there too.
+ *
+ * TCP_DEFER_ACCEPT holds a connection in the kernel until its first bytes
+ * arrive (or defer_accept seconds pass), so accept never returns a socket
+ * that would block on its first read.
+ */
+
+struct listener_options {
+  int reuse_port;     // Join a SO_REUSEPORT group on the port.
+  int nonblocking;    // Open the listener O_NONBLOCK.
+  int defer_accept;   // TCP_DEFER_ACCEPT timeout in seconds; 0 is off.
+  int pin_cpus;       // Pin the thread serving listener i to core i.
+  int steer_by_cpu;   // Steer connections to the listener of their core.
+};
+
+int listener_open(int port, const struct listener_options *options);
+
+/*
+ * Opens COUNT listeners on PORT in one SO_REUSEPORT group, in order, into
+ * FDS, and attaches the steering program if OPTIONS ask for it. Exits if
+ * something else already listens on PORT, as listener_open does.
+ */
+void listener_open_group(int port, int count,
+    const struct listener_options *options, int *fds);
+
+/*
+ * Pins the calling thread to the INDEX-th core the process may run on
+ * (wrapping around), the core steer_by_cpu sends listener INDEX's
+ * connections from. Returns the core, or -1 if it can't be pinned.
+ */
+int listener_pin_thread(int index);
+
+#endif
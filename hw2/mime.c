@@ -0,0 +1,390 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mime.h"
+
+#define MIME_MAX_EXTENSION 16
+
+struct mime_slot {
+  char extension[MIME_MAX_EXTENSION];  // Lowercase, NUL-padded.
+  const char *type;
+};
+
+static const struct {
+  const char *extension;
+  const char *type;
+} mime_builtin_types[] = {
+  /* Text and documents. */
+  { "html", "text/html" }, { "htm", "text/html" }, { "shtml", "text/html" },
+  { "xhtml", "application/xhtml+xml" }, { "css", "text/css" },
+  { "txt", "text/plain" }, { "text", "text/plain" }, { "log", "text/plain" },
+  { "conf", "text/plain" }, { "ini", "text/plain" }, { "md", "text/markdown" },
+  { "markdown", "text/markdown" }, { "csv", "text/csv" },
+  { "tsv", "text/tab-separated-values" }, { "rtf", "application/rtf" },
+  { "xml", "application/xml" }, { "xsl", "application/xml" },
+  { "xslt", "application/xslt+xml" }, { "dtd", "application/xml-dtd" },
+  { "ics", "text/calendar" }, { "vcf", "text/vcard" }, { "vtt", "text/vtt" },
+  { "srt", "application/x-subrip" }, { "sgml", "text/sgml" },
+  { "appcache", "text/cache-manifest" }, { "manifest", "text/cache-manifest" },
+  { "pdf", "application/pdf" }, { "ps", "application/postscript" },
+  { "eps", "application/postscript" }, { "ai", "application/postscript" },
+  { "tex", "application/x-tex" }, { "latex", "application/x-latex" },
+  { "dvi", "application/x-dvi" }, { "epub", "application/epub+zip" },
+  { "mobi", "application/x-mobipocket-ebook" },
+  { "djvu", "image/vnd.djvu" }, { "chm", "application/vnd.ms-htmlhelp" },
+
+  /* Scripts, data and source. */
+  { "js", "application/javascript" }, { "mjs", "application/javascript" },
+  { "cjs", "application/javascript" }, { "json", "application/json" },
+  { "jsonld", "application/ld+json" }, { "map", "application/json" },
+  { "webmanifest", "application/manifest+json" },
+  { "geojson", "application/geo+json" }, { "wasm", "application/wasm" },
+  { "yaml", "application/yaml" }, { "yml", "application/yaml" },
+  { "toml", "application/toml" }, { "rss", "application/rss+xml" },
+  { "atom", "application/atom+xml" }, { "rdf", "application/rdf+xml" },
+  { "kml", "application/vnd.google-earth.kml+xml" },
+  { "kmz", "application/vnd.google-earth.kmz" },
+  { "gpx", "application/gpx+xml" }, { "wsdl", "application/wsdl+xml" },
+  { "sql", "application/sql" }, { "graphql", "application/graphql" },
+  { "c", "text/x-c" }, { "h", "text/x-c" }, { "cc", "text/x-c" },
+  { "cpp", "text/x-c" }, { "cxx", "text/x-c" }, { "hpp", "text/x-c" },
+  { "hh", "text/x-c" }, { "java", "text/x-java-source" },
+  { "py", "text/x-python" }, { "rb", "text/x-ruby" }, { "pl", "text/x-perl" },
+  { "pm", "text/x-perl" }, { "sh", "application/x-sh" },
+  { "bash", "application/x-sh" }, { "csh", "application/x-csh" },
+  { "tcl", "application/x-tcl" }, { "lua", "text/x-lua" },
+  { "go", "text/x-go" }, { "rs", "text/x-rust" }, { "s", "text/x-asm" },
+  { "asm", "text/x-asm" }, { "f", "text/x-fortran" },
+  { "f90", "text/x-fortran" }, { "p", "text/x-pascal" },
+  { "pas", "text/x-pascal" }, { "diff", "text/x-diff" },
+  { "patch", "text/x-diff" }, { "scala", "text/x-scala" },
+  { "kt", "text/x-kotlin" }, { "swift", "text/x-swift" },
+  { "ts", "application/typescript" }, { "tsx", "text/tsx" },
+  { "jsx", "text/jsx" }, { "coffee", "text/coffeescript" },
+  { "less", "text/less" }, { "scss", "text/x-scss" }, { "sass", "text/x-sass" },
+  { "php", "application/x-httpd-php" }, { "jsp", "text/plain" },
+  { "asp", "text/plain" }, { "ipynb", "application/x-ipynb+json" },
+
+  /* Images. */
+  { "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" }, { "jpe", "image/jpeg" },
+  { "jfif", "image/jpeg" }, { "png", "image/png" }, { "apng", "image/apng" },
+  { "gif", "image/gif" }, { "bmp", "image/bmp" }, { "ico", "image/x-icon" },
+  { "cur", "image/x-icon" }, { "svg", "image/svg+xml" },
+  { "svgz", "image/svg+xml" }, { "webp", "image/webp" },
+  { "avif", "image/avif" }, { "heic", "image/heic" }, { "heif", "image/heif" },
+  { "tif", "image/tiff" }, { "tiff", "image/tiff" }, { "jp2", "image/jp2" },
+  { "jpx", "image/jpx" }, { "jxl", "image/jxl" }, { "psd", "image/vnd.adobe.photoshop" },
+  { "xcf", "image/x-xcf" }, { "pbm", "image/x-portable-bitmap" },
+  { "pgm", "image/x-portable-graymap" }, { "ppm", "image/x-portable-pixmap" },
+  { "pnm", "image/x-portable-anymap" }, { "xbm", "image/x-xbitmap" },
+  { "xpm", "image/x-xpixmap" }, { "tga", "image/x-tga" },
+  { "dds", "image/vnd.ms-dds" }, { "exr", "image/x-exr" },
+  { "hdr", "image/vnd.radiance" }, { "raw", "image/x-dcraw" },
+  { "cr2", "image/x-canon-cr2" }, { "nef", "image/x-nikon-nef" },
+  { "dng", "image/x-adobe-dng" }, { "wbmp", "image/vnd.wap.wbmp" },
+  { "emf", "image/emf" }, { "wmf", "image/wmf" },
+
+  /* Audio. */
+  { "mp3", "audio/mpeg" }, { "mpga", "audio/mpeg" }, { "m4a", "audio/mp4" },
+  { "aac", "audio/aac" }, { "oga", "audio/ogg" }, { "ogg", "audio/ogg" },
+  { "opus", "audio/opus" }, { "spx", "audio/ogg" }, { "wav", "audio/wav" },
+  { "weba", "audio/webm" }, { "flac", "audio/flac" }, { "mid", "audio/midi" },
+  { "midi", "audio/midi" }, { "kar", "audio/midi" }, { "aif", "audio/aiff" },
+  { "aiff", "audio/aiff" }, { "aifc", "audio/aiff" }, { "au", "audio/basic" },
+  { "snd", "audio/basic" }, { "wma", "audio/x-ms-wma" },
+  { "ra", "audio/x-realaudio" }, { "m3u", "audio/x-mpegurl" },
+  { "pls", "audio/x-scpls" }, { "amr", "audio/amr" }, { "caf", "audio/x-caf" },
+  { "ape", "audio/x-ape" }, { "mka", "audio/x-matroska" },
+
+  /* Video. */
+  { "mp4", "video/mp4" }, { "m4v", "video/mp4" }, { "mp4v", "video/mp4" },
+  { "mpg", "video/mpeg" }, { "mpeg", "video/mpeg" }, { "mpe", "video/mpeg" },
+  { "m1v", "video/mpeg" }, { "m2v", "video/mpeg" }, { "webm", "video/webm" },
+  { "ogv", "video/ogg" }, { "mov", "video/quicktime" },
+  { "qt", "video/quicktime" }, { "avi", "video/x-msvideo" },
+  { "wmv", "video/x-ms-wmv" }, { "asf", "video/x-ms-asf" },
+  { "flv", "video/x-flv" }, { "f4v", "video/x-f4v" },
+  { "mkv", "video/x-matroska" }, { "mk3d", "video/x-matroska" },
+  { "3gp", "video/3gpp" }, { "3g2", "video/3gpp2" }, { "m2ts", "video/mp2t" },
+  { "mts", "video/mp2t" }, { "m3u8", "application/vnd.apple.mpegurl" },
+  { "mpd", "application/dash+xml" }, { "h264", "video/h264" },
+  { "ivf", "video/x-ivf" }, { "vob", "video/x-ms-vob" },
+
+  /* Fonts. */
+  { "woff", "font/woff" }, { "woff2", "font/woff2" }, { "ttf", "font/ttf" },
+  { "otf", "font/otf" }, { "ttc", "font/collection" },
+  { "eot", "application/vnd.ms-fontobject" }, { "pfb", "application/x-font-type1" },
+  { "pfa", "application/x-font-type1" }, { "bdf", "application/x-font-bdf" },
+  { "pcf", "application/x-font-pcf" },
+
+  /* Archives and compressed data. */
+  { "zip", "application/zip" }, { "gz", "application/gzip" },
+  { "tgz", "application/gzip" }, { "bz2", "application/x-bzip2" },
+  { "tbz2", "application/x-bzip2" }, { "xz", "application/x-xz" },
+  { "txz", "application/x-xz" }, { "zst", "application/zstd" },
+  { "lz", "application/x-lzip" }, { "lzma", "application/x-lzma" },
+  { "lz4", "application/x-lz4" }, { "br", "application/x-brotli" },
+  { "z", "application/x-compress" }, { "tar", "application/x-tar" },
+  { "7z", "application/x-7z-compressed" }, { "rar", "application/vnd.rar" },
+  { "cab", "application/vnd.ms-cab-compressed" },
+  { "cpio", "application/x-cpio" }, { "ar", "application/x-archive" },
+  { "shar", "application/x-shar" }, { "iso", "application/x-iso9660-image" },
+  { "dmg", "application/x-apple-diskimage" }, { "img", "application/octet-stream" },
+  { "jar", "application/java-archive" }, { "war", "application/java-archive" },
+  { "ear", "application/java-archive" }, { "apk", "application/vnd.android.package-archive" },
+  { "xpi", "application/x-xpinstall" }, { "crx", "application/x-chrome-extension" },
+
+  /* Binaries and packages. */
+  { "bin", "application/octet-stream" }, { "exe", "application/vnd.microsoft.portable-executable" },
+  { "dll", "application/octet-stream" }, { "so", "application/octet-stream" },
+  { "o", "application/octet-stream" }, { "a", "application/octet-stream" },
+  { "obj", "application/octet-stream" }, { "class", "application/java-vm" },
+  { "deb", "application/vnd.debian.binary-package" },
+  { "rpm", "application/x-rpm" }, { "msi", "application/x-msi" },
+  { "pkg", "application/octet-stream" }, { "elf", "application/x-elf" },
+  { "swf", "application/x-shockwave-flash" }, { "pyc", "application/x-python-code" },
+  { "dat", "application/octet-stream" }, { "db", "application/octet-stream" },
+  { "sqlite", "application/vnd.sqlite3" }, { "torrent", "application/x-bittorrent" },
+  { "pem", "application/x-pem-file" }, { "crt", "application/x-x509-ca-cert" },
+  { "cer", "application/pkix-cert" }, { "der", "application/x-x509-ca-cert" },
+  { "p12", "application/x-pkcs12" }, { "pfx", "application/x-pkcs12" },
+  { "p7b", "application/x-pkcs7-certificates" }, { "crl", "application/pkix-crl" },
+  { "asc", "application/pgp-signature" }, { "sig", "application/pgp-signature" },
+  { "gpg", "application/pgp-encrypted" },
+
+  /* Office formats. */
+  { "doc", "application/msword" }, { "dot", "application/msword" },
+  { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+  { "dotx", "application/vnd.openxmlformats-officedocument.wordprocessingml.template" },
+  { "xls", "application/vnd.ms-excel" }, { "xlt", "application/vnd.ms-excel" },
+  { "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+  { "xltx", "application/vnd.openxmlformats-officedocument.spreadsheetml.template" },
+  { "ppt", "application/vnd.ms-powerpoint" }, { "pps", "application/vnd.ms-powerpoint" },
+  { "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+  { "ppsx", "application/vnd.openxmlformats-officedocument.presentationml.slideshow" },
+  { "odt", "application/vnd.oasis.opendocument.text" },
+  { "ods", "application/vnd.oasis.opendocument.spreadsheet" },
+  { "odp", "application/vnd.oasis.opendocument.presentation" },
+  { "odg", "application/vnd.oasis.opendocument.graphics" },
+  { "odf", "application/vnd.oasis.opendocument.formula" },
+  { "pages", "application/vnd.apple.pages" }, { "numbers", "application/vnd.apple.numbers" },
+  { "key", "application/vnd.apple.keynote" }, { "vsd", "application/vnd.visio" },
+  { "mdb", "application/x-msaccess" }, { "pub", "application/x-mspublisher" },
+  { "one", "application/onenote" }, { "xps", "application/vnd.ms-xpsdocument" },
+  { "oxps", "application/oxps" },
+
+  /* 3D, science and misc. */
+  { "stl", "model/stl" }, { "gltf", "model/gltf+json" },
+  { "glb", "model/gltf-binary" }, { "dae", "model/vnd.collada+xml" },
+  { "usdz", "model/vnd.usdz+zip" }, { "wrl", "model/vrml" },
+  { "x3d", "model/x3d+xml" }, { "ply", "application/ply" },
+  { "nc", "application/x-netcdf" }, { "hdf", "application/x-hdf" },
+  { "h5", "application/x-hdf5" }, { "fits", "application/fits" },
+  { "mat", "application/x-matlab-data" }, { "parquet", "application/vnd.apache.parquet" },
+  { "avro", "application/avro" }, { "arrow", "application/vnd.apache.arrow.file" },
+  { "npy", "application/octet-stream" }, { "pkl", "application/octet-stream" },
+  { "eml", "message/rfc822" }, { "mht", "message/rfc822" },
+  { "mhtml", "message/rfc822" }, { "msg", "application/vnd.ms-outlook" },
+  { "url", "application/internet-shortcut" }, { "webloc", "application/x-webloc" },
+  { "desktop", "application/x-desktop" },
+  { "bib", "text/x-bibtex" }, { "gcode", "text/x-gcode" },
+};
+
+/* Entries gathered from the built-in table and mime.types files. */
+static struct mime_slot *mime_entries;
+static size_t mime_entries_count, mime_entries_capacity;
+
+/* The compiled table: a displacement per bucket, then one slot per key. */
+static struct mime_slot *mime_slots;
+static uint16_t *mime_displacements;
+static uint32_t mime_slot_mask, mime_bucket_mask;
+
+/* FNV-1a over the lowercased extension, perturbed by SEED. */
+static uint32_t mime_hash(const char *extension, size_t length, uint32_t seed) {
+  uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char) tolower((unsigned char) extension[i]);
+    hash *= 16777619u;
+  }
+  return hash ^ (hash >> 15);
+}
+
+/* Records EXTENSION as TYPE, replacing any earlier mapping. */
+static int mime_add(const char *extension, size_t length, const char *type) {
+  /* Lookups only see what follows the last dot, so "tar.gz" style
+   * entries could never match. */
+  if (length == 0 || length >= MIME_MAX_EXTENSION || memchr(extension, '.', length))
+    return 0;
+
+  struct mime_slot slot;
+  memset(&slot, 0, sizeof(slot));
+  for (size_t i = 0; i < length; i++)
+    slot.extension[i] = tolower((unsigned char) extension[i]);
+  slot.type = type;
+
+  for (size_t i = 0; i < mime_entries_count; i++) {
+    if (memcmp(mime_entries[i].extension, slot.extension, MIME_MAX_EXTENSION) == 0) {
+      mime_entries[i].type = type;
+      return 0;
+    }
+  }
+  if (mime_entries_count == mime_entries_capacity) {
+    size_t capacity = mime_entries_capacity ? mime_entries_capacity * 2 : 512;
+    struct mime_slot *entries = realloc(mime_entries, capacity * sizeof(*entries));
+    if (!entries) return -1;
+    mime_entries = entries;
+    mime_entries_capacity = capacity;
+  }
+  mime_entries[mime_entries_count++] = slot;
+  return 0;
+}
+
+/*
+ * Tries to place every entry with SLOT_COUNT slots and BUCKET_COUNT
+ * buckets. Buckets are placed largest first; each gets the first
+ * displacement that sends all its keys to distinct free slots.
+ */
+static int mime_place(uint32_t slot_count, uint32_t bucket_count) {
+  struct mime_slot *slots = calloc(slot_count, sizeof(*slots));
+  uint16_t *displacements = calloc(bucket_count, sizeof(*displacements));
+  uint32_t *bucket_of = malloc(mime_entries_count * sizeof(*bucket_of));
+  uint32_t *order = malloc(mime_entries_count * sizeof(*order));
+  uint32_t *bucket_sizes = calloc(bucket_count, sizeof(*bucket_sizes));
+  uint32_t *targets = malloc(mime_entries_count * sizeof(*targets));
+  int placed = 0;
+  if (!slots || !displacements || !bucket_of || !order || !bucket_sizes || !targets)
+    goto done;
+
+  for (size_t i = 0; i < mime_entries_count; i++) {
+    const char *extension = mime_entries[i].extension;
+    bucket_of[i] = mime_hash(extension, strlen(extension), 0) & (bucket_count - 1);
+    bucket_sizes[bucket_of[i]]++;
+  }
+
+  /* Entries sorted by descending bucket size, grouped by bucket. */
+  size_t count = 0;
+  for (uint32_t size = mime_entries_count; size > 0; size--)
+    for (uint32_t bucket = 0; bucket < bucket_count; bucket++)
+      if (bucket_sizes[bucket] == size)
+        for (size_t i = 0; i < mime_entries_count; i++)
+          if (bucket_of[i] == bucket) order[count++] = i;
+
+  for (size_t start = 0; start < count; ) {
+    uint32_t bucket = bucket_of[order[start]];
+    size_t end = start + bucket_sizes[bucket];
+    uint32_t displacement;
+    for (displacement = 1; displacement < UINT16_MAX; displacement++) {
+      size_t i;
+      for (i = start; i < end; i++) {
+        const char *extension = mime_entries[order[i]].extension;
+        uint32_t target = mime_hash(extension, strlen(extension), displacement) &
+          (slot_count - 1);
+        if (slots[target].type) break;
+        size_t j;
+        for (j = start; j < i && targets[j] != target; j++) {}
+        if (j < i) break;
+        targets[i] = target;
+      }
+      if (i == end) break;
+    }
+    if (displacement == UINT16_MAX) goto done;
+
+    displacements[bucket] = displacement;
+    for (size_t i = start; i < end; i++) slots[targets[i]] = mime_entries[order[i]];
+    start = end;
+  }
+
+  free(mime_slots);
+  free(mime_displacements);
+  mime_slots = slots;
+  mime_displacements = displacements;
+  mime_slot_mask = slot_count - 1;
+  mime_bucket_mask = bucket_count - 1;
+  slots = NULL;
+  displacements = NULL;
+  placed = 1;
+
+done:
+  free(slots);
+  free(displacements);
+  free(bucket_of);
+  free(order);
+  free(bucket_sizes);
+  free(targets);
+  return placed;
+}
+
+/* Compiles the gathered entries into the perfect hash. */
+static int mime_build(void) {
+  uint32_t slot_count = 16;
+  while (slot_count < mime_entries_count * 2) slot_count *= 2;
+  for (; slot_count <= (1u << 24); slot_count *= 2)
+    if (mime_place(slot_count, slot_count / 8 ? slot_count / 8 : 1)) return 0;
+  errno = ENOMEM;
+  return -1;
+}
+
+__attribute__((constructor))
+static void mime_init(void) {
+  size_t count = sizeof(mime_builtin_types) / sizeof(mime_builtin_types[0]);
+  for (size_t i = 0; i < count; i++)
+    mime_add(mime_builtin_types[i].extension,
+        strlen(mime_builtin_types[i].extension), mime_builtin_types[i].type);
+  mime_build();
+}
+
+int mime_load(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) return -1;
+
+  char line[1024];
+  while (fgets(line, sizeof(line), file)) {
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+
+    char *cursor = line;
+    cursor += strspn(cursor, " \t\r\n");
+    size_t type_length = strcspn(cursor, " \t\r\n");
+    if (type_length == 0 || !memchr(cursor, '/', type_length)) continue;
+
+    /* Types live as long as the table, which is never torn down. */
+    char *type = strndup(cursor, type_length);
+    if (!type) {
+      fclose(file);
+      return -1;
+    }
+    cursor += type_length;
+    while (*(cursor += strspn(cursor, " \t\r\n"))) {
+      size_t length = strcspn(cursor, " \t\r\n");
+      if (mime_add(cursor, length, type) < 0) {
+        fclose(file);
+        return -1;
+      }
+      cursor += length;
+    }
+  }
+  fclose(file);
+  return mime_build();
+}
+
+const char *mime_lookup(const char *file_name) {
+  const char *dot = strrchr(file_name, '.');
+  if (!dot || strchr(dot, '/')) return MIME_DEFAULT_TYPE;
+  const char *extension = dot + 1;
+  size_t length = strlen(extension);
+  if (length == 0 || length >= MIME_MAX_EXTENSION || !mime_slots)
+    return MIME_DEFAULT_TYPE;
+
+  uint32_t bucket = mime_hash(extension, length, 0) & mime_bucket_mask;
+  const struct mime_slot *slot = &mime_slots[
+    mime_hash(extension, length, mime_displacements[bucket]) & mime_slot_mask];
+  if (!slot->type || strncasecmp(slot->extension, extension, length) != 0 ||
+      slot->extension[length] != '\0')
+    return MIME_DEFAULT_TYPE;
+  return slot->type;
+}
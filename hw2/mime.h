@@ -0,0 +1,24 @@
+#ifndef __MIME__
+#define __MIME__
+
+/*
+ * MIME maps file name extensions to Content-Types. A built-in table of
+ * common types is always present; mime_load adds (or overrides) entries
+ * from a mime.types style file: one type per line followed by its
+ * extensions, '#' starting a comment.
+ *
+ * The table is compiled into a perfect hash (hash and displace), so a
+ * lookup folds the extension to lowercase while hashing it, then costs one
+ * displacement read, one slot read and one comparison, whatever the table
+ * size. Unknown extensions map to MIME_DEFAULT_TYPE.
+ *
+ * mime_load rebuilds the table and must run before serving starts;
+ * lookups are read only and safe from any thread.
+ */
+
+#define MIME_DEFAULT_TYPE "text/plain"
+
+int mime_load(const char *path);
+const char *mime_lookup(const char *file_name);
+
+#endif
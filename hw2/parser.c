@@ -0,0 +1,310 @@
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PARSER_X86 1
+#endif
+
+#include "parser.h"
+
+enum {
+  PARSER_METHOD,
+  PARSER_PATH,
+  PARSER_VERSION,
+  PARSER_LINE_LF,
+  PARSER_HEADER_START,
+  PARSER_HEADER_NAME,
+  PARSER_VALUE_START,
+  PARSER_VALUE,
+  PARSER_HEAD_LF,
+  PARSER_DONE,
+  PARSER_FAILED,
+};
+
+/* RFC 7230 token characters, which make up methods and header names. */
+static const char token_chars[256] = {
+  ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1,
+  ['*'] = 1, ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1,
+  ['`'] = 1, ['|'] = 1, ['~'] = 1,
+  ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1,
+  ['7'] = 1, ['8'] = 1, ['9'] = 1,
+  ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1,
+  ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1,
+  ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1,
+  ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+  ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1,
+  ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1,
+  ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1, ['u'] = 1,
+  ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+};
+
+/*
+ * Delimiter scanners. Each returns the first byte in [p, end) that is a
+ * control character (below 0x20, or DEL), or also a space when
+ * STOP_AT_SPACE is set; end if there is none. Paths stop at spaces, header
+ * values only at control characters.
+ */
+static const char *scan_scalar(const char *p, const char *end,
+    int stop_at_space) {
+  unsigned char limit = stop_at_space ? 0x20 : 0x1f;
+  for (; p < end; p++) {
+    unsigned char c = *p;
+    if (c <= limit || c == 0x7f) break;
+  }
+  return p;
+}
+
+#ifdef PARSER_X86
+/* pcmpestri with ranges finds the first byte inside any of the ranges, 16
+ * bytes at a time. */
+__attribute__((target("sse4.2")))
+static const char *scan_sse42(const char *p, const char *end,
+    int stop_at_space) {
+  static const char ranges[16] __attribute__((aligned(16))) =
+    "\x00\x20\x7f\x7f";
+  __m128i ranges_vector = _mm_load_si128((const __m128i *) ranges);
+  int ranges_size = 4;
+  if (!stop_at_space) {
+    static const char no_space[16] __attribute__((aligned(16))) =
+      "\x00\x1f\x7f\x7f";
+    ranges_vector = _mm_load_si128((const __m128i *) no_space);
+  }
+
+  while (end - p >= 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *) p);
+    int index = _mm_cmpestri(ranges_vector, ranges_size, bytes, 16,
+        _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+    if (index != 16) return p + index;
+    p += 16;
+  }
+  return scan_scalar(p, end, stop_at_space);
+}
+
+/* AVX2 has no range compare; an unsigned min against the limit finds the
+ * low bytes and an equality compare finds DEL, 32 bytes at a time. */
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const char *end,
+    int stop_at_space) {
+  __m256i limit = _mm256_set1_epi8(stop_at_space ? 0x20 : 0x1f);
+  __m256i del = _mm256_set1_epi8(0x7f);
+
+  while (end - p >= 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i *) p);
+    __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, limit), bytes);
+    __m256i stop = _mm256_or_si256(low, _mm256_cmpeq_epi8(bytes, del));
+    unsigned mask = _mm256_movemask_epi8(stop);
+    if (mask) return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return scan_scalar(p, end, stop_at_space);
+}
+#endif
+
+static const char *(*scan)(const char *, const char *, int) = scan_scalar;
+
+__attribute__((constructor))
+static void parser_select_scanner(void) {
+#ifdef PARSER_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    scan = scan_avx2;
+  else if (__builtin_cpu_supports("sse4.2"))
+    scan = scan_sse42;
+#endif
+}
+
+int parser_use_scanner(const char *name) {
+  if (strcmp(name, "scalar") == 0) {
+    scan = scan_scalar;
+    return 1;
+  }
+#ifdef PARSER_X86
+  __builtin_cpu_init();
+  if (strcmp(name, "sse4.2") == 0 && __builtin_cpu_supports("sse4.2")) {
+    scan = scan_sse42;
+    return 1;
+  }
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    scan = scan_avx2;
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+void parser_init(struct http_parser *parser) {
+  parser->state = PARSER_METHOD;
+  parser->offset = 0;
+  parser->token_start = 0;
+  parser->num_headers = 0;
+}
+
+static void parser_finish(struct http_parser *parser, const char *buffer) {
+  parser->method.data = buffer + parser->method_span.start;
+  parser->method.size = parser->method_span.size;
+  parser->path.data = buffer + parser->path_span.start;
+  parser->path.size = parser->path_span.size;
+  parser->version.data = buffer + parser->version_span.start;
+  parser->version.size = parser->version_span.size;
+  for (int i = 0; i < parser->num_headers; i++) {
+    struct parser_span *spans = parser->header_spans[i];
+    parser->headers[i].name.data = buffer + spans[0].start;
+    parser->headers[i].name.size = spans[0].size;
+    parser->headers[i].value.data = buffer + spans[1].start;
+    parser->headers[i].value.size = spans[1].size;
+  }
+}
+
+static void span_set(struct parser_span *span, size_t start, size_t end) {
+  span->start = start;
+  span->size = end - start;
+}
+
+ssize_t parser_execute(struct http_parser *parser, const char *buffer,
+    size_t size) {
+  const char *p = buffer + parser->offset, *end = buffer + size;
+  int state = parser->state;
+
+  if (state == PARSER_DONE) {
+    parser_finish(parser, buffer);
+    return parser->offset;
+  }
+  while (p < end && state != PARSER_FAILED) {
+    unsigned char c = *p;
+    switch (state) {
+      case PARSER_METHOD:
+        while (p < end && token_chars[(unsigned char) *p]) p++;
+        if (p == end) break;
+        if (*p != ' ' || p == buffer) {
+          state = PARSER_FAILED;
+          break;
+        }
+        span_set(&parser->method_span, 0, p - buffer);
+        parser->token_start = ++p - buffer;
+        state = PARSER_PATH;
+        break;
+
+      case PARSER_PATH:
+        p = scan(p, end, 1);
+        if (p == end) break;
+        if ((size_t) (p - buffer) == parser->token_start ||
+            (*p != ' ' && *p != '\r' && *p != '\n')) {
+          state = PARSER_FAILED;
+          break;
+        }
+        span_set(&parser->path_span, parser->token_start, p - buffer);
+        if (*p == ' ') {
+          parser->token_start = ++p - buffer;
+          state = PARSER_VERSION;
+        } else {
+          /* An HTTP/0.9 style request line with no version. */
+          span_set(&parser->version_span, p - buffer, p - buffer);
+          state = *p++ == '\r' ? PARSER_LINE_LF : PARSER_HEADER_START;
+        }
+        break;
+
+      case PARSER_VERSION:
+        p = scan_scalar(p, end, 1);
+        if (p == end) break;
+        if (*p != '\r' && *p != '\n') {
+          state = PARSER_FAILED;
+          break;
+        }
+        span_set(&parser->version_span, parser->token_start, p - buffer);
+        state = *p++ == '\r' ? PARSER_LINE_LF : PARSER_HEADER_START;
+        break;
+
+      case PARSER_LINE_LF:
+        if (c != '\n') {
+          state = PARSER_FAILED;
+          break;
+        }
+        p++;
+        state = PARSER_HEADER_START;
+        break;
+
+      case PARSER_HEADER_START:
+        if (c == '\r' || c == '\n') {
+          p++;
+          state = c == '\r' ? PARSER_HEAD_LF : PARSER_DONE;
+        } else if (token_chars[c] && parser->num_headers < PARSER_MAX_HEADERS) {
+          parser->token_start = p++ - buffer;
+          state = PARSER_HEADER_NAME;
+        } else {
+          state = PARSER_FAILED; /* Bad name, folded line or too many. */
+        }
+        break;
+
+      case PARSER_HEADER_NAME:
+        while (p < end && token_chars[(unsigned char) *p]) p++;
+        if (p == end) break;
+        if (*p != ':') {
+          state = PARSER_FAILED;
+          break;
+        }
+        span_set(&parser->header_spans[parser->num_headers][0],
+            parser->token_start, p - buffer);
+        p++;
+        state = PARSER_VALUE_START;
+        break;
+
+      case PARSER_VALUE_START:
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p == end) break;
+        parser->token_start = p - buffer;
+        state = PARSER_VALUE;
+        break;
+
+      case PARSER_VALUE: {
+        p = scan(p, end, 0);
+        if (p == end) break;
+        if (*p == '\t') {
+          p++;
+          break;
+        }
+        if (*p != '\r' && *p != '\n') {
+          state = PARSER_FAILED;
+          break;
+        }
+        const char *value_end = p;
+        while (value_end > buffer + parser->token_start &&
+            (value_end[-1] == ' ' || value_end[-1] == '\t'))
+          value_end--;
+        span_set(&parser->header_spans[parser->num_headers++][1],
+            parser->token_start, value_end - buffer);
+        state = *p++ == '\r' ? PARSER_LINE_LF : PARSER_HEADER_START;
+        break;
+      }
+
+      case PARSER_HEAD_LF:
+        if (c != '\n') {
+          state = PARSER_FAILED;
+          break;
+        }
+        p++;
+        state = PARSER_DONE;
+        break;
+    }
+    if (state == PARSER_DONE) break;
+  }
+
+  parser->state = state;
+  parser->offset = p - buffer;
+  if (state == PARSER_FAILED) return PARSER_ERROR;
+  if (state != PARSER_DONE) return PARSER_INCOMPLETE;
+  parser_finish(parser, buffer);
+  return parser->offset;
+}
+
+const struct http_slice *parser_find_header(const struct http_parser *parser,
+    const char *name) {
+  size_t name_length = strlen(name);
+  for (int i = 0; i < parser->num_headers; i++) {
+    const struct http_header *header = &parser->headers[i];
+    if (header->name.size == name_length &&
+        strncasecmp(header->name.data, name, name_length) == 0)
+      return &header->value;
+  }
+  return NULL;
+}
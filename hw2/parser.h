@@ -0,0 +1,81 @@
+#ifndef __PARSER__
+#define __PARSER__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * PARSER is a resumable, zero-allocation parser for HTTP request heads.
+ *
+ * The caller owns the buffer and calls parser_execute with every byte of the
+ * head received so far, starting from its first byte, each time more
+ * arrives. Progress is kept as offsets, so the buffer may move between
+ * calls (as a connection buffer does when it is compacted), and bytes
+ * already scanned are not scanned again. Once the head is complete the
+ * method, path, version and headers are exposed as (pointer, length)
+ * slices into the buffer from the last call; nothing is copied.
+ *
+ * Delimiter scanning over paths and header values uses SSE4.2 or AVX2 when
+ * the CPU has them, picked once at startup, and a scalar loop otherwise.
+ */
+
+#define PARSER_MAX_HEADERS 64
+
+/* parser_execute results other than a head length. */
+#define PARSER_INCOMPLETE 0
+#define PARSER_ERROR -1
+
+struct http_slice {
+  const char *data;
+  size_t size;
+};
+
+struct http_header {
+  struct http_slice name;
+  struct http_slice value;
+};
+
+struct parser_span {
+  size_t start;
+  size_t size;
+};
+
+struct http_parser {
+  int state;
+  size_t offset;       // Bytes of the head consumed so far.
+  size_t token_start;  // Offset where the token being parsed began.
+  struct parser_span method_span;
+  struct parser_span path_span;
+  struct parser_span version_span;
+  struct parser_span header_spans[PARSER_MAX_HEADERS][2];
+
+  /* Filled in once the head is complete. */
+  struct http_slice method;
+  struct http_slice path;
+  struct http_slice version;
+  int num_headers;
+  struct http_header headers[PARSER_MAX_HEADERS];
+};
+
+void parser_init(struct http_parser *parser);
+
+/*
+ * Parses on from where the last call stopped. Returns the length of the
+ * head once its terminating blank line is seen, PARSER_INCOMPLETE while it
+ * needs more bytes and PARSER_ERROR if the head is malformed or has more
+ * than PARSER_MAX_HEADERS headers.
+ */
+ssize_t parser_execute(struct http_parser *parser, const char *buffer,
+    size_t size);
+
+/* Finds the first header called NAME, matched case insensitively. */
+const struct http_slice *parser_find_header(const struct http_parser *parser,
+    const char *name);
+
+/*
+ * Forces the delimiter scanner to "scalar", "sse4.2" or "avx2" (for the
+ * fuzzer and benchmarks). Returns 0 if the CPU lacks it.
+ */
+int parser_use_scanner(const char *name);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * Differential fuzzer for the request parser.
+ *
+ * Every input is parsed three ways and the results must agree: in one call
+ * with each delimiter scanner the CPU supports, and incrementally with the
+ * scalar scanner, fed at random split points and with the bytes moved to a
+ * fresh buffer before each call (as a compacted connection buffer would
+ * be). Slices of a complete head must lie inside it. Exact-size heap copies
+ * let AddressSanitizer catch reads past the end.
+ *
+ * Built with clang -fsanitize=fuzzer,address -DPARSER_LIBFUZZER this is a
+ * libFuzzer target. Otherwise it runs its own mutation loop over a few seed
+ * requests.
+ *
+ * Usage: ./parser_fuzz [iterations] [seed]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.h"
+
+static const char *scanners[] = { "scalar", "sse4.2", "avx2" };
+#define NUM_SCANNERS (sizeof(scanners) / sizeof(scanners[0]))
+
+struct outcome {
+  ssize_t result;
+  size_t method[2], path[2], version[2];
+  int num_headers;
+  size_t headers[PARSER_MAX_HEADERS][4];
+};
+
+static void fail(const char *what, const uint8_t *data, size_t size) {
+  fprintf(stderr, "parser_fuzz: %s on input of %zu bytes:\n", what, size);
+  fwrite(data, 1, size, stderr);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+static void slice_offsets(const struct http_slice *slice, const char *base,
+    size_t head_length, size_t *offsets, const uint8_t *data, size_t size) {
+  if (slice->data < base || slice->data + slice->size > base + head_length)
+    fail("slice outside the head", data, size);
+  offsets[0] = slice->data - base;
+  offsets[1] = slice->size;
+}
+
+/* Records RESULT and, for a complete head, where its slices point. */
+static void record(struct outcome *outcome, struct http_parser *parser,
+    ssize_t result, const char *base, const uint8_t *data, size_t size) {
+  memset(outcome, 0, sizeof(*outcome));
+  outcome->result = result;
+  if (result <= 0) return;
+  slice_offsets(&parser->method, base, result, outcome->method, data, size);
+  slice_offsets(&parser->path, base, result, outcome->path, data, size);
+  slice_offsets(&parser->version, base, result, outcome->version, data, size);
+  outcome->num_headers = parser->num_headers;
+  for (int i = 0; i < parser->num_headers; i++) {
+    slice_offsets(&parser->headers[i].name, base, result, outcome->headers[i],
+        data, size);
+    slice_offsets(&parser->headers[i].value, base, result,
+        outcome->headers[i] + 2, data, size);
+  }
+}
+
+static void parse_whole(struct outcome *outcome, const uint8_t *data,
+    size_t size) {
+  struct http_parser parser;
+  char *copy = malloc(size ? size : 1);
+  memcpy(copy, data, size);
+  parser_init(&parser);
+  record(outcome, &parser, parser_execute(&parser, copy, size), copy, data,
+      size);
+  free(copy);
+}
+
+static void parse_split(struct outcome *outcome, const uint8_t *data,
+    size_t size, unsigned *seed) {
+  struct http_parser parser;
+  ssize_t result = PARSER_INCOMPLETE;
+  char *copy = NULL;
+  size_t fed = 0;
+
+  parser_init(&parser);
+  while (result == PARSER_INCOMPLETE && fed < size) {
+    fed += 1 + rand_r(seed) % (size - fed);
+    free(copy);
+    copy = malloc(fed);
+    memcpy(copy, data, fed);
+    result = parser_execute(&parser, copy, fed);
+  }
+  if (size == 0) result = parser_execute(&parser, "", 0);
+  record(outcome, &parser, result, copy, data, size);
+  free(copy);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static unsigned seed = 1;
+  struct outcome expected, actual;
+
+  parser_use_scanner("scalar");
+  parse_whole(&expected, data, size);
+  for (size_t i = 1; i < NUM_SCANNERS; i++) {
+    if (!parser_use_scanner(scanners[i])) continue;
+    parse_whole(&actual, data, size);
+    if (memcmp(&expected, &actual, sizeof(actual)) != 0)
+      fail(scanners[i], data, size);
+  }
+
+  parser_use_scanner("scalar");
+  parse_split(&actual, data, size, &seed);
+  if (memcmp(&expected, &actual, sizeof(actual)) != 0)
+    fail("incremental parse", data, size);
+  return 0;
+}
+
+#ifndef PARSER_LIBFUZZER
+static const char *seeds[] = {
+  "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n",
+  "GET /index.html HTTP/1.0\n\n",
+  "HEAD /a/b?c=d HTTP/1.1\r\nHost: x\r\nConnection: keep-alive, Upgrade\r\n"
+    "Accept-Encoding: gzip, br\r\nX-Empty:\r\nX-Tab:\ta\tb \r\n\r\n",
+  "POST /upload HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello",
+  "GET /0123456789abcdef0123456789abcdef0123456789abcdef HTTP/1.1\r\n"
+    "User-Agent: a rather long header value that spans several vector "
+    "widths of the scanners\r\n\r\n",
+  "GET /\r\n\r\n",
+};
+
+static const char dictionary[] = " \t\r\n:\x7f\x00\x80/%?HTTP";
+
+static size_t mutate(uint8_t *data, size_t size, size_t capacity,
+    unsigned *seed) {
+  int mutations = 1 + rand_r(seed) % 4;
+  while (mutations--) {
+    size_t at = size ? rand_r(seed) % size : 0;
+    switch (rand_r(seed) % 5) {
+      case 0:
+        if (size) data[at] = rand_r(seed);
+        break;
+      case 1:
+        if (size) data[at] = dictionary[rand_r(seed) % (sizeof(dictionary) - 1)];
+        break;
+      case 2:
+        if (size < capacity) {
+          memmove(data + at + 1, data + at, size - at);
+          data[at] = dictionary[rand_r(seed) % (sizeof(dictionary) - 1)];
+          size++;
+        }
+        break;
+      case 3:
+        if (size) {
+          memmove(data + at, data + at + 1, size - at - 1);
+          size--;
+        }
+        break;
+      case 4:
+        size = at;
+        break;
+    }
+  }
+  return size;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 100000;
+  unsigned seed = argc > 2 ? atoi(argv[2]) : 1;
+  uint8_t buffer[1024];
+
+  for (size_t i = 1; i < NUM_SCANNERS; i++)
+    if (!parser_use_scanner(scanners[i]))
+      printf("%s not supported here; skipped\n", scanners[i]);
+
+  long complete = 0;
+  for (long i = 0; i < iterations; i++) {
+    const char *base = seeds[rand_r(&seed) % (sizeof(seeds) / sizeof(seeds[0]))];
+    size_t size = strlen(base);
+    memcpy(buffer, base, size);
+    if (i % 8) size = mutate(buffer, size, sizeof(buffer), &seed);
+    LLVMFuzzerTestOneInput(buffer, size);
+
+    struct http_parser parser;
+    parser_init(&parser);
+    if (parser_execute(&parser, (char *) buffer, size) > 0) complete++;
+  }
+  printf("%ld inputs agreed (%ld complete heads)\n", iterations, complete);
+  return 0;
+}
+#endif
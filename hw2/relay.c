@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "relay.h"
+
+#define RELAY_CHUNK_SIZE (64 * 1024)
+#define RELAY_PIPE_SIZE (256 * 1024)
+#define RELAY_PIPE_POOL 8
+#define RELAY_RUN_MAX (1024 * 1024)  // Bytes one run moves before yielding.
+
+/* Empty pipes of the calling thread, kept for the next channels. */
+static __thread int relay_pipes[RELAY_PIPE_POOL][2];
+static __thread size_t relay_pipe_sizes[RELAY_PIPE_POOL];
+static __thread int relay_pipe_count;
+
+/* Fills PIPE_FDS with a pipe from the calling thread's pool, or a new one,
+ * and returns its capacity, or 0 if no pipe could be created. */
+static size_t relay_take_pipe(int pipe_fds[2]) {
+  if (relay_pipe_count > 0) {
+    int index = --relay_pipe_count;
+    pipe_fds[0] = relay_pipes[index][0];
+    pipe_fds[1] = relay_pipes[index][1];
+    return relay_pipe_sizes[index];
+  }
+  if (pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) return 0;
+  fcntl(pipe_fds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+  int size = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+  return size > 0 ? size : 4096;
+}
+
+/* Returns an empty pipe to the pool; one still holding bytes of an aborted
+ * channel, or one the pool has no room for, is closed. */
+static void relay_give_pipe(int pipe_fds[2], size_t size, int empty) {
+  if (empty && relay_pipe_count < RELAY_PIPE_POOL) {
+    int index = relay_pipe_count++;
+    relay_pipes[index][0] = pipe_fds[0];
+    relay_pipes[index][1] = pipe_fds[1];
+    relay_pipe_sizes[index] = size;
+    return;
+  }
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+}
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0 && !(flags & O_NONBLOCK))
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int relay_channel_setup(struct relay_channel *channel, int from, int to,
+    size_t remaining, int use_splice) {
+  memset(channel, 0, sizeof(*channel));
+  channel->from = from;
+  channel->to = to;
+  channel->pipe[0] = channel->pipe[1] = -1;
+  channel->remaining = remaining;
+  channel->eof = remaining == 0;
+  if (use_splice)
+    channel->capacity = relay_take_pipe(channel->pipe);
+  else if ((channel->buffer = malloc(RELAY_CHUNK_SIZE)))
+    channel->capacity = RELAY_CHUNK_SIZE;
+  return channel->capacity > 0 ? 0 : -1;
+}
+
+int relay_channel_open(struct relay_channel *channel, int from, int to,
+    size_t remaining) {
+  return relay_channel_setup(channel, from, to, remaining, 1);
+}
+
+void relay_channel_close(struct relay_channel *channel) {
+  if (channel->pipe[0] >= 0)
+    relay_give_pipe(channel->pipe, channel->capacity, channel->buffered == 0);
+  free(channel->buffer);
+  channel->pipe[0] = channel->pipe[1] = -1;
+  channel->buffer = NULL;
+}
+
+/* Moves what it can from FROM into the channel's pipe or buffer. Returns
+ * the bytes taken, 0 if there were none to take and -1 on error. */
+static ssize_t relay_fill(struct relay_channel *channel) {
+  size_t want = channel->capacity - channel->buffered;
+  if (want > channel->remaining) want = channel->remaining;
+  ssize_t bytes = channel->buffer ?
+    read(channel->from, channel->buffer + channel->buffered, want) :
+    splice(channel->from, NULL, channel->pipe[1], NULL, want,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (bytes > 0) {
+    channel->buffered += bytes;
+    if (channel->remaining != RELAY_UNTIL_CLOSE &&
+        (channel->remaining -= bytes) == 0)
+      channel->eof = 1;
+    return bytes;
+  }
+  if (bytes == 0) {
+    channel->eof = 1;
+    /* Closing early leaves the bytes still owed undelivered. */
+    return channel->remaining == RELAY_UNTIL_CLOSE ? 0 : -1;
+  }
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+}
+
+/* Moves what it can from the channel's pipe or buffer into TO. Returns the
+ * bytes delivered, 0 if TO took none and -1 on error. */
+static ssize_t relay_drain(struct relay_channel *channel) {
+  ssize_t bytes = channel->buffer ?
+    write(channel->to, channel->buffer + channel->offset,
+        channel->buffered - channel->offset) :
+    splice(channel->pipe[0], NULL, channel->to, NULL, channel->buffered,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (bytes < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+
+  if (!channel->buffer) {
+    channel->buffered -= bytes;
+  } else if ((channel->offset += bytes) == channel->buffered) {
+    channel->offset = channel->buffered = 0;
+  }
+  return bytes;
+}
+
+int relay_channel_run(struct relay_channel *channel, short *from_events,
+    short *to_events) {
+  /* A fast pair of sockets yields after RELAY_RUN_MAX bytes, still ready,
+   * so whoever drives the channel can get to the rest of its work. */
+  size_t moved = 0;
+  while (moved < RELAY_RUN_MAX) {
+    ssize_t filled = 0, drained = 0;
+    if (!channel->eof && channel->buffered < channel->capacity &&
+        (filled = relay_fill(channel)) < 0)
+      return -1;
+    if (channel->buffered > 0 && (drained = relay_drain(channel)) < 0)
+      return -1;
+    if (channel->eof && channel->buffered == 0) return 1;
+    if (filled == 0 && drained == 0) break;
+    moved += drained;
+  }
+  if (!channel->eof && channel->buffered < channel->capacity)
+    *from_events |= POLLIN;
+  if (channel->buffered > 0) *to_events |= POLLOUT;
+  return 0;
+}
+
+static int relay_setup(struct relay *relay, int client_fd, int upstream_fd,
+    int use_splice) {
+  relay->done[0] = relay->done[1] = 0;
+  relay->channels[1].pipe[0] = -1;
+  relay->channels[1].buffer = NULL;
+  if (relay_channel_setup(&relay->channels[0], client_fd, upstream_fd,
+        RELAY_UNTIL_CLOSE, use_splice) < 0 ||
+      relay_channel_setup(&relay->channels[1], upstream_fd, client_fd,
+        RELAY_UNTIL_CLOSE, use_splice) < 0) {
+    relay_close(relay);
+    return -1;
+  }
+  return 0;
+}
+
+int relay_open(struct relay *relay, int client_fd, int upstream_fd) {
+  return relay_setup(relay, client_fd, upstream_fd, 1);
+}
+
+int relay_run(struct relay *relay, short *client_events,
+    short *upstream_events) {
+  short *events[2] = { client_events, upstream_events };
+  for (int i = 0; i < 2; i++) {
+    if (relay->done[i]) continue;
+    int status = relay_channel_run(&relay->channels[i], events[i],
+        events[1 - i]);
+    if (status < 0) return -1;
+    if (status > 0) {
+      /* Everything FROM sent has been delivered: pass the close on. */
+      shutdown(relay->channels[i].to, SHUT_WR);
+      relay->done[i] = 1;
+    }
+  }
+  return relay->done[0] && relay->done[1];
+}
+
+void relay_close(struct relay *relay) {
+  relay_channel_close(&relay->channels[0]);
+  relay_channel_close(&relay->channels[1]);
+}
+
+static int relay(int client_fd, int upstream_fd, int use_splice,
+    int timeout_ms) {
+  struct relay relay;
+  if (relay_setup(&relay, client_fd, upstream_fd, use_splice) < 0) return -1;
+  set_nonblocking(client_fd);
+  set_nonblocking(upstream_fd);
+
+  int status;
+  while (1) {
+    struct pollfd pollfds[2] = {
+      { .fd = client_fd }, { .fd = upstream_fd },
+    };
+    status = relay_run(&relay, &pollfds[0].events, &pollfds[1].events);
+    if (status != 0) break;
+
+    int ready = poll(pollfds, 2, timeout_ms);
+    if (ready < 0 && errno == EINTR) continue;
+    if (ready <= 0) {
+      status = -1; /* Failed, or both sides idle for too long. */
+      break;
+    }
+    if ((pollfds[0].revents | pollfds[1].revents) & (POLLERR | POLLNVAL)) {
+      status = -1; /* Reset by a peer: nothing more can be delivered. */
+      break;
+    }
+  }
+
+  relay_close(&relay);
+  return status < 0 ? -1 : 0;
+}
+
+int relay_splice(int client_fd, int upstream_fd, int timeout_ms) {
+  return relay(client_fd, upstream_fd, 1, timeout_ms);
+}
+
+int relay_copy(int client_fd, int upstream_fd, int timeout_ms) {
+  return relay(client_fd, upstream_fd, 0, timeout_ms);
+}
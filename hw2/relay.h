@@ -0,0 +1,67 @@
+#ifndef __RELAY__
+#define __RELAY__
+
+#include <stddef.h>
+
+/*
+ * RELAY shuttles bytes between sockets, as the proxy does between a client
+ * and its upstream, without ever blocking, so an event loop can drive many
+ * relays at once.
+ *
+ * A relay_channel moves bytes one way, from FROM to TO: REMAINING bytes,
+ * or with RELAY_UNTIL_CLOSE everything FROM sends until it closes. Bytes
+ * move with splice(2) through a pipe, so payload never enters userspace;
+ * each thread keeps a few empty pipes for the channels it opens next.
+ * relay_channel_run moves whatever both sockets allow right now. It
+ * returns 1 once every byte has been delivered, -1 on a socket error (or
+ * FROM closing before it sent all it owed) and 0 otherwise, having added
+ * POLLIN to *FROM_EVENTS and POLLOUT to *TO_EVENTS as the channel needs
+ * them before it can go on. It leaves the sockets open and their blocking
+ * mode untouched, but only ever asks them for what they have ready.
+ *
+ * A relay pairs two channels between a client and its upstream, until both
+ * sides have finished sending; a half-close on one side is forwarded as
+ * shutdown(SHUT_WR) on the other, so the opposite direction keeps flowing.
+ * relay_run returns and reports what to wait for as relay_channel_run does.
+ *
+ * relay_splice and relay_copy run a relay to the end in a poll loop, the
+ * latter with plain read/write, kept as a fallback and as a benchmark
+ * baseline. Both set the two sockets non-blocking and return 0 once both
+ * directions are closed cleanly, or -1 on a socket error or once neither
+ * side has been ready for TIMEOUT_MS (-1 waits forever). The caller closes
+ * the fds.
+ */
+
+#define RELAY_UNTIL_CLOSE ((size_t) -1)
+
+struct relay_channel {
+  int from, to;
+  int pipe[2];        // Splicing: bytes taken from FROM, not yet delivered.
+  char *buffer;       // Copying: the same, in userspace.
+  size_t offset;      // Copying: bytes of buffer already delivered.
+  size_t buffered;
+  size_t capacity;
+  size_t remaining;   // Bytes FROM still owes, or RELAY_UNTIL_CLOSE.
+  int eof;            // Nothing more to take from FROM.
+};
+
+struct relay {
+  struct relay_channel channels[2];  // Client to upstream, and back.
+  int done[2];
+};
+
+int relay_channel_open(struct relay_channel *channel, int from, int to,
+    size_t remaining);
+int relay_channel_run(struct relay_channel *channel, short *from_events,
+    short *to_events);
+void relay_channel_close(struct relay_channel *channel);
+
+int relay_open(struct relay *relay, int client_fd, int upstream_fd);
+int relay_run(struct relay *relay, short *client_events,
+    short *upstream_events);
+void relay_close(struct relay *relay);
+
+int relay_splice(int client_fd, int upstream_fd, int timeout_ms);
+int relay_copy(int client_fd, int upstream_fd, int timeout_ms);
+
+#endif
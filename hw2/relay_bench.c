@@ -0,0 +1,157 @@
+/*
+ * Benchmark for the proxy relay.
+ *
+ * Starts a local stand-in upstream and pushes a download through the relay
+ * the way the proxy does: the client sends a short request and half-closes,
+ * the relay forwards the close, and the upstream answers with SIZE bytes
+ * and closes. Reports wall-clock throughput and bytes moved per CPU-second
+ * of the relaying thread for relay_splice and relay_copy.
+ *
+ * Usage: ./relay_bench [megabytes] [rounds]
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "relay.h"
+
+struct bench {
+  int upstream_listener;
+  int relay_listener;
+  struct sockaddr_in upstream_address;
+  struct sockaddr_in relay_address;
+  size_t size;
+  int use_splice;
+  double relay_cpu_seconds;
+  int relay_status;
+};
+
+static int listen_loopback(struct sockaddr_in *address) {
+  int fd = socket(PF_INET, SOCK_STREAM, 0);
+  memset(address, 0, sizeof(*address));
+  address->sin_family = AF_INET;
+  address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(*address);
+  if (fd < 0 || bind(fd, (struct sockaddr *) address, sizeof(*address)) < 0 ||
+      listen(fd, 16) < 0 ||
+      getsockname(fd, (struct sockaddr *) address, &length) < 0) {
+    perror("Failed to set up loopback listener");
+    exit(1);
+  }
+  return fd;
+}
+
+static double thread_cpu_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Stand-in upstream: reads the request to EOF, then sends SIZE bytes. */
+static void *upstream_main(void *arg) {
+  struct bench *bench = arg;
+  int fd = accept(bench->upstream_listener, NULL, NULL);
+  char buffer[64 * 1024];
+  while (read(fd, buffer, sizeof(buffer)) > 0);
+
+  memset(buffer, 'x', sizeof(buffer));
+  size_t remaining = bench->size;
+  while (remaining > 0) {
+    ssize_t bytes = write(fd, buffer,
+        remaining < sizeof(buffer) ? remaining : sizeof(buffer));
+    if (bytes <= 0) break;
+    remaining -= bytes;
+  }
+  close(fd);
+  return NULL;
+}
+
+/* The proxy's side: relays one accepted client to the upstream. */
+static void *relay_main(void *arg) {
+  struct bench *bench = arg;
+  int client_fd = accept(bench->relay_listener, NULL, NULL);
+  int upstream_fd = socket(PF_INET, SOCK_STREAM, 0);
+  connect(upstream_fd, (struct sockaddr *) &bench->upstream_address,
+      sizeof(bench->upstream_address));
+
+  double start = thread_cpu_seconds();
+  bench->relay_status = bench->use_splice ?
+    relay_splice(client_fd, upstream_fd, -1) :
+    relay_copy(client_fd, upstream_fd, -1);
+  bench->relay_cpu_seconds = thread_cpu_seconds() - start;
+
+  close(client_fd);
+  close(upstream_fd);
+  return NULL;
+}
+
+/* Runs one download and returns the bytes the client received. */
+static size_t run_once(struct bench *bench) {
+  pthread_t upstream, relay;
+  pthread_create(&upstream, NULL, upstream_main, bench);
+  pthread_create(&relay, NULL, relay_main, bench);
+
+  int fd = socket(PF_INET, SOCK_STREAM, 0);
+  connect(fd, (struct sockaddr *) &bench->relay_address,
+      sizeof(bench->relay_address));
+  const char *request = "GET /large HTTP/1.0\r\n\r\n";
+  write(fd, request, strlen(request));
+  shutdown(fd, SHUT_WR);
+
+  char buffer[64 * 1024];
+  size_t received = 0;
+  ssize_t bytes;
+  while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) received += bytes;
+  close(fd);
+
+  pthread_join(upstream, NULL);
+  pthread_join(relay, NULL);
+  return received;
+}
+
+int main(int argc, char **argv) {
+  size_t megabytes = argc > 1 ? atol(argv[1]) : 256;
+  int rounds = argc > 2 ? atoi(argv[2]) : 5;
+
+  struct bench bench;
+  bench.upstream_listener = listen_loopback(&bench.upstream_address);
+  bench.relay_listener = listen_loopback(&bench.relay_address);
+  bench.size = megabytes << 20;
+
+  printf("%-8s %12s %14s %16s\n", "mode", "MB/s (wall)", "relay CPU s",
+      "MB per CPU-s");
+  for (int use_splice = 1; use_splice >= 0; use_splice--) {
+    bench.use_splice = use_splice;
+    double wall = 0, cpu = 0;
+    size_t total = 0;
+    for (int round = 0; round < rounds; round++) {
+      double start = now_seconds();
+      size_t received = run_once(&bench);
+      wall += now_seconds() - start;
+      cpu += bench.relay_cpu_seconds;
+      total += received;
+      if (received != bench.size || bench.relay_status != 0) {
+        fprintf(stderr, "Relay delivered %zu of %zu bytes (status %d)\n",
+            received, bench.size, bench.relay_status);
+        return 1;
+      }
+    }
+    double total_mb = total / (1024.0 * 1024.0);
+    printf("%-8s %12.1f %14.3f %16.1f\n", use_splice ? "splice" : "copy",
+        total_mb / wall, cpu, total_mb / cpu);
+  }
+  return 0;
+}
@@ -0,0 +1,174 @@
+#ifdef HTTP_STATS
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+__thread struct stats_thread *stats_self;
+int stats_use_tsc;
+uint64_t stats_scale = 1ULL << 32;
+uint64_t *stats_queued_at;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread *stats_threads;
+
+static const char *stage_names[NUM_STATS_STAGES] = {
+  "accept", "queue_wait", "parse", "handler", "send"
+};
+
+/* Gives the calling thread its block. Blocks outlive their threads, so
+ * nothing a thread counted is lost when it exits. */
+struct stats_thread *stats_register() {
+  struct stats_thread *self;
+  if (posix_memalign((void **) &self, 64, sizeof(*self)) != 0) {
+    perror("Failed to allocate thread stats");
+    exit(ENOMEM);
+  }
+  memset(self, 0, sizeof(*self));
+  pthread_mutex_lock(&stats_lock);
+  self->next = stats_threads;
+  __atomic_store_n(&stats_threads, self, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&stats_lock);
+  stats_self = self;
+  return self;
+}
+
+/*
+ * Uses the TSC when the CPU says it ticks at a constant rate across cores
+ * and sleep states, measuring that rate against CLOCK_MONOTONIC.
+ */
+void stats_init() {
+  if (!(stats_queued_at = calloc(STATS_MAX_FDS, sizeof(*stats_queued_at)))) {
+    perror("Failed to allocate stats");
+    exit(ENOMEM);
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+    return;
+
+  struct timespec start, end, pause = { 0, 20 * 1000 * 1000 };
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t start_ticks = __builtin_ia32_rdtsc();
+  nanosleep(&pause, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  uint64_t ticks = __builtin_ia32_rdtsc() - start_ticks;
+  uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+    end.tv_nsec - start.tv_nsec;
+  if (ticks == 0) return;
+  stats_scale = ((unsigned __int128) ns << 32) / ticks;
+  stats_use_tsc = 1;
+#endif
+}
+
+static uint64_t stats_load(const uint64_t *value) {
+  return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static void write_counter(FILE *out, const char *name, const char *help,
+    const char *label, const enum stats_counter *counters,
+    const char **label_values, int count, const uint64_t *totals) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+  for (int i = 0; i < count; i++) {
+    if (label)
+      fprintf(out, "%s{%s=\"%s\"} %lu\n", name, label, label_values[i],
+          (unsigned long) totals[counters[i]]);
+    else
+      fprintf(out, "%s %lu\n", name, (unsigned long) totals[counters[i]]);
+  }
+}
+
+void stats_write(FILE *out) {
+  uint64_t counters[NUM_STATS_COUNTERS] = { 0 };
+  struct stats_histogram stages[NUM_STATS_STAGES];
+  memset(stages, 0, sizeof(stages));
+
+  for (struct stats_thread *thread = __atomic_load_n(&stats_threads,
+        __ATOMIC_ACQUIRE); thread; thread = thread->next) {
+    for (int i = 0; i < NUM_STATS_COUNTERS; i++)
+      counters[i] += stats_load(&thread->counters[i]);
+    for (int i = 0; i < NUM_STATS_STAGES; i++) {
+      for (int j = 0; j < STATS_BUCKETS; j++)
+        stages[i].buckets[j] += stats_load(&thread->stages[i].buckets[j]);
+      stages[i].sum_ns += stats_load(&thread->stages[i].sum_ns);
+    }
+  }
+
+  fprintf(out, "# HELP httpserver_stage_seconds Time spent in each stage of "
+      "serving a request.\n# TYPE httpserver_stage_seconds histogram\n");
+  for (int i = 0; i < NUM_STATS_STAGES; i++) {
+    uint64_t cumulative = 0;
+    for (int j = 0; j < STATS_BUCKETS; j++) {
+      cumulative += stages[i].buckets[j];
+      if (j < STATS_BUCKETS - 1)
+        fprintf(out, "httpserver_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} "
+            "%lu\n", stage_names[i], (1024ULL << j) / 1e9,
+            (unsigned long) cumulative);
+      else
+        fprintf(out, "httpserver_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} "
+            "%lu\n", stage_names[i], (unsigned long) cumulative);
+    }
+    fprintf(out, "httpserver_stage_seconds_sum{stage=\"%s\"} %.9f\n",
+        stage_names[i], stages[i].sum_ns / 1e9);
+    fprintf(out, "httpserver_stage_seconds_count{stage=\"%s\"} %lu\n",
+        stage_names[i], (unsigned long) cumulative);
+  }
+
+  static const enum stats_counter connections[] = { STATS_CONNECTIONS };
+  write_counter(out, "httpserver_connections_total", "Connections accepted.",
+      NULL, connections, NULL, 1, counters);
+  static const enum stats_counter shed[] = { STATS_CONNECTIONS_SHED };
+  write_counter(out, "httpserver_connections_shed_total",
+      "Connections refused at the connection limit.", NULL, shed, NULL, 1,
+      counters);
+  static const enum stats_counter timeouts[] = { STATS_HEADER_TIMEOUTS };
+  write_counter(out, "httpserver_header_timeouts_total",
+      "Connections closed for not sending a request head in time.", NULL,
+      timeouts, NULL, 1, counters);
+  static const enum stats_counter requests[] = { STATS_REQUESTS };
+  write_counter(out, "httpserver_requests_total", "Requests served.",
+      NULL, requests, NULL, 1, counters);
+  static const enum stats_counter limited[] = { STATS_REQUESTS_LIMITED };
+  write_counter(out, "httpserver_requests_rate_limited_total",
+      "Requests refused by the per-client rate limit.", NULL, limited, NULL, 1,
+      counters);
+  static const enum stats_counter responses[] = { STATS_RESPONSES_1XX,
+    STATS_RESPONSES_2XX, STATS_RESPONSES_3XX, STATS_RESPONSES_4XX,
+    STATS_RESPONSES_5XX };
+  static const char *classes[] = { "1xx", "2xx", "3xx", "4xx", "5xx" };
+  write_counter(out, "httpserver_responses_total", "Responses by status class.",
+      "code", responses, classes, 5, counters);
+
+  static const char *results[] = { "hit", "miss" };
+  static const enum stats_counter fdcache[] = { STATS_FDCACHE_HITS,
+    STATS_FDCACHE_MISSES };
+  write_counter(out, "httpserver_fd_cache_lookups_total",
+      "Open file cache lookups.", "result", fdcache, results, 2, counters);
+  static const enum stats_counter encoding[] = { STATS_ENCODING_HITS,
+    STATS_ENCODING_MISSES };
+  write_counter(out, "httpserver_compressed_cache_lookups_total",
+      "Compressed variant cache lookups.", "result", encoding, results, 2,
+      counters);
+
+  static const enum stats_counter upstream[] = { STATS_UPSTREAM_REUSED,
+    STATS_UPSTREAM_CONNECTED };
+  static const char *sources[] = { "pool", "new" };
+  write_counter(out, "httpserver_upstream_connections_total",
+      "Upstream connections used, by where they came from.", "source",
+      upstream, sources, 2, counters);
+  uint64_t idle = counters[STATS_UPSTREAM_POOLED] -
+    counters[STATS_UPSTREAM_REUSED] - counters[STATS_UPSTREAM_DROPPED];
+  fprintf(out, "# HELP httpserver_upstream_idle_connections Upstream "
+      "connections idle in the pools.\n"
+      "# TYPE httpserver_upstream_idle_connections gauge\n"
+      "httpserver_upstream_idle_connections %ld\n", (long) idle);
+}
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef __STATS__
+#define __STATS__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * STATS keeps counters and per-stage latency histograms for the server.
+ *
+ * Every thread writes only its own block, registered on first use, so
+ * recording is a thread-local load and a plain add: no locks, no atomic
+ * read-modify-writes and no shared cache lines. stats_write sums the
+ * blocks of all threads when /__stats is requested (under --stats). Stage
+ * times come from the TSC where it is invariant (clock_gettime otherwise)
+ * and land in power-of-two buckets from 1 µs, so recording one costs a few
+ * nanoseconds.
+ *
+ * A request's time is split into the stages below: accept→enqueue and
+ * queue wait for the worker pool, then reading and parsing the head, the
+ * handler and sending the response (under io_uring, handing it to the
+ * ring). The handler stage is what is left of the request once parsing and
+ * sending are taken out.
+ *
+ * Instrumentation goes through the STATS_* macros, which compile to
+ * nothing unless the build defines HTTP_STATS (make STATS=0 leaves it out).
+ */
+
+enum stats_counter {
+  STATS_CONNECTIONS,
+  STATS_CONNECTIONS_SHED,     // Refused with a 503 at the connection limit.
+  STATS_HEADER_TIMEOUTS,      // Closed for sending a head too slowly.
+  STATS_REQUESTS_LIMITED,     // Refused with a 429 by the rate limit.
+  STATS_REQUESTS,
+  STATS_RESPONSES_1XX,  // Five consecutive classes, indexed by status / 100.
+  STATS_RESPONSES_2XX,
+  STATS_RESPONSES_3XX,
+  STATS_RESPONSES_4XX,
+  STATS_RESPONSES_5XX,
+  STATS_FDCACHE_HITS,
+  STATS_FDCACHE_MISSES,
+  STATS_ENCODING_HITS,
+  STATS_ENCODING_MISSES,
+  STATS_UPSTREAM_REUSED,      // Taken from a worker's idle pool.
+  STATS_UPSTREAM_CONNECTED,   // Newly connected.
+  STATS_UPSTREAM_POOLED,      // Returned to an idle pool.
+  STATS_UPSTREAM_DROPPED,     // Closed out of an idle pool.
+  NUM_STATS_COUNTERS
+};
+
+enum stats_stage {
+  STATS_ACCEPT,
+  STATS_QUEUE_WAIT,
+  STATS_PARSE,
+  STATS_HANDLER,
+  STATS_SEND,
+  NUM_STATS_STAGES
+};
+
+/* A request set aside while its handler waits, so the thread can serve
+ * others meanwhile; the wait isn't charged to any stage. */
+struct stats_request {
+  uint64_t elapsed;  // Ticks served before the wait.
+  uint64_t parse;
+  uint64_t send;
+};
+
+#define STATS_BUCKETS 28          // 1 µs << 26 is about a minute; then +Inf.
+#define STATS_MAX_FDS 65536       // Queue waits are tracked for fds below.
+
+#ifdef HTTP_STATS
+
+struct stats_histogram {
+  uint64_t buckets[STATS_BUCKETS];
+  uint64_t sum_ns;
+};
+
+struct stats_thread {
+  uint64_t counters[NUM_STATS_COUNTERS];
+  struct stats_histogram stages[NUM_STATS_STAGES];
+  uint64_t request_start;    // Ticks, while a request is being served.
+  uint64_t request_parse;
+  uint64_t request_send;
+  struct stats_thread *next;
+} __attribute__((aligned(64)));
+
+extern __thread struct stats_thread *stats_self;
+extern int stats_use_tsc;
+extern uint64_t stats_scale;  // Nanoseconds per tick, times 2^32.
+extern uint64_t *stats_queued_at;
+
+struct stats_thread *stats_register();
+
+static inline struct stats_thread *stats_thread() {
+  struct stats_thread *self = stats_self;
+  return self ? self : stats_register();
+}
+
+static inline uint64_t stats_now() {
+#if defined(__x86_64__) || defined(__i386__)
+  if (stats_use_tsc) return __builtin_ia32_rdtsc();
+#endif
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Only the owning thread writes, so relaxed accesses can't tear or lose. */
+static inline void stats_add(uint64_t *value, uint64_t amount) {
+  __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + amount,
+      __ATOMIC_RELAXED);
+}
+
+static inline void stats_count(enum stats_counter counter) {
+  stats_add(&stats_thread()->counters[counter], 1);
+}
+
+static inline void stats_record_ticks(enum stats_stage stage, uint64_t ticks) {
+  struct stats_histogram *histogram = &stats_thread()->stages[stage];
+  uint64_t ns = (unsigned __int128) ticks * stats_scale >> 32;
+  int bucket = ns < 1024 ? 0 : 64 - __builtin_clzll(ns >> 10);
+  stats_add(&histogram->buckets[bucket < STATS_BUCKETS ? bucket :
+      STATS_BUCKETS - 1], 1);
+  stats_add(&histogram->sum_ns, ns);
+}
+
+/* Records STAGE as having taken from START until now; returns now. */
+static inline uint64_t stats_record(enum stats_stage stage, uint64_t start) {
+  uint64_t now = stats_now();
+  stats_record_ticks(stage, now - start);
+  return now;
+}
+
+static inline void stats_enqueued(int fd) {
+  if (fd < STATS_MAX_FDS) stats_queued_at[fd] = stats_now();
+}
+
+static inline void stats_dequeued(int fd) {
+  if (fd < STATS_MAX_FDS) stats_record(STATS_QUEUE_WAIT, stats_queued_at[fd]);
+}
+
+static inline void stats_request_begin() {
+  struct stats_thread *self = stats_thread();
+  self->request_start = stats_now();
+  self->request_parse = self->request_send = 0;
+}
+
+/*
+ * Ends the request begun last, which answered with STATUS (0 if unknown).
+ * A request that sent nothing was a connection closing, and isn't counted.
+ */
+static inline void stats_request_end(int status) {
+  struct stats_thread *self = stats_thread();
+  if (self->request_send == 0) return;
+  uint64_t total = stats_now() - self->request_start;
+  uint64_t inside = self->request_parse + self->request_send;
+  stats_record_ticks(STATS_HANDLER, total > inside ? total - inside : 0);
+  stats_record_ticks(STATS_SEND, self->request_send);
+  stats_add(&self->counters[STATS_REQUESTS], 1);
+  if (status >= 100 && status < 600)
+    stats_add(&self->counters[STATS_RESPONSES_1XX + status / 100 - 1], 1);
+}
+
+/* Charges the time since START to the request's parse or send stage. */
+static inline void stats_request_parsed(uint64_t start) {
+  struct stats_thread *self = stats_thread();
+  uint64_t ticks = stats_record(STATS_PARSE, start) - start;
+  self->request_parse += ticks;
+}
+
+static inline void stats_request_sent(uint64_t start) {
+  struct stats_thread *self = stats_thread();
+  self->request_send += stats_now() - start;
+}
+
+/* Sets the request begun last aside in REQUEST while its handler waits. */
+static inline void stats_request_suspend(struct stats_request *request) {
+  struct stats_thread *self = stats_thread();
+  request->elapsed = stats_now() - self->request_start;
+  request->parse = self->request_parse;
+  request->send = self->request_send;
+}
+
+/* Takes up a request stats_request_suspend set aside, as the one begun. */
+static inline void stats_request_resume(const struct stats_request *request) {
+  struct stats_thread *self = stats_thread();
+  self->request_start = stats_now() - request->elapsed;
+  self->request_parse = request->parse;
+  self->request_send = request->send;
+}
+
+#define STATS_INIT() stats_init()
+#define STATS_COUNT(counter) stats_count(counter)
+#define STATS_START(name) uint64_t name = stats_now()
+#define STATS_RECORD(stage, start) stats_record(stage, start)
+#define STATS_ENQUEUED(fd) stats_enqueued(fd)
+#define STATS_DEQUEUED(fd) stats_dequeued(fd)
+#define STATS_REQUEST_BEGIN() stats_request_begin()
+#define STATS_REQUEST_END(status) stats_request_end(status)
+#define STATS_PARSED(start) stats_request_parsed(start)
+#define STATS_SENT(start) stats_request_sent(start)
+#define STATS_REQUEST_SUSPEND(request) stats_request_suspend(request)
+#define STATS_REQUEST_RESUME(request) stats_request_resume(request)
+
+/* Calibrates the clock; call once before starting threads. */
+void stats_init();
+
+/* Writes every metric, summed over all threads, in Prometheus text format. */
+void stats_write(FILE *out);
+
+#else
+
+#define STATS_INIT() ((void) 0)
+#define STATS_COUNT(counter) ((void) 0)
+#define STATS_START(name) ((void) 0)
+#define STATS_RECORD(stage, start) ((void) 0)
+#define STATS_ENQUEUED(fd) ((void) 0)
+#define STATS_DEQUEUED(fd) ((void) 0)
+#define STATS_REQUEST_BEGIN() ((void) 0)
+#define STATS_REQUEST_END(status) ((void) 0)
+#define STATS_PARSED(start) ((void) 0)
+#define STATS_SENT(start) ((void) 0)
+#define STATS_REQUEST_SUSPEND(request) ((void) 0)
+#define STATS_REQUEST_RESUME(request) ((void) 0)
+
+#endif
+
+#endif
@@ -0,0 +1,61 @@
+#include <stddef.h>
+
+#include "timerwheel.h"
+
+static void timerwheel_link(struct timerwheel_timer *head,
+    struct timerwheel_timer *timer) {
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+void timerwheel_init(struct timerwheel *wheel, uint64_t now) {
+  wheel->now = now;
+  for (int i = 0; i < TIMERWHEEL_SLOTS; i++)
+    wheel->slots[i].prev = wheel->slots[i].next = &wheel->slots[i];
+}
+
+void timerwheel_cancel(struct timerwheel_timer *timer) {
+  if (!timer->next) return;
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->prev = timer->next = NULL;
+}
+
+void timerwheel_schedule(struct timerwheel *wheel,
+    struct timerwheel_timer *timer, uint64_t expires) {
+  timerwheel_cancel(timer);
+  if (expires <= wheel->now) expires = wheel->now + 1;
+  timer->expires = expires;
+  timerwheel_link(&wheel->slots[expires & (TIMERWHEEL_SLOTS - 1)], timer);
+}
+
+void timerwheel_advance(struct timerwheel *wheel, uint64_t now,
+    void (*expired)(struct timerwheel_timer *timer, void *context),
+    void *context) {
+  if (now <= wheel->now) return;
+  /* Past a whole turn, every slot is due for a look exactly once. */
+  uint64_t ticks = now - wheel->now;
+  if (ticks > TIMERWHEEL_SLOTS) ticks = TIMERWHEEL_SLOTS;
+  uint64_t tick = now - ticks;
+  wheel->now = now;
+
+  while (tick++ < now) {
+    /* Detach the slot first: callbacks may reschedule into it. */
+    struct timerwheel_timer *head = &wheel->slots[tick & (TIMERWHEEL_SLOTS - 1)];
+    struct timerwheel_timer pending;
+    if (head->next == head) continue;
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = pending.prev->next = &pending;
+    head->prev = head->next = head;
+
+    while (pending.next != &pending) {
+      struct timerwheel_timer *timer = pending.next;
+      timerwheel_cancel(timer);
+      if (timer->expires <= now) expired(timer, context);
+      else timerwheel_link(head, timer);
+    }
+  }
+}
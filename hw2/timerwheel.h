@@ -0,0 +1,48 @@
+#ifndef __TIMERWHEEL__
+#define __TIMERWHEEL__
+
+#include <stdint.h>
+
+/*
+ * TIMERWHEEL keeps one deadline per connection for a reactor thread
+ * without a system call or a sorted structure per timer. Time is counted
+ * in ticks (the caller picks the unit; the engines use seconds) and a
+ * timer lives in the slot its expiry tick hashes to. Scheduling,
+ * rescheduling and cancelling are a list unlink and link; advancing the
+ * clock visits only the slots of the ticks that passed. Timers further
+ * out than TIMERWHEEL_SLOTS ticks sit in their slot until their round
+ * comes up.
+ *
+ * Timers are embedded in the structures they time, and a wheel is owned
+ * by one thread.
+ */
+
+#define TIMERWHEEL_SLOTS 64  // A power of two.
+
+struct timerwheel_timer {
+  uint64_t expires;
+  struct timerwheel_timer *prev, *next;  // NULL when not scheduled.
+};
+
+struct timerwheel {
+  uint64_t now;
+  struct timerwheel_timer slots[TIMERWHEEL_SLOTS];  // Circular list heads.
+};
+
+void timerwheel_init(struct timerwheel *wheel, uint64_t now);
+
+/* (Re)schedules TIMER for tick EXPIRES; one in the past fires next tick. */
+void timerwheel_schedule(struct timerwheel *wheel,
+    struct timerwheel_timer *timer, uint64_t expires);
+
+void timerwheel_cancel(struct timerwheel_timer *timer);
+
+/*
+ * Moves the clock to NOW and calls EXPIRED for every timer due by then,
+ * unscheduled first so it may reschedule or free it.
+ */
+void timerwheel_advance(struct timerwheel *wheel, uint64_t now,
+    void (*expired)(struct timerwheel_timer *timer, void *context),
+    void *context);
+
+#endif
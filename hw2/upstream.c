@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "upstream.h"
+
+#define UPSTREAM_MAX_ADDRESSES 8
+#define UPSTREAM_MAX_POOL_SIZE 64
+
+static const char *upstream_hostname;
+static char upstream_port[8];
+static int upstream_dns_ttl, upstream_pool_size, upstream_idle_timeout;
+
+/* Cached resolution, guarded by dns_lock. */
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sockaddr_storage addresses[UPSTREAM_MAX_ADDRESSES];
+static socklen_t address_lengths[UPSTREAM_MAX_ADDRESSES];
+static int address_count;
+static int address_first;  // Where connecting starts, past failed ones.
+static time_t addresses_expire;
+static int refreshing;
+
+/* Idle connections of the calling worker, most recently used last. */
+struct upstream_idle {
+  int fd;
+  time_t since;
+};
+static __thread struct upstream_idle pool[UPSTREAM_MAX_POOL_SIZE];
+static __thread int pool_count;
+
+static time_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/* Resolves the target and replaces the cached addresses on success. */
+static void upstream_resolve() {
+  struct addrinfo hints, *results;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  int err = getaddrinfo(upstream_hostname, upstream_port, &hints, &results);
+
+  pthread_mutex_lock(&dns_lock);
+  if (err == 0) {
+    address_count = address_first = 0;
+    for (struct addrinfo *result = results;
+        result && address_count < UPSTREAM_MAX_ADDRESSES; result = result->ai_next) {
+      memcpy(&addresses[address_count], result->ai_addr, result->ai_addrlen);
+      address_lengths[address_count++] = result->ai_addrlen;
+    }
+    freeaddrinfo(results);
+    addresses_expire = now() + upstream_dns_ttl;
+  } else {
+    fprintf(stderr, "Cannot find host %s: %s\n", upstream_hostname,
+        gai_strerror(err));
+    /* Keep serving the stale list, but don't retry on every request. */
+    addresses_expire = now() + 1;
+  }
+  refreshing = 0;
+  pthread_mutex_unlock(&dns_lock);
+}
+
+static void *upstream_resolver(void *arg) {
+  upstream_resolve();
+  return NULL;
+}
+
+/* Refreshes the cached addresses on a thread of their own: getaddrinfo can
+ * take seconds, and the caller may be a reactor serving other clients. */
+static void upstream_refresh() {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, upstream_resolver, NULL) != 0) {
+    pthread_mutex_lock(&dns_lock);
+    addresses_expire = now() + 1;
+    refreshing = 0;
+    pthread_mutex_unlock(&dns_lock);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+void upstream_init(const char *hostname, int port, int dns_ttl,
+    int pool_size, int idle_timeout) {
+  upstream_hostname = hostname;
+  snprintf(upstream_port, sizeof(upstream_port), "%d", port);
+  upstream_dns_ttl = dns_ttl;
+  upstream_pool_size = pool_size < UPSTREAM_MAX_POOL_SIZE ?
+    pool_size : UPSTREAM_MAX_POOL_SIZE;
+  upstream_idle_timeout = idle_timeout;
+  upstream_resolve();
+}
+
+/* Starts a new connection to the first cached address that takes a
+ * connect(), starting past any that failed lately. Once the addresses
+ * expire they are refreshed in the background, and used meanwhile. */
+static int upstream_connect() {
+  pthread_mutex_lock(&dns_lock);
+  int refresh = !refreshing && now() >= addresses_expire;
+  if (refresh) refreshing = 1;
+  pthread_mutex_unlock(&dns_lock);
+  if (refresh) upstream_refresh();
+
+  struct sockaddr_storage candidates[UPSTREAM_MAX_ADDRESSES];
+  socklen_t lengths[UPSTREAM_MAX_ADDRESSES];
+  pthread_mutex_lock(&dns_lock);
+  int count = address_count, first = address_first;
+  memcpy(candidates, addresses, sizeof(candidates));
+  memcpy(lengths, address_lengths, sizeof(lengths));
+  pthread_mutex_unlock(&dns_lock);
+
+  for (int i = 0; i < count; i++) {
+    int index = (first + i) % count;
+    int fd = socket(candidates[index].ss_family,
+        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) continue;
+    if (connect(fd, (struct sockaddr *) &candidates[index],
+          lengths[index]) == 0 || errno == EINPROGRESS)
+      return fd;
+    close(fd);
+  }
+  return -1;
+}
+
+int upstream_connected(int fd, int give_up) {
+  struct pollfd pollfd = { .fd = fd, .events = POLLOUT };
+  int ready = poll(&pollfd, 1, 0);
+  if (ready == 0 && !give_up) return 0;
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (ready > 0 &&
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 &&
+      error == 0)
+    return 1;
+
+  /* The address didn't take it: the next connection tries the next. */
+  pthread_mutex_lock(&dns_lock);
+  if (address_count > 0) address_first = (address_first + 1) % address_count;
+  pthread_mutex_unlock(&dns_lock);
+  return -1;
+}
+
+/* An idle connection is usable if the target hasn't closed it or sent
+ * anything unsolicited on it. */
+static int upstream_idle_usable(int fd) {
+  char byte;
+  ssize_t bytes = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * Returns a connection to the target, preferring this worker's most
+ * recently used idle one, or -1 if none can be started. *REUSED tells the
+ * caller whether the connection came from the pool, i.e. whether a failure
+ * on it is worth one retry on a fresh connection; a fresh one may still be
+ * connecting.
+ */
+int upstream_acquire(int *reused) {
+  time_t current = now();
+  while (pool_count > 0) {
+    struct upstream_idle idle = pool[--pool_count];
+    if (current - idle.since < upstream_idle_timeout &&
+        upstream_idle_usable(idle.fd)) {
+      *reused = 1;
+      STATS_COUNT(STATS_UPSTREAM_REUSED);
+      return idle.fd;
+    }
+    close(idle.fd);
+    STATS_COUNT(STATS_UPSTREAM_DROPPED);
+  }
+  *reused = 0;
+  STATS_COUNT(STATS_UPSTREAM_CONNECTED);
+  return upstream_connect();
+}
+
+/* Returns FD to the pool if REUSABLE and there's room, else closes it. */
+void upstream_release(int fd, int reusable) {
+  if (!reusable || upstream_pool_size == 0) {
+    close(fd);
+    return;
+  }
+  if (pool_count == upstream_pool_size) {
+    /* Full: drop the connection idle the longest. */
+    close(pool[0].fd);
+    memmove(pool, pool + 1, --pool_count * sizeof(*pool));
+    STATS_COUNT(STATS_UPSTREAM_DROPPED);
+  }
+  pool[pool_count].fd = fd;
+  pool[pool_count].since = now();
+  pool_count++;
+  STATS_COUNT(STATS_UPSTREAM_POOLED);
+}
@@ -0,0 +1,27 @@
+#ifndef __UPSTREAM__
+#define __UPSTREAM__
+
+/*
+ * UPSTREAM manages connections from the proxy to its target.
+ *
+ * The target's addresses are resolved with getaddrinfo and cached for
+ * dns_ttl seconds; when they go stale, the next caller starts a refresh on
+ * a thread of its own and everyone keeps using the old list meanwhile. Each worker thread keeps its own
+ * pool of idle keep-alive connections, so taking one needs no lock. Idle
+ * connections are dropped after idle_timeout seconds, when the pool already
+ * holds pool_size of them, or when the target has closed them.
+ *
+ * Connections are non-blocking, and a new one is returned as soon as it is
+ * started: once it turns writable, upstream_connected tells whether it
+ * was made (1), is still under way (0) or failed (-1); with GIVE_UP, one
+ * still under way counts as failed. After a failure the next connection
+ * starts at the target's next address.
+ */
+
+void upstream_init(const char *hostname, int port, int dns_ttl,
+    int pool_size, int idle_timeout);
+int upstream_acquire(int *reused);
+int upstream_connected(int fd, int give_up);
+void upstream_release(int fd, int reusable);
+
+#endif
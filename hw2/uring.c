@@ -0,0 +1,771 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "admission.h"
+#include "fdcache.h"
+#include "libhttp.h"
+#include "listener.h"
+#include "stats.h"
+#include "timerwheel.h"
+#include "uring.h"
+
+#define URING_ENTRIES 1024       // Submission queue size.
+#define URING_BUFFERS 512        // Provided receive buffers per ring.
+#define URING_BUFFER_SIZE 4096
+#define URING_FILE_SLOTS 1024    // Registered file table size.
+#define URING_FD_INDEX 4096      // Descriptor numbers tracked, modulo.
+#define URING_CHAIN_MAX 64       // SQEs linked into one output chain.
+#define URING_PIPE_SIZE (1 << 20)
+#define URING_BACKLOG 64         // Received buffers held while busy.
+
+/* Operation tags kept in the low bits of a connection pointer. */
+enum {
+  URING_OP_ACCEPT,
+  URING_OP_RECV,
+  URING_OP_SEND,
+  URING_OP_TIMEOUT,
+  URING_OP_CANCEL,
+  URING_OP_CLOSE,
+};
+#define URING_OP_MASK 7
+
+/* A run of output: bytes of the output buffer, or of a registered file. */
+struct uring_segment {
+  off_t offset;
+  size_t size;
+  int slot;       // Registered file slot, or -1 for buffered bytes.
+};
+
+struct uring_connection {
+  struct timerwheel_timer timer;  // First, so a timer is its connection.
+  struct uring *ring;
+  int head_pending;      // The deadline is for a head under way.
+  int recv_armed;
+  int inflight;          // Sends and splices not completed yet.
+  int failed;            // Part of the output failed to go out.
+  int closing;           // Close once nothing is in flight.
+  int cancelled;         // The recv has been cancelled.
+  int close_after_output;
+  int pipe[2];
+  size_t pipe_size;
+  char *output;
+  size_t output_size, output_capacity;
+  struct uring_segment *segments;
+  int num_segments, segments_capacity, next_segment;
+  struct {
+    unsigned short bid;
+    unsigned int offset, size;
+  } backlog[URING_BACKLOG];
+  int backlog_count;
+  struct http_connection http;
+};
+
+struct uring {
+  int index;
+  int pin_cpu;
+  int ring_fd;
+  int listen_fd;
+  int keep_alive_timeout;
+  int header_timeout;
+  void (*request_handler)(int);
+  int multishot_accept, multishot_recv;
+
+  unsigned int *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+  unsigned int sq_local_tail, sq_submitted;
+  struct io_uring_sqe *sqes;
+  unsigned int *cq_head, *cq_tail, cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *buf_ring;
+  char *buffers;
+  unsigned short buf_tail;
+
+  int slot_users[URING_FILE_SLOTS];   // Queued segments reading a slot.
+  int slot_fds[URING_FILE_SLOTS];     // Descriptor registered in a slot.
+  unsigned int slot_generations[URING_FILE_SLOTS];
+  int fd_slots[URING_FD_INDEX];       // Slot of a descriptor, by fd modulo.
+  int next_slot;
+
+  struct __kernel_timespec tick;
+  struct timerwheel wheel;
+};
+
+/*
+ * Descriptor closes the fd cache has made, counted per fd number modulo
+ * URING_FD_INDEX. A slot registered under the current count still holds
+ * the file its descriptor number stands for.
+ */
+static unsigned int uring_fd_generations[URING_FD_INDEX];
+
+static void uring_file_closed(int fd) {
+  __atomic_add_fetch(&uring_fd_generations[fd % URING_FD_INDEX], 1,
+      __ATOMIC_SEQ_CST);
+}
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned int to_submit,
+    unsigned int min_complete, unsigned int flags) {
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+      NULL, 0);
+}
+
+static int uring_register(int ring_fd, unsigned int opcode, void *arg,
+    unsigned int count) {
+  return syscall(__NR_io_uring_register, ring_fd, opcode, arg, count);
+}
+
+/* Hands the queued SQEs to the kernel, waiting for WAIT completions. */
+static void uring_submit(struct uring *ring, unsigned int wait) {
+  unsigned int to_submit = ring->sq_local_tail - ring->sq_submitted;
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  int submitted;
+  do {
+    submitted = uring_enter(ring->ring_fd, to_submit, wait,
+        wait ? IORING_ENTER_GETEVENTS : 0);
+  } while (submitted < 0 && errno == EINTR);
+  if (submitted < 0 && errno != EBUSY && errno != EAGAIN) {
+    perror("io_uring_enter failed");
+    exit(errno);
+  }
+  if (submitted > 0) ring->sq_submitted += submitted;
+}
+
+/* Makes sure COUNT SQEs can be queued without a submit in between. */
+static void uring_reserve(struct uring *ring, unsigned int count) {
+  while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+      + count > ring->sq_entries)
+    uring_submit(ring, 0);
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring, int op,
+    struct uring_connection *connection) {
+  uring_reserve(ring, 1);
+  unsigned int index = ring->sq_local_tail++ & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uintptr_t) connection | op;
+  ring->sq_array[index] = index;
+  return sqe;
+}
+
+static void uring_recycle_buffer(struct uring *ring, unsigned short bid) {
+  struct io_uring_buf *buf =
+      &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+  buf->addr = (uintptr_t) (ring->buffers + (size_t) bid * URING_BUFFER_SIZE);
+  buf->len = URING_BUFFER_SIZE;
+  buf->bid = bid;
+  __atomic_store_n(&ring->buf_ring->tail, ++ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_arm_accept(struct uring *ring) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring, URING_OP_ACCEPT, NULL);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = ring->listen_fd;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  if (ring->multishot_accept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void uring_arm_recv(struct uring_connection *connection) {
+  struct uring *ring = connection->ring;
+  struct io_uring_sqe *sqe = uring_get_sqe(ring, URING_OP_RECV, connection);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = connection->http.fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  if (ring->multishot_recv) sqe->ioprio = IORING_RECV_MULTISHOT;
+  connection->recv_armed = 1;
+}
+
+static void uring_arm_timeout(struct uring *ring) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring, URING_OP_TIMEOUT, NULL);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uintptr_t) &ring->tick;
+  sqe->len = 1;
+}
+
+static void uring_queue_close(struct uring *ring, int fd) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring, URING_OP_CLOSE, NULL);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+}
+
+/*
+ * Re-arms CONNECTION's deadline after serving SERVED requests, as
+ * evloop_rearm does.
+ */
+static void uring_rearm(struct uring_connection *connection, int served) {
+  struct uring *ring = connection->ring;
+  struct http_connection *http = &connection->http;
+  int partial = http_connection_in_request(http) ||
+    connection->backlog_count > 0;
+  if (served) connection->head_pending = 0;
+  if (partial && !connection->head_pending) {
+    connection->head_pending = 1;
+    timerwheel_schedule(&ring->wheel, &connection->timer,
+        time(NULL) + ring->header_timeout);
+  } else if (served && !partial) {
+    timerwheel_schedule(&ring->wheel, &connection->timer,
+        time(NULL) + ring->keep_alive_timeout);
+  }
+}
+
+/* Drops CONNECTION's output and the file slots it held. */
+static void uring_reset_output(struct uring_connection *connection) {
+  for (int i = 0; i < connection->num_segments; i++)
+    if (connection->segments[i].slot >= 0)
+      connection->ring->slot_users[connection->segments[i].slot]--;
+  connection->output_size = 0;
+  connection->num_segments = 0;
+  connection->next_segment = 0;
+}
+
+/* Frees CONNECTION once no operation on it can complete any more. */
+static void uring_maybe_free(struct uring_connection *connection) {
+  if (!connection->closing || connection->inflight || connection->recv_armed)
+    return;
+  struct uring *ring = connection->ring;
+  uring_reset_output(connection);
+  for (int i = 0; i < connection->backlog_count; i++)
+    uring_recycle_buffer(ring, connection->backlog[i].bid);
+  timerwheel_cancel(&connection->timer);
+  admission_release();
+  uring_queue_close(ring, connection->http.fd);
+  if (connection->pipe[0] >= 0) {
+    uring_queue_close(ring, connection->pipe[0]);
+    uring_queue_close(ring, connection->pipe[1]);
+  }
+  free(connection->output);
+  free(connection->segments);
+  free(connection);
+}
+
+/*
+ * Starts closing CONNECTION: cancels its recv once its output is out. The
+ * completion handler frees it (uring_maybe_free) when nothing is left.
+ */
+static void uring_close(struct uring_connection *connection) {
+  connection->closing = 1;
+  if (connection->inflight || !connection->recv_armed || connection->cancelled)
+    return;
+  struct io_uring_sqe *sqe = uring_get_sqe(connection->ring, URING_OP_CANCEL,
+      NULL);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = (uintptr_t) connection | URING_OP_RECV;
+  connection->cancelled = 1;
+}
+
+static int uring_add_segment(struct uring_connection *connection, off_t offset,
+    size_t size, int slot) {
+  if (connection->num_segments == connection->segments_capacity) {
+    int capacity = connection->segments_capacity ?
+      connection->segments_capacity * 2 : 8;
+    struct uring_segment *segments = realloc(connection->segments,
+        capacity * sizeof(*segments));
+    if (!segments) return -1;
+    connection->segments = segments;
+    connection->segments_capacity = capacity;
+  }
+  struct uring_segment *segment = &connection->segments[connection->num_segments++];
+  segment->offset = offset;
+  segment->size = size;
+  segment->slot = slot;
+  return 0;
+}
+
+/* Sink: copies response bytes into the output buffer. */
+static int uring_sink_write(void *context, const struct iovec *iov, int iovcnt) {
+  struct uring_connection *connection = context;
+  for (int i = 0; i < iovcnt; i++) {
+    size_t size = iov[i].iov_len;
+    if (size == 0) continue;
+    if (connection->output_size + size > connection->output_capacity) {
+      size_t capacity = connection->output_capacity ?
+        connection->output_capacity : LIBHTTP_OUTPUT_BUFFER_SIZE;
+      while (capacity < connection->output_size + size) capacity *= 2;
+      char *output = realloc(connection->output, capacity);
+      if (!output) {
+        connection->failed = 1;
+        return -1;
+      }
+      connection->output = output;
+      connection->output_capacity = capacity;
+    }
+    memcpy(connection->output + connection->output_size, iov[i].iov_base, size);
+
+    struct uring_segment *last = connection->num_segments ?
+      &connection->segments[connection->num_segments - 1] : NULL;
+    if (last && last->slot < 0 &&
+        (size_t) last->offset + last->size == connection->output_size) {
+      last->size += size;
+    } else if (uring_add_segment(connection, connection->output_size, size, -1) < 0) {
+      connection->failed = 1;
+      return -1;
+    }
+    connection->output_size += size;
+  }
+  return 0;
+}
+
+/*
+ * Returns the registered file slot holding FILE_FD, registering it there
+ * first unless it already is. A file keeps its slot, which holds its own
+ * reference to it, for as long as the fd cache keeps the descriptor open,
+ * so a hot file costs one FILES_UPDATE rather than one per response.
+ * Returns -1 if every slot is being read from.
+ */
+static int uring_file_slot(struct uring *ring, int file_fd) {
+  unsigned int generation = __atomic_load_n(
+      &uring_fd_generations[file_fd % URING_FD_INDEX], __ATOMIC_SEQ_CST);
+  int *index = &ring->fd_slots[file_fd % URING_FD_INDEX];
+  if (*index >= 0 && ring->slot_fds[*index] == file_fd &&
+      ring->slot_generations[*index] == generation)
+    return *index;
+
+  int slot = -1;
+  for (int tries = 0; tries < URING_FILE_SLOTS && slot < 0; tries++) {
+    if (ring->slot_users[ring->next_slot] == 0) slot = ring->next_slot;
+    ring->next_slot = (ring->next_slot + 1) % URING_FILE_SLOTS;
+  }
+  struct io_uring_files_update update = {
+    .offset = slot,
+    .fds = (uintptr_t) &file_fd,
+  };
+  if (slot < 0 ||
+      uring_register(ring->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1)
+    return -1;
+
+  int replaced = ring->slot_fds[slot];
+  if (replaced >= 0 && ring->fd_slots[replaced % URING_FD_INDEX] == slot)
+    ring->fd_slots[replaced % URING_FD_INDEX] = -1;
+  ring->slot_fds[slot] = file_fd;
+  ring->slot_generations[slot] = generation;
+  *index = slot;
+  return slot;
+}
+
+/* Sink: queues the range for splicing from FILE_FD's registered slot. */
+static int uring_sink_send_file(void *context, int file_fd, off_t offset,
+    size_t size) {
+  struct uring_connection *connection = context;
+  int slot = uring_file_slot(connection->ring, file_fd);
+  if (slot < 0 || uring_add_segment(connection, offset, size, slot) < 0) {
+    connection->failed = 1;
+    return -1;
+  }
+  connection->ring->slot_users[slot]++;
+  return 0;
+}
+
+static const struct http_sink uring_sink = {
+  .write = uring_sink_write,
+  .send_file = uring_sink_send_file,
+};
+
+/*
+ * Queues the next stretch of CONNECTION's output as one linked chain:
+ * sends for buffered bytes, and splice pairs through the connection's pipe
+ * for file ranges. A failure or short transfer cancels the rest of the
+ * chain, and the connection closes.
+ */
+static void uring_send_output(struct uring_connection *connection) {
+  struct uring *ring = connection->ring;
+  if (connection->next_segment < connection->num_segments &&
+      connection->segments[connection->next_segment].slot >= 0 &&
+      connection->pipe[0] < 0) {
+    if (pipe2(connection->pipe, O_CLOEXEC) < 0) {
+      connection->pipe[0] = -1;
+      connection->failed = 1;
+      uring_close(connection);
+      return;
+    }
+    fcntl(connection->pipe[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+    int size = fcntl(connection->pipe[1], F_GETPIPE_SZ);
+    connection->pipe_size = size > 0 ? size : 65536;
+  }
+
+  uring_reserve(ring, URING_CHAIN_MAX + 1);
+  struct io_uring_sqe *sqe = NULL;
+  int linked = 0;
+  while (connection->next_segment < connection->num_segments &&
+      linked + 2 <= URING_CHAIN_MAX) {
+    struct uring_segment *segment = &connection->segments[connection->next_segment];
+    if (segment->slot < 0) {
+      sqe = uring_get_sqe(ring, URING_OP_SEND, connection);
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = connection->http.fd;
+      sqe->addr = (uintptr_t) (connection->output + segment->offset);
+      sqe->len = segment->size;
+      sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+      sqe->flags = IOSQE_IO_LINK;
+      linked++;
+      connection->next_segment++;
+      continue;
+    }
+    if (connection->pipe[0] < 0) break;  // Opened on the next round.
+
+    size_t chunk = segment->size < connection->pipe_size ?
+      segment->size : connection->pipe_size;
+    sqe = uring_get_sqe(ring, URING_OP_SEND, connection);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = segment->slot;
+    sqe->splice_off_in = segment->offset;
+    sqe->fd = connection->pipe[1];
+    sqe->off = (uint64_t) -1;
+    sqe->len = chunk;
+    sqe->splice_flags = SPLICE_F_FD_IN_FIXED | SPLICE_F_MOVE;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring_get_sqe(ring, URING_OP_SEND, connection);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = connection->pipe[0];
+    sqe->splice_off_in = (uint64_t) -1;
+    sqe->fd = connection->http.fd;
+    sqe->off = (uint64_t) -1;
+    sqe->len = chunk;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    sqe->flags = IOSQE_IO_LINK;
+    linked += 2;
+
+    segment->offset += chunk;
+    segment->size -= chunk;
+    if (segment->size == 0) connection->next_segment++;
+  }
+  if (sqe) sqe->flags &= ~IOSQE_IO_LINK;
+  connection->inflight += linked;
+}
+
+/* Copies what the connection's buffer has room for out of the backlog. */
+static void uring_drain_backlog(struct uring_connection *connection) {
+  struct http_connection *http = &connection->http;
+  struct uring *ring = connection->ring;
+  /* A parsed head points into the buffer, so it only moves between heads. */
+  if (http->start > 0 && http->head_length == 0) {
+    memmove(http->buffer, http->buffer + http->start, http->size - http->start);
+    http->size -= http->start;
+    http->start = 0;
+  }
+  while (connection->backlog_count > 0) {
+    size_t room = sizeof(http->buffer) - http->size;
+    if (room == 0) return;
+    unsigned short bid = connection->backlog[0].bid;
+    unsigned int offset = connection->backlog[0].offset;
+    unsigned int size = connection->backlog[0].size;
+    size_t take = size < room ? size : room;
+    memcpy(http->buffer + http->size,
+        ring->buffers + (size_t) bid * URING_BUFFER_SIZE + offset, take);
+    http->size += take;
+    if (take < size) {
+      connection->backlog[0].offset += take;
+      connection->backlog[0].size -= take;
+      return;
+    }
+    uring_recycle_buffer(ring, bid);
+    memmove(connection->backlog, connection->backlog + 1,
+        --connection->backlog_count * sizeof(connection->backlog[0]));
+  }
+}
+
+/*
+ * Runs the handler for every complete request head buffered, then queues
+ * their output. Only called with nothing in flight, so the output buffer
+ * can grow freely while handlers run.
+ */
+static void uring_serve(struct uring_connection *connection) {
+  struct uring *ring = connection->ring;
+  struct http_connection *http = &connection->http;
+  uring_reset_output(connection);
+
+  int served = 0;
+  while (!connection->close_after_output) {
+    uring_drain_backlog(connection);
+    if (!http_connection_has_request(http)) {
+      /* Skipping the last request's body failed. */
+      if (!http->keep_alive) {
+        connection->close_after_output = 1;
+        break;
+      }
+      /* A full buffer without a whole head is rejected as oversized. */
+      if (http->size - http->start < sizeof(http->buffer)) break;
+      connection->close_after_output = 1;
+      http_connection_bind(http);
+      ring->request_handler(http->fd);
+      accesslog_request(http);
+      http_connection_bind(NULL);
+      break;
+    }
+    served++;
+    http_connection_bind(http);
+    STATS_REQUEST_BEGIN();
+    ring->request_handler(http->fd);
+    accesslog_request(http);
+    int keep_alive = http_connection_finish(http);
+    STATS_REQUEST_END(http->response_status);
+    http_connection_bind(NULL);
+    if (!keep_alive) connection->close_after_output = 1;
+  }
+
+  if (connection->failed) {
+    uring_close(connection);
+  } else if (connection->num_segments > 0) {
+    uring_send_output(connection);
+  } else if (connection->close_after_output) {
+    uring_close(connection);
+  }
+  if (!connection->closing) uring_rearm(connection, served);
+}
+
+/* Takes LENGTH received bytes from buffer BID for CONNECTION. */
+static void uring_receive(struct uring_connection *connection,
+    unsigned short bid, unsigned int length) {
+  if (connection->backlog_count == URING_BACKLOG) {
+    uring_recycle_buffer(connection->ring, bid);
+    uring_close(connection);
+    return;
+  }
+  connection->backlog[connection->backlog_count].bid = bid;
+  connection->backlog[connection->backlog_count].offset = 0;
+  connection->backlog[connection->backlog_count++].size = length;
+  if (connection->inflight == 0 && !connection->closing) uring_serve(connection);
+}
+
+static void uring_accepted(struct uring *ring, int fd) {
+  if (!admission_admit(fd)) return;
+  struct uring_connection *connection = calloc(1, sizeof(*connection));
+  if (!connection) {
+    close(fd);
+    admission_release();
+    return;
+  }
+  connection->ring = ring;
+  connection->pipe[0] = connection->pipe[1] = -1;
+  http_connection_init(&connection->http, fd);
+  http_connection_set_sink(&connection->http, &uring_sink, connection);
+  STATS_COUNT(STATS_CONNECTIONS);
+  /* A new connection gets header_timeout to start its first request. */
+  timerwheel_schedule(&ring->wheel, &connection->timer,
+      time(NULL) + ring->header_timeout);
+  uring_arm_recv(connection);
+}
+
+/*
+ * Closes a connection whose deadline passed, unless it is still sending a
+ * response; that one gets another keep-alive timeout.
+ */
+static void uring_expired(struct timerwheel_timer *timer, void *context) {
+  struct uring_connection *connection = (struct uring_connection *) timer;
+  struct uring *ring = context;
+  if (connection->closing) return;
+  if (connection->inflight) {
+    timerwheel_schedule(&ring->wheel, timer,
+        time(NULL) + ring->keep_alive_timeout);
+    return;
+  }
+  if (connection->head_pending) STATS_COUNT(STATS_HEADER_TIMEOUTS);
+  uring_close(connection);
+  uring_maybe_free(connection);
+}
+
+static void uring_complete(struct uring *ring, struct io_uring_cqe *cqe) {
+  int op = cqe->user_data & URING_OP_MASK;
+  struct uring_connection *connection =
+      (struct uring_connection *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+  int more = cqe->flags & IORING_CQE_F_MORE;
+
+  switch (op) {
+    case URING_OP_ACCEPT:
+      if (cqe->res == -EINVAL && ring->multishot_accept) ring->multishot_accept = 0;
+      else if (cqe->res >= 0) uring_accepted(ring, cqe->res);
+      if (!more) uring_arm_accept(ring);
+      break;
+
+    case URING_OP_TIMEOUT:
+      timerwheel_advance(&ring->wheel, time(NULL), uring_expired, ring);
+      uring_arm_timeout(ring);
+      break;
+
+    case URING_OP_RECV:
+      if (!more) connection->recv_armed = 0;
+      if (cqe->res > 0) {
+        uring_receive(connection, cqe->flags >> IORING_CQE_BUFFER_SHIFT, cqe->res);
+      } else if (cqe->res == -EINVAL && ring->multishot_recv) {
+        ring->multishot_recv = 0;
+      } else if (cqe->res != -ENOBUFS) {
+        uring_close(connection);
+      }
+      /* Out of buffers, or a single-shot recv: ask again. */
+      if (!connection->recv_armed && !connection->closing) uring_arm_recv(connection);
+      uring_maybe_free(connection);
+      break;
+
+    case URING_OP_SEND:
+      connection->inflight--;
+      if (cqe->res < 0) connection->failed = 1;
+      if (connection->inflight > 0) break;
+      if (connection->failed || connection->closing) {
+        uring_close(connection);
+      } else if (connection->next_segment < connection->num_segments) {
+        uring_send_output(connection);
+      } else if (connection->close_after_output) {
+        uring_close(connection);
+      } else {
+        uring_serve(connection);
+      }
+      uring_maybe_free(connection);
+      break;
+  }
+}
+
+static void *uring_main(void *arg) {
+  struct uring *ring = arg;
+  if (ring->pin_cpu) listener_pin_thread(ring->index);
+
+  uring_arm_accept(ring);
+  uring_arm_timeout(ring);
+  while (1) {
+    uring_submit(ring, 1);
+    unsigned int head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      uring_complete(ring, &ring->cqes[head & ring->cq_mask]);
+      __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Creates RING's io_uring, maps its queues and registers its receive
+ * buffers and (empty) file table. Returns -1 if the kernel can't.
+ */
+static int uring_init(struct uring *ring) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+    IORING_SETUP_COOP_TASKRUN;
+  params.cq_entries = URING_ENTRIES * 4;
+  ring->ring_fd = uring_setup(URING_ENTRIES, &params);
+  if (ring->ring_fd < 0 && errno == EINVAL) {
+    params.flags = IORING_SETUP_CQSIZE;
+    ring->ring_fd = uring_setup(URING_ENTRIES, &params);
+  }
+  if (ring->ring_fd < 0) return -1;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_NODROP))
+    goto fail;
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+  char *rings = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED) goto fail;
+  ring->sq_head = (unsigned int *) (rings + params.sq_off.head);
+  ring->sq_tail = (unsigned int *) (rings + params.sq_off.tail);
+  ring->sq_mask = *(unsigned int *) (rings + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_array = (unsigned int *) (rings + params.sq_off.array);
+  ring->sq_local_tail = ring->sq_submitted = *ring->sq_tail;
+  ring->cq_head = (unsigned int *) (rings + params.cq_off.head);
+  ring->cq_tail = (unsigned int *) (rings + params.cq_off.tail);
+  ring->cq_mask = *(unsigned int *) (rings + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+      IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) goto fail;
+
+  ring->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring->buffers = malloc((size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+  if (ring->buf_ring == MAP_FAILED || !ring->buffers) goto fail;
+  struct io_uring_buf_reg buf_reg = {
+    .ring_addr = (uintptr_t) ring->buf_ring,
+    .ring_entries = URING_BUFFERS,
+    .bgid = 0,
+  };
+  if (uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &buf_reg, 1) < 0)
+    goto fail;
+  for (int i = 0; i < URING_BUFFERS; i++) uring_recycle_buffer(ring, i);
+
+  int files[URING_FILE_SLOTS];
+  for (int i = 0; i < URING_FILE_SLOTS; i++)
+    files[i] = ring->slot_fds[i] = -1;
+  for (int i = 0; i < URING_FD_INDEX; i++) ring->fd_slots[i] = -1;
+  if (uring_register(ring->ring_fd, IORING_REGISTER_FILES, files,
+      URING_FILE_SLOTS) < 0)
+    goto fail;
+
+  ring->multishot_accept = ring->multishot_recv = 1;
+  ring->tick.tv_sec = 1;
+  timerwheel_init(&ring->wheel, time(NULL));
+  return 0;
+
+fail:
+  close(ring->ring_fd);
+  return -1;
+}
+
+int uring_serve_forever(int port, int num_rings,
+    const struct listener_options *listen_options, int keep_alive_timeout,
+    int header_timeout, void (*request_handler)(int)) {
+  if (num_rings < 1) num_rings = 1;
+
+  struct uring *rings = calloc(num_rings, sizeof(*rings));
+  int *listen_fds = calloc(num_rings, sizeof(*listen_fds));
+  if (!rings || !listen_fds) {
+    fprintf(stderr, "Failed to allocate rings\n");
+    exit(ENOMEM);
+  }
+  for (int i = 0; i < num_rings; i++) {
+    if (uring_init(&rings[i]) < 0) {
+      while (i-- > 0) close(rings[i].ring_fd);
+      free(rings);
+      free(listen_fds);
+      return -1;
+    }
+  }
+
+  fdcache_set_close_hook(uring_file_closed);
+
+  listener_open_group(port, num_rings, listen_options, listen_fds);
+  for (int i = 0; i < num_rings; i++) {
+    rings[i].index = i;
+    rings[i].pin_cpu = listen_options->pin_cpus;
+    rings[i].listen_fd = listen_fds[i];
+    rings[i].keep_alive_timeout = keep_alive_timeout;
+    rings[i].header_timeout = header_timeout;
+    rings[i].request_handler = request_handler;
+  }
+
+  printf("Listening on port %d with %d io_uring thread(s)...\n", port,
+      num_rings);
+
+  for (int i = 0; i < num_rings - 1; i++) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, uring_main, &rings[i]);
+    if (err != 0) {
+      fprintf(stderr, "Failed to create ring thread: %s\n", strerror(err));
+      exit(err);
+    }
+    pthread_detach(thread);
+  }
+  uring_main(&rings[num_rings - 1]);
+  return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef __URING__
+#define __URING__
+
+#include "listener.h"
+
+/*
+ * URING is an io_uring engine, driven through the raw system calls. Each
+ * ring thread owns a SO_REUSEPORT listener and does all its socket I/O
+ * through one ring, so a loop iteration costs a single io_uring_enter that
+ * submits everything queued and waits for completions:
+ *
+ *   - one multishot accept produces every new connection;
+ *   - one multishot recv per connection fills buffers the kernel picks
+ *     from a provided buffer ring;
+ *   - the request handler runs unchanged, but its output goes to a sink
+ *     (see http_connection_set_sink) and leaves as a linked chain of sends
+ *     for buffered bytes and splices (file to pipe to socket) for file
+ *     bodies. Files are read through the ring's registered file table, so
+ *     the fd cache may close its descriptor while the splice is pending; a
+ *     file is registered once and keeps its slot while the fd cache keeps
+ *     it open.
+ *
+ * Connection deadlines (see evloop.h) sit on a timer wheel that a
+ * once-a-second timeout completion advances.
+ */
+
+/*
+ * Serves forever on PORT as evloop_serve_forever does, with NUM_RINGS ring
+ * threads. Returns -1 (having opened nothing) if the kernel lacks the
+ * io_uring features the engine needs, so the caller can fall back.
+ */
+int uring_serve_forever(int port, int num_rings,
+    const struct listener_options *listen_options, int keep_alive_timeout,
+    int header_timeout, void (*request_handler)(int));
+
+#endif
@@ -1,38 +1,220 @@
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include "wq.h"
 #include "utlist.h"
 
-/* Initializes a work queue WQ. */
-void wq_init(wq_t *wq) {
+static void futex_wait(int *addr, int expected) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
 
-  /* TODO: Make me thread-safe! */
+static void futex_wake(int *addr, int count) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
 
+/* Initializes a work queue WQ that holds at most CAPACITY items. A
+ * non-positive CAPACITY selects WQ_DEFAULT_CAPACITY. */
+void wq_init(wq_t *wq, int capacity) {
   wq->size = 0;
+  wq->capacity = capacity > 0 ? capacity : WQ_DEFAULT_CAPACITY;
   wq->head = NULL;
+  wq->ring = NULL;
+  pthread_mutex_init(&wq->lock, NULL);
+  pthread_cond_init(&wq->not_empty, NULL);
+  pthread_cond_init(&wq->not_full, NULL);
 }
 
-/* Remove an item from the WQ. This function should block until there
- * is at least one item on the queue. */
+/* Initializes WQ as a lock-free ring. CAPACITY is rounded up to a power of
+ * two so a slot index is a mask rather than a division. */
+void wq_init_ring(wq_t *wq, int capacity) {
+  wq_init(wq, capacity);
+
+  unsigned long slots = 1;
+  while (slots < (unsigned long) wq->capacity) slots <<= 1;
+  wq->capacity = slots;
+
+  wq_ring_t *ring;
+  if (posix_memalign((void **) &ring, WQ_CACHE_LINE, sizeof(*ring)) != 0 ||
+      posix_memalign((void **) &ring->cells, WQ_CACHE_LINE,
+        slots * sizeof(wq_ring_cell_t)) != 0) {
+    fprintf(stderr, "Failed to allocate work queue ring\n");
+    exit(ENOMEM);
+  }
+  ring->enqueue_pos = 0;
+  ring->dequeue_pos = 0;
+  ring->items_epoch = 0;
+  ring->consumers_waiting = 0;
+  ring->slots_epoch = 0;
+  ring->producers_waiting = 0;
+  ring->mask = slots - 1;
+  for (unsigned long i = 0; i < slots; i++)
+    ring->cells[i].sequence = i;
+  wq->ring = ring;
+}
+
+/*
+ * Bounded MPMC queue after Vyukov: a slot whose sequence equals the
+ * enqueue cursor is free, one whose sequence is one past the dequeue cursor
+ * is full. Claiming a slot is a single CAS on the matching cursor.
+ */
+static int wq_ring_try_push(wq_ring_t *ring, int client_socket_fd) {
+  unsigned long pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+  while (1) {
+    wq_ring_cell_t *cell = &ring->cells[pos & ring->mask];
+    unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    long diff = (long) (sequence - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->client_socket_fd = client_socket_fd;
+        __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static int wq_ring_try_pop(wq_ring_t *ring, int *client_socket_fd) {
+  unsigned long pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+  while (1) {
+    wq_ring_cell_t *cell = &ring->cells[pos & ring->mask];
+    unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    long diff = (long) (sequence - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *client_socket_fd = cell->client_socket_fd;
+        __atomic_store_n(&cell->sequence, pos + ring->mask + 1,
+            __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/*
+ * Wakes one thread parked on EPOCH, if any. The fence pairs with the one in
+ * the parking path: either the waker sees the waiter's count or the waiter's
+ * retry sees the slot the waker just published.
+ */
+static void wq_ring_notify(int *epoch, int *waiting) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiting, __ATOMIC_RELAXED) > 0) {
+    __atomic_add_fetch(epoch, 1, __ATOMIC_RELEASE);
+    futex_wake(epoch, 1);
+  }
+}
+
+static void wq_ring_push(wq_ring_t *ring, int client_socket_fd) {
+  while (!wq_ring_try_push(ring, client_socket_fd)) {
+    __atomic_add_fetch(&ring->producers_waiting, 1, __ATOMIC_SEQ_CST);
+    int epoch = __atomic_load_n(&ring->slots_epoch, __ATOMIC_ACQUIRE);
+    if (wq_ring_try_push(ring, client_socket_fd)) {
+      __atomic_sub_fetch(&ring->producers_waiting, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    futex_wait(&ring->slots_epoch, epoch);
+    __atomic_sub_fetch(&ring->producers_waiting, 1, __ATOMIC_RELAXED);
+  }
+  wq_ring_notify(&ring->items_epoch, &ring->consumers_waiting);
+}
+
+static int wq_ring_pop(wq_ring_t *ring) {
+  int client_socket_fd;
+  while (!wq_ring_try_pop(ring, &client_socket_fd)) {
+    __atomic_add_fetch(&ring->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+    int epoch = __atomic_load_n(&ring->items_epoch, __ATOMIC_ACQUIRE);
+    if (wq_ring_try_pop(ring, &client_socket_fd)) {
+      __atomic_sub_fetch(&ring->consumers_waiting, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    futex_wait(&ring->items_epoch, epoch);
+    __atomic_sub_fetch(&ring->consumers_waiting, 1, __ATOMIC_RELAXED);
+  }
+  wq_ring_notify(&ring->slots_epoch, &ring->producers_waiting);
+  return client_socket_fd;
+}
+
+/* Remove an item from the WQ. This function blocks until there is at least
+ * one item on the queue. */
 int wq_pop(wq_t *wq) {
+  if (wq->ring)
+    return wq_ring_pop(wq->ring);
 
-  /* TODO: Make me blocking and thread-safe! */
+  pthread_mutex_lock(&wq->lock);
+  while (wq->size == 0)
+    pthread_cond_wait(&wq->not_empty, &wq->lock);
 
   wq_item_t *wq_item = wq->head;
   int client_socket_fd = wq->head->client_socket_fd;
   wq->size--;
   DL_DELETE(wq->head, wq->head);
+  pthread_cond_signal(&wq->not_full);
+  pthread_mutex_unlock(&wq->lock);
 
   free(wq_item);
   return client_socket_fd;
 }
 
-/* Add ITEM to WQ. */
-void wq_push(wq_t *wq, int client_socket_fd) {
-
-  /* TODO: Make me thread-safe! */
+/* Add ITEM to WQ. This function blocks while the queue is full. Returns 0,
+ * or -1 with errno set if the list backend can't allocate the item. */
+int wq_push(wq_t *wq, int client_socket_fd) {
+  if (wq->ring) {
+    wq_ring_push(wq->ring, client_socket_fd);
+    return 0;
+  }
 
   wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
+  if (!wq_item) return -1;
   wq_item->client_socket_fd = client_socket_fd;
+
+  pthread_mutex_lock(&wq->lock);
+  while (wq->size >= wq->capacity)
+    pthread_cond_wait(&wq->not_full, &wq->lock);
+
   DL_APPEND(wq->head, wq_item);
   wq->size++;
+  pthread_cond_signal(&wq->not_empty);
+  pthread_mutex_unlock(&wq->lock);
+  return 0;
+}
+
+/* Returns how many items WQ holds, without locking: a snapshot that may be
+ * stale by the time the caller looks at it. */
+int wq_size(wq_t *wq) {
+  if (wq->ring) {
+    unsigned long dequeued = __atomic_load_n(&wq->ring->dequeue_pos, __ATOMIC_RELAXED);
+    unsigned long enqueued = __atomic_load_n(&wq->ring->enqueue_pos, __ATOMIC_RELAXED);
+    return enqueued > dequeued ? (int) (enqueued - dequeued) : 0;
+  }
+  return __atomic_load_n(&wq->size, __ATOMIC_RELAXED);
+}
+
+/* Frees WQ's ring or remaining items. No thread may be using WQ. */
+void wq_destroy(wq_t *wq) {
+  if (wq->ring) {
+    free(wq->ring->cells);
+    free(wq->ring);
+    wq->ring = NULL;
+  }
+  while (wq->head) {
+    wq_item_t *wq_item = wq->head;
+    DL_DELETE(wq->head, wq_item);
+    free(wq_item);
+  }
+  wq->size = 0;
+  pthread_mutex_destroy(&wq->lock);
+  pthread_cond_destroy(&wq->not_empty);
+  pthread_cond_destroy(&wq->not_full);
 }
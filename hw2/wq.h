@@ -4,7 +4,16 @@
 #include <pthread.h>
 
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served. The queue is bounded: wq_push blocks while it holds
+ * CAPACITY items, so a slow pool of workers pushes back on the acceptor
+ * instead of letting the backlog grow without limit.
+ *
+ * Two backends share this interface. wq_init builds a mutex and condition
+ * variable protected list; wq_init_ring builds a fixed-capacity lock-free
+ * ring that parks idle threads on a futex instead. */
+
+#define WQ_DEFAULT_CAPACITY 1024
+#define WQ_CACHE_LINE 64
 
 typedef struct wq_item {
   int client_socket_fd; // Client socket to be served.
@@ -12,14 +21,41 @@ typedef struct wq_item {
   struct wq_item *prev;
 } wq_item_t;
 
+/* One slot of the ring, padded so neighbouring slots never share a line. */
+typedef struct wq_ring_cell {
+  unsigned long sequence;
+  int client_socket_fd;
+} __attribute__((aligned(WQ_CACHE_LINE))) wq_ring_cell_t;
+
+/* Bounded multi-producer/multi-consumer ring. Each cursor and futex word
+ * sits on its own cache line so producers and consumers don't bounce a
+ * shared line between cores. */
+typedef struct wq_ring {
+  unsigned long enqueue_pos __attribute__((aligned(WQ_CACHE_LINE)));
+  unsigned long dequeue_pos __attribute__((aligned(WQ_CACHE_LINE)));
+  int items_epoch __attribute__((aligned(WQ_CACHE_LINE)));
+  int consumers_waiting;
+  int slots_epoch __attribute__((aligned(WQ_CACHE_LINE)));
+  int producers_waiting;
+  unsigned long mask __attribute__((aligned(WQ_CACHE_LINE)));
+  wq_ring_cell_t *cells;
+} wq_ring_t;
+
 typedef struct wq {
   int size;
+  int capacity;
   wq_item_t *head;
-  /* TODO: More stuff here, maybe? */
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty; // Signalled when an item is pushed.
+  pthread_cond_t not_full;  // Signalled when an item is popped.
+  wq_ring_t *ring;          // Non-NULL when backed by the lock-free ring.
 } wq_t;
 
-void wq_init(wq_t *wq);
-void wq_push(wq_t *wq, int client_socket_fd);
+void wq_init(wq_t *wq, int capacity);
+void wq_init_ring(wq_t *wq, int capacity);
+int wq_push(wq_t *wq, int client_socket_fd);
 int wq_pop(wq_t *wq);
+int wq_size(wq_t *wq);
+void wq_destroy(wq_t *wq);
 
 #endif
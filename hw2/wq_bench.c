@@ -0,0 +1,91 @@
+/*
+ * Microbenchmark for the two wq_t backends.
+ *
+ * For each thread count N in 1, 2, 4, ..., 64, runs N producers and N
+ * consumers through one queue and reports push/pop pairs per second for
+ * the mutex+condvar list and for the lock-free ring.
+ *
+ * Usage: ./wq_bench [items-per-producer] [capacity]
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "wq.h"
+
+#define WQ_BENCH_MAX_THREADS 64
+
+struct bench_config {
+  wq_t *wq;
+  long items;
+};
+
+static void *producer_main(void *arg) {
+  struct bench_config *config = arg;
+  for (long i = 0; i < config->items; i++)
+    if (wq_push(config->wq, (int) (i & 0x7fffffff)) < 0) {
+      perror("Failed to push");
+      exit(errno);
+    }
+  return NULL;
+}
+
+static void *consumer_main(void *arg) {
+  struct bench_config *config = arg;
+  while (wq_pop(config->wq) != -1);
+  return NULL;
+}
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the number of items moved through WQ per second. */
+static double run(wq_t *wq, int threads, long items) {
+  pthread_t producers[WQ_BENCH_MAX_THREADS], consumers[WQ_BENCH_MAX_THREADS];
+  struct bench_config config = { wq, items };
+
+  double start = now_seconds();
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&consumers[i], NULL, consumer_main, &config);
+    pthread_create(&producers[i], NULL, producer_main, &config);
+  }
+  for (int i = 0; i < threads; i++)
+    pthread_join(producers[i], NULL);
+  /* One stop marker per consumer, after every real item. */
+  for (int i = 0; i < threads; i++)
+    if (wq_push(wq, -1) < 0) {
+      perror("Failed to push");
+      exit(errno);
+    }
+  for (int i = 0; i < threads; i++)
+    pthread_join(consumers[i], NULL);
+  double elapsed = now_seconds() - start;
+
+  return threads * items / elapsed;
+}
+
+int main(int argc, char **argv) {
+  long items = argc > 1 ? atol(argv[1]) : 200000;
+  int capacity = argc > 2 ? atoi(argv[2]) : WQ_DEFAULT_CAPACITY;
+
+  printf("%8s %16s %16s %8s\n", "threads", "list ops/s", "ring ops/s", "speedup");
+  for (int threads = 1; threads <= WQ_BENCH_MAX_THREADS; threads *= 2) {
+    wq_t list, ring;
+    wq_init(&list, capacity);
+    wq_init_ring(&ring, capacity);
+
+    double list_rate = run(&list, threads, items / threads);
+    double ring_rate = run(&ring, threads, items / threads);
+    printf("%8d %16.0f %16.0f %7.2fx\n", threads, list_rate, ring_rate,
+        ring_rate / list_rate);
+    wq_destroy(&list);
+    wq_destroy(&ring);
+  }
+  return 0;
+}
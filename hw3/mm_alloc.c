@@ -1,22 +1,822 @@
 /*
  * mm_alloc.c
  *
- * Stub implementations of the mm_* routines.
+ * A size-class allocator with a heap per thread.
+ *
+ * Memory comes from the kernel in regions aligned to MM_REGION_SIZE, so the
+ * region header of any pointer is found by masking it. The header says what
+ * each of the region's MM_SLAB_SIZE pieces holds:
+ *
+ *   - A slab holds objects of one size class. Classes are 16 bytes apart
+ *     up to 128 bytes, then four to each doubling up to MM_SMALL_MAX, so
+ *     no request wastes more than a fifth of its object. Slabs are aligned
+ *     to their size, so a second mask finds the slab's own header.
+ *   - A medium region is one arena of blocks up to MM_MEDIUM_MAX, each
+ *     behind a boundary tag giving its size and whether it and the block
+ *     before it are in use; a free block also leaves its size at the start
+ *     of the next one. Freeing merges a block with free neighbours in O(1),
+ *     and mm_realloc grows a block into a free neighbour or gives its tail
+ *     back without moving it.
+ *   - A larger request gets a region of its own, returned to the kernel
+ *     when freed. mm_realloc resizes it with mremap, which moves pages
+ *     rather than copying them when it can't grow in place.
+ *
+ * Every thread allocates from a heap of its own: for each class, the slabs
+ * it owns that have room, and the ones that are full. Allocating pops the
+ * first slab's free list (or, the first time round, bumps into the slab's
+ * unused tail), and freeing an object of a slab the thread owns pushes it
+ * back. Neither takes a lock or an atomic instruction.
+ *
+ * An object freed by any other thread goes on its slab's remote list, a
+ * lock-free stack the owner takes whole with one exchange once the slab's
+ * own free list runs dry. A full slab has no reason to be looked at, so
+ * its owner parks it with MM_NOTIFY set in the remote list; the first
+ * remote free to clear that flag queues the slab on the owner's reclaim
+ * stack, and the owner moves it back among the slabs with room.
+ *
+ * Heaps refill from the central heap a slab (a batch of objects) at a
+ * time, keep up to MM_HEAP_SPARE emptied slabs, and drain the rest back
+ * in batches. The central heap, under a lock, carves slabs out of lazily
+ * backed regions and gives the pages of spares past MM_SPARE_SLABS back
+ * with MADV_DONTNEED. A heap outlives its thread: it waits, slabs and all,
+ * for the next thread to take it over. Medium blocks, being fewer and
+ * bigger, are shared by all threads under a lock of their own.
  */
 
+#define _GNU_SOURCE
+
 #include "mm_alloc.h"
-#include <stdlib.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define MM_SLAB_SIZE ((size_t) 64 << 10)
+#define MM_REGION_SIZE ((size_t) 4 << 20)
+#define MM_PIECES (MM_REGION_SIZE / MM_SLAB_SIZE)
+#define MM_SMALL_MAX 8192
+#define MM_MEDIUM_MAX ((size_t) 1 << 20)
+#define MM_CLASSES 32                       /* Classes up to MM_SMALL_MAX. */
+#define MM_SPARE_SLABS 16                   /* Empty slabs kept backed. */
+#define MM_HEAP_SPARE 4                     /* Empty slabs a heap keeps. */
+
+#define MM_NOTIFY ((uintptr_t) 1)           /* Owner wants the next remote free. */
+
+/* What a piece of a region holds. */
+enum { MM_NONE, MM_SLAB, MM_MEDIUM, MM_LARGE };
+
+/* The header at the start of every region. */
+struct mm_region {
+    unsigned char kind[MM_PIECES];
+    size_t size;                /* A large block's mapping length. */
+} __attribute__((aligned(64)));
+
+#define MM_REGION_HEADER_SIZE sizeof(struct mm_region)
+
+/* Medium blocks' tags; sizes include the tag and are multiples of 16. */
+#define MM_USED ((size_t) 1)
+#define MM_PREV_USED ((size_t) 2)
+#define MM_TAG_BITS (MM_USED | MM_PREV_USED)
+#define MM_MIN_SPLIT 256            /* Smallest free block split off. */
+#define MM_BINS 64                  /* Four to each doubling from 256. */
+
+struct mm_tag {
+    size_t prev_size;           /* The block before's size, if it's free. */
+    size_t size;
+};
+
+struct mm_block {
+    struct mm_tag tag;
+    struct mm_block *prev, *next;   /* In its bin, while free. */
+};
+
+struct mm_heap;
+
+/* The header at the start of every slab. */
+struct mm_slab {
+    int size_class;
+    int full;                   /* On its heap's full list. */
+    size_t size;                /* Object size. */
+    struct mm_heap *heap;       /* Owner, while it has one. */
+    void *free;                 /* Freed objects, linked through themselves. */
+    char *unused;               /* Tail never handed out yet. */
+    char *end;
+    unsigned int used;          /* Objects not back on the free list. */
+    struct mm_slab *prev, *next;
+    /* Written by other threads. */
+    uintptr_t remote __attribute__((aligned(64)));
+    struct mm_slab *reclaim_next;
+} __attribute__((aligned(64)));
+
+#define MM_HEADER_SIZE sizeof(struct mm_slab)
+
+struct mm_heap {
+    struct mm_slab *partial[MM_CLASSES];   /* Slabs with room, by class. */
+    struct mm_slab *full[MM_CLASSES];
+    struct mm_slab *spare;
+    unsigned int spare_count;
+    struct mm_heap *next_idle;
+    /* Written by other threads. */
+    struct mm_slab *reclaim __attribute__((aligned(64)));
+};
+
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mm_slab *spare;                 /* Empty slabs. */
+static unsigned int spare_count;
+static char *region, *region_end;             /* Slabs left in a region. */
+static char *heap_space, *heap_space_end;     /* Room for new heaps. */
+static struct mm_heap *idle_heaps;            /* Heaps of exited threads. */
+
+static pthread_mutex_t mm_medium_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mm_block *bins[MM_BINS];        /* Free medium blocks. */
+static uint64_t bins_used;                    /* Bit per non-empty bin. */
+static unsigned int medium_regions;
+
+static pthread_once_t mm_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mm_heap_key;
+static __thread struct mm_heap *mm_thread_heap
+    __attribute__((tls_model("initial-exec")));
+
+static inline size_t mm_class_size(int size_class) {
+    if (size_class < 8)
+        return (size_t) (size_class + 1) << 4;
+    int log = 7 + (size_class - 8) / 4;
+    return (size_t) ((size_class - 8) % 4 + 5) << (log - 2);
+}
+
+static inline int mm_size_class(size_t size) {
+    if (size <= 128)
+        return size == 0 ? 0 : (int) ((size + 15) >> 4) - 1;
+    int log = 63 - __builtin_clzl(size - 1);    /* 2^log < size <= 2^(log+1) */
+    return 8 + (log - 7) * 4 + (int) ((size - 1) >> (log - 2)) - 4;
+}
+
+static inline struct mm_slab *mm_slab_of(void *ptr) {
+    return (struct mm_slab *) ((uintptr_t) ptr & ~(MM_SLAB_SIZE - 1));
+}
+
+static inline struct mm_region *mm_region_of(void *ptr) {
+    return (struct mm_region *) ((uintptr_t) ptr & ~(MM_REGION_SIZE - 1));
+}
+
+static inline int mm_kind_of(void *ptr) {
+    return mm_region_of(ptr)->kind[((uintptr_t) ptr & (MM_REGION_SIZE - 1)) /
+        MM_SLAB_SIZE];
+}
+
+/* Maps LENGTH bytes starting on an MM_REGION_SIZE boundary. */
+static void *mm_map_aligned(size_t length) {
+    size_t padded = length + MM_REGION_SIZE;
+    char *map = mmap(NULL, padded, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    char *start = (char *) (((uintptr_t) map + MM_REGION_SIZE - 1) &
+            ~(MM_REGION_SIZE - 1));
+    if (start > map)
+        munmap(map, start - map);
+    munmap(start + length, map + padded - (start + length));
+    return start;
+}
+
+static void mm_list_remove(struct mm_slab **list, struct mm_slab *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->prev = slab->next = NULL;
+}
+
+static void mm_list_push(struct mm_slab **list, struct mm_slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+/* Maps a region whose pieces but the first hold KIND. */
+static char *mm_region_new(int kind) {
+    struct mm_region *new = mm_map_aligned(MM_REGION_SIZE);
+    if (!new)
+        return NULL;
+    memset(new->kind + 1, kind, MM_PIECES - 1);
+    return (char *) new;
+}
+
+/* Takes up to COUNT empty slabs from the central heap onto *LIST. */
+static unsigned int mm_central_take(struct mm_slab **list, unsigned int count) {
+    unsigned int taken = 0;
+    pthread_mutex_lock(&mm_lock);
+    while (taken < count && spare) {
+        struct mm_slab *slab = spare;
+        mm_list_remove(&spare, slab);
+        spare_count--;
+        mm_list_push(list, slab);
+        taken++;
+    }
+    if (taken == 0) {
+        if (region == region_end) {
+            region = mm_region_new(MM_SLAB);
+            region_end = region ? region + MM_REGION_SIZE : NULL;
+            if (region)
+                region += MM_SLAB_SIZE;     /* Past the header. */
+        }
+        if (region) {
+            mm_list_push(list, (struct mm_slab *) region);
+            region += MM_SLAB_SIZE;
+            taken++;
+        }
+    }
+    pthread_mutex_unlock(&mm_lock);
+    return taken;
+}
+
+/* Gives the empty slabs on LIST back to the central heap. */
+static void mm_central_give(struct mm_slab *list) {
+    unsigned int backed = __atomic_load_n(&spare_count, __ATOMIC_RELAXED);
+    for (struct mm_slab *slab = list; slab; slab = slab->next)
+        if (backed++ >= MM_SPARE_SLABS)
+            madvise((char *) slab + MM_HEADER_SIZE,
+                    MM_SLAB_SIZE - MM_HEADER_SIZE, MADV_DONTNEED);
+
+    pthread_mutex_lock(&mm_lock);
+    while (list) {
+        struct mm_slab *slab = list;
+        list = slab->next;
+        mm_list_push(&spare, slab);
+        spare_count++;
+    }
+    pthread_mutex_unlock(&mm_lock);
+}
+
+/* Parks the heap of an exiting thread for the next thread to take. */
+static void mm_heap_detach(void *arg) {
+    struct mm_heap *heap = arg;
+    mm_thread_heap = NULL;
+    mm_central_give(heap->spare);
+    heap->spare = NULL;
+    heap->spare_count = 0;
+
+    pthread_mutex_lock(&mm_lock);
+    heap->next_idle = idle_heaps;
+    idle_heaps = heap;
+    pthread_mutex_unlock(&mm_lock);
+}
+
+static void mm_key_create() {
+    pthread_key_create(&mm_heap_key, mm_heap_detach);
+}
+
+/*
+ * Holds the locks across fork so the child's copies are consistent, and
+ * starts them afresh in the child. The heaps of threads the child doesn't
+ * have may have been caught mid-change, so they're left alone: their
+ * blocks can still be freed, onto remote lists no one will collect.
+ */
+static void mm_fork_prepare() {
+    pthread_mutex_lock(&mm_medium_lock);
+    pthread_mutex_lock(&mm_lock);
+}
+
+static void mm_fork_parent() {
+    pthread_mutex_unlock(&mm_lock);
+    pthread_mutex_unlock(&mm_medium_lock);
+}
+
+static void mm_fork_child() {
+    pthread_mutex_init(&mm_lock, NULL);
+    pthread_mutex_init(&mm_medium_lock, NULL);
+}
+
+static void __attribute__((constructor)) mm_init() {
+    pthread_atfork(mm_fork_prepare, mm_fork_parent, mm_fork_child);
+}
+
+/* Gives the calling thread a heap: an idle one, or a new one. */
+static struct mm_heap *mm_heap_attach() {
+    pthread_once(&mm_key_once, mm_key_create);
+
+    pthread_mutex_lock(&mm_lock);
+    struct mm_heap *heap = idle_heaps;
+    if (heap) {
+        idle_heaps = heap->next_idle;
+    } else {
+        if ((size_t) (heap_space_end - heap_space) < sizeof(*heap)) {
+            pthread_mutex_unlock(&mm_lock);
+            struct mm_slab *slab = NULL;
+            if (!mm_central_take(&slab, 1))
+                return NULL;
+            memset(slab, 0, MM_SLAB_SIZE);
+            pthread_mutex_lock(&mm_lock);
+            heap_space = (char *) slab;
+            heap_space_end = heap_space + MM_SLAB_SIZE;
+        }
+        heap = (struct mm_heap *) heap_space;
+        heap_space += (sizeof(*heap) + 63) & ~(size_t) 63;
+    }
+    pthread_mutex_unlock(&mm_lock);
+
+    /* Set first: pthread_setspecific may itself allocate. */
+    mm_thread_heap = heap;
+    pthread_setspecific(mm_heap_key, heap);
+    return heap;
+}
+
+static inline struct mm_heap *mm_heap_get() {
+    struct mm_heap *heap = mm_thread_heap;
+    return heap ? heap : mm_heap_attach();
+}
+
+/* Moves other threads' frees of SLAB onto its free list. */
+static int mm_collect(struct mm_slab *slab) {
+    if (__atomic_load_n(&slab->remote, __ATOMIC_RELAXED) == 0)
+        return 0;
+    void *list = (void *) __atomic_exchange_n(&slab->remote, 0,
+            __ATOMIC_ACQUIRE);
+    void *last = list;
+    unsigned int count = 1;
+    while (*(void **) last) {
+        last = *(void **) last;
+        count++;
+    }
+    *(void **) last = slab->free;
+    slab->free = list;
+    slab->used -= count;
+    return 1;
+}
+
+/*
+ * Moves SLAB, which has no room, to its heap's full list and asks to hear
+ * of its next remote free. Fails if one has come in already.
+ */
+static int mm_park(struct mm_heap *heap, struct mm_slab *slab) {
+    uintptr_t expected = 0;
+    if (!__atomic_compare_exchange_n(&slab->remote, &expected, MM_NOTIFY, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return 0;
+    mm_list_remove(&heap->partial[slab->size_class], slab);
+    mm_list_push(&heap->full[slab->size_class], slab);
+    slab->full = 1;
+    return 1;
+}
+
+/* Moves the full slabs that got a remote free back among those with room. */
+static int mm_reclaim(struct mm_heap *heap) {
+    if (!__atomic_load_n(&heap->reclaim, __ATOMIC_RELAXED))
+        return 0;
+    struct mm_slab *slab = __atomic_exchange_n(&heap->reclaim, NULL,
+            __ATOMIC_ACQUIRE);
+    while (slab) {
+        struct mm_slab *next = slab->reclaim_next;
+        mm_list_remove(&heap->full[slab->size_class], slab);
+        mm_list_push(&heap->partial[slab->size_class], slab);
+        slab->full = 0;
+        slab = next;
+    }
+    return 1;
+}
+
+static void mm_slab_init(struct mm_slab *slab, struct mm_heap *heap,
+        int size_class) {
+    slab->size_class = size_class;
+    slab->full = 0;
+    slab->size = mm_class_size(size_class);
+    slab->heap = heap;
+    slab->free = NULL;
+    slab->unused = (char *) slab + MM_HEADER_SIZE;
+    slab->end = slab->unused +
+        (MM_SLAB_SIZE - MM_HEADER_SIZE) / slab->size * slab->size;
+    slab->used = 0;
+    slab->remote = 0;
+}
+
+/* Puts an emptied SLAB aside, draining half the heap's spares past
+ * MM_HEAP_SPARE. */
+static void mm_slab_release(struct mm_heap *heap, struct mm_slab *slab) {
+    mm_list_remove(&heap->partial[slab->size_class], slab);
+    slab->heap = NULL;
+    mm_list_push(&heap->spare, slab);
+    if (++heap->spare_count <= MM_HEAP_SPARE)
+        return;
+
+    struct mm_slab *drained = NULL;
+    while (heap->spare_count > MM_HEAP_SPARE / 2) {
+        struct mm_slab *oldest = heap->spare;
+        mm_list_remove(&heap->spare, oldest);
+        mm_list_push(&drained, oldest);
+        heap->spare_count--;
+    }
+    mm_central_give(drained);
+}
+
+static void *mm_malloc_slow(struct mm_heap *heap, int size_class) {
+    while (1) {
+        struct mm_slab *slab = heap->partial[size_class];
+        if (slab) {
+            void *ptr = slab->free;
+            if (ptr) {
+                slab->free = *(void **) ptr;
+                slab->used++;
+                return ptr;
+            }
+            if (slab->unused < slab->end) {
+                ptr = slab->unused;
+                slab->unused += slab->size;
+                slab->used++;
+                return ptr;
+            }
+            if (!mm_collect(slab))
+                mm_park(heap, slab);
+            continue;
+        }
+        if (mm_reclaim(heap))
+            continue;
+
+        if (!heap->spare) {
+            heap->spare_count += mm_central_take(&heap->spare,
+                    MM_HEAP_SPARE / 2);
+            if (!heap->spare)
+                return NULL;
+        }
+        slab = heap->spare;
+        mm_list_remove(&heap->spare, slab);
+        heap->spare_count--;
+        mm_slab_init(slab, heap, size_class);
+        mm_list_push(&heap->partial[size_class], slab);
+    }
+}
+
+static void *mm_small_malloc(size_t size) {
+    struct mm_heap *heap = mm_heap_get();
+    if (!heap)
+        return NULL;
+    int size_class = mm_size_class(size);
+    struct mm_slab *slab = heap->partial[size_class];
+    void *ptr;
+    if (slab && (ptr = slab->free)) {
+        slab->free = *(void **) ptr;
+        slab->used++;
+        return ptr;
+    }
+    return mm_malloc_slow(heap, size_class);
+}
+
+static void mm_local_free(struct mm_heap *heap, struct mm_slab *slab,
+        void *ptr) {
+    *(void **) ptr = slab->free;
+    slab->free = ptr;
+    slab->used--;
+    if (slab->full) {
+        /* Unless a remote free took the notification and is queueing the
+         * slab for mm_reclaim, move it back now. */
+        uintptr_t expected = MM_NOTIFY;
+        if (__atomic_compare_exchange_n(&slab->remote, &expected, 0, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            mm_list_remove(&heap->full[slab->size_class], slab);
+            mm_list_push(&heap->partial[slab->size_class], slab);
+            slab->full = 0;
+        }
+        return;
+    }
+    /* The last slab of a class stays, so one object going back and forth
+     * doesn't set a slab up each time. */
+    if (slab->used == 0 && (slab->prev || slab->next))
+        mm_slab_release(heap, slab);
+}
+
+static void mm_remote_free(struct mm_slab *slab, void *ptr) {
+    uintptr_t old = __atomic_load_n(&slab->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **) ptr = (void *) (old & ~MM_NOTIFY);
+    } while (!__atomic_compare_exchange_n(&slab->remote, &old, (uintptr_t) ptr,
+                1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (!(old & MM_NOTIFY))
+        return;
+
+    /* This free took the notification: the slab stays parked until its
+     * owner reclaims it, so its heap can't change under us. */
+    struct mm_heap *heap = slab->heap;
+    struct mm_slab *head = __atomic_load_n(&heap->reclaim, __ATOMIC_RELAXED);
+    do {
+        slab->reclaim_next = head;
+    } while (!__atomic_compare_exchange_n(&heap->reclaim, &head, slab, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static inline size_t mm_tag_size(struct mm_tag *tag) {
+    return tag->size & ~MM_TAG_BITS;
+}
+
+static inline struct mm_tag *mm_tag_next(struct mm_tag *tag) {
+    return (struct mm_tag *) ((char *) tag + mm_tag_size(tag));
+}
+
+/* The medium block size holding SIZE bytes. */
+static inline size_t mm_medium_need(size_t size) {
+    return (size + sizeof(struct mm_tag) + 15) & ~(size_t) 15;
+}
+
+static inline int mm_bin(size_t size) {
+    int log = 63 - __builtin_clzl(size);        /* 2^log <= size < 2^(log+1) */
+    return (log - 8) * 4 + (int) (size >> (log - 2)) - 4;
+}
+
+static void mm_bin_insert(struct mm_block *block) {
+    int bin = mm_bin(mm_tag_size(&block->tag));
+    block->prev = NULL;
+    block->next = bins[bin];
+    if (bins[bin])
+        bins[bin]->prev = block;
+    bins[bin] = block;
+    bins_used |= (uint64_t) 1 << bin;
+}
+
+static void mm_bin_remove(struct mm_block *block) {
+    int bin = mm_bin(mm_tag_size(&block->tag));
+    if (block->prev)
+        block->prev->next = block->next;
+    else if (!(bins[bin] = block->next))
+        bins_used &= ~((uint64_t) 1 << bin);
+    if (block->next)
+        block->next->prev = block->prev;
+}
+
+/* Finds a free block of at least NEED bytes: the first that fits in its
+ * own bin, or any in a bigger one. */
+static struct mm_block *mm_bin_find(size_t need) {
+    int bin = mm_bin(need);
+    for (struct mm_block *block = bins[bin]; block; block = block->next)
+        if (mm_tag_size(&block->tag) >= need)
+            return block;
+    uint64_t bigger = bins_used & ~(((uint64_t) 2 << bin) - 1);
+    return bigger ? bins[__builtin_ctzll(bigger)] : NULL;
+}
+
+/* Marks the SIZE bytes at TAG a free block and files it. */
+static void mm_medium_release(struct mm_tag *tag, size_t size) {
+    tag->size = size | (tag->size & MM_PREV_USED);
+    struct mm_tag *next = mm_tag_next(tag);
+    next->prev_size = size;
+    next->size &= ~MM_PREV_USED;
+    mm_bin_insert((struct mm_block *) tag);
+}
+
+/* Frees TAG's block, merging it with its free neighbours. Unmaps its
+ * region instead once it's all free, unless it's the last one. */
+static void mm_medium_free_locked(struct mm_tag *tag) {
+    size_t size = mm_tag_size(tag);
+    struct mm_tag *next = mm_tag_next(tag);
+    if (!(next->size & MM_USED)) {
+        mm_bin_remove((struct mm_block *) next);
+        size += mm_tag_size(next);
+    }
+    if (!(tag->size & MM_PREV_USED)) {
+        tag = (struct mm_tag *) ((char *) tag - tag->prev_size);
+        mm_bin_remove((struct mm_block *) tag);
+        size += mm_tag_size(tag);
+    }
+    if (size == MM_REGION_SIZE - MM_REGION_HEADER_SIZE - sizeof(*tag) &&
+            medium_regions > 1) {
+        munmap(mm_region_of(tag), MM_REGION_SIZE);
+        medium_regions--;
+        return;
+    }
+    mm_medium_release(tag, size);
+}
+
+/* Gives the tail of TAG's block past NEED bytes back, if worth it. */
+static void mm_medium_split(struct mm_tag *tag, size_t need) {
+    size_t size = mm_tag_size(tag);
+    if (size - need < MM_MIN_SPLIT)
+        return;
+    tag->size = need | (tag->size & MM_TAG_BITS);
+    struct mm_tag *rest = mm_tag_next(tag);
+    rest->size = (size - need) | MM_USED | MM_PREV_USED;
+    mm_medium_free_locked(rest);
+}
+
+/* Maps a medium region: one free block, then a fence that's always used. */
+static int mm_medium_grow() {
+    struct mm_region *new = (struct mm_region *) mm_region_new(MM_MEDIUM);
+    if (!new)
+        return 0;
+    new->kind[0] = MM_MEDIUM;
+    struct mm_tag *tag = (struct mm_tag *) ((char *) new + MM_REGION_HEADER_SIZE);
+    struct mm_tag *fence = (struct mm_tag *) ((char *) new + MM_REGION_SIZE) - 1;
+    fence->size = MM_USED;
+    tag->size = MM_PREV_USED;
+    mm_medium_release(tag, (char *) fence - (char *) tag);
+    medium_regions++;
+    return 1;
+}
+
+static void *mm_medium_malloc(size_t size) {
+    size_t need = mm_medium_need(size);
+    pthread_mutex_lock(&mm_medium_lock);
+    struct mm_block *block = mm_bin_find(need);
+    if (!block && mm_medium_grow())
+        block = mm_bin_find(need);
+    if (!block) {
+        pthread_mutex_unlock(&mm_medium_lock);
+        return NULL;
+    }
+    mm_bin_remove(block);
+    struct mm_tag *tag = &block->tag;
+    tag->size |= MM_USED;
+    mm_tag_next(tag)->size |= MM_PREV_USED;
+    mm_medium_split(tag, need);
+    pthread_mutex_unlock(&mm_medium_lock);
+    return tag + 1;
+}
+
+static void mm_medium_free(void *ptr) {
+    pthread_mutex_lock(&mm_medium_lock);
+    mm_medium_free_locked((struct mm_tag *) ptr - 1);
+    pthread_mutex_unlock(&mm_medium_lock);
+}
+
+/* Makes PTR's block hold SIZE bytes where it is, taking in the next block
+ * if that's free and big enough, or giving back its own tail. */
+static int mm_medium_resize(void *ptr, size_t size) {
+    struct mm_tag *tag = (struct mm_tag *) ptr - 1;
+    size_t need = mm_medium_need(size);
+    pthread_mutex_lock(&mm_medium_lock);
+    size_t have = mm_tag_size(tag);
+    if (need > have) {
+        struct mm_tag *next = mm_tag_next(tag);
+        if ((next->size & MM_USED) || have + mm_tag_size(next) < need) {
+            pthread_mutex_unlock(&mm_medium_lock);
+            return 0;
+        }
+        mm_bin_remove((struct mm_block *) next);
+        tag->size = (have + mm_tag_size(next)) | (tag->size & MM_TAG_BITS);
+        mm_tag_next(tag)->size |= MM_PREV_USED;
+    }
+    mm_medium_split(tag, need);
+    pthread_mutex_unlock(&mm_medium_lock);
+    return 1;
+}
+
+/* Places a block of SIZE bytes at OFFSET into a region of its own. */
+static void *mm_large_malloc(size_t size, size_t offset) {
+    if (size > SIZE_MAX - offset - MM_REGION_SIZE)
+        return NULL;
+    size_t length = (offset + size + 4095) & ~(size_t) 4095;
+    struct mm_region *large = mm_map_aligned(length);
+    if (!large)
+        return NULL;
+    memset(large->kind, MM_LARGE, MM_PIECES);
+    large->size = length;
+    return (char *) large + offset;
+}
+
+/* Resizes PTR's region to hold SIZE bytes without copying: in place if
+ * there's room, or else by moving its pages to a new aligned address. */
+static void *mm_large_resize(void *ptr, size_t size) {
+    struct mm_region *large = mm_region_of(ptr);
+    size_t offset = (char *) ptr - (char *) large;
+    if (size > SIZE_MAX - offset - MM_REGION_SIZE)
+        return NULL;
+    size_t length = (offset + size + 4095) & ~(size_t) 4095;
+    void *moved = large;
+    if (length != large->size)
+        moved = mremap(large, large->size, length, 0);
+    if (moved == MAP_FAILED) {
+        void *target = mm_map_aligned(length);
+        if (!target)
+            return NULL;
+        moved = mremap(large, large->size, length,
+                MREMAP_MAYMOVE | MREMAP_FIXED, target);
+        if (moved == MAP_FAILED) {
+            munmap(target, length);
+            return NULL;
+        }
+    }
+    ((struct mm_region *) moved)->size = length;
+    return (char *) moved + offset;
+}
+
+/* Bytes PTR's block, of kind KIND, can hold. */
+static size_t mm_usable(void *ptr, int kind) {
+    if (kind == MM_SLAB)
+        return mm_slab_of(ptr)->size;
+    if (kind == MM_MEDIUM)
+        return mm_tag_size((struct mm_tag *) ptr - 1) - sizeof(struct mm_tag);
+    struct mm_region *large = mm_region_of(ptr);
+    return large->size - ((char *) ptr - (char *) large);
+}
+
+/*
+ * Allocates a medium block of SIZE bytes aligned to ALIGNMENT by taking
+ * one with room to spare and giving back what's before the first aligned
+ * address far enough in to make a free block of its own.
+ */
+static void *mm_medium_memalign(size_t alignment, size_t size) {
+    char *ptr = mm_medium_malloc(size + alignment + MM_MIN_SPLIT);
+    if (!ptr)
+        return NULL;
+    char *aligned = (char *) (((uintptr_t) ptr + MM_MIN_SPLIT + alignment - 1) &
+            ~(uintptr_t) (alignment - 1));
+    struct mm_tag *lead = (struct mm_tag *) ptr - 1;
+    struct mm_tag *tag = (struct mm_tag *) aligned - 1;
+
+    pthread_mutex_lock(&mm_medium_lock);
+    size_t skipped = aligned - ptr;
+    tag->size = (mm_tag_size(lead) - skipped) | MM_USED | MM_PREV_USED;
+    lead->size = skipped | (lead->size & MM_TAG_BITS);
+    mm_medium_free_locked(lead);
+    mm_medium_split(tag, mm_medium_need(size));
+    pthread_mutex_unlock(&mm_medium_lock);
+    return aligned;
+}
 
 void *mm_malloc(size_t size) {
-    /* YOUR CODE HERE */
-    return NULL;
+    if (size <= MM_SMALL_MAX)
+        return mm_small_malloc(size);
+    if (size <= MM_MEDIUM_MAX)
+        return mm_medium_malloc(size);
+    return mm_large_malloc(size, MM_REGION_HEADER_SIZE);
 }
 
+void mm_free(void *ptr) {
+    if (!ptr)
+        return;
+    int kind = mm_kind_of(ptr);
+    if (kind == MM_SLAB) {
+        struct mm_slab *slab = mm_slab_of(ptr);
+        struct mm_heap *heap = mm_thread_heap;
+        if (heap && slab->heap == heap)
+            mm_local_free(heap, slab, ptr);
+        else
+            mm_remote_free(slab, ptr);
+    } else if (kind == MM_MEDIUM) {
+        mm_medium_free(ptr);
+    } else {
+        struct mm_region *large = mm_region_of(ptr);
+        munmap(large, large->size);
+    }
+}
+
+/*
+ * Resizes the block where it is when it can: a slab object that SIZE still
+ * fits without leaving more than half of it unused, a medium block through
+ * its neighbour, a large one through mremap. Copies to a new block only
+ * when SIZE belongs to another kind or there's no room in place.
+ */
 void *mm_realloc(void *ptr, size_t size) {
-    /* YOUR CODE HERE */
-    return NULL;
+    if (!ptr)
+        return mm_malloc(size);
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+
+    int kind = mm_kind_of(ptr);
+    size_t usable = mm_usable(ptr, kind);
+    if (kind == MM_SLAB && size <= usable && size > usable / 2)
+        return ptr;
+    if (kind == MM_MEDIUM && size <= MM_MEDIUM_MAX &&
+            size > MM_SMALL_MAX / 2 && mm_medium_resize(ptr, size))
+        return ptr;
+    if (kind == MM_LARGE && size > MM_MEDIUM_MAX)
+        return mm_large_resize(ptr, size);
+
+    void *moved = mm_malloc(size);
+    if (!moved)
+        return NULL;
+    memcpy(moved, ptr, size < usable ? size : usable);
+    mm_free(ptr);
+    return moved;
 }
 
-void mm_free(void *ptr) {
-    /* YOUR CODE HERE */
+/*
+ * Small blocks get ALIGNMENT from a class whose objects are all aligned to
+ * it; the rest from a medium block trimmed to it, or a large block placed
+ * at it. Alignments past half a region aren't supported.
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+    if (alignment & (alignment - 1) || alignment > MM_REGION_SIZE / 2)
+        return NULL;
+    if (alignment <= 16)
+        return mm_malloc(size);
+
+    if (MM_HEADER_SIZE % alignment == 0 && size <= MM_SMALL_MAX) {
+        int size_class = mm_size_class(size);
+        while (mm_class_size(size_class) % alignment)
+            size_class++;
+        return mm_small_malloc(mm_class_size(size_class));
+    }
+    if (alignment < MM_MEDIUM_MAX / 2 &&
+            size <= MM_MEDIUM_MAX - alignment - MM_MIN_SPLIT)
+        return mm_medium_memalign(alignment, size);
+    return mm_large_malloc(size, alignment > MM_REGION_HEADER_SIZE ?
+            alignment : MM_REGION_HEADER_SIZE);
+}
+
+size_t mm_usable_size(void *ptr) {
+    return ptr ? mm_usable(ptr, mm_kind_of(ptr)) : 0;
 }
@@ -11,3 +11,5 @@
 void *mm_malloc(size_t size);
 void *mm_realloc(void *ptr, size_t size);
 void mm_free(void *ptr);
+void *mm_memalign(size_t alignment, size_t size);
+size_t mm_usable_size(void *ptr);
@@ -0,0 +1,521 @@
+/*
+ * Benchmark for hw3lib.so-compatible allocators.
+ *
+ * Runs each workload against each allocator in a forked child of its own,
+ * so one allocator's heap never inflates another's numbers, and prints for
+ * each: operations per second; the peak RSS the workload added; the
+ * utilization, peak live bytes over that peak; and the fragmentation at
+ * the end of the workload, the share of the heap's RSS then holding no
+ * live bytes ("-" if nothing is live then).
+ *
+ * Live bytes are sampled every BENCH_SAMPLE_US and at the end, so the
+ * peak can be missed between samples, and RSS is counted in whole pages
+ * by kernel counters that lag the allocator. Neither figure is exact, and
+ * utilization is capped at 100% where the two disagree.
+ *
+ * Workloads:
+ *   uniform    random replacement of 64K blocks of 16 to 256 bytes
+ *   bimodal    the same with one block in 100 of 16 to 256 KiB
+ *   prodcons   producer threads handing blocks to consumer threads to free
+ *   realloc    4K buffers grown by realloc and started over past 256 KiB
+ *   trace      replay of the --trace file, if one is given
+ *
+ * Usage: ./mm_bench [--trace FILE] [--scale X] [LIBRARY...]
+ *
+ * A LIBRARY is a shared library exporting mm_malloc, mm_realloc and
+ * mm_free, or "system" for the C library's malloc. The default is
+ * ./hw3lib.so and system. --scale multiplies every workload's operations.
+ *
+ * A trace has one operation per line, blocks being numbered from 0:
+ *   m ID SIZE      malloc SIZE bytes as block ID
+ *   r ID SIZE      realloc block ID to SIZE bytes
+ * SIZE may be 0. A block realloc'd to 0 stays allocated as far as the
+ * trace goes, whether or not the allocator freed it.
+ *   f ID           free block ID
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_THREADS 8
+#define BENCH_SAMPLE_US 2000
+#define BENCH_PAIRS 2               /* Producer-consumer pairs. */
+#define BENCH_QUEUE 1024
+
+struct allocator {
+    const char *name;
+    void *(*malloc)(size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+};
+
+struct result {
+    double seconds;
+    unsigned long ops;
+    size_t peak_heap;
+    size_t peak_live;
+    size_t end_heap;
+    size_t end_live;
+};
+
+/* Live bytes per thread, summed by the sampler. */
+struct live {
+    long bytes;
+} __attribute__((aligned(64)));
+
+static struct allocator bench;
+static double scale = 1;
+static struct live live[BENCH_MAX_THREADS];
+static size_t baseline;
+static struct result result;
+static struct timespec start;
+static int sampling;
+
+struct trace_op {
+    char op;
+    unsigned int id;
+    size_t size;
+};
+
+static struct trace_op *trace;
+static size_t trace_length;
+static unsigned int trace_blocks;
+
+static size_t current_rss() {
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1)
+            pages = 0;
+        fclose(statm);
+    }
+    return (size_t) pages * sysconf(_SC_PAGESIZE);
+}
+
+static size_t peak_rss() {
+    char line[256];
+    size_t kib = 0;
+    FILE *status = fopen("/proc/self/status", "r");
+    if (!status)
+        return 0;
+    while (fgets(line, sizeof(line), status))
+        if (sscanf(line, "VmHWM: %zu", &kib) == 1)
+            break;
+    fclose(status);
+    return kib << 10;
+}
+
+static size_t live_bytes() {
+    long sum = 0;
+    for (int i = 0; i < BENCH_MAX_THREADS; i++)
+        sum += __atomic_load_n(&live[i].bytes, __ATOMIC_RELAXED);
+    return sum > 0 ? sum : 0;
+}
+
+static void *sampler_main(void *arg) {
+    while (__atomic_load_n(&sampling, __ATOMIC_ACQUIRE)) {
+        size_t bytes = live_bytes();
+        if (bytes > result.peak_live)
+            result.peak_live = bytes;
+        usleep(BENCH_SAMPLE_US);
+    }
+    return NULL;
+}
+
+static unsigned long scaled(unsigned long ops) {
+    return (unsigned long) (ops * scale);
+}
+
+/* Writes to every page of BLOCK, as a program using it would. */
+static void touch(unsigned char *block, size_t size) {
+    if (size == 0)
+        return;
+    for (size_t i = 0; i < size; i += 4096)
+        block[i] = i;
+    block[size - 1] = 1;
+}
+
+static void *bench_malloc(int thread, size_t size) {
+    unsigned char *block = bench.malloc(size);
+    if (!block && size > 0) {
+        fprintf(stderr, "%s: out of memory\n", bench.name);
+        exit(1);
+    }
+    touch(block, size);
+    __atomic_store_n(&live[thread].bytes, live[thread].bytes + size,
+            __ATOMIC_RELAXED);
+    return block;
+}
+
+static void *bench_realloc(int thread, void *block, size_t old_size,
+        size_t size) {
+    unsigned char *resized = bench.realloc(block, size);
+    if (!resized && size > 0) {
+        fprintf(stderr, "%s: out of memory\n", bench.name);
+        exit(1);
+    }
+    if (size > old_size)
+        touch(resized + old_size, size - old_size);
+    __atomic_store_n(&live[thread].bytes,
+            live[thread].bytes + size - old_size, __ATOMIC_RELAXED);
+    return resized;
+}
+
+static void bench_free(int thread, void *block, size_t size) {
+    bench.free(block);
+    __atomic_store_n(&live[thread].bytes, live[thread].bytes - size,
+            __ATOMIC_RELAXED);
+}
+
+/* Stops the clock and takes the end-of-workload figures, before the
+ * workload frees what it still holds. */
+static void bench_checkpoint(unsigned long ops) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result.seconds = end.tv_sec - start.tv_sec +
+        (end.tv_nsec - start.tv_nsec) / 1e9;
+    result.ops = ops;
+    result.end_live = live_bytes();
+    if (result.end_live > result.peak_live)
+        result.peak_live = result.end_live;
+    size_t rss = current_rss();
+    result.end_heap = rss > baseline ? rss - baseline : 0;
+}
+
+static void run_replace(size_t small_max, int large_every) {
+    enum { SLOTS = 65536 };
+    static unsigned char *blocks[SLOTS];
+    static size_t sizes[SLOTS];
+    unsigned int seed = 162;
+    unsigned long ops = scaled(4000000), done = 0;
+
+    for (unsigned long i = 0; i < ops; i++) {
+        int slot = rand_r(&seed) % SLOTS;
+        if (blocks[slot]) {
+            bench_free(0, blocks[slot], sizes[slot]);
+            done++;
+        }
+        if (large_every && rand_r(&seed) % large_every == 0)
+            sizes[slot] = (16 << 10) + rand_r(&seed) % (240 << 10);
+        else
+            sizes[slot] = 16 + rand_r(&seed) % (small_max - 15);
+        blocks[slot] = bench_malloc(0, sizes[slot]);
+        done++;
+    }
+    bench_checkpoint(done);
+    for (int i = 0; i < SLOTS; i++)
+        if (blocks[i])
+            bench_free(0, blocks[i], sizes[i]);
+}
+
+static void run_uniform() {
+    run_replace(256, 0);
+}
+
+static void run_bimodal() {
+    run_replace(128, 100);
+}
+
+/* A queue from one producer to one consumer. */
+struct queue {
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+    unsigned long count;
+    int producer;
+    struct {
+        void *block;
+        size_t size;
+    } slots[BENCH_QUEUE];
+};
+
+static struct queue queues[BENCH_PAIRS];
+
+static void *producer_main(void *arg) {
+    struct queue *queue = arg;
+    unsigned int seed = queue->producer;
+    for (unsigned long i = 0; i < queue->count; i++) {
+        while (i - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) ==
+                BENCH_QUEUE)
+            sched_yield();
+        size_t size = 16 + rand_r(&seed) % 1009;
+        queue->slots[i % BENCH_QUEUE].block =
+            bench_malloc(queue->producer, size);
+        queue->slots[i % BENCH_QUEUE].size = size;
+        __atomic_store_n(&queue->head, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *consumer_main(void *arg) {
+    struct queue *queue = arg;
+    int thread = queue->producer + BENCH_PAIRS;
+    for (unsigned long i = 0; i < queue->count; i++) {
+        while (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == i)
+            sched_yield();
+        bench_free(thread, queue->slots[i % BENCH_QUEUE].block,
+                queue->slots[i % BENCH_QUEUE].size);
+        __atomic_store_n(&queue->tail, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void run_prodcons() {
+    pthread_t threads[2 * BENCH_PAIRS];
+    for (int i = 0; i < BENCH_PAIRS; i++) {
+        queues[i].count = scaled(1000000);
+        queues[i].producer = i;
+        pthread_create(&threads[2 * i], NULL, producer_main, &queues[i]);
+        pthread_create(&threads[2 * i + 1], NULL, consumer_main, &queues[i]);
+    }
+    for (int i = 0; i < 2 * BENCH_PAIRS; i++)
+        pthread_join(threads[i], NULL);
+    bench_checkpoint(2 * BENCH_PAIRS * queues[0].count);
+}
+
+static void run_realloc() {
+    enum { SLOTS = 4096 };
+    static unsigned char *blocks[SLOTS];
+    static size_t sizes[SLOTS];
+    unsigned int seed = 162;
+    unsigned long ops = scaled(1000000);
+
+    for (unsigned long i = 0; i < ops; i++) {
+        int slot = rand_r(&seed) % SLOTS;
+        size_t size = sizes[slot];
+        if (!blocks[slot]) {
+            sizes[slot] = 16;
+            blocks[slot] = bench_malloc(0, 16);
+        } else if (size > (256 << 10)) {
+            bench_free(0, blocks[slot], size);
+            blocks[slot] = NULL;
+        } else {
+            /* Mostly grow, as buffers being filled do; sometimes trim. */
+            sizes[slot] = rand_r(&seed) % 8 ? size + size / 2 : size / 2 + 1;
+            blocks[slot] = bench_realloc(0, blocks[slot], size, sizes[slot]);
+        }
+    }
+    bench_checkpoint(ops);
+    for (int i = 0; i < SLOTS; i++)
+        if (blocks[i])
+            bench_free(0, blocks[i], sizes[i]);
+}
+
+static void run_trace() {
+    void **blocks = calloc(trace_blocks, sizeof(*blocks));
+    size_t *sizes = calloc(trace_blocks, sizeof(*sizes));
+    if (!blocks || !sizes) {
+        perror("Failed to allocate the trace's blocks");
+        exit(1);
+    }
+    baseline = current_rss();
+
+    for (size_t i = 0; i < trace_length; i++) {
+        struct trace_op *op = &trace[i];
+        if (op->op == 'm') {
+            blocks[op->id] = bench_malloc(0, op->size);
+        } else if (op->op == 'r') {
+            blocks[op->id] = bench_realloc(0, blocks[op->id], sizes[op->id],
+                    op->size);
+        } else {
+            bench_free(0, blocks[op->id], sizes[op->id]);
+            blocks[op->id] = NULL;
+        }
+        sizes[op->id] = op->op == 'f' ? 0 : op->size;
+    }
+    bench_checkpoint(trace_length);
+    for (unsigned int i = 0; i < trace_blocks; i++)
+        if (blocks[i])
+            bench_free(0, blocks[i], sizes[i]);
+}
+
+static void load_trace(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("Failed to open the trace");
+        exit(1);
+    }
+    size_t capacity = 0, ids = 0;
+    char line[128];
+    char *allocated = NULL;     /* Per block, whether it's live. */
+    for (int number = 1; fgets(line, sizeof(line), file); number++) {
+        struct trace_op op = { 0 };
+        if (line[0] == '\n' || line[0] == '#')
+            continue;
+        if (!((sscanf(line, "%c %u %zu", &op.op, &op.id, &op.size) == 3 &&
+                        (op.op == 'm' || op.op == 'r')) ||
+                    (sscanf(line, "%c %u", &op.op, &op.id) == 2 &&
+                     op.op == 'f'))) {
+            fprintf(stderr, "%s:%d: bad operation\n", path, number);
+            exit(1);
+        }
+        if (op.id >= ids) {
+            size_t grown = op.id + 1 > 2 * ids ? op.id + 1 : 2 * ids;
+            allocated = realloc(allocated, grown);
+            if (!allocated) {
+                perror("Failed to load the trace");
+                exit(1);
+            }
+            memset(allocated + ids, 0, grown - ids);
+            ids = grown;
+        }
+        if (allocated[op.id] != (op.op != 'm')) {
+            fprintf(stderr, "%s:%d: block %u is %s\n", path, number, op.id,
+                    allocated[op.id] ? "already allocated" : "not allocated");
+            exit(1);
+        }
+        allocated[op.id] = op.op != 'f';
+        if (trace_length == capacity) {
+            capacity = capacity ? 2 * capacity : 4096;
+            trace = realloc(trace, capacity * sizeof(*trace));
+            if (!trace) {
+                perror("Failed to load the trace");
+                exit(1);
+            }
+        }
+        trace[trace_length++] = op;
+        if (op.id >= trace_blocks)
+            trace_blocks = op.id + 1;
+    }
+    free(allocated);
+    fclose(file);
+}
+
+/* Points BENCH at the allocator called NAME, in the calling process. */
+static void load_allocator(const char *name) {
+    bench.name = name;
+    if (strcmp(name, "system") == 0) {
+        bench.malloc = malloc;
+        bench.realloc = realloc;
+        bench.free = free;
+        return;
+    }
+    void *handle = dlopen(name, RTLD_NOW);
+    if (!handle) {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+    bench.malloc = dlsym(handle, "mm_malloc");
+    bench.realloc = dlsym(handle, "mm_realloc");
+    bench.free = dlsym(handle, "mm_free");
+    if (!bench.malloc || !bench.realloc || !bench.free) {
+        fprintf(stderr, "%s: missing mm_malloc, mm_realloc or mm_free\n",
+                name);
+        exit(1);
+    }
+}
+
+/* Runs WORKLOAD on allocator NAME in a child; returns 0 if it failed. */
+static int run(void (*workload)(), const char *name, struct result *out) {
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+        perror("Failed to create a pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        close(pipefd[0]);
+        load_allocator(name);
+        FILE *clear_refs = fopen("/proc/self/clear_refs", "w");
+        if (clear_refs) {
+            fputs("5", clear_refs);     /* Resets the peak RSS. */
+            fclose(clear_refs);
+        }
+        baseline = current_rss();
+
+        pthread_t sampler;
+        sampling = 1;
+        pthread_create(&sampler, NULL, sampler_main, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        workload();
+        __atomic_store_n(&sampling, 0, __ATOMIC_RELEASE);
+        pthread_join(sampler, NULL);
+
+        size_t peak = peak_rss();
+        result.peak_heap = peak > baseline ? peak - baseline : 0;
+        if (write(pipefd[1], &result, sizeof(result)) != sizeof(result))
+            _exit(1);
+        _exit(0);
+    }
+
+    close(pipefd[1]);
+    ssize_t size = read(pipefd[0], out, sizeof(*out));
+    close(pipefd[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return size == sizeof(*out) && WIFEXITED(status) &&
+        WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv) {
+    static const struct {
+        const char *name;
+        void (*run)();
+    } workloads[] = {
+        { "uniform", run_uniform },
+        { "bimodal", run_bimodal },
+        { "prodcons", run_prodcons },
+        { "realloc", run_realloc },
+        { "trace", run_trace },
+    };
+    const char *libraries[16];
+    int library_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            load_trace(argv[++i]);
+        } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = atof(argv[++i]);
+        } else if (argv[i][0] == '-' || library_count == 16) {
+            fprintf(stderr, "Usage: %s [--trace FILE] [--scale X] "
+                    "[LIBRARY...]\n", argv[0]);
+            return 1;
+        } else {
+            libraries[library_count++] = argv[i];
+        }
+    }
+    if (library_count == 0) {
+        libraries[library_count++] = "./hw3lib.so";
+        libraries[library_count++] = "system";
+    }
+
+    printf("%-9s %-14s %12s %10s %6s %6s\n", "workload", "allocator",
+            "ops/s", "peak RSS", "util", "frag");
+    for (int w = 0; w < (int) (sizeof(workloads) / sizeof(workloads[0]));
+            w++) {
+        if (workloads[w].run == run_trace && !trace)
+            continue;
+        for (int l = 0; l < library_count; l++) {
+            struct result out;
+            if (!run(workloads[w].run, libraries[l], &out)) {
+                printf("%-9s %-14s failed\n", workloads[w].name, libraries[l]);
+                continue;
+            }
+            char fragmentation[16] = "-";
+            if (out.end_live > 0)
+                snprintf(fragmentation, sizeof(fragmentation), "%.1f%%",
+                        out.end_heap > out.end_live ? 100.0 * (1 -
+                            (double) out.end_live / out.end_heap) : 0);
+            printf("%-9s %-14s %12.0f %8.1fMB %5.1f%% %6s\n",
+                    workloads[w].name, libraries[l], out.ops / out.seconds,
+                    out.peak_heap / 1e6,
+                    out.peak_heap > out.peak_live ?
+                        100.0 * out.peak_live / out.peak_heap :
+                        out.peak_live ? 100.0 : 0,
+                    fragmentation);
+        }
+    }
+    return 0;
+}
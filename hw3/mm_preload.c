@@ -0,0 +1,108 @@
+/*
+ * mm_preload.c
+ *
+ * Puts mm_alloc in place of the C library's malloc in a program that was
+ * never built against it:
+ *
+ *     LD_PRELOAD=/path/to/libmm_preload.so ../hw2/httpserver ...
+ *
+ * Every allocation entry point glibc has is replaced, not just the common
+ * ones, so no block from one allocator can reach the other's free.
+ *
+ * The allocator is safe to call before any constructor has run, as the
+ * dynamic loader and libc may do: its locks are statically initialized,
+ * nothing it calls allocates, and its per-thread pointer is initial-exec
+ * TLS, set up with the thread. It also keeps itself consistent across
+ * fork (see mm_fork_prepare).
+ */
+
+#define _GNU_SOURCE
+
+#include "mm_alloc.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Sets errno as the C library would when an allocation of SIZE fails. */
+static void *mm_checked(void *ptr, size_t size) {
+    if (!ptr && size)
+        errno = ENOMEM;
+    return ptr;
+}
+
+void *malloc(size_t size) {
+    return mm_checked(mm_malloc(size), 1);
+}
+
+void free(void *ptr) {
+    mm_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size) {
+    return mm_checked(mm_realloc(ptr, size), !ptr || size);
+}
+
+void *reallocarray(void *ptr, size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+void *calloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = mm_malloc(total);
+    if (ptr)
+        memset(ptr, 0, total);
+    return mm_checked(ptr, 1);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    /* As glibc does, rounds ALIGNMENT up to a power of two. */
+    if (alignment & (alignment - 1))
+        alignment = (size_t) 1 << (64 - __builtin_clzl(alignment));
+    return mm_checked(mm_memalign(alignment, size), 1);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    if (alignment & (alignment - 1) || alignment % sizeof(void *))
+        return EINVAL;
+    void *block = mm_memalign(alignment, size);
+    if (!block)
+        return ENOMEM;
+    *ptr = block;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment & (alignment - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return mm_checked(mm_memalign(alignment, size), 1);
+}
+
+void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return mm_usable_size(ptr);
+}
@@ -1,12 +1,18 @@
 #include <assert.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 /* Function pointers to hw3 functions */
 void* (*mm_malloc)(size_t);
 void* (*mm_realloc)(void*, size_t);
 void (*mm_free)(void*);
+void* (*mm_memalign)(size_t, size_t);
+size_t (*mm_usable_size)(void*);
 
 void load_alloc_functions() {
     void *handle = dlopen("hw3lib.so", RTLD_NOW);
@@ -33,15 +39,240 @@ void load_alloc_functions() {
         fprintf(stderr, "%s\n", dlerror());
         exit(1);
     }
+
+    mm_memalign = dlsym(handle, "mm_memalign");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    mm_usable_size = dlsym(handle, "mm_usable_size");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
 }
 
-int main() {
+/*
+ * Allocates blocks of every size class and a few large ones, fills each
+ * with its own pattern, and checks none overlap and realloc keeps the data.
+ */
+void test_sizes() {
+    static const size_t sizes[] = { 0, 1, 8, 16, 17, 100, 128, 129, 500,
+        1000, 4096, 5000, 8192, 8193, 20000, 100000, 1 << 20, 5 << 20 };
+    int count = sizeof(sizes) / sizeof(sizes[0]);
+    unsigned char *blocks[sizeof(sizes) / sizeof(sizes[0])][8];
+
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < 8; j++) {
+            blocks[i][j] = mm_malloc(sizes[i]);
+            assert(blocks[i][j] != NULL);
+            assert((uintptr_t) blocks[i][j] % 16 == 0);
+            memset(blocks[i][j], i * 8 + j, sizes[i]);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < 8; j++) {
+            for (size_t k = 0; k < sizes[i]; k++)
+                assert(blocks[i][j][k] == (unsigned char) (i * 8 + j));
+            size_t grown = sizes[i] * 3 + 10;
+            blocks[i][j] = mm_realloc(blocks[i][j], grown);
+            assert(blocks[i][j] != NULL);
+            for (size_t k = 0; k < sizes[i]; k++)
+                assert(blocks[i][j][k] == (unsigned char) (i * 8 + j));
+            memset(blocks[i][j], 0xff, grown);
+            blocks[i][j] = mm_realloc(blocks[i][j], 8);
+            assert(blocks[i][j] != NULL && blocks[i][j][7] == 0xff);
+            mm_free(blocks[i][j]);
+        }
+    }
+    mm_free(NULL);
+    assert(mm_realloc(mm_malloc(10), 0) == NULL);
+}
+
+/* Allocates blocks of every kind at every alignment the shim may ask for,
+ * and checks each is aligned, holds what it says it can, and resizes. */
+void test_align() {
+    static const size_t sizes[] = { 1, 100, 5000, 50000, 900000, 3 << 20 };
+    void *blocks[sizeof(sizes) / sizeof(sizes[0])];
+    int count = sizeof(sizes) / sizeof(sizes[0]);
+
+    for (size_t alignment = 8; alignment <= (1 << 20); alignment *= 2) {
+        for (int i = 0; i < count; i++) {
+            blocks[i] = mm_memalign(alignment, sizes[i]);
+            assert(blocks[i] != NULL);
+            assert((uintptr_t) blocks[i] % alignment == 0);
+            assert(mm_usable_size(blocks[i]) >= sizes[i]);
+            memset(blocks[i], i, mm_usable_size(blocks[i]));
+        }
+        for (int i = 0; i < count; i++) {
+            unsigned char *grown = mm_realloc(blocks[i], sizes[i] * 2);
+            assert(grown != NULL && grown[0] == i && grown[sizes[i] - 1] == i);
+            mm_free(grown);
+        }
+    }
+    assert(mm_usable_size(NULL) == 0);
+    assert(mm_memalign(48, 10) == NULL);
+}
+
+/* Churns many small blocks so slabs fill, empty and get reused. */
+void test_churn() {
+    enum { LIVE = 4096, ROUNDS = 200000 };
+    static unsigned char *live[LIVE];
+    static size_t sizes[LIVE];
+    unsigned int seed = 162;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        int slot = rand_r(&seed) % LIVE;
+        if (live[slot]) {
+            assert(live[slot][0] == (unsigned char) slot);
+            assert(live[slot][sizes[slot] - 1] == (unsigned char) slot);
+            mm_free(live[slot]);
+        }
+        sizes[slot] = 1 + rand_r(&seed) % (rand_r(&seed) % 8 ? 256 : 16384);
+        live[slot] = mm_malloc(sizes[slot]);
+        assert(live[slot] != NULL);
+        live[slot][0] = live[slot][sizes[slot] - 1] = slot;
+    }
+    for (int i = 0; i < LIVE; i++)
+        mm_free(live[i]);
+}
+
+/*
+ * Grows a buffer by realloc the way tokenizer.c's vector_push does, one
+ * element at a time, then by repeated doubling, and reports how many bytes
+ * realloc copied, remapped or kept where they were. Blocks over
+ * REMAP_MIN, mm_alloc.c's MM_MEDIUM_MAX, move by having their pages
+ * remapped rather than copied.
+ */
+#define REMAP_MIN (1 << 20)
+
+void test_realloc_growth() {
+    static const struct {
+        const char *name;
+        size_t start, step, factor, limit;
+    } patterns[] = {
+        { "push 8 bytes", 8, 8, 1, 16 << 20 },
+        { "double", 16, 0, 2, 256 << 20 },
+    };
+
+    for (int i = 0; i < 2; i++) {
+        /* A neighbour allocated alongside, so growth can't always be free. */
+        void *neighbour = mm_malloc(patterns[i].start);
+        size_t size = patterns[i].start;
+        unsigned char *buffer = mm_malloc(size);
+        assert(buffer != NULL);
+        buffer[0] = 0x16;
+        buffer[size - 1] = 0x2;
+        unsigned long reallocs = 0;
+        size_t copied = 0, remapped = 0, kept = 0;
+        while (size < patterns[i].limit) {
+            size_t grown = size * patterns[i].factor + patterns[i].step;
+            unsigned char *next = mm_realloc(buffer, grown);
+            assert(next != NULL && next[0] == 0x16 && next[size - 1] == 0x2);
+            if (next == buffer)
+                kept += size;
+            else if (size > REMAP_MIN)
+                remapped += size;
+            else
+                copied += size;
+            reallocs++;
+            buffer = next;
+            size = grown;
+            buffer[size - 1] = 0x2;
+        }
+        printf("realloc %s to %zu MiB: %lu reallocs, %zu KiB copied, "
+                "%zu KiB remapped, %zu KiB kept in place\n",
+                patterns[i].name, size >> 20, reallocs, copied >> 10,
+                remapped >> 10, kept >> 10);
+        mm_free(buffer);
+        mm_free(neighbour);
+    }
+}
+
+#define STRESS_OPS 1000000          /* Per thread, whatever the count. */
+#define STRESS_LIVE 1024
+#define STRESS_SHARED 256
+
+/* Blocks in transit between threads, so some get freed by another one. */
+static unsigned char *shared[STRESS_SHARED];
+
+static void *stress_main(void *arg) {
+    unsigned int seed = (uintptr_t) arg;
+    unsigned char *live[STRESS_LIVE] = { NULL };
+
+    for (int op = 0; op < STRESS_OPS; op++) {
+        int slot = rand_r(&seed) % STRESS_LIVE;
+        unsigned char *block = live[slot];
+        if (block && rand_r(&seed) % 8 == 0) {
+            block = __atomic_exchange_n(&shared[rand_r(&seed) % STRESS_SHARED],
+                    block, __ATOMIC_ACQ_REL);
+        }
+        if (block) {
+            assert(block[0] == block[1]);
+            mm_free(block);
+        }
+        size_t size = 2 + rand_r(&seed) % (rand_r(&seed) % 16 ? 128 : 4096);
+        live[slot] = mm_malloc(size);
+        assert(live[slot] != NULL);
+        live[slot][0] = live[slot][1] = op;
+    }
+    for (int i = 0; i < STRESS_LIVE; i++)
+        mm_free(live[i]);
+    return NULL;
+}
+
+/* Runs STRESS_OPS per thread on 1, 2, 4... up to MAX_THREADS threads. */
+void test_stress(int max_threads) {
+    double base = 0;
+    printf("%8s %14s %8s %11s\n", "threads", "ops/s", "speedup",
+            "efficiency");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        pthread_t ids[threads];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < threads; i++)
+            pthread_create(&ids[i], NULL, stress_main,
+                    (void *) (uintptr_t) (i + 1));
+        for (int i = 0; i < threads; i++)
+            pthread_join(ids[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        for (int i = 0; i < STRESS_SHARED; i++) {
+            mm_free(shared[i]);
+            shared[i] = NULL;
+        }
+
+        double seconds = end.tv_sec - start.tv_sec +
+            (end.tv_nsec - start.tv_nsec) / 1e9;
+        double rate = (double) threads * STRESS_OPS / seconds;
+        if (threads == 1)
+            base = rate;
+        printf("%8d %14.0f %7.2fx %10.0f%%\n", threads, rate, rate / base,
+                100 * rate / base / threads);
+    }
+}
+
+int main(int argc, char **argv) {
     load_alloc_functions();
 
+    if (argc > 1 && strcmp(argv[1], "--stress") == 0) {
+        test_stress(argc > 2 ? atoi(argv[2]) : 32);
+        return 0;
+    }
+
     int *data = (int*) mm_malloc(sizeof(int));
     assert(data != NULL);
     data[0] = 0x162;
     mm_free(data);
     printf("malloc test successful!\n");
+
+    test_sizes();
+    printf("size class test successful!\n");
+    test_align();
+    printf("alignment test successful!\n");
+    test_churn();
+    printf("churn test successful!\n");
+    test_realloc_growth();
+    printf("realloc growth test successful!\n");
     return 0;
 }